@@ -0,0 +1,726 @@
+//
+//  main.c
+//  bench
+//
+//  Created by Tim K. on 26.02.23.
+//  Copyright © 2023 Tim K. All rights reserved.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include "http_server.h"
+#include "stats.h"
+
+//
+// HTTP/1.1 load generator. Every thread drives its share of the connections with
+// poll(), keeping up to the pipelining depth of requests in flight on each. In a
+// closed loop, the next request goes out as soon as there's room for it. In an open
+// loop, requests are due at a constant rate and their latency is measured from when
+// they were due rather than from when they were actually sent, so that a server
+// falling behind can't hide it by holding the load generator back (coordinated
+// omission). Without a target, it starts a server of its own on loopback
+//
+
+/// max requests in flight on a connection
+#define BENCH_DEPTH_MAX 256
+/// bytes of responses buffered per connection, any heading has to fit
+#define BENCH_INPUT_SIZE (64 * 1024)
+/// milliseconds poll() waits when nothing is due
+#define BENCH_POLL_INTERVAL 100
+/// milliseconds to wait for the server to accept connections before giving up
+#define BENCH_CONNECT_TIMEOUT 2000
+/// body of every answer of the in-process server
+#define BENCH_BODY "Hello, world!\n"
+
+typedef struct {
+    // target, a server is started in-process if port is 0
+    char* address;
+    http_port_t port;
+    char* path;
+    
+    http_size_t threads;
+    http_size_t connections;
+    // requests in flight per connection
+    http_size_t depth;
+    // total requests per second, 0 for a closed loop
+    double rate;
+    // seconds to run for
+    double duration;
+    // false to use a new connection for every request
+    bool keepAlive;
+    
+    // workers and event backend of the in-process server
+    http_size_t workers;
+    http_backend_t backend;
+    // the in-process server, NULL if there's none
+    http_server_ref server;
+} bench_options;
+
+typedef struct {
+    // -1 while it's closed
+    int sk;
+    
+    // when the requests in flight were due (see http_stats_clock), oldest first
+    uint64_t due[BENCH_DEPTH_MAX];
+    http_size_t first;
+    http_size_t inFlight;
+    // when the next request is due (open loop)
+    uint64_t next;
+    
+    // requests waiting to be written, depth of them fit
+    char* output;
+    size_t outputSize;
+    size_t outputSent;
+    
+    // responses received so far, the first one starts at the beginning. Bodies too
+    // large for it are skipped, bodyLeft is what's left of the current one then
+    char input[BENCH_INPUT_SIZE];
+    size_t inputSize;
+    size_t bodyLeft;
+    http_status_t bodyStatus;
+    bool bodyCloses;
+} bench_connection;
+
+typedef struct {
+    const bench_options* options;
+    struct sockaddr_in target;
+    const char* request;
+    size_t requestSize;
+    // nanoseconds between two requests on a connection (open loop)
+    uint64_t interval;
+    
+    bench_connection* connections;
+    http_size_t count;
+    struct pollfd* pollFDs;
+    uint64_t deadline;
+    
+    // what came out of it
+    http_histogram_t latency;
+    uint64_t completed;
+    uint64_t errors;
+    uint64_t bytes;
+    
+    pthread_t thread;
+} bench_thread;
+
+void bench_show_help() {
+    fprintf(stderr, "Usage: bench [-lIPADDR] [-pPORT] [-uPATH] [-tTHREADS] [-cCONNECTIONS]\n");
+    fprintf(stderr, "       [-PDEPTH] [-rRATE] [-dSECONDS] [-K] [-wWORKERS]\n");
+    fprintf(stderr, "       [-bselect|epoll|uring] [-help]\n");
+    fprintf(stderr, "       without -p, a server is started in-process (-w and -b are for it)\n");
+    fprintf(stderr, "       -P pipelines DEPTH requests per connection\n");
+    fprintf(stderr, "       -r sends RATE requests per second in total (open loop)\n");
+    fprintf(stderr, "       -K opens a new connection for every request\n");
+}
+
+bench_options bench_make_options(const size_t argc, const char** argv) {
+    bench_options opts = { strdup("127.0.0.1"), 0, strdup("/"), 4, 64, 1, 0, 5, true,
+        2, HTTP_BACKEND_AUTO, NULL };
+    
+    for (size_t index = 1; index < argc; index++) {
+        const char* param = argv[index];
+        
+        if (strlen(param) < 2 || param[0] != '-') {
+            fprintf(stderr, "warning! invalid param - \"%s\" - must start with a dash\n",
+                    param);
+            continue;
+        }
+        
+        char opt = param[1];
+        param += 2;
+        
+        switch (opt) {
+            case 'l': {
+                free(opts.address);
+                opts.address = strdup(param);
+                break;
+            }
+            case 'p': {
+                opts.port = (http_port_t)atoi(param);
+                break;
+            }
+            case 'u': {
+                free(opts.path);
+                opts.path = strdup(param);
+                break;
+            }
+            case 't': {
+                opts.threads = (http_size_t)atoi(param);
+                break;
+            }
+            case 'c': {
+                opts.connections = (http_size_t)atoi(param);
+                break;
+            }
+            case 'P': {
+                opts.depth = (http_size_t)atoi(param);
+                break;
+            }
+            case 'r': {
+                opts.rate = atof(param);
+                break;
+            }
+            case 'd': {
+                opts.duration = atof(param);
+                break;
+            }
+            case 'K': {
+                opts.keepAlive = false;
+                break;
+            }
+            case 'w': {
+                opts.workers = (http_size_t)atoi(param);
+                break;
+            }
+            case 'b': {
+                if (strcmp(param, "select") == 0)
+                    opts.backend = HTTP_BACKEND_SELECT;
+                else if (strcmp(param, "epoll") == 0)
+                    opts.backend = HTTP_BACKEND_EPOLL;
+                else if (strcmp(param, "uring") == 0)
+                    opts.backend = HTTP_BACKEND_IO_URING;
+                else
+                    fprintf(stderr, "warning! unknown backend - \"%s\"\n", param);
+                
+                break;
+            }
+            case 'h':
+            case 'H':
+            case '?': {
+                bench_show_help();
+                exit(1);
+            }
+            default: {
+                fprintf(stderr, "warning! unknown option - '-%c'\n", opt);
+                break;
+            }
+        }
+    }
+    
+    // there have to be as many connections as threads, one request each at least
+    opts.threads = (opts.threads < 1) ? 1 : opts.threads;
+    opts.connections = (opts.connections < opts.threads) ? opts.threads : opts.connections;
+    opts.depth = (opts.depth < 1) ? 1 : (opts.depth > BENCH_DEPTH_MAX) ? BENCH_DEPTH_MAX :
+                 opts.depth;
+    
+    // a new connection per request can't have more than one in flight
+    if (!opts.keepAlive)
+        opts.depth = 1;
+    
+    return opts;
+}
+
+//
+// in-process server
+//
+
+http_headers_ref bench_callback(const http_headers_ref request,
+                                void* additionalData) {
+    HI_UNUSED(request);
+    HI_UNUSED(additionalData);
+    
+    return http_headers_init_with_response(HTTP_OK, "text/plain", BENCH_BODY,
+                                           (http_size_t)strlen(BENCH_BODY), NULL);
+}
+
+void* bench_server_thread(void* additionalData) {
+    bench_options* opts = (bench_options*)additionalData;
+    
+    http_server_listen_workers(opts->server, opts->workers);
+    return NULL;
+}
+
+http_port_t bench_find_port() {
+    // whatever port the system would pick right now
+    struct sockaddr_in address;
+    socklen_t addressSize = sizeof(address);
+    
+    bzero(&address, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    
+    int sk = socket(AF_INET, SOCK_STREAM, 0);
+    http_port_t port = 0;
+    
+    if (sk >= 0 && bind(sk, (struct sockaddr*)&address, sizeof(address)) == 0 &&
+        getsockname(sk, (struct sockaddr*)&address, &addressSize) == 0)
+        port = ntohs(address.sin_port);
+    
+    if (sk >= 0)
+        close(sk);
+    
+    return port;
+}
+
+bool bench_start_server(bench_options* opts) {
+    opts->port = bench_find_port();
+    
+    opts->server = http_server_init_ipv4(opts->address, opts->port);
+    
+    if (!opts->server)
+        return false;
+    
+    // every connection lasts for the whole run, and any worker might get all of them
+    http_server_set_callback(opts->server, bench_callback, NULL);
+    http_server_set_keep_alive(opts->server, HTTP_KEEP_ALIVE_TIMEOUT, UINT32_MAX);
+    http_server_set_clients_max(opts->server, opts->connections + 1);
+    
+    if (opts->backend != HTTP_BACKEND_AUTO &&
+        !http_server_set_backend(opts->server, opts->backend))
+        fprintf(stderr, "warning! requested backend unavailable, using a fallback\n");
+    
+    // runs until the process ends
+    pthread_t thread;
+    
+    if (pthread_create(&thread, NULL, bench_server_thread, opts) != 0)
+        return false;
+    
+    pthread_detach(thread);
+    return true;
+}
+
+//
+// load generator
+//
+
+int bench_connect(const struct sockaddr_in* target) {
+    int sk = socket(AF_INET, SOCK_STREAM, 0);
+    
+    if (sk < 0)
+        return -1;
+    else if (connect(sk, (const struct sockaddr*)target, sizeof(*target)) != 0) {
+        close(sk);
+        return -1;
+    }
+    
+    // requests go out right away, whatever their size
+    int tempTrueV = 1;
+    setsockopt(sk, IPPROTO_TCP, TCP_NODELAY, &tempTrueV, sizeof(tempTrueV));
+    fcntl(sk, F_SETFL, fcntl(sk, F_GETFL, 0) | O_NONBLOCK);
+    
+    return sk;
+}
+
+bool bench_wait_for_server(const struct sockaddr_in* target) {
+    for (int waited = 0; waited < BENCH_CONNECT_TIMEOUT; waited += 10) {
+        int sk = bench_connect(target);
+        
+        if (sk >= 0) {
+            close(sk);
+            return true;
+        }
+        
+        usleep(10000);
+    }
+    
+    return false;
+}
+
+void bench_queue_request(bench_thread* thread, bench_connection* connection,
+                         const uint64_t due) {
+    // what was written is dropped, so the rest (of at most depth requests) fits
+    if (connection->outputSent > 0) {
+        memmove(connection->output, connection->output + connection->outputSent,
+                connection->outputSize - connection->outputSent);
+        
+        connection->outputSize -= connection->outputSent;
+        connection->outputSent = 0;
+    }
+    
+    memcpy(connection->output + connection->outputSize, thread->request, thread->requestSize);
+    connection->outputSize += thread->requestSize;
+    
+    connection->due[(connection->first + connection->inFlight) % BENCH_DEPTH_MAX] = due;
+    connection->inFlight++;
+}
+
+void bench_reopen(bench_thread* thread, bench_connection* connection) {
+    if (connection->sk >= 0)
+        close(connection->sk);
+    
+    connection->sk = bench_connect(&thread->target);
+    connection->inputSize = 0;
+    connection->bodyLeft = 0;
+    
+    // whatever wasn't answered goes out again, still due when it was
+    connection->outputSize = connection->outputSent = 0;
+    
+    for (http_size_t sz = 0; sz < connection->inFlight; sz++) {
+        memcpy(connection->output + connection->outputSize, thread->request,
+               thread->requestSize);
+        connection->outputSize += thread->requestSize;
+    }
+    
+    if (connection->sk < 0)
+        thread->errors++;
+}
+
+void bench_schedule(bench_thread* thread, bench_connection* connection, const uint64_t now) {
+    while (connection->inFlight < thread->options->depth) {
+        if (thread->interval < 1) {
+            // closed loop, as soon as there's room
+            bench_queue_request(thread, connection, now);
+            continue;
+        } else if (connection->next > now)
+            break;
+        
+        // a request that's late because the connection had no room is still due
+        // when it was supposed to go out
+        bench_queue_request(thread, connection, connection->next);
+        connection->next += thread->interval;
+    }
+}
+
+bool bench_write(bench_connection* connection) {
+    while (connection->outputSent < connection->outputSize) {
+        ssize_t written = write(connection->sk, connection->output + connection->outputSent,
+                                connection->outputSize - connection->outputSent);
+        
+        if (written < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return true;
+        else if (written < 0 && errno == EINTR)
+            continue;
+        else if (written < 1)
+            return false;
+        
+        connection->outputSent += (size_t)written;
+    }
+    
+    return true;
+}
+
+const char* bench_find_header(const char* heading, const size_t size, const char* key) {
+    size_t keyLength = strlen(key);
+    const char* end = heading + size;
+    
+    // each line after the status line
+    for (const char* line = memchr(heading, '\n', size); line && line + 1 < end;
+         line = memchr(line + 1, '\n', (size_t)(end - line - 1))) {
+        if ((size_t)(end - line - 1) > keyLength &&
+            strncasecmp(line + 1, key, keyLength) == 0 && line[keyLength + 1] == ':')
+            return line + keyLength + 2;
+    }
+    
+    return NULL;
+}
+
+bool bench_complete(bench_thread* thread, bench_connection* connection,
+                    const http_status_t status, const bool closes) {
+    uint64_t due = connection->due[connection->first];
+    
+    connection->first = (connection->first + 1) % BENCH_DEPTH_MAX;
+    connection->inFlight--;
+    
+    if (status >= 200 && status < 400) {
+        http_stats_record(&thread->latency, http_stats_clock() - due);
+        thread->completed++;
+    } else
+        thread->errors++;
+    
+    // the server is done with the connection, or we are
+    return !closes && thread->options->keepAlive;
+}
+
+bool bench_read(bench_thread* thread, bench_connection* connection) {
+    ssize_t rawRead = read(connection->sk, connection->input + connection->inputSize,
+                           BENCH_INPUT_SIZE - connection->inputSize);
+    
+    if (rawRead < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+        return true;
+    else if (rawRead < 1)
+        return false;
+    
+    connection->inputSize += (size_t)rawRead;
+    thread->bytes += (uint64_t)rawRead;
+    
+    size_t consumed = 0;
+    bool keep = true;
+    
+    while (keep && connection->inFlight > 0) {
+        const char* data = connection->input + consumed;
+        size_t size = connection->inputSize - consumed;
+        
+        if (connection->bodyLeft > 0) {
+            // the rest of a body that didn't fit
+            size_t skipped = (size < connection->bodyLeft) ? size : connection->bodyLeft;
+            
+            consumed += skipped;
+            connection->bodyLeft -= skipped;
+            
+            if (connection->bodyLeft > 0)
+                break;
+            
+            keep = bench_complete(thread, connection, connection->bodyStatus,
+                                  connection->bodyCloses);
+            continue;
+        }
+        
+        const char* end = memmem(data, size, "\r\n\r\n", 4);
+        
+        if (!end && consumed < 1 && connection->inputSize >= BENCH_INPUT_SIZE)
+            return false; // a heading larger than the whole buffer
+        else if (!end)
+            break;
+        
+        size_t headingSize = (size_t)(end - data) + 4;
+        http_status_t status = (size > 12 && strncmp(data, "HTTP/1.", 7) == 0) ?
+                               (http_status_t)atoi(data + 9) : 0;
+        
+        const char* length = bench_find_header(data, headingSize, "Content-Length");
+        const char* connectionHeader = bench_find_header(data, headingSize, "Connection");
+        
+        bool closes = (connectionHeader &&
+                       strncasecmp(connectionHeader + strspn(connectionHeader, " "), "close",
+                                   5) == 0);
+        size_t bodySize = length ? strtoull(length, NULL, 10) : 0;
+        
+        if (status >= 100 && status < 200) {
+            // interim, the actual answer follows
+            consumed += headingSize;
+            continue;
+        } else if (!length && status != 204 && status != 304) {
+            fprintf(stderr, "warning! response without Content-Length, can't tell where it ends\n");
+            return false;
+        }
+        
+        consumed += headingSize;
+        
+        if (bodySize <= connection->inputSize - consumed) {
+            consumed += bodySize;
+            keep = bench_complete(thread, connection, status, closes);
+        } else {
+            // skipped as it comes in
+            connection->bodyLeft = bodySize;
+            connection->bodyStatus = status;
+            connection->bodyCloses = closes;
+        }
+    }
+    
+    memmove(connection->input, connection->input + consumed, connection->inputSize - consumed);
+    connection->inputSize -= consumed;
+    
+    return keep;
+}
+
+int bench_poll(bench_thread* thread, const uint64_t now) {
+    // until the next request is due
+    uint64_t next = now + (uint64_t)BENCH_POLL_INTERVAL * 1000000;
+    
+    for (http_size_t sz = 0; sz < thread->count && thread->interval > 0; sz++) {
+        bench_connection* connection = &thread->connections[sz];
+        
+        if (connection->inFlight < thread->options->depth && connection->next < next)
+            next = connection->next;
+    }
+    
+    uint64_t timeout = (next > now) ? next - now : 0;
+
+#ifdef __linux__
+    // requests going out late would add to their latency, milliseconds are too coarse
+    struct timespec ts = { (time_t)(timeout / 1000000000), (long)(timeout % 1000000000) };
+    return ppoll(thread->pollFDs, thread->count, &ts, NULL);
+#else
+    return poll(thread->pollFDs, thread->count, (int)((timeout + 999999) / 1000000));
+#endif
+}
+
+void* bench_thread_run(void* data) {
+    bench_thread* thread = (bench_thread*)data;
+    uint64_t now = http_stats_clock();
+    
+    for (http_size_t sz = 0; sz < thread->count; sz++) {
+        bench_connection* connection = &thread->connections[sz];
+        
+        // spread out over the first interval, not all at once
+        connection->next = now + thread->interval * sz / thread->count;
+        connection->sk = bench_connect(&thread->target);
+        
+        if (connection->sk < 0)
+            thread->errors++;
+    }
+    
+    while ((now = http_stats_clock()) < thread->deadline) {
+        for (http_size_t sz = 0; sz < thread->count; sz++) {
+            bench_connection* connection = &thread->connections[sz];
+            
+            if (connection->sk < 0)
+                bench_reopen(thread, connection);
+            if (connection->sk < 0)
+                continue;
+            
+            bench_schedule(thread, connection, now);
+            
+            if (!bench_write(connection))
+                bench_reopen(thread, connection);
+            
+            thread->pollFDs[sz].fd = connection->sk;
+            thread->pollFDs[sz].events = POLLIN;
+            thread->pollFDs[sz].revents = 0;
+            
+            if (connection->outputSent < connection->outputSize)
+                thread->pollFDs[sz].events |= POLLOUT;
+        }
+        
+        if (bench_poll(thread, now) < 0 && errno != EINTR)
+            break;
+        
+        for (http_size_t sz = 0; sz < thread->count; sz++) {
+            bench_connection* connection = &thread->connections[sz];
+            short events = thread->pollFDs[sz].revents;
+            
+            if (connection->sk < 0 || !events)
+                continue;
+            else if ((events & (POLLIN | POLLERR | POLLHUP)) && !bench_read(thread, connection))
+                bench_reopen(thread, connection);
+            else if ((events & POLLOUT) && !bench_write(connection))
+                bench_reopen(thread, connection);
+        }
+    }
+    
+    for (http_size_t sz = 0; sz < thread->count; sz++) {
+        if (thread->connections[sz].sk >= 0)
+            close(thread->connections[sz].sk);
+    }
+    
+    return NULL;
+}
+
+void bench_print_results(const bench_options* opts, bench_thread* threads,
+                         const double elapsed) {
+    http_histogram_t latency;
+    uint64_t completed = 0;
+    uint64_t errors = 0;
+    uint64_t bytes = 0;
+    
+    bzero(&latency, sizeof(latency));
+    
+    for (http_size_t sz = 0; sz < opts->threads; sz++) {
+        const bench_thread* thread = &threads[sz];
+        
+        completed += thread->completed;
+        errors += thread->errors;
+        bytes += thread->bytes;
+        
+        latency.count += thread->latency.count;
+        latency.sum += thread->latency.sum;
+        latency.max = (thread->latency.max > latency.max) ? thread->latency.max : latency.max;
+        
+        for (http_size_t bucket = 0; bucket < HTTP_HISTOGRAM_BUCKETS; bucket++)
+            latency.buckets[bucket] += thread->latency.buckets[bucket];
+    }
+    
+    printf(" Requests: %llu in %.2fs, %.1f req/s, %.2f MB/s read \n",
+           (unsigned long long)completed, elapsed, (double)completed / elapsed,
+           (double)bytes / elapsed / 1e6);
+    printf(" Errors: %llu \n", (unsigned long long)errors);
+    
+    if (latency.count < 1)
+        return;
+    
+    printf(" Latency%s: mean %.1f us, p50 %.1f us, p99 %.1f us, p999 %.1f us, max %.1f us \n",
+           (opts->rate > 0) ? " (corrected for coordinated omission)" : "",
+           (double)latency.sum / (double)latency.count / 1e3,
+           (double)http_histogram_get_percentile(&latency, 50) / 1e3,
+           (double)http_histogram_get_percentile(&latency, 99) / 1e3,
+           (double)http_histogram_get_percentile(&latency, 99.9) / 1e3,
+           (double)latency.max / 1e3);
+}
+
+int main(const int argc, const char** argv) {
+    bench_options opts = bench_make_options((size_t)argc, argv);
+    bool inProcess = (opts.port == 0);
+    
+    if (inProcess && !bench_start_server(&opts)) {
+        fprintf(stderr, "error! couldn't start the server\n");
+        return 1;
+    }
+    
+    struct sockaddr_in target;
+    bzero(&target, sizeof(target));
+    target.sin_family = AF_INET;
+    target.sin_port = htons(opts.port);
+    
+    if (inet_pton(AF_INET, opts.address, &target.sin_addr) != 1) {
+        fprintf(stderr, "error! invalid IPv4 address - \"%s\"\n", opts.address);
+        return 1;
+    } else if (!bench_wait_for_server(&target)) {
+        fprintf(stderr, "error! nothing accepts connections on %s:%u\n", opts.address, opts.port);
+        return 1;
+    }
+    
+    // every request is the same
+    char request[HTTP_REQUEST_FIELD_SIZE];
+    int requestSize = snprintf(request, sizeof(request),
+                               "GET %s HTTP/1.1\r\nHost: %s:%u\r\n%s\r\n", opts.path,
+                               opts.address, opts.port,
+                               opts.keepAlive ? "" : "Connection: close\r\n");
+    
+    if (requestSize < 1 || (size_t)requestSize >= sizeof(request)) {
+        fprintf(stderr, "error! path too long\n");
+        return 1;
+    }
+    
+    printf("=============================================\n");
+    printf(" Target: %s:%u%s%s \n", opts.address, opts.port, opts.path,
+           inProcess ? " (in-process server)" : "");
+    
+    if (inProcess)
+        printf(" Server: %u workers, backend %d \n", opts.workers,
+               (int)http_server_get_backend(opts.server));
+    printf(" Threads: %u, connections: %u, pipelining: %u, keep-alive: %s \n",
+           opts.threads, opts.connections, opts.depth, opts.keepAlive ? "yes" : "no");
+    
+    if (opts.rate > 0)
+        printf(" Open loop at %.0f req/s for %.1fs \n", opts.rate, opts.duration);
+    else
+        printf(" Closed loop for %.1fs \n", opts.duration);
+    
+    printf("=============================================\n");
+    fflush(stdout);
+    
+    bench_thread* threads = calloc(opts.threads, sizeof(bench_thread));
+    uint64_t started = http_stats_clock();
+    uint64_t deadline = started + (uint64_t)(opts.duration * 1e9);
+    
+    for (http_size_t sz = 0; sz < opts.threads; sz++) {
+        bench_thread* thread = &threads[sz];
+        
+        // the connections are dealt out as evenly as they go
+        thread->options = &opts;
+        thread->target = target;
+        thread->request = request;
+        thread->requestSize = (size_t)requestSize;
+        thread->count = opts.connections / opts.threads +
+                        (sz < opts.connections % opts.threads ? 1 : 0);
+        thread->interval = (opts.rate > 0) ? (uint64_t)(1e9 * opts.connections / opts.rate) : 0;
+        thread->deadline = deadline;
+        
+        thread->connections = calloc(thread->count, sizeof(bench_connection));
+        thread->pollFDs = calloc(thread->count, sizeof(struct pollfd));
+        
+        for (http_size_t connection = 0; connection < thread->count; connection++)
+            thread->connections[connection].output = malloc(opts.depth * (size_t)requestSize);
+        
+        if (pthread_create(&thread->thread, NULL, bench_thread_run, thread) != 0) {
+            fprintf(stderr, "error! couldn't start the load threads\n");
+            return 1;
+        }
+    }
+    
+    for (http_size_t sz = 0; sz < opts.threads; sz++)
+        pthread_join(threads[sz].thread, NULL);
+    
+    bench_print_results(&opts, threads, (double)(http_stats_clock() - started) / 1e9);
+    return 0;
+}
@@ -0,0 +1,500 @@
+//
+//  cache.c
+//  http
+//
+//  Created by Tim K. on 26.02.23.
+//  Copyright © 2023 Tim K. All rights reserved.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/param.h>
+#include <sys/resource.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+#include "cache.h"
+#include "static.h"
+
+#ifdef __linux__
+/// everything that makes a cached entry (or its directory) outdated
+#define SV_CACHE_WATCH_MASK (IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | \
+                             IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | \
+                             IN_MOVE_SELF)
+#endif
+
+/// a watched directory
+typedef struct {
+    int wd;
+    // relative to the root, "" for the root itself
+    char* path;
+} sv_cache_watch_t;
+
+struct sv_cache_s {
+    int rootFD;
+    char* root;
+    
+    // buckets of the hash table and all the entries in it for the eviction clock
+    pthread_rwlock_t lock;
+    sv_cache_entry_ref* buckets;
+    size_t bucketsMask;
+    sv_cache_entry_ref* slots;
+    size_t capacity;
+    size_t count;
+    size_t clockHand;
+    // bumped on every invalidation, so that files opened meanwhile aren't kept
+    uint64_t generation;
+    
+    // -1 if inotify isn't available, then nothing is cached
+    int inotifyFD;
+    pthread_t watcher;
+    // directories already watched, under their own lock
+    pthread_mutex_t watchesLock;
+    sv_cache_watch_t* watches;
+    size_t watchesCount;
+    size_t watchesCapacity;
+};
+
+//
+// private
+//
+
+uint32_t sv_cache_hash(const char* path) {
+    // FNV-1a
+    uint32_t hash = 2166136261u;
+    
+    for (; *path; path++)
+        hash = (hash ^ (uint8_t)*path) * 16777619u;
+    
+    return hash;
+}
+
+sv_cache_entry_ref sv_cache_entry_init(sv_cache_ref cache, const char* path) {
+    int fd = openat(cache->rootFD, path, O_RDONLY | O_CLOEXEC);
+    struct stat info;
+    
+    if (fd < 0 && (errno == ENOENT || errno == ENOTDIR)) {
+        // a negative entry, nothing's there
+        sv_cache_entry_ref entry = calloc(1, sizeof(struct sv_cache_entry_s));
+        entry->path = strdup(path);
+        entry->hash = sv_cache_hash(path);
+        entry->error = errno;
+        entry->fd = -1;
+        entry->references = 1;
+        
+        return entry;
+    } else if (fd < 0)
+        return NULL;
+    else if (fstat(fd, &info) != 0) {
+        int error = errno;
+        
+        close(fd);
+        errno = error;
+        
+        return NULL;
+    }
+    
+    sv_cache_entry_ref entry = calloc(1, sizeof(struct sv_cache_entry_s));
+    entry->path = strdup(path);
+    entry->hash = sv_cache_hash(path);
+    entry->mode = info.st_mode;
+    entry->inode = info.st_ino;
+    entry->size = info.st_size;
+    entry->modified = info.st_mtim;
+    entry->contentType = sv_static_get_content_type(path);
+    entry->references = 1;
+    
+    // only regular files are ever read, no need to keep anything else open
+    if (S_ISREG(info.st_mode))
+        entry->fd = fd;
+    else {
+        entry->fd = -1;
+        close(fd);
+    }
+    
+    return entry;
+}
+
+void sv_cache_unlink(sv_cache_ref cache, const size_t slot) {
+    // must be called with the lock held for writing
+    sv_cache_entry_ref entry = cache->slots[slot];
+    sv_cache_entry_ref* link = &cache->buckets[entry->hash & cache->bucketsMask];
+    
+    while (*link != entry)
+        link = &(*link)->next;
+    
+    *link = entry->next;
+    
+    // the last entry fills the gap
+    cache->slots[slot] = cache->slots[--cache->count];
+    cache->slots[cache->count] = NULL;
+    
+    sv_cache_entry_release(entry);
+}
+
+void sv_cache_evict(sv_cache_ref cache) {
+    // second chance for everything used since the hand passed by last time
+    while (true) {
+        if (cache->clockHand >= cache->count)
+            cache->clockHand = 0;
+        
+        sv_cache_entry_ref entry = cache->slots[cache->clockHand];
+        
+        if (__atomic_exchange_n(&entry->recent, 0, __ATOMIC_RELAXED) == 0) {
+            sv_cache_unlink(cache, cache->clockHand);
+            return;
+        }
+        
+        cache->clockHand++;
+    }
+}
+
+sv_cache_entry_ref sv_cache_find(sv_cache_ref cache, const char* path, const uint32_t hash) {
+    // must be called with the lock held
+    for (sv_cache_entry_ref entry = cache->buckets[hash & cache->bucketsMask]; entry;
+         entry = entry->next) {
+        if (entry->hash == hash && strcmp(entry->path, path) == 0)
+            return entry;
+    }
+    
+    return NULL;
+}
+
+#ifdef __linux__
+bool sv_cache_watch(sv_cache_ref cache, const char* path) {
+    // watch the directory of the path before it's opened, so no change gets lost
+    const char* slash = strrchr(path, '/');
+    size_t directoryLength = slash ? (size_t)(slash - path) : 0;
+    
+    char fullPath[MAXPATHLEN];
+    
+    if (strcmp(path, ".") == 0)
+        snprintf(fullPath, sizeof(fullPath), "%s", cache->root);
+    else
+        snprintf(fullPath, sizeof(fullPath), "%s/%.*s", cache->root, (int)directoryLength, path);
+    
+    pthread_mutex_lock(&cache->watchesLock);
+    
+    for (size_t sz = 0; sz < cache->watchesCount; sz++) {
+        if (strlen(cache->watches[sz].path) == directoryLength &&
+            strncmp(cache->watches[sz].path, path, directoryLength) == 0) {
+            pthread_mutex_unlock(&cache->watchesLock);
+            return true;
+        }
+    }
+    
+    int wd = inotify_add_watch(cache->inotifyFD, fullPath, SV_CACHE_WATCH_MASK);
+    
+    if (wd < 0) {
+        pthread_mutex_unlock(&cache->watchesLock);
+        return false;
+    }
+    
+    for (size_t sz = 0; sz < cache->watchesCount; sz++) {
+        if (cache->watches[sz].wd != wd)
+            continue;
+        
+        // the same directory under another name (through a symlink), events are about
+        // the latest one
+        free(cache->watches[sz].path);
+        cache->watches[sz].path = strndup(path, directoryLength);
+        
+        pthread_mutex_unlock(&cache->watchesLock);
+        return true;
+    }
+    
+    if (cache->watchesCount >= cache->watchesCapacity) {
+        cache->watchesCapacity = cache->watchesCapacity ? cache->watchesCapacity * 2 : 16;
+        cache->watches = realloc(cache->watches,
+                                 cache->watchesCapacity * sizeof(sv_cache_watch_t));
+    }
+    
+    cache->watches[cache->watchesCount].wd = wd;
+    cache->watches[cache->watchesCount].path = strndup(path, directoryLength);
+    cache->watchesCount++;
+    
+    pthread_mutex_unlock(&cache->watchesLock);
+    return true;
+}
+
+void sv_cache_unwatch(sv_cache_ref cache, const char* path) {
+    // the directory and everything watched below it, their names don't lead there
+    // anymore, so the next lookup has to watch whatever is at those paths now
+    size_t length = strlen(path);
+    
+    for (size_t sz = 0; sz < cache->watchesCount;) {
+        sv_cache_watch_t* watch = &cache->watches[sz];
+        
+        if (length > 0 && (strncmp(watch->path, path, length) != 0 ||
+                           (watch->path[length] != '\0' && watch->path[length] != '/'))) {
+            sz++;
+            continue;
+        }
+        
+        // its IN_IGNORED finds nothing to drop anymore
+        inotify_rm_watch(cache->inotifyFD, watch->wd);
+        
+        free(watch->path);
+        cache->watches[sz] = cache->watches[--cache->watchesCount];
+    }
+}
+
+void sv_cache_invalidate(sv_cache_ref cache, const char* path, const char* parent) {
+    // the path itself and everything below it (renamed or deleted directories), as
+    // well as the directory containing it, whose listing and mtime just changed
+    size_t length = strlen(path);
+    const char* parentPath = parent[0] ? parent : ".";
+    
+    pthread_rwlock_wrlock(&cache->lock);
+    
+    for (size_t sz = 0; sz < cache->count;) {
+        const char* entryPath = cache->slots[sz]->path;
+        
+        if (length < 1 || strcmp(entryPath, parentPath) == 0 ||
+            (strncmp(entryPath, path, length) == 0 &&
+             (entryPath[length] == '\0' || entryPath[length] == '/')))
+            sv_cache_unlink(cache, sz);
+        else
+            sz++;
+    }
+    
+    cache->generation++;
+    pthread_rwlock_unlock(&cache->lock);
+}
+
+void* sv_cache_watcher_thread(void* data) {
+    sv_cache_ref cache = (sv_cache_ref)data;
+    char buffer[16384] __attribute__((aligned(__alignof__(struct inotify_event))));
+    
+    while (true) {
+        ssize_t bufferSize = read(cache->inotifyFD, buffer, sizeof(buffer));
+        
+        if (bufferSize < 0 && errno == EINTR)
+            continue;
+        else if (bufferSize <= 0)
+            break;
+        
+        for (char* position = buffer; position < buffer + bufferSize;) {
+            const struct inotify_event* event = (const struct inotify_event*)position;
+            position += sizeof(struct inotify_event) + event->len;
+            
+            if (event->mask & IN_Q_OVERFLOW) {
+                // lost track, start over
+                sv_cache_invalidate(cache, "", "");
+                continue;
+            }
+            
+            // which directory it is about
+            char path[MAXPATHLEN];
+            char parent[MAXPATHLEN];
+            bool found = false;
+            
+            pthread_mutex_lock(&cache->watchesLock);
+            
+            for (size_t sz = 0; sz < cache->watchesCount; sz++) {
+                sv_cache_watch_t* watch = &cache->watches[sz];
+                
+                if (watch->wd != event->wd)
+                    continue;
+                
+                if (event->len > 0 && watch->path[0])
+                    snprintf(path, sizeof(path), "%s/%s", watch->path, event->name);
+                else if (event->len > 0)
+                    snprintf(path, sizeof(path), "%s", event->name);
+                else
+                    snprintf(path, sizeof(path), "%s", watch->path);
+                
+                snprintf(parent, sizeof(parent), "%s", watch->path);
+                
+                // the directory is gone or elsewhere, so is its watch
+                if (event->mask & (IN_MOVE_SELF | IN_DELETE_SELF))
+                    sv_cache_unwatch(cache, parent);
+                else if (event->mask & IN_IGNORED) {
+                    free(watch->path);
+                    cache->watches[sz] = cache->watches[--cache->watchesCount];
+                }
+                
+                found = true;
+                break;
+            }
+            
+            pthread_mutex_unlock(&cache->watchesLock);
+            
+            if (found)
+                sv_cache_invalidate(cache, path, parent);
+        }
+    }
+    
+    return NULL;
+}
+#endif
+
+sv_cache_entry_ref sv_cache_lookup(sv_cache_ref cache, const char* path) {
+    uint32_t hash = sv_cache_hash(path);
+    
+    pthread_rwlock_rdlock(&cache->lock);
+    sv_cache_entry_ref entry = sv_cache_find(cache, path, hash);
+    
+    if (entry) {
+        // the cache's own reference keeps it alive until this one is taken
+        __atomic_add_fetch(&entry->references, 1, __ATOMIC_RELAXED);
+        __atomic_store_n(&entry->recent, 1, __ATOMIC_RELAXED);
+    }
+    
+    uint64_t generation = cache->generation;
+    pthread_rwlock_unlock(&cache->lock);
+    
+    if (entry)
+        return entry;
+    
+    bool cacheable = false;
+
+#ifdef __linux__
+    cacheable = (cache->inotifyFD >= 0 && cache->capacity > 0 && sv_cache_watch(cache, path));
+    
+    // anything that changed while the watch wasn't there yet must not be kept
+    if (cacheable) {
+        pthread_rwlock_rdlock(&cache->lock);
+        generation = cache->generation;
+        pthread_rwlock_unlock(&cache->lock);
+    }
+#endif
+    
+    entry = sv_cache_entry_init(cache, path);
+    
+    if (!entry || !cacheable)
+        return entry;
+    
+    pthread_rwlock_wrlock(&cache->lock);
+    
+    sv_cache_entry_ref existing = sv_cache_find(cache, path, hash);
+    
+    if (existing) {
+        // another worker was faster
+        __atomic_add_fetch(&existing->references, 1, __ATOMIC_RELAXED);
+        pthread_rwlock_unlock(&cache->lock);
+        
+        sv_cache_entry_release(entry);
+        return existing;
+    } else if (generation != cache->generation) {
+        // something changed meanwhile, might have been this very file
+        pthread_rwlock_unlock(&cache->lock);
+        return entry;
+    }
+    
+    if (cache->count >= cache->capacity)
+        sv_cache_evict(cache);
+    
+    sv_cache_entry_ref* bucket = &cache->buckets[hash & cache->bucketsMask];
+    entry->next = *bucket;
+    *bucket = entry;
+    
+    cache->slots[cache->count++] = entry;
+    entry->references++;
+    
+    pthread_rwlock_unlock(&cache->lock);
+    return entry;
+}
+
+//
+// public
+//
+
+sv_cache_ref sv_cache_init(const int rootFD, const char* root) {
+    sv_cache_ref cache = calloc(1, sizeof(struct sv_cache_s));
+    cache->rootFD = rootFD;
+    cache->root = strdup(root);
+    cache->inotifyFD = -1;
+    
+    // every regular file keeps a descriptor open, leave room for the clients
+    struct rlimit limit;
+    cache->capacity = SV_CACHE_ENTRIES_MAX;
+    
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY)
+        cache->capacity = MIN(cache->capacity, (size_t)limit.rlim_cur / 2);
+    
+    size_t bucketsCount = 16;
+    while (bucketsCount < cache->capacity * 2)
+        bucketsCount *= 2;
+    
+    cache->buckets = calloc(bucketsCount, sizeof(sv_cache_entry_ref));
+    cache->bucketsMask = bucketsCount - 1;
+    cache->slots = calloc(cache->capacity + 1, sizeof(sv_cache_entry_ref));
+    
+    pthread_rwlock_init(&cache->lock, NULL);
+    pthread_mutex_init(&cache->watchesLock, NULL);
+
+#ifdef __linux__
+    cache->inotifyFD = inotify_init1(IN_CLOEXEC);
+    
+    if (cache->inotifyFD >= 0 &&
+        pthread_create(&cache->watcher, NULL, sv_cache_watcher_thread, cache) != 0) {
+        close(cache->inotifyFD);
+        cache->inotifyFD = -1;
+    }
+#endif
+    
+    if (cache->inotifyFD < 0)
+        fprintf(stderr, "warning! no inotify, files won't be cached\n");
+    
+    return cache;
+}
+
+sv_cache_entry_ref sv_cache_open(sv_cache_ref cache, const char* path) {
+    sv_cache_entry_ref entry = sv_cache_lookup(cache, path);
+    
+    if (entry && entry->error) {
+        // known not to be there
+        errno = entry->error;
+        
+        sv_cache_entry_release(entry);
+        return NULL;
+    }
+    
+    return entry;
+}
+
+void sv_cache_entry_release(sv_cache_entry_ref entry) {
+    if (!entry || __atomic_sub_fetch(&entry->references, 1, __ATOMIC_ACQ_REL) > 0)
+        return;
+    
+    if (entry->fd >= 0)
+        close(entry->fd);
+    
+    free(entry->path);
+    free(entry);
+}
+
+void sv_cache_release(sv_cache_ref cache) {
+    if (!cache)
+        return;
+
+#ifdef __linux__
+    if (cache->inotifyFD >= 0) {
+        pthread_cancel(cache->watcher);
+        pthread_join(cache->watcher, NULL);
+        close(cache->inotifyFD);
+    }
+#endif
+    
+    while (cache->count > 0)
+        sv_cache_unlink(cache, cache->count - 1);
+    
+    for (size_t sz = 0; sz < cache->watchesCount; sz++)
+        free(cache->watches[sz].path);
+    
+    pthread_rwlock_destroy(&cache->lock);
+    pthread_mutex_destroy(&cache->watchesLock);
+    
+    free(cache->watches);
+    free(cache->buckets);
+    free(cache->slots);
+    free(cache->root);
+    free(cache);
+}
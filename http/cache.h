@@ -0,0 +1,65 @@
+//
+//  cache.h
+//  http
+//
+//  Created by Tim K. on 26.02.23.
+//  Copyright © 2023 Tim K. All rights reserved.
+//
+
+#pragma once
+
+#include <sys/types.h>
+#include <time.h>
+#include "http_server.h"
+
+//
+// bounded cache of open files and their metadata below the served directory, shared
+// by all the worker threads. Entries are keyed by normalized paths relative to the
+// root and dropped as soon as inotify reports a change to them, so hits cost no
+// filesystem syscalls at all. Without inotify nothing is kept and every lookup
+// opens the file again
+//
+
+/// upper bound of cached entries (each regular file holds a descriptor open)
+#define SV_CACHE_ENTRIES_MAX 1024
+
+typedef struct sv_cache_s* sv_cache_ref;
+typedef struct sv_cache_entry_s* sv_cache_entry_ref;
+
+struct sv_cache_entry_s {
+    // normalized path relative to the root, "." for the root itself
+    char* path;
+    uint32_t hash;
+    
+    // errno of opening it if it's known not to exist, 0 otherwise
+    int error;
+    
+    // open file, -1 for anything but regular files
+    int fd;
+    mode_t mode;
+    ino_t inode;
+    off_t size;
+    struct timespec modified;
+    const char* contentType;
+    
+    // one for the cache (while the entry is in it) plus one per user
+    uint32_t references;
+    // set on every hit, cleared by the eviction clock
+    uint8_t recent;
+    
+    // next entry in the same bucket
+    sv_cache_entry_ref next;
+};
+
+/// creates the cache for the directory rootFD refers to, which is found at root
+sv_cache_ref sv_cache_init(const int rootFD, const char* root);
+
+/// finds or opens the file at the path, NULL (with errno set) if it cannot be opened.
+/// The entry must be given back with sv_cache_entry_release. Paths that don't exist
+/// are remembered as well, so asking for them again costs nothing either
+sv_cache_entry_ref sv_cache_open(sv_cache_ref cache, const char* path);
+
+/// drops the reference sv_cache_open returned, the entry is freed with the last one
+void sv_cache_entry_release(sv_cache_entry_ref entry);
+
+void sv_cache_release(sv_cache_ref cache);
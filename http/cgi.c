@@ -0,0 +1,1134 @@
+//
+//  cgi.c
+//  http
+//
+//  Created by Tim K. on 26.02.23.
+//  Copyright © 2023 Tim K. All rights reserved.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <sys/param.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+#include "cgi.h"
+
+/// kinds of records going between the dispatcher and the runners
+typedef enum {
+    // environment of the script as "NAME=value" strings, each NUL-terminated
+    SV_CGI_RECORD_PARAMS = 1,
+    // the whole request body
+    SV_CGI_RECORD_STDIN,
+    // next piece of the script's output, runner to dispatcher
+    SV_CGI_RECORD_STDOUT,
+    // the script is done, the payload is its exit code or an SV_CGI_STATUS_* value
+    SV_CGI_RECORD_END
+} sv_cgi_record_type_t;
+
+typedef struct {
+    uint32_t type;
+    uint32_t length;
+} sv_cgi_record_t;
+
+/// script couldn't be run at all
+#define SV_CGI_STATUS_FAILED -1
+/// script was killed for taking too long
+#define SV_CGI_STATUS_TIMEOUT -2
+
+/// bytes of script output forwarded (and received) at once
+#define SV_CGI_CHUNK_SIZE 65536
+/// environment strings passed to a script at most
+#define SV_CGI_ENVIRONMENT_MAX 256
+/// header fields taken from a script's output at most
+#define SV_CGI_HEADERS_MAX 64
+
+typedef struct {
+    char* data;
+    size_t size;
+    size_t capacity;
+} sv_cgi_buffer_t;
+
+typedef struct sv_cgi_job_s* sv_cgi_job_ref;
+
+struct sv_cgi_job_s {
+    // where the response goes
+    http_deferred_ref deferred;
+    
+    // records for the runner and how much of them is written already
+    sv_cgi_buffer_t request;
+    size_t requestWritten;
+    
+    // a spilled request body, read into request a chunk at a time once the records
+    // before it are written, -1 for the others
+    int bodyFD;
+    off_t bodySize;
+    off_t bodyRead;
+    
+    // what the script wrote so far, dropped once it's too much
+    sv_cgi_buffer_t output;
+    bool outputTooLarge;
+    
+    sv_cgi_job_ref next;
+};
+
+typedef struct {
+    // dispatcher's end of the runner's socket, -1 if the runner is gone
+    int sk;
+    pid_t pid;
+    
+    // request being run, NULL while the runner is idle
+    sv_cgi_job_ref job;
+    // received bytes not parsed into records yet
+    sv_cgi_buffer_t input;
+} sv_cgi_runner_t;
+
+struct sv_cgi_s {
+    // absolute path of the served directory
+    char* root;
+    
+    sv_cgi_runner_t* runners;
+    http_size_t runnersCount;
+    
+    // requests waiting for a runner, in order
+    pthread_mutex_t lock;
+    sv_cgi_job_ref firstJob;
+    sv_cgi_job_ref lastJob;
+    http_size_t jobsCount;
+    bool stopping;
+    
+    // wakes the dispatcher up when there's something new for it
+    int wakePipe[2];
+    pthread_t dispatcher;
+};
+
+/// hop-by-hop and framing fields scripts don't get to set
+static const char* sv_cgi_dropped_headers[] = {
+    "Status",
+    "Content-Type",
+    "Content-Length",
+    "Connection",
+    "Keep-Alive",
+    "Transfer-Encoding",
+    NULL
+};
+
+//
+// private
+//
+
+bool sv_cgi_buffer_reserve(sv_cgi_buffer_t* buffer, const size_t size) {
+    if (buffer->size + size > buffer->capacity) {
+        size_t capacity = (buffer->capacity > 0) ? buffer->capacity : 4096;
+        while (capacity < buffer->size + size)
+            capacity *= 2;
+        
+        char* grown = realloc(buffer->data, capacity);
+        
+        if (!grown)
+            return false;
+        
+        buffer->data = grown;
+        buffer->capacity = capacity;
+    }
+    
+    return true;
+}
+
+bool sv_cgi_buffer_append(sv_cgi_buffer_t* buffer, const void* data, const size_t size) {
+    if (!sv_cgi_buffer_reserve(buffer, size))
+        return false;
+    
+    if (size > 0)
+        memcpy(buffer->data + buffer->size, data, size);
+    
+    buffer->size += size;
+    return true;
+}
+
+void sv_cgi_buffer_free(sv_cgi_buffer_t* buffer) {
+    free(buffer->data);
+    bzero(buffer, sizeof(sv_cgi_buffer_t));
+}
+
+bool sv_cgi_append_heading(sv_cgi_buffer_t* buffer, const sv_cgi_record_type_t type,
+                           const size_t length) {
+    sv_cgi_record_t record = { (uint32_t)type, (uint32_t)length };
+    
+    return sv_cgi_buffer_append(buffer, &record, sizeof(record));
+}
+
+bool sv_cgi_append_record(sv_cgi_buffer_t* buffer, const sv_cgi_record_type_t type,
+                          const void* payload, const size_t length) {
+    return (sv_cgi_append_heading(buffer, type, length) &&
+            sv_cgi_buffer_append(buffer, payload, length));
+}
+
+bool sv_cgi_append_param(sv_cgi_buffer_t* buffer, const char* name, const char* value,
+                         const size_t valueLength) {
+    return (sv_cgi_buffer_append(buffer, name, strlen(name)) &&
+            sv_cgi_buffer_append(buffer, "=", 1) &&
+            sv_cgi_buffer_append(buffer, value, valueLength) &&
+            sv_cgi_buffer_append(buffer, "", 1));
+}
+
+bool sv_cgi_append_param_str(sv_cgi_buffer_t* buffer, const char* name, const char* value) {
+    return sv_cgi_append_param(buffer, name, value, strlen(value));
+}
+
+http_headers_ref sv_cgi_make_error(const http_status_t status) {
+    // the reason phrases are static, nothing to deallocate
+    const char* reason = http_status_get_reason(status);
+    
+    return http_headers_init_with_response(status, "text/plain; charset=utf-8",
+                                           (void*)reason, (http_size_t)strlen(reason), NULL);
+}
+
+void sv_cgi_job_free(sv_cgi_job_ref job) {
+    if (job->bodyFD >= 0)
+        close(job->bodyFD);
+    
+    sv_cgi_buffer_free(&job->request);
+    sv_cgi_buffer_free(&job->output);
+    free(job);
+}
+
+//
+// runner side, each runner is a process of its own
+//
+
+bool sv_cgi_read_full(const int fd, void* data, const size_t size) {
+    size_t done = 0;
+    
+    while (done < size) {
+        ssize_t got = read(fd, (char*)data + done, size - done);
+        
+        if (got > 0)
+            done += (size_t)got;
+        else if (got == 0 || errno != EINTR)
+            return false;
+    }
+    
+    return true;
+}
+
+bool sv_cgi_write_full(const int fd, const void* data, const size_t size) {
+    size_t done = 0;
+    
+    while (done < size) {
+        ssize_t written = write(fd, (const char*)data + done, size - done);
+        
+        if (written > 0)
+            done += (size_t)written;
+        else if (written == 0 || errno != EINTR)
+            return false;
+    }
+    
+    return true;
+}
+
+bool sv_cgi_runner_send(const int sk, const sv_cgi_record_type_t type, const void* payload,
+                        const size_t length) {
+    sv_cgi_record_t record = { (uint32_t)type, (uint32_t)length };
+    
+    return (sv_cgi_write_full(sk, &record, sizeof(record)) &&
+            sv_cgi_write_full(sk, payload, length));
+}
+
+char* sv_cgi_runner_receive(const int sk, const sv_cgi_record_type_t type, size_t* lengthPtr) {
+    sv_cgi_record_t record;
+    
+    if (!sv_cgi_read_full(sk, &record, sizeof(record)) || record.type != (uint32_t)type)
+        return NULL;
+    
+    // NUL-terminated for good measure
+    char* payload = malloc(record.length + 1);
+    
+    if (!payload || !sv_cgi_read_full(sk, payload, record.length)) {
+        free(payload);
+        return NULL;
+    }
+    
+    payload[record.length] = '\0';
+    (*lengthPtr) = record.length;
+    
+    return payload;
+}
+
+void sv_cgi_runner_exec(char* params, const size_t paramsSize, const int input,
+                        const int output) {
+    // the environment comes ready-made, it only needs an array of pointers
+    char* environment[SV_CGI_ENVIRONMENT_MAX + 1];
+    const char* script = NULL;
+    size_t count = 0;
+    
+    for (char* param = params; param < params + paramsSize && count < SV_CGI_ENVIRONMENT_MAX;
+         param += strlen(param) + 1) {
+        if (strncmp(param, "SCRIPT_FILENAME=", 16) == 0)
+            script = param + 16;
+        
+        environment[count++] = param;
+    }
+    
+    environment[count] = NULL;
+    
+    if (!script)
+        _exit(127);
+    
+    dup2(input, STDIN_FILENO);
+    dup2(output, STDOUT_FILENO);
+    close(input);
+    close(output);
+    
+    // the runner ignores it (and might block others), scripts are used to the default
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigprocmask(SIG_SETMASK, &signals, NULL);
+    signal(SIGPIPE, SIG_DFL);
+    // a group of its own, so that whatever it starts is killed along with it
+    setpgid(0, 0);
+    
+    // scripts run in their own directory
+    char directory[MAXPATHLEN];
+    snprintf(directory, sizeof(directory), "%s", script);
+    
+    char* slash = strrchr(directory, '/');
+    
+    if (slash && slash != directory) {
+        *slash = '\0';
+        
+        if (chdir(directory) != 0)
+            _exit(127);
+    }
+    
+    char* arguments[] = { (char*)script, NULL };
+    execve(script, arguments, environment);
+    
+    _exit(127);
+}
+
+int32_t sv_cgi_runner_wait(const pid_t pid, const time_t deadline, bool timedOut) {
+    int status = 0;
+    
+    // scripts closing their output early still get until the deadline to exit
+    while (true) {
+        pid_t result = waitpid(pid, &status, timedOut ? 0 : WNOHANG);
+        
+        if (result == pid)
+            break;
+        else if (result < 0 && errno != EINTR)
+            return SV_CGI_STATUS_FAILED;
+        else if (result == 0 && time(NULL) >= deadline) {
+            kill(-pid, SIGKILL);
+            timedOut = true;
+        } else if (result == 0)
+            usleep(10000);
+    }
+    
+    if (timedOut)
+        return SV_CGI_STATUS_TIMEOUT;
+    
+    return WIFEXITED(status) ? WEXITSTATUS(status) : SV_CGI_STATUS_FAILED;
+}
+
+int32_t sv_cgi_runner_run(const int sk, char* params, const size_t paramsSize,
+                          const char* body, const size_t bodySize) {
+    int input[2];
+    int output[2];
+    
+    if (pipe(input) != 0)
+        return SV_CGI_STATUS_FAILED;
+    else if (pipe(output) != 0) {
+        close(input[0]);
+        close(input[1]);
+        
+        return SV_CGI_STATUS_FAILED;
+    }
+    
+    pid_t pid = fork();
+    
+    if (pid == 0) {
+        close(sk);
+        close(input[1]);
+        close(output[0]);
+        
+        sv_cgi_runner_exec(params, paramsSize, input[0], output[1]);
+    }
+    
+    close(input[0]);
+    close(output[1]);
+    
+    if (pid > 0)
+        setpgid(pid, pid);
+    
+    if (pid < 0) {
+        close(input[1]);
+        close(output[0]);
+        
+        return SV_CGI_STATUS_FAILED;
+    }
+    
+    // the body goes in while the output comes out, so neither side can get stuck
+    fcntl(input[1], F_SETFL, fcntl(input[1], F_GETFL, 0) | O_NONBLOCK);
+    
+    int inputFD = (bodySize > 0) ? input[1] : -1;
+    int outputFD = output[0];
+    size_t bodyWritten = 0;
+    
+    if (inputFD < 0)
+        close(input[1]);
+    
+    static char chunk[SV_CGI_CHUNK_SIZE];
+    time_t deadline = time(NULL) + SV_CGI_TIMEOUT;
+    bool timedOut = false;
+    
+    while (outputFD >= 0) {
+        time_t left = deadline - time(NULL);
+        
+        if (left <= 0) {
+            kill(-pid, SIGKILL);
+            timedOut = true;
+            break;
+        }
+        
+        struct pollfd fds[2] = { { outputFD, POLLIN, 0 }, { inputFD, POLLOUT, 0 } };
+        int ready = poll(fds, (inputFD >= 0) ? 2 : 1, (int)left * 1000);
+        
+        if (ready < 0 && errno != EINTR)
+            break;
+        else if (ready <= 0)
+            continue;
+        
+        if (inputFD >= 0 && fds[1].revents) {
+            ssize_t written = write(inputFD, body + bodyWritten, bodySize - bodyWritten);
+            
+            if (written > 0)
+                bodyWritten += (size_t)written;
+            
+            // all of it is there, or the script isn't reading anymore
+            if (bodyWritten >= bodySize ||
+                (written < 0 && errno != EAGAIN && errno != EINTR)) {
+                close(inputFD);
+                inputFD = -1;
+            }
+        }
+        
+        if (fds[0].revents) {
+            ssize_t got = read(outputFD, chunk, sizeof(chunk));
+            
+            if (got > 0) {
+                if (!sv_cgi_runner_send(sk, SV_CGI_RECORD_STDOUT, chunk, (size_t)got)) {
+                    // nobody to send it to anymore
+                    kill(-pid, SIGKILL);
+                    timedOut = true;
+                    break;
+                }
+            } else if (got == 0 || errno != EINTR) {
+                close(outputFD);
+                outputFD = -1;
+            }
+        }
+    }
+    
+    if (inputFD >= 0)
+        close(inputFD);
+    if (outputFD >= 0)
+        close(outputFD);
+    
+    return sv_cgi_runner_wait(pid, deadline, timedOut);
+}
+
+void sv_cgi_runner_main(const int sk) {
+    // a script going away while it's being fed must not take the runner with it
+    signal(SIGPIPE, SIG_IGN);
+    
+    while (true) {
+        size_t paramsSize = 0;
+        size_t bodySize = 0;
+        
+        char* params = sv_cgi_runner_receive(sk, SV_CGI_RECORD_PARAMS, &paramsSize);
+        char* body = params ? sv_cgi_runner_receive(sk, SV_CGI_RECORD_STDIN, &bodySize) : NULL;
+        
+        // the server is gone
+        if (!body) {
+            free(params);
+            _exit(0);
+        }
+        
+        int32_t status = sv_cgi_runner_run(sk, params, paramsSize, body, bodySize);
+        
+        free(params);
+        free(body);
+        
+        if (!sv_cgi_runner_send(sk, SV_CGI_RECORD_END, &status, sizeof(status)))
+            _exit(0);
+    }
+}
+
+void sv_cgi_close_inherited(const int keep) {
+    // runners only need their socket (and the standard streams), descriptors of the
+    // server (clients, listening sockets) must not be kept open by them
+    if (keep != 3) {
+        dup2(keep, 3);
+        close(keep);
+    }
+
+#if defined(__linux__) && defined(SYS_close_range)
+    if (syscall(SYS_close_range, 4, ~0u, 0) == 0)
+        return;
+#endif
+    
+    long maxFD = sysconf(_SC_OPEN_MAX);
+    
+    for (long fd = 4; fd < MIN(maxFD, 65536); fd++)
+        close((int)fd);
+}
+
+bool sv_cgi_spawn(sv_cgi_runner_t* runner) {
+    int sockets[2];
+    
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) != 0) {
+        fprintf(stderr, "warning! cannot create a CGI runner socket: %s\n", strerror(errno));
+        return false;
+    }
+    
+    pid_t pid = fork();
+    
+    if (pid == 0) {
+        sv_cgi_close_inherited(sockets[1]);
+        sv_cgi_runner_main(3);
+    }
+    
+    close(sockets[1]);
+    
+    if (pid < 0) {
+        fprintf(stderr, "warning! cannot fork a CGI runner: %s\n", strerror(errno));
+        
+        close(sockets[0]);
+        return false;
+    }
+    
+    fcntl(sockets[0], F_SETFD, FD_CLOEXEC);
+    fcntl(sockets[0], F_SETFL, fcntl(sockets[0], F_GETFL, 0) | O_NONBLOCK);
+    
+    runner->sk = sockets[0];
+    runner->pid = pid;
+    
+    return true;
+}
+
+//
+// dispatcher side
+//
+
+http_headers_ref sv_cgi_make_response(sv_cgi_job_ref job, const int32_t status) {
+    if (status == SV_CGI_STATUS_TIMEOUT)
+        return sv_cgi_make_error(HTTP_GATEWAY_TIMEOUT);
+    else if (job->outputTooLarge)
+        return sv_cgi_make_error(HTTP_BAD_GATEWAY);
+    
+    // the header fields end with an empty line, either kind of line breaks will do
+    char* data = job->output.data;
+    size_t size = job->output.size;
+    size_t position = 0;
+    
+    const char* keys[SV_CGI_HEADERS_MAX];
+    const char* values[SV_CGI_HEADERS_MAX];
+    http_size_t count = 0;
+    bool complete = false;
+    
+    while (position < size) {
+        char* lineEnd = memchr(data + position, '\n', size - position);
+        
+        if (!lineEnd)
+            break;
+        
+        char* line = data + position;
+        size_t lineLength = (size_t)(lineEnd - line);
+        position += lineLength + 1;
+        
+        if (lineLength > 0 && line[lineLength - 1] == '\r')
+            lineLength--;
+        
+        if (lineLength < 1) {
+            complete = true;
+            break;
+        }
+        
+        line[lineLength] = '\0';
+        char* colon = strchr(line, ':');
+        
+        if (!colon || count >= SV_CGI_HEADERS_MAX)
+            continue;
+        
+        *colon = '\0';
+        
+        for (colon++; *colon == ' ' || *colon == '\t'; colon++);
+        
+        keys[count] = line;
+        values[count] = colon;
+        count++;
+    }
+    
+    if (!complete || count < 1)
+        return sv_cgi_make_error(HTTP_BAD_GATEWAY);
+    
+    // Status if it's there, a redirect if there's just a Location
+    int code = HTTP_OK;
+    const char* contentType = "application/octet-stream";
+    
+    for (http_size_t sz = 0; sz < count; sz++) {
+        if (strcasecmp(keys[sz], "Status") == 0)
+            code = atoi(values[sz]);
+        else if (strcasecmp(keys[sz], "Content-Type") == 0)
+            contentType = values[sz];
+        else if (strcasecmp(keys[sz], "Location") == 0 && code == HTTP_OK)
+            code = HTTP_FOUND;
+    }
+    
+    // only final answers, and only ones the client can make sense of
+    if (code < 200 || code > 599)
+        return sv_cgi_make_error(HTTP_BAD_GATEWAY);
+    
+    size_t bodySize = size - position;
+    char* body = (bodySize > 0) ? malloc(bodySize) : NULL;
+    
+    if (body)
+        memcpy(body, data + position, bodySize);
+    
+    http_headers_ref response = http_headers_init_with_response((http_status_t)code, contentType,
+                                                                body, (http_size_t)bodySize,
+                                                                body ? free : NULL);
+    
+    for (http_size_t sz = 0; sz < count; sz++) {
+        bool dropped = false;
+        
+        for (const char** name = sv_cgi_dropped_headers; *name && !dropped; name++)
+            dropped = (strcasecmp(keys[sz], *name) == 0);
+        
+        if (!dropped)
+            http_headers_add(response, keys[sz], values[sz]);
+    }
+    
+    return response;
+}
+
+void sv_cgi_finish(sv_cgi_runner_t* runner, const int32_t status) {
+    sv_cgi_job_ref job = runner->job;
+    runner->job = NULL;
+    
+    if (!job)
+        return;
+    
+    http_deferred_respond(job->deferred, sv_cgi_make_response(job, status));
+    sv_cgi_job_free(job);
+}
+
+bool sv_cgi_has_request(sv_cgi_job_ref job) {
+    return (job->requestWritten < job->request.size ||
+            (job->bodyFD >= 0 && job->bodyRead < job->bodySize));
+}
+
+bool sv_cgi_read_body(sv_cgi_job_ref job) {
+    // the next chunk of a spilled body takes the place of what's written already
+    size_t amount = (size_t)MIN(job->bodySize - job->bodyRead, SV_CGI_CHUNK_SIZE);
+    
+    job->request.size = 0;
+    job->requestWritten = 0;
+    
+    if (!sv_cgi_buffer_reserve(&job->request, amount))
+        return false;
+    
+    while (true) {
+        ssize_t got = pread(job->bodyFD, job->request.data, amount, job->bodyRead);
+        
+        if (got < 0 && errno == EINTR)
+            continue;
+        else if (got <= 0)
+            return false; // the runner would wait for the rest forever
+        
+        job->request.size = (size_t)got;
+        job->bodyRead += got;
+        
+        return true;
+    }
+}
+
+bool sv_cgi_write_request(sv_cgi_runner_t* runner) {
+    sv_cgi_job_ref job = runner->job;
+    
+    while (job && sv_cgi_has_request(job)) {
+        if (job->requestWritten >= job->request.size && !sv_cgi_read_body(job))
+            return false;
+        
+        ssize_t written = write(runner->sk, job->request.data + job->requestWritten,
+                                job->request.size - job->requestWritten);
+        
+        if (written > 0)
+            job->requestWritten += (size_t)written;
+        else if (written < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return true;
+        else if (written < 0 && errno == EINTR)
+            continue;
+        else
+            return false;
+    }
+    
+    return true;
+}
+
+bool sv_cgi_handle_record(sv_cgi_runner_t* runner, const sv_cgi_record_t* record,
+                          const char* payload) {
+    sv_cgi_job_ref job = runner->job;
+    
+    if (record->type == SV_CGI_RECORD_END) {
+        int32_t status = SV_CGI_STATUS_FAILED;
+        
+        if (record->length >= sizeof(status))
+            memcpy(&status, payload, sizeof(status));
+        
+        sv_cgi_finish(runner, status);
+        return true;
+    } else if (record->type != SV_CGI_RECORD_STDOUT)
+        return false;
+    
+    if (!job || job->outputTooLarge)
+        return true;
+    
+    if (job->output.size + record->length > SV_CGI_OUTPUT_MAX ||
+        !sv_cgi_buffer_append(&job->output, payload, record->length)) {
+        // the rest of it is dropped, the client gets a 502 once the script is done
+        job->outputTooLarge = true;
+        sv_cgi_buffer_free(&job->output);
+    }
+    
+    return true;
+}
+
+bool sv_cgi_read_records(sv_cgi_runner_t* runner) {
+    sv_cgi_buffer_t* input = &runner->input;
+    bool alive = true;
+    
+    // everything there is right now
+    while (true) {
+        if (input->capacity - input->size < SV_CGI_CHUNK_SIZE) {
+            char* grown = realloc(input->data, input->size + SV_CGI_CHUNK_SIZE);
+            
+            if (!grown) {
+                alive = false;
+                break;
+            }
+            
+            input->data = grown;
+            input->capacity = input->size + SV_CGI_CHUNK_SIZE;
+        }
+        
+        ssize_t got = read(runner->sk, input->data + input->size, input->capacity - input->size);
+        
+        if (got > 0)
+            input->size += (size_t)got;
+        else if (got < 0 && errno == EINTR)
+            continue;
+        else {
+            alive = (got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK));
+            break;
+        }
+    }
+    
+    // whole records only, the rest waits for more
+    size_t position = 0;
+    
+    while (input->size - position >= sizeof(sv_cgi_record_t)) {
+        sv_cgi_record_t record;
+        memcpy(&record, input->data + position, sizeof(record));
+        
+        if (input->size - position - sizeof(record) < record.length)
+            break;
+        
+        if (!sv_cgi_handle_record(runner, &record, input->data + position + sizeof(record)))
+            alive = false;
+        
+        position += sizeof(record) + record.length;
+    }
+    
+    memmove(input->data, input->data + position, input->size - position);
+    input->size -= position;
+    
+    return alive;
+}
+
+void sv_cgi_restart(sv_cgi_runner_t* runner) {
+    // whatever it was doing is lost
+    sv_cgi_finish(runner, SV_CGI_STATUS_FAILED);
+    
+    close(runner->sk);
+    waitpid(runner->pid, NULL, 0);
+    
+    runner->sk = -1;
+    runner->pid = 0;
+    runner->input.size = 0;
+    
+    sv_cgi_spawn(runner);
+}
+
+void sv_cgi_assign_jobs(sv_cgi_ref cgi) {
+    // must be called with the lock held
+    bool anyRunner = false;
+    
+    for (http_size_t sz = 0; sz < cgi->runnersCount; sz++) {
+        sv_cgi_runner_t* runner = &cgi->runners[sz];
+        anyRunner |= (runner->sk >= 0);
+        
+        if (runner->job || runner->sk < 0 || !cgi->firstJob)
+            continue;
+        
+        runner->job = cgi->firstJob;
+        cgi->firstJob = runner->job->next;
+        cgi->jobsCount--;
+        
+        runner->job->next = NULL;
+    }
+    
+    if (!cgi->firstJob)
+        cgi->lastJob = NULL;
+    
+    // nothing is going to run these
+    while (!anyRunner && cgi->firstJob) {
+        sv_cgi_job_ref job = cgi->firstJob;
+        cgi->firstJob = job->next;
+        cgi->jobsCount--;
+        
+        http_deferred_respond(job->deferred, sv_cgi_make_error(HTTP_SERVICE_UNAVAILABLE));
+        sv_cgi_job_free(job);
+    }
+}
+
+void* sv_cgi_dispatch(void* data) {
+    sv_cgi_ref cgi = (sv_cgi_ref)data;
+    struct pollfd* fds = calloc(cgi->runnersCount + 1, sizeof(struct pollfd));
+    
+    while (true) {
+        pthread_mutex_lock(&cgi->lock);
+        
+        if (cgi->stopping) {
+            pthread_mutex_unlock(&cgi->lock);
+            break;
+        }
+        
+        sv_cgi_assign_jobs(cgi);
+        pthread_mutex_unlock(&cgi->lock);
+        
+        // new jobs, output of the runners and room for requests to them
+        fds[0].fd = cgi->wakePipe[0];
+        fds[0].events = POLLIN;
+        
+        for (http_size_t sz = 0; sz < cgi->runnersCount; sz++) {
+            sv_cgi_runner_t* runner = &cgi->runners[sz];
+            sv_cgi_job_ref job = runner->job;
+            
+            fds[sz + 1].fd = runner->sk;
+            fds[sz + 1].events = POLLIN;
+            
+            if (job && sv_cgi_has_request(job))
+                fds[sz + 1].events |= POLLOUT;
+        }
+        
+        if (poll(fds, cgi->runnersCount + 1, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            
+            fprintf(stderr, "warning! CGI dispatcher failed: %s\n", strerror(errno));
+            break;
+        }
+        
+        if (fds[0].revents) {
+            char drained[64];
+            while (read(cgi->wakePipe[0], drained, sizeof(drained)) > 0);
+        }
+        
+        for (http_size_t sz = 0; sz < cgi->runnersCount; sz++) {
+            sv_cgi_runner_t* runner = &cgi->runners[sz];
+            short revents = fds[sz + 1].revents;
+            bool alive = true;
+            
+            if (runner->sk < 0 || !revents)
+                continue;
+            
+            if (revents & POLLOUT)
+                alive = sv_cgi_write_request(runner);
+            if (alive && (revents & (POLLIN | POLLHUP | POLLERR)))
+                alive = sv_cgi_read_records(runner);
+            
+            if (!alive)
+                sv_cgi_restart(runner);
+        }
+    }
+    
+    free(fds);
+    return NULL;
+}
+
+//
+// public
+//
+
+sv_cgi_ref sv_cgi_init(const char* root, const http_size_t runnersCount) {
+    char* absoluteRoot = realpath(root, NULL);
+    
+    if (!absoluteRoot) {
+        fprintf(stderr, "warning! cannot resolve the CGI root - \"%s\": %s\n", root,
+                strerror(errno));
+        return NULL;
+    }
+    
+    sv_cgi_ref cgi = calloc(1, sizeof(struct sv_cgi_s));
+    cgi->root = absoluteRoot;
+    cgi->runnersCount = (runnersCount > 0) ? runnersCount : SV_CGI_RUNNERS;
+    cgi->runners = calloc(cgi->runnersCount, sizeof(sv_cgi_runner_t));
+    
+    pthread_mutex_init(&cgi->lock, NULL);
+    
+    for (http_size_t sz = 0; sz < cgi->runnersCount; sz++) {
+        cgi->runners[sz].sk = -1;
+        sv_cgi_spawn(&cgi->runners[sz]);
+    }
+    
+    if (pipe(cgi->wakePipe) != 0) {
+        fprintf(stderr, "warning! cannot create the CGI dispatcher pipe: %s\n", strerror(errno));
+        
+        cgi->wakePipe[0] = cgi->wakePipe[1] = -1;
+        sv_cgi_release(cgi);
+        
+        return NULL;
+    }
+    
+    for (http_size_t sz = 0; sz < 2; sz++) {
+        fcntl(cgi->wakePipe[sz], F_SETFD, FD_CLOEXEC);
+        fcntl(cgi->wakePipe[sz], F_SETFL, fcntl(cgi->wakePipe[sz], F_GETFL, 0) | O_NONBLOCK);
+    }
+    
+    if (pthread_create(&cgi->dispatcher, NULL, sv_cgi_dispatch, cgi) != 0) {
+        fprintf(stderr, "warning! cannot start the CGI dispatcher\n");
+        
+        close(cgi->wakePipe[0]);
+        close(cgi->wakePipe[1]);
+        cgi->wakePipe[0] = cgi->wakePipe[1] = -1;
+        
+        sv_cgi_release(cgi);
+        return NULL;
+    }
+    
+    return cgi;
+}
+
+bool sv_cgi_is_script(const char* path, const mode_t mode) {
+    if (!S_ISREG(mode) || !(mode & (S_IXUSR | S_IXGRP | S_IXOTH)))
+        return false;
+    
+    size_t length = strlen(path);
+    
+    return ((length > 4 && strcmp(path + length - 4, ".cgi") == 0) ||
+            strncmp(path, "cgi-bin/", 8) == 0 || strstr(path, "/cgi-bin/") != NULL);
+}
+
+http_headers_ref sv_cgi_respond(sv_cgi_ref cgi, const http_headers_ref request,
+                                const char* path) {
+    pthread_mutex_lock(&cgi->lock);
+    bool busy = (cgi->jobsCount >= SV_CGI_QUEUE_MAX || cgi->stopping);
+    pthread_mutex_unlock(&cgi->lock);
+    
+    if (busy)
+        return sv_cgi_make_error(HTTP_SERVICE_UNAVAILABLE);
+    
+    // the environment of RFC 3875, the request is gone once the callback returns
+    const char* url = http_headers_get_request_url(request);
+    const char* query = strchr(url, '?');
+    const char* host = http_headers_get(request, "Host");
+    const char* contentType = http_headers_get(request, "Content-Type");
+    const char* systemPath = getenv("PATH");
+    const char* clientInfo = http_headers_get_client_info(request);
+    
+    http_size_t bodySize = 0;
+    void* body = http_headers_get_body(request, &bodySize);
+    
+    // large bodies wait in a file, which the dispatcher reads from while sending them
+    // (the runner gets them as one record all the same). It's closed once the callback
+    // returns, so the job keeps a descriptor of its own
+    off_t spilledSize = 0;
+    int spilledFD = http_headers_get_file(request, NULL, &spilledSize);
+    
+    if (body || spilledSize < 1)
+        spilledFD = -1;
+    else if (spilledFD >= 0 && spilledSize > UINT32_MAX)
+        return sv_cgi_make_error(HTTP_PAYLOAD_TOO_LARGE);
+    else if (spilledFD >= 0) {
+        spilledFD = fcntl(spilledFD, F_DUPFD_CLOEXEC, 0);
+        
+        if (spilledFD < 0)
+            return sv_cgi_make_error(HTTP_INTERNAL_SERVER_ERROR);
+        
+        bodySize = (http_size_t)spilledSize;
+    }
+    
+    char scriptFilename[MAXPATHLEN * 2];
+    char scriptName[MAXPATHLEN + 2];
+    char contentLength[24];
+    
+    snprintf(scriptFilename, sizeof(scriptFilename), "%s/%s", cgi->root, path);
+    snprintf(scriptName, sizeof(scriptName), "/%s", path);
+    snprintf(contentLength, sizeof(contentLength), "%u", bodySize);
+    
+    sv_cgi_buffer_t params = { NULL, 0, 0 };
+    bool success = (sv_cgi_append_param_str(&params, "GATEWAY_INTERFACE", "CGI/1.1") &&
+                    sv_cgi_append_param_str(&params, "SERVER_SOFTWARE", "http_server") &&
+                    sv_cgi_append_param_str(&params, "SERVER_PROTOCOL",
+                                            http_headers_get_request_version(request)) &&
+                    sv_cgi_append_param_str(&params, "REQUEST_METHOD",
+                                            http_headers_get_request_type(request)) &&
+                    sv_cgi_append_param_str(&params, "REQUEST_URI", url) &&
+                    sv_cgi_append_param_str(&params, "SCRIPT_NAME", scriptName) &&
+                    sv_cgi_append_param_str(&params, "SCRIPT_FILENAME", scriptFilename) &&
+                    sv_cgi_append_param_str(&params, "DOCUMENT_ROOT", cgi->root) &&
+                    sv_cgi_append_param_str(&params, "PATH_INFO", "") &&
+                    sv_cgi_append_param(&params, "QUERY_STRING", query ? query + 1 : "",
+                                        query ? strcspn(query + 1, "#") : 0) &&
+                    sv_cgi_append_param_str(&params, "REMOTE_ADDR",
+                                            clientInfo ? clientInfo : "") &&
+                    sv_cgi_append_param_str(&params, "PATH",
+                                            systemPath ? systemPath : "/usr/local/bin:/usr/bin:/bin"));
+    
+    if (success && (body || spilledFD >= 0)) {
+        success = (sv_cgi_append_param_str(&params, "CONTENT_LENGTH", contentLength) &&
+                   (!contentType || sv_cgi_append_param_str(&params, "CONTENT_TYPE", contentType)));
+    }
+    
+    if (success && host) {
+        // [IPv6]:port or name:port
+        const char* port = (host[0] == '[') ? strstr(host, "]:") : strchr(host, ':');
+        size_t nameLength = port ? (size_t)(port - host) + (host[0] == '[') : strlen(host);
+        
+        success = (sv_cgi_append_param(&params, "SERVER_NAME", host, nameLength) &&
+                   (!port || sv_cgi_append_param_str(&params, "SERVER_PORT",
+                                                     port + 1 + (host[0] == '['))));
+    }
+    
+    // every header field as HTTP_NAME, except for the ones above and Proxy (httpoxy)
+    const char* key = NULL;
+    const char* value = NULL;
+    
+    for (http_size_t sz = 0; success && http_headers_get_field(request, sz, &key, &value); sz++) {
+        if (strcasecmp(key, "Content-Type") == 0 || strcasecmp(key, "Content-Length") == 0 ||
+            strcasecmp(key, "Proxy") == 0)
+            continue;
+        
+        char name[HTTP_HEADER_LENGTH_MAX + 8] = "HTTP_";
+        size_t length = 5;
+        
+        for (; *key && length + 1 < sizeof(name); key++)
+            name[length++] = (*key == '-') ? '_' : (char)toupper((unsigned char)*key);
+        
+        name[length] = '\0';
+        success = sv_cgi_append_param_str(&params, name, value);
+    }
+    
+    sv_cgi_job_ref job = calloc(1, sizeof(struct sv_cgi_job_s));
+    job->bodyFD = spilledFD;
+    job->bodySize = (spilledFD >= 0) ? spilledSize : 0;
+    
+    // a spilled body follows the heading of its record right from the file
+    success = (success &&
+               sv_cgi_append_record(&job->request, SV_CGI_RECORD_PARAMS, params.data, params.size) &&
+               ((spilledFD >= 0) ?
+                    sv_cgi_append_heading(&job->request, SV_CGI_RECORD_STDIN, bodySize) :
+                    sv_cgi_append_record(&job->request, SV_CGI_RECORD_STDIN, body,
+                                         body ? bodySize : 0)));
+    
+    sv_cgi_buffer_free(&params);
+    
+    http_headers_ref placeholder = success ? http_headers_init_deferred(request, &job->deferred) :
+                                             NULL;
+    
+    if (!placeholder) {
+        sv_cgi_job_free(job);
+        return sv_cgi_make_error(HTTP_INTERNAL_SERVER_ERROR);
+    }
+    
+    // off to the dispatcher
+    pthread_mutex_lock(&cgi->lock);
+    
+    if (cgi->lastJob)
+        cgi->lastJob->next = job;
+    else
+        cgi->firstJob = job;
+    
+    cgi->lastJob = job;
+    cgi->jobsCount++;
+    
+    pthread_mutex_unlock(&cgi->lock);
+    
+    char wakeUp = 1;
+    if (write(cgi->wakePipe[1], &wakeUp, 1) < 0 && errno != EAGAIN)
+        fprintf(stderr, "warning! cannot wake the CGI dispatcher up: %s\n", strerror(errno));
+    
+    return placeholder;
+}
+
+void sv_cgi_release(sv_cgi_ref cgi) {
+    if (!cgi)
+        return;
+    
+    if (cgi->wakePipe[0] >= 0) {
+        pthread_mutex_lock(&cgi->lock);
+        cgi->stopping = true;
+        pthread_mutex_unlock(&cgi->lock);
+        
+        char wakeUp = 1;
+        if (write(cgi->wakePipe[1], &wakeUp, 1) == 1)
+            pthread_join(cgi->dispatcher, NULL);
+        
+        close(cgi->wakePipe[0]);
+        close(cgi->wakePipe[1]);
+    }
+    
+    // the runners exit once their sockets are closed, their jobs are just dropped
+    // as the server is going away anyway
+    for (http_size_t sz = 0; sz < cgi->runnersCount; sz++) {
+        sv_cgi_runner_t* runner = &cgi->runners[sz];
+        
+        if (runner->sk >= 0) {
+            close(runner->sk);
+            waitpid(runner->pid, NULL, 0);
+        }
+        
+        if (runner->job)
+            sv_cgi_job_free(runner->job);
+        
+        sv_cgi_buffer_free(&runner->input);
+    }
+    
+    while (cgi->firstJob) {
+        sv_cgi_job_ref job = cgi->firstJob;
+        cgi->firstJob = job->next;
+        
+        sv_cgi_job_free(job);
+    }
+    
+    pthread_mutex_destroy(&cgi->lock);
+    
+    free(cgi->runners);
+    free(cgi->root);
+    free(cgi);
+}
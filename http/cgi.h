@@ -0,0 +1,49 @@
+//
+//  cgi.h
+//  http
+//
+//  Created by Tim K. on 26.02.23.
+//  Copyright © 2023 Tim K. All rights reserved.
+//
+
+#pragma once
+
+#include <sys/types.h>
+#include "http_server.h"
+
+//
+// CGI scripts. They're spawned by a pool of runner processes forked once at startup,
+// each of which takes one request at a time over a Unix socket, runs the script from
+// its own small address space and streams the output back. A dispatcher thread moves
+// requests and output between the runners and the server, so the workers only defer
+// the response and never wait for a script themselves
+//
+
+/// runner processes spawning the scripts
+#define SV_CGI_RUNNERS 4
+/// requests waiting for a runner at most, more are answered with 503
+#define SV_CGI_QUEUE_MAX 256
+/// seconds a script may take before it's killed
+#define SV_CGI_TIMEOUT 30
+/// bytes of output a script may produce
+#define SV_CGI_OUTPUT_MAX (16 * 1024 * 1024)
+
+typedef struct sv_cgi_s* sv_cgi_ref;
+
+///
+/// forks the runners for scripts below root, NULL on failure. Must be called before
+/// any threads are started, so that the runners are forked from a clean process
+///
+sv_cgi_ref sv_cgi_init(const char* root, const http_size_t runnersCount);
+
+/// true if the file at the path (relative to the root) is a script: executable and
+/// either named *.cgi or found in a cgi-bin directory
+bool sv_cgi_is_script(const char* path, const mode_t mode);
+
+/// hands the request over to a runner and returns a deferred response, or an error
+/// response if that's impossible
+http_headers_ref sv_cgi_respond(sv_cgi_ref cgi, const http_headers_ref request,
+                                const char* path);
+
+/// stops the dispatcher and the runners
+void sv_cgi_release(sv_cgi_ref cgi);
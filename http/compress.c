@@ -0,0 +1,543 @@
+//
+//  compress.c
+//  http
+//
+//  Created by Tim K. on 26.02.23.
+//  Copyright © 2023 Tim K. All rights reserved.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#ifdef SV_ZLIB
+#include <zlib.h>
+#endif
+#ifdef SV_BROTLI
+#include <brotli/encode.h>
+#endif
+#include "compress.h"
+
+#define SV_COMPRESS_BUCKETS 256
+/// misses waiting for the compressor at most, the rest is served as is
+#define SV_COMPRESS_JOBS_MAX 64
+
+/// a variant to be made
+typedef struct sv_compress_job_s {
+    // holds a reference until the job is done
+    sv_cache_entry_ref source;
+    sv_encoding_t encoding;
+    struct sv_compress_job_s* next;
+} sv_compress_job_t;
+
+struct sv_compress_cache_s {
+    pthread_mutex_t lock;
+    sv_variant_ref buckets[SV_COMPRESS_BUCKETS];
+    
+    // compressed bytes held by all the variants and the limit for that
+    size_t size;
+    size_t maxSize;
+    // bumped on every hit, the variant used the longest ago goes first
+    uint64_t clock;
+    
+    // compressing takes far too long for the workers' event loops, so it's done on a
+    // thread of its own. The first job is the one being compressed, all of them stay
+    // here until they're done so that a miss is queued only once
+    pthread_t compressor;
+    bool hasCompressor;
+    bool stopping;
+    pthread_cond_t wake;
+    sv_compress_job_t* jobs;
+    size_t jobsCount;
+};
+
+static const char* sv_encoding_names[SV_ENCODING_COUNT] = { "br", "gzip" };
+static const char* sv_encoding_extensions[SV_ENCODING_COUNT] = { ".br", ".gz" };
+
+static const char* sv_compressible_types[] = {
+    "text/",
+    "application/javascript",
+    "application/json",
+    "application/xml",
+    "application/wasm",
+    "image/svg+xml",
+    "image/x-icon",
+    "font/ttf",
+    "font/otf",
+    NULL
+};
+
+//
+// private
+//
+
+uint32_t sv_compress_hash(const char* path, const sv_encoding_t encoding) {
+    // FNV-1a
+    uint32_t hash = 2166136261u ^ (uint32_t)encoding;
+    
+    for (; *path; path++)
+        hash = (hash ^ (uint8_t)*path) * 16777619u;
+    
+    return hash;
+}
+
+bool sv_compress_is_current(const sv_variant_ref variant, const sv_cache_entry_ref source) {
+    return (variant->sourceSize == source->size && variant->sourceInode == source->inode &&
+            variant->sourceModified.tv_sec == source->modified.tv_sec &&
+            variant->sourceModified.tv_nsec == source->modified.tv_nsec);
+}
+
+#ifdef SV_ZLIB
+bool sv_compress_gzip(const void* data, const size_t size, void** outputPtr,
+                      size_t* outputSizePtr) {
+    z_stream stream;
+    bzero(&stream, sizeof(z_stream));
+    
+    // 16 more window bits for a gzip wrapper instead of a zlib one
+    if (deflateInit2(&stream, SV_COMPRESS_GZIP_LEVEL, Z_DEFLATED, 15 + 16, 8,
+                     Z_DEFAULT_STRATEGY) != Z_OK)
+        return false;
+    
+    size_t capacity = deflateBound(&stream, (uLong)size);
+    void* output = malloc(capacity);
+    
+    stream.next_in = (Bytef*)data;
+    stream.avail_in = (uInt)size;
+    stream.next_out = output;
+    stream.avail_out = (uInt)capacity;
+    
+    bool result = (output && deflate(&stream, Z_FINISH) == Z_STREAM_END);
+    
+    (*outputPtr) = output;
+    (*outputSizePtr) = stream.total_out;
+    
+    deflateEnd(&stream);
+    return result;
+}
+#endif
+
+#ifdef SV_BROTLI
+bool sv_compress_brotli(const void* data, const size_t size, void** outputPtr,
+                        size_t* outputSizePtr) {
+    size_t capacity = BrotliEncoderMaxCompressedSize(size);
+    
+    if (capacity < 1)
+        return false;
+    
+    void* output = malloc(capacity);
+    (*outputPtr) = output;
+    (*outputSizePtr) = capacity;
+    
+    return (output && BrotliEncoderCompress(SV_COMPRESS_BROTLI_QUALITY, BROTLI_DEFAULT_WINDOW,
+                                            BROTLI_MODE_TEXT, size, data, outputSizePtr,
+                                            output) == BROTLI_TRUE);
+}
+#endif
+
+int sv_compress_make_file(const void* data, const size_t size) {
+    // the variant is sent just like any other file, but lives in memory only
+#ifdef __linux__
+    int fd = memfd_create("sv-variant", MFD_CLOEXEC);
+#else
+    FILE* temporary = tmpfile();
+    int fd = temporary ? dup(fileno(temporary)) : -1;
+    
+    if (temporary)
+        fclose(temporary);
+#endif
+    
+    for (size_t written = 0; fd >= 0 && written < size;) {
+        ssize_t result = write(fd, (const char*)data + written, size - written);
+        
+        if (result < 0 && errno == EINTR)
+            continue;
+        else if (result <= 0) {
+            close(fd);
+            return -1;
+        }
+        
+        written += (size_t)result;
+    }
+    
+    return fd;
+}
+
+sv_variant_ref sv_compress_make(sv_cache_entry_ref source, const sv_encoding_t encoding) {
+    size_t size = (size_t)source->size;
+    char* data = malloc(size);
+    
+    for (size_t done = 0; data && done < size;) {
+        ssize_t result = pread(source->fd, data + done, size - done, (off_t)done);
+        
+        if (result < 0 && errno == EINTR)
+            continue;
+        else if (result <= 0) {
+            // changed in the meantime, it'll be picked up next time
+            free(data);
+            return NULL;
+        }
+        
+        done += (size_t)result;
+    }
+    
+    if (!data)
+        return NULL;
+    
+    void* output = NULL;
+    size_t outputSize = 0;
+    bool compressed = false;
+
+#ifdef SV_BROTLI
+    if (encoding == SV_ENCODING_BROTLI)
+        compressed = sv_compress_brotli(data, size, &output, &outputSize);
+#endif
+#ifdef SV_ZLIB
+    if (encoding == SV_ENCODING_GZIP)
+        compressed = sv_compress_gzip(data, size, &output, &outputSize);
+#endif
+    
+    free(data);
+    
+    if (!compressed) {
+        free(output);
+        return NULL;
+    }
+    
+    sv_variant_ref variant = calloc(1, sizeof(struct sv_variant_s));
+    variant->path = strdup(source->path);
+    variant->encoding = encoding;
+    variant->sourceSize = source->size;
+    variant->sourceModified = source->modified;
+    variant->sourceInode = source->inode;
+    variant->references = 1;
+    variant->fd = -1;
+    
+    // not worth the CPU time on the client side otherwise, remember that too
+    if (outputSize < size - size / 10) {
+        variant->fd = sv_compress_make_file(output, outputSize);
+        variant->size = (off_t)outputSize;
+    }
+    
+    free(output);
+    return variant;
+}
+
+void sv_compress_cache_unlink(sv_compress_cache_ref cache, sv_variant_ref* link) {
+    // must be called with the lock held
+    sv_variant_ref variant = *link;
+    
+    *link = variant->next;
+    cache->size -= (size_t)variant->size;
+    
+    sv_variant_release(variant);
+}
+
+bool sv_compress_cache_evict(sv_compress_cache_ref cache) {
+    // least recently used first
+    sv_variant_ref* oldest = NULL;
+    
+    for (size_t sz = 0; sz < SV_COMPRESS_BUCKETS; sz++) {
+        for (sv_variant_ref* link = &cache->buckets[sz]; *link; link = &(*link)->next) {
+            if (!oldest || (*link)->lastUsed < (*oldest)->lastUsed)
+                oldest = link;
+        }
+    }
+    
+    if (!oldest)
+        return false;
+    
+    sv_compress_cache_unlink(cache, oldest);
+    return true;
+}
+
+void sv_compress_cache_insert(sv_compress_cache_ref cache, sv_variant_ref variant) {
+    // must be called with the lock held, takes a reference of its own
+    sv_variant_ref* bucket = &cache->buckets[sv_compress_hash(variant->path, variant->encoding) %
+                                             SV_COMPRESS_BUCKETS];
+    
+    // whatever was there for this file before is outdated (or just as good)
+    for (sv_variant_ref* link = bucket; *link;) {
+        if ((*link)->encoding == variant->encoding && strcmp((*link)->path, variant->path) == 0)
+            sv_compress_cache_unlink(cache, link);
+        else
+            link = &(*link)->next;
+    }
+    
+    if ((size_t)variant->size > cache->maxSize)
+        return;
+    
+    while (cache->size + (size_t)variant->size > cache->maxSize &&
+           sv_compress_cache_evict(cache));
+    
+    variant->next = *bucket;
+    variant->lastUsed = ++cache->clock;
+    __atomic_add_fetch(&variant->references, 1, __ATOMIC_RELAXED);
+    
+    *bucket = variant;
+    cache->size += (size_t)variant->size;
+}
+
+void sv_compress_cache_queue(sv_compress_cache_ref cache, sv_cache_entry_ref source,
+                             const sv_encoding_t encoding) {
+    // must be called with the lock held
+    sv_compress_job_t** link = &cache->jobs;
+    
+    for (; *link; link = &(*link)->next) {
+        if ((*link)->encoding == encoding && strcmp((*link)->source->path, source->path) == 0)
+            return; // on its way already
+    }
+    
+    if (!cache->hasCompressor || cache->jobsCount >= SV_COMPRESS_JOBS_MAX)
+        return;
+    
+    sv_compress_job_t* job = calloc(1, sizeof(sv_compress_job_t));
+    
+    if (!job)
+        return;
+    
+    __atomic_add_fetch(&source->references, 1, __ATOMIC_RELAXED);
+    job->source = source;
+    job->encoding = encoding;
+    
+    *link = job;
+    cache->jobsCount++;
+    
+    pthread_cond_signal(&cache->wake);
+}
+
+void* sv_compress_thread(void* data) {
+    sv_compress_cache_ref cache = (sv_compress_cache_ref)data;
+    
+    pthread_mutex_lock(&cache->lock);
+    
+    while (true) {
+        while (!cache->jobs && !cache->stopping)
+            pthread_cond_wait(&cache->wake, &cache->lock);
+        
+        if (cache->stopping)
+            break;
+        
+        sv_compress_job_t* job = cache->jobs;
+        pthread_mutex_unlock(&cache->lock);
+        
+        // nobody waits for it, the source is served as is until it's there
+        sv_variant_ref variant = sv_compress_make(job->source, job->encoding);
+        
+        pthread_mutex_lock(&cache->lock);
+        
+        if (variant)
+            sv_compress_cache_insert(cache, variant);
+        
+        cache->jobs = job->next;
+        cache->jobsCount--;
+        
+        pthread_mutex_unlock(&cache->lock);
+        
+        sv_variant_release(variant);
+        sv_cache_entry_release(job->source);
+        free(job);
+        
+        pthread_mutex_lock(&cache->lock);
+    }
+    
+    pthread_mutex_unlock(&cache->lock);
+    return NULL;
+}
+
+//
+// public
+//
+
+const char* sv_compress_get_name(const sv_encoding_t encoding) {
+    return (encoding < SV_ENCODING_COUNT) ? sv_encoding_names[encoding] : "identity";
+}
+
+const char* sv_compress_get_extension(const sv_encoding_t encoding) {
+    return (encoding < SV_ENCODING_COUNT) ? sv_encoding_extensions[encoding] : "";
+}
+
+bool sv_compress_is_available(const sv_encoding_t encoding) {
+    switch (encoding) {
+#ifdef SV_BROTLI
+        case SV_ENCODING_BROTLI:
+            return true;
+#endif
+#ifdef SV_ZLIB
+        case SV_ENCODING_GZIP:
+            return true;
+#endif
+        default:
+            return false;
+    }
+}
+
+bool sv_compress_is_compressible(const char* contentType) {
+    for (const char** type = sv_compressible_types; *type; type++) {
+        if (strncmp(contentType, *type, strlen(*type)) == 0)
+            return true;
+    }
+    
+    return false;
+}
+
+http_size_t sv_compress_negotiate(const char* acceptEncoding,
+                                  sv_encoding_t encodings[SV_ENCODING_COUNT]) {
+    // quality of every coding in thousandths, -1 if not mentioned at all
+    int qualities[SV_ENCODING_COUNT];
+    int wildcard = -1;
+    
+    for (http_size_t sz = 0; sz < SV_ENCODING_COUNT; sz++)
+        qualities[sz] = -1;
+    
+    for (const char* position = acceptEncoding; position && *position;) {
+        // "name [; q=value]" separated by commas
+        position += strspn(position, " \t,");
+        
+        size_t nameLength = strcspn(position, " \t;,");
+        const char* parameters = position + nameLength;
+        const char* end = parameters + strcspn(parameters, ",");
+        
+        int quality = 1000;
+        const char* q = strstr(parameters, "q=");
+        
+        if (q && q < end) {
+            double value = atof(q + 2);
+            quality = (int)(value * 1000 + 0.5);
+        }
+        
+        if (nameLength == 1 && position[0] == '*')
+            wildcard = quality;
+        
+        for (http_size_t sz = 0; sz < SV_ENCODING_COUNT; sz++) {
+            if (strlen(sv_encoding_names[sz]) == nameLength &&
+                strncasecmp(position, sv_encoding_names[sz], nameLength) == 0)
+                qualities[sz] = quality;
+        }
+        
+        // "x-gzip" is the same as "gzip"
+        if (nameLength == 6 && strncasecmp(position, "x-gzip", 6) == 0)
+            qualities[SV_ENCODING_GZIP] = quality;
+        
+        position = end;
+    }
+    
+    http_size_t count = 0;
+    
+    for (http_size_t sz = 0; sz < SV_ENCODING_COUNT; sz++) {
+        int quality = (qualities[sz] < 0) ? wildcard : qualities[sz];
+        
+        if (quality <= 0)
+            continue;
+        
+        // insertion sort by quality, preference order breaks ties
+        http_size_t index = count++;
+        qualities[sz] = quality;
+        
+        while (index > 0 && qualities[encodings[index - 1]] < quality) {
+            encodings[index] = encodings[index - 1];
+            index--;
+        }
+        
+        encodings[index] = (sv_encoding_t)sz;
+    }
+    
+    return count;
+}
+
+sv_compress_cache_ref sv_compress_cache_init(const size_t maxSize) {
+    sv_compress_cache_ref cache = calloc(1, sizeof(struct sv_compress_cache_s));
+    cache->maxSize = maxSize;
+    
+    pthread_mutex_init(&cache->lock, NULL);
+    pthread_cond_init(&cache->wake, NULL);
+    
+    // nothing is compressed on the fly without it, precompressed files still are served
+    cache->hasCompressor = (pthread_create(&cache->compressor, NULL, sv_compress_thread,
+                                           cache) == 0);
+    
+    if (!cache->hasCompressor)
+        fprintf(stderr, "warning! couldn't start the compressor thread\n");
+    
+    return cache;
+}
+
+sv_variant_ref sv_compress_cache_get(sv_compress_cache_ref cache, sv_cache_entry_ref source,
+                                     const sv_encoding_t encoding) {
+    if (!sv_compress_is_available(encoding) || source->fd < 0 ||
+        source->size < SV_COMPRESS_SIZE_MIN || source->size > SV_COMPRESS_SOURCE_MAX)
+        return NULL;
+    
+    uint32_t hash = sv_compress_hash(source->path, encoding);
+    sv_variant_ref* bucket = &cache->buckets[hash % SV_COMPRESS_BUCKETS];
+    
+    pthread_mutex_lock(&cache->lock);
+    
+    for (sv_variant_ref variant = *bucket; variant; variant = variant->next) {
+        if (variant->encoding != encoding || strcmp(variant->path, source->path) != 0 ||
+            !sv_compress_is_current(variant, source))
+            continue;
+        
+        variant->lastUsed = ++cache->clock;
+        
+        if (variant->fd < 0)
+            variant = NULL;
+        else
+            __atomic_add_fetch(&variant->references, 1, __ATOMIC_RELAXED);
+        
+        pthread_mutex_unlock(&cache->lock);
+        return variant;
+    }
+    
+    // made in the background, the source is served as is meanwhile
+    sv_compress_cache_queue(cache, source, encoding);
+    
+    pthread_mutex_unlock(&cache->lock);
+    return NULL;
+}
+
+void sv_variant_release(sv_variant_ref variant) {
+    if (!variant || __atomic_sub_fetch(&variant->references, 1, __ATOMIC_ACQ_REL) > 0)
+        return;
+    
+    if (variant->fd >= 0)
+        close(variant->fd);
+    
+    free(variant->path);
+    free(variant);
+}
+
+void sv_compress_cache_release(sv_compress_cache_ref cache) {
+    if (!cache)
+        return;
+    
+    // the job being compressed is finished first
+    if (cache->hasCompressor) {
+        pthread_mutex_lock(&cache->lock);
+        cache->stopping = true;
+        pthread_cond_signal(&cache->wake);
+        pthread_mutex_unlock(&cache->lock);
+        
+        pthread_join(cache->compressor, NULL);
+    }
+    
+    while (cache->jobs) {
+        sv_compress_job_t* job = cache->jobs;
+        cache->jobs = job->next;
+        
+        sv_cache_entry_release(job->source);
+        free(job);
+    }
+    
+    for (size_t sz = 0; sz < SV_COMPRESS_BUCKETS; sz++) {
+        while (cache->buckets[sz])
+            sv_compress_cache_unlink(cache, &cache->buckets[sz]);
+    }
+    
+    pthread_cond_destroy(&cache->wake);
+    pthread_mutex_destroy(&cache->lock);
+    free(cache);
+}
@@ -0,0 +1,92 @@
+//
+//  compress.h
+//  http
+//
+//  Created by Tim K. on 26.02.23.
+//  Copyright © 2023 Tim K. All rights reserved.
+//
+
+#pragma once
+
+#include "cache.h"
+
+//
+// content negotiation and compressed variants of static files. Each variant is
+// compressed once on a thread of its own, kept in an anonymous in-memory file (so that it can be sent
+// with sendfile() like any other file) and dropped once its source changes or
+// the cache needs the room. The encoders are only there if the build found zlib
+// (SV_ZLIB) and brotli (SV_BROTLI)
+//
+
+/// files smaller than that aren't worth compressing
+#define SV_COMPRESS_SIZE_MIN 256
+/// files larger than that are only served precompressed
+#define SV_COMPRESS_SOURCE_MAX (8 * 1024 * 1024)
+/// default limit for the size of all the compressed variants together
+#define SV_COMPRESS_CACHE_SIZE (64 * 1024 * 1024)
+
+#define SV_COMPRESS_GZIP_LEVEL 9
+#define SV_COMPRESS_BROTLI_QUALITY 9
+
+/// content codings, in the order of preference
+typedef enum {
+    SV_ENCODING_BROTLI = 0,
+    SV_ENCODING_GZIP,
+    SV_ENCODING_COUNT,
+    
+    SV_ENCODING_IDENTITY = SV_ENCODING_COUNT
+} sv_encoding_t;
+
+typedef struct sv_compress_cache_s* sv_compress_cache_ref;
+typedef struct sv_variant_s* sv_variant_ref;
+
+struct sv_variant_s {
+    // source path and the state of the source it was made of
+    char* path;
+    sv_encoding_t encoding;
+    off_t sourceSize;
+    struct timespec sourceModified;
+    ino_t sourceInode;
+    
+    // compressed contents, -1 if compressing didn't make it any smaller
+    int fd;
+    off_t size;
+    
+    // one for the cache plus one per user
+    uint32_t references;
+    // value of the cache's clock when it was used last
+    uint64_t lastUsed;
+    sv_variant_ref next;
+};
+
+/// Content-Encoding value of the encoding
+const char* sv_compress_get_name(const sv_encoding_t encoding);
+/// suffix of precompressed files (".br", ".gz")
+const char* sv_compress_get_extension(const sv_encoding_t encoding);
+/// true if the server can compress with the encoding by itself
+bool sv_compress_is_available(const sv_encoding_t encoding);
+/// true for text-like content types that compress well
+bool sv_compress_is_compressible(const char* contentType);
+
+///
+/// fills encodings with the codings the client accepts according to its
+/// Accept-Encoding header (NULL if there's none), best first, and returns their
+/// amount. Identity is never included, it's always acceptable
+///
+http_size_t sv_compress_negotiate(const char* acceptEncoding,
+                                  sv_encoding_t encodings[SV_ENCODING_COUNT]);
+
+sv_compress_cache_ref sv_compress_cache_init(const size_t maxSize);
+
+///
+/// gets the source file compressed with the encoding. NULL if that's impossible or
+/// doesn't pay off, and also if there's no up-to-date variant yet: then it's made in
+/// the background and the source has to be served as is meanwhile. Otherwise the
+/// variant must be given back with sv_variant_release
+///
+sv_variant_ref sv_compress_cache_get(sv_compress_cache_ref cache, sv_cache_entry_ref source,
+                                     const sv_encoding_t encoding);
+
+void sv_variant_release(sv_variant_ref variant);
+
+void sv_compress_cache_release(sv_compress_cache_ref cache);
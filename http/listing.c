@@ -0,0 +1,526 @@
+//
+//  listing.c
+//  http
+//
+//  Created by Tim K. on 26.02.23.
+//  Copyright © 2023 Tim K. All rights reserved.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/param.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+#include "listing.h"
+
+#define SV_LISTING_BUCKETS 64
+/// bytes in front of the rendered text of a listing
+#define SV_LISTING_HEADER_SIZE offsetof(struct sv_listing_s, text)
+
+struct sv_listing_cache_s {
+    // served directory, every listed one is opened relative to it
+    int rootFD;
+    
+    pthread_mutex_t lock;
+    sv_listing_ref buckets[SV_LISTING_BUCKETS];
+    
+    // rendered bytes held by all the listings and the limit for that
+    size_t size;
+    size_t maxSize;
+    // bumped on every hit, the listing used the longest ago goes first
+    uint64_t clock;
+};
+
+/// one thing in a directory, its name is kept in the names pool
+typedef struct {
+    const char* name;
+    size_t nameOffset;
+    size_t nameLength;
+    bool directory;
+} sv_listing_item_t;
+
+/// everything in a directory, as read from the kernel
+typedef struct {
+    sv_listing_item_t* items;
+    size_t count;
+    size_t capacity;
+    
+    char* names;
+    size_t namesSize;
+    size_t namesCapacity;
+} sv_listing_items_t;
+
+/// output growing geometrically, room for the listing object itself comes first
+typedef struct {
+    char* data;
+    size_t size;
+    size_t capacity;
+} sv_listing_buffer_t;
+
+#ifdef __linux__
+/// record returned by getdents64(), not every libc declares it
+struct sv_listing_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+#endif
+
+static const char* sv_listing_content_types[SV_LISTING_FORMAT_COUNT] = {
+    "text/html; charset=utf-8",
+    "application/json"
+};
+
+//
+// private
+//
+
+uint32_t sv_listing_hash(const char* path, const sv_listing_format_t format) {
+    // FNV-1a
+    uint32_t hash = 2166136261u ^ (uint32_t)format;
+    
+    for (; *path; path++)
+        hash = (hash ^ (uint8_t)*path) * 16777619u;
+    
+    return hash;
+}
+
+bool sv_listing_is_current(const sv_listing_ref listing, const sv_cache_entry_ref directory) {
+    // anything added, removed or renamed in there changes the directory's mtime
+    return (listing->directoryInode == directory->inode &&
+            listing->directoryModified.tv_sec == directory->modified.tv_sec &&
+            listing->directoryModified.tv_nsec == directory->modified.tv_nsec);
+}
+
+bool sv_listing_grow(void** dataPtr, size_t* capacityPtr, const size_t required,
+                     const size_t itemSize) {
+    if (required <= *capacityPtr)
+        return true;
+    
+    size_t capacity = (*capacityPtr > 0) ? *capacityPtr : 64;
+    while (capacity < required)
+        capacity *= 2;
+    
+    void* data = realloc(*dataPtr, capacity * itemSize);
+    
+    if (!data)
+        return false;
+    
+    (*dataPtr) = data;
+    (*capacityPtr) = capacity;
+    
+    return true;
+}
+
+bool sv_listing_add_item(sv_listing_items_t* items, const int fd, const char* name,
+                         const unsigned char type) {
+    if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+        return true;
+    
+    bool directory = (type == DT_DIR);
+    
+    if (type == DT_UNKNOWN || type == DT_LNK) {
+        // some filesystems don't tell, and links are listed as what they point to
+        struct stat info;
+        directory = (fstatat(fd, name, &info, 0) == 0 && S_ISDIR(info.st_mode));
+    }
+    
+    size_t nameLength = strlen(name);
+    
+    if (!sv_listing_grow((void**)&items->items, &items->capacity, items->count + 1,
+                         sizeof(sv_listing_item_t)) ||
+        !sv_listing_grow((void**)&items->names, &items->namesCapacity,
+                         items->namesSize + nameLength + 1, 1))
+        return false;
+    
+    // the pool moves while growing, so the names are only pointed to once it's done
+    sv_listing_item_t* item = &items->items[items->count++];
+    item->nameOffset = items->namesSize;
+    item->nameLength = nameLength;
+    item->directory = directory;
+    
+    memcpy(items->names + items->namesSize, name, nameLength + 1);
+    items->namesSize += nameLength + 1;
+    
+    return true;
+}
+
+bool sv_listing_read(const int fd, sv_listing_items_t* items) {
+#ifdef __linux__
+    // big batches, so that huge directories take few syscalls
+    char* batch = malloc(SV_LISTING_BATCH_SIZE);
+    long batchSize = 0;
+    
+    while ((batchSize = syscall(SYS_getdents64, fd, batch, SV_LISTING_BATCH_SIZE)) > 0) {
+        for (long offset = 0; offset < batchSize;) {
+            struct sv_listing_dirent64* record = (struct sv_listing_dirent64*)(batch + offset);
+            offset += record->d_reclen;
+            
+            if (!sv_listing_add_item(items, fd, record->d_name, record->d_type)) {
+                free(batch);
+                return false;
+            }
+        }
+    }
+    
+    free(batch);
+    
+    if (batchSize < 0)
+        return false;
+#else
+    DIR* directory = fdopendir(dup(fd));
+    
+    if (!directory)
+        return false;
+    
+    for (struct dirent* record = readdir(directory); record; record = readdir(directory)) {
+        if (!sv_listing_add_item(items, fd, record->d_name, record->d_type)) {
+            closedir(directory);
+            return false;
+        }
+    }
+    
+    closedir(directory);
+#endif
+    
+    for (size_t sz = 0; sz < items->count; sz++)
+        items->items[sz].name = items->names + items->items[sz].nameOffset;
+    
+    return true;
+}
+
+int sv_listing_compare(const void* left, const void* right) {
+    const sv_listing_item_t* leftItem = left;
+    const sv_listing_item_t* rightItem = right;
+    
+    // directories first, then by name
+    if (leftItem->directory != rightItem->directory)
+        return leftItem->directory ? -1 : 1;
+    
+    return strcmp(leftItem->name, rightItem->name);
+}
+
+bool sv_listing_append(sv_listing_buffer_t* buffer, const char* data, const size_t size) {
+    if (!sv_listing_grow((void**)&buffer->data, &buffer->capacity, buffer->size + size, 1))
+        return false;
+    
+    memcpy(buffer->data + buffer->size, data, size);
+    buffer->size += size;
+    
+    return true;
+}
+
+bool sv_listing_append_str(sv_listing_buffer_t* buffer, const char* text) {
+    return sv_listing_append(buffer, text, strlen(text));
+}
+
+bool sv_listing_append_escaped(sv_listing_buffer_t* buffer, const char* text,
+                               const size_t length, const sv_listing_format_t format) {
+    size_t start = 0;
+    
+    // runs of harmless characters are copied at once
+    for (size_t sz = 0; sz < length; sz++) {
+        unsigned char current = (unsigned char)text[sz];
+        const char* escaped = NULL;
+        char escapedBuffer[8];
+        
+        if (format == SV_LISTING_HTML) {
+            switch (current) {
+                case '&': escaped = "&amp;"; break;
+                case '<': escaped = "&lt;"; break;
+                case '>': escaped = "&gt;"; break;
+                case '"': escaped = "&quot;"; break;
+                case '\'': escaped = "&#39;"; break;
+                default: break;
+            }
+        } else if (current == '"' || current == '\\') {
+            snprintf(escapedBuffer, sizeof(escapedBuffer), "\\%c", current);
+            escaped = escapedBuffer;
+        } else if (current < 0x20) {
+            snprintf(escapedBuffer, sizeof(escapedBuffer), "\\u%04x", current);
+            escaped = escapedBuffer;
+        }
+        
+        if (!escaped)
+            continue;
+        
+        if (!sv_listing_append(buffer, text + start, sz - start) ||
+            !sv_listing_append_str(buffer, escaped))
+            return false;
+        
+        start = sz + 1;
+    }
+    
+    return sv_listing_append(buffer, text + start, length - start);
+}
+
+bool sv_listing_append_url(sv_listing_buffer_t* buffer, const char* text, const size_t length) {
+    static const char* digits = "0123456789ABCDEF";
+    size_t start = 0;
+    
+    // anything but unreserved characters is percent-encoded in links
+    for (size_t sz = 0; sz < length; sz++) {
+        unsigned char current = (unsigned char)text[sz];
+        
+        if ((current >= 'a' && current <= 'z') || (current >= 'A' && current <= 'Z') ||
+            (current >= '0' && current <= '9') || strchr("-._~", current))
+            continue;
+        
+        char encoded[3] = { '%', digits[current >> 4], digits[current & 15] };
+        
+        if (!sv_listing_append(buffer, text + start, sz - start) ||
+            !sv_listing_append(buffer, encoded, sizeof(encoded)))
+            return false;
+        
+        start = sz + 1;
+    }
+    
+    return sv_listing_append(buffer, text + start, length - start);
+}
+
+bool sv_listing_render_html(sv_listing_buffer_t* buffer, const char* displayPath,
+                            const sv_listing_items_t* items) {
+    size_t displayLength = strlen(displayPath);
+    bool success = (sv_listing_append_str(buffer, "<!DOCTYPE html>\n<html>\n<head>\n"
+                                          "<meta charset=\"utf-8\">\n<title>Index of ") &&
+                    sv_listing_append_escaped(buffer, displayPath, displayLength, SV_LISTING_HTML) &&
+                    sv_listing_append_str(buffer, "</title>\n</head>\n<body>\n<h1>Index of ") &&
+                    sv_listing_append_escaped(buffer, displayPath, displayLength, SV_LISTING_HTML) &&
+                    sv_listing_append_str(buffer, "</h1>\n<ul>\n"));
+    
+    if (success && strcmp(displayPath, "/") != 0)
+        success = sv_listing_append_str(buffer, "<li><a href=\"../\">../</a></li>\n");
+    
+    for (size_t sz = 0; sz < items->count && success; sz++) {
+        const sv_listing_item_t* item = &items->items[sz];
+        const char* suffix = item->directory ? "/" : "";
+        
+        success = (sv_listing_append_str(buffer, "<li><a href=\"") &&
+                   sv_listing_append_url(buffer, item->name, item->nameLength) &&
+                   sv_listing_append_str(buffer, suffix) &&
+                   sv_listing_append_str(buffer, "\">") &&
+                   sv_listing_append_escaped(buffer, item->name, item->nameLength,
+                                             SV_LISTING_HTML) &&
+                   sv_listing_append_str(buffer, suffix) &&
+                   sv_listing_append_str(buffer, "</a></li>\n"));
+    }
+    
+    return (success && sv_listing_append_str(buffer, "</ul>\n</body>\n</html>\n"));
+}
+
+bool sv_listing_render_json(sv_listing_buffer_t* buffer, const char* displayPath,
+                            const sv_listing_items_t* items) {
+    bool success = (sv_listing_append_str(buffer, "{\"path\":\"") &&
+                    sv_listing_append_escaped(buffer, displayPath, strlen(displayPath),
+                                              SV_LISTING_JSON) &&
+                    sv_listing_append_str(buffer, "\",\"entries\":["));
+    
+    for (size_t sz = 0; sz < items->count && success; sz++) {
+        const sv_listing_item_t* item = &items->items[sz];
+        
+        success = (sv_listing_append_str(buffer, (sz > 0) ? ",{\"name\":\"" : "{\"name\":\"") &&
+                   sv_listing_append_escaped(buffer, item->name, item->nameLength,
+                                             SV_LISTING_JSON) &&
+                   sv_listing_append_str(buffer, item->directory ? "\",\"directory\":true}" :
+                                                                   "\",\"directory\":false}"));
+    }
+    
+    return (success && sv_listing_append_str(buffer, "]}\n"));
+}
+
+sv_listing_ref sv_listing_make(sv_listing_cache_ref cache, sv_cache_entry_ref directory,
+                               const sv_listing_format_t format) {
+    int fd = openat(cache->rootFD, directory->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    
+    if (fd < 0)
+        return NULL;
+    
+    sv_listing_items_t items;
+    bzero(&items, sizeof(sv_listing_items_t));
+    
+    bool success = sv_listing_read(fd, &items);
+    int error = errno;
+    close(fd);
+    
+    // sorted once here rather than on every request
+    if (success)
+        qsort(items.items, items.count, sizeof(sv_listing_item_t), sv_listing_compare);
+    
+    // rendered right behind the listing object, which is at the start of the buffer
+    sv_listing_buffer_t buffer = { NULL, 0, 0 };
+    char displayPath[MAXPATHLEN + 2] = "/";
+    
+    if (strcmp(directory->path, ".") != 0)
+        snprintf(displayPath, sizeof(displayPath), "/%s/", directory->path);
+    
+    if (success) {
+        // links and escaping roughly double the names, which is a good first guess
+        success = sv_listing_grow((void**)&buffer.data, &buffer.capacity,
+                                  SV_LISTING_HEADER_SIZE + items.namesSize * 2 + 256, 1);
+        buffer.size = SV_LISTING_HEADER_SIZE;
+        
+        if (success && format == SV_LISTING_JSON)
+            success = sv_listing_render_json(&buffer, displayPath, &items);
+        else if (success)
+            success = sv_listing_render_html(&buffer, displayPath, &items);
+        
+        error = ENOMEM;
+    }
+    
+    free(items.items);
+    free(items.names);
+    
+    if (!success) {
+        free(buffer.data);
+        
+        errno = error;
+        return NULL;
+    }
+    
+    sv_listing_ref listing = (sv_listing_ref)buffer.data;
+    listing->path = strdup(directory->path);
+    listing->format = format;
+    listing->directoryModified = directory->modified;
+    listing->directoryInode = directory->inode;
+    listing->references = 1;
+    listing->lastUsed = 0;
+    listing->next = NULL;
+    listing->size = buffer.size - SV_LISTING_HEADER_SIZE;
+    
+    return listing;
+}
+
+void sv_listing_cache_unlink(sv_listing_cache_ref cache, sv_listing_ref* link) {
+    // must be called with the lock held
+    sv_listing_ref listing = *link;
+    
+    *link = listing->next;
+    cache->size -= listing->size;
+    
+    sv_listing_release(listing);
+}
+
+bool sv_listing_cache_evict(sv_listing_cache_ref cache) {
+    // least recently used first
+    sv_listing_ref* oldest = NULL;
+    
+    for (size_t sz = 0; sz < SV_LISTING_BUCKETS; sz++) {
+        for (sv_listing_ref* link = &cache->buckets[sz]; *link; link = &(*link)->next) {
+            if (!oldest || (*link)->lastUsed < (*oldest)->lastUsed)
+                oldest = link;
+        }
+    }
+    
+    if (!oldest)
+        return false;
+    
+    sv_listing_cache_unlink(cache, oldest);
+    return true;
+}
+
+//
+// public
+//
+
+const char* sv_listing_get_content_type(const sv_listing_format_t format) {
+    return sv_listing_content_types[format];
+}
+
+sv_listing_cache_ref sv_listing_cache_init(const int rootFD, const size_t maxSize) {
+    sv_listing_cache_ref cache = calloc(1, sizeof(struct sv_listing_cache_s));
+    cache->rootFD = rootFD;
+    cache->maxSize = maxSize;
+    
+    pthread_mutex_init(&cache->lock, NULL);
+    
+    return cache;
+}
+
+sv_listing_ref sv_listing_cache_get(sv_listing_cache_ref cache, sv_cache_entry_ref directory,
+                                    const sv_listing_format_t format) {
+    uint32_t hash = sv_listing_hash(directory->path, format);
+    sv_listing_ref* bucket = &cache->buckets[hash % SV_LISTING_BUCKETS];
+    
+    pthread_mutex_lock(&cache->lock);
+    
+    for (sv_listing_ref listing = *bucket; listing; listing = listing->next) {
+        if (listing->format != format || strcmp(listing->path, directory->path) != 0 ||
+            !sv_listing_is_current(listing, directory))
+            continue;
+        
+        listing->lastUsed = ++cache->clock;
+        __atomic_add_fetch(&listing->references, 1, __ATOMIC_RELAXED);
+        
+        pthread_mutex_unlock(&cache->lock);
+        return listing;
+    }
+    
+    pthread_mutex_unlock(&cache->lock);
+    
+    // read and render it without blocking the other workers
+    sv_listing_ref listing = sv_listing_make(cache, directory, format);
+    
+    if (!listing)
+        return NULL;
+    
+    pthread_mutex_lock(&cache->lock);
+    
+    // whatever was there for this directory before is outdated (or just as good)
+    for (sv_listing_ref* link = bucket; *link;) {
+        if ((*link)->format == format && strcmp((*link)->path, directory->path) == 0)
+            sv_listing_cache_unlink(cache, link);
+        else
+            link = &(*link)->next;
+    }
+    
+    if (listing->size <= cache->maxSize) {
+        while (cache->size + listing->size > cache->maxSize && sv_listing_cache_evict(cache));
+        
+        listing->next = *bucket;
+        listing->lastUsed = ++cache->clock;
+        __atomic_add_fetch(&listing->references, 1, __ATOMIC_RELAXED);
+        
+        *bucket = listing;
+        cache->size += listing->size;
+    }
+    
+    pthread_mutex_unlock(&cache->lock);
+    return listing;
+}
+
+void sv_listing_release(sv_listing_ref listing) {
+    if (!listing || __atomic_sub_fetch(&listing->references, 1, __ATOMIC_ACQ_REL) > 0)
+        return;
+    
+    free(listing->path);
+    free(listing);
+}
+
+void sv_listing_release_text(void* text) {
+    if (text)
+        sv_listing_release((sv_listing_ref)((char*)text - offsetof(struct sv_listing_s, text)));
+}
+
+void sv_listing_cache_release(sv_listing_cache_ref cache) {
+    if (!cache)
+        return;
+    
+    for (size_t sz = 0; sz < SV_LISTING_BUCKETS; sz++) {
+        while (cache->buckets[sz])
+            sv_listing_cache_unlink(cache, &cache->buckets[sz]);
+    }
+    
+    pthread_mutex_destroy(&cache->lock);
+    free(cache);
+}
@@ -0,0 +1,70 @@
+//
+//  listing.h
+//  http
+//
+//  Created by Tim K. on 26.02.23.
+//  Copyright © 2023 Tim K. All rights reserved.
+//
+
+#pragma once
+
+#include "cache.h"
+
+//
+// directory listings. A directory is read in large getdents64() batches and sorted
+// once, then rendered into a buffer that every request for it shares until the
+// directory's modification time changes
+//
+
+/// default limit for the size of all the rendered listings together
+#define SV_LISTING_CACHE_SIZE (32 * 1024 * 1024)
+/// bytes of directory entries asked from the kernel at once
+#define SV_LISTING_BATCH_SIZE (256 * 1024)
+
+typedef enum {
+    SV_LISTING_HTML = 0,
+    SV_LISTING_JSON,
+    SV_LISTING_FORMAT_COUNT
+} sv_listing_format_t;
+
+typedef struct sv_listing_cache_s* sv_listing_cache_ref;
+typedef struct sv_listing_s* sv_listing_ref;
+
+struct sv_listing_s {
+    // directory path relative to the root and the state it was read in
+    char* path;
+    sv_listing_format_t format;
+    struct timespec directoryModified;
+    ino_t directoryInode;
+    
+    // one for the cache plus one per user
+    uint32_t references;
+    // value of the cache's clock when it was used last
+    uint64_t lastUsed;
+    sv_listing_ref next;
+    
+    // the rendered document
+    size_t size;
+    char text[];
+};
+
+/// Content-Type of a listing in the format
+const char* sv_listing_get_content_type(const sv_listing_format_t format);
+
+/// creates the cache for directories below the one rootFD refers to
+sv_listing_cache_ref sv_listing_cache_init(const int rootFD, const size_t maxSize);
+
+///
+/// gets the listing of the directory in the format, reading and rendering it right
+/// away if there's no up-to-date one yet. NULL (with errno set) if the directory cannot
+/// be read, otherwise the listing must be given back with sv_listing_release
+///
+sv_listing_ref sv_listing_cache_get(sv_listing_cache_ref cache, sv_cache_entry_ref directory,
+                                    const sv_listing_format_t format);
+
+void sv_listing_release(sv_listing_ref listing);
+
+/// body deallocator for responses whose body is listing->text
+void sv_listing_release_text(void* text);
+
+void sv_listing_cache_release(sv_listing_cache_ref cache);
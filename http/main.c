@@ -11,20 +11,25 @@
 #include <string.h>
 #include <unistd.h>
 #include <sys/param.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include "http_server.h"
-
-/// hidden method from libhttp_server generating a good datetime str
-char* hi_make_current_datetime(void);
+#include "static.h"
 
 #define SV_YES_NO(vl) (vl ? "yes" : "no")
 
 typedef struct {
     // if true, then the web server will accept range downloads
     bool ranges;
-    // if true, then the web server will be able to run CGI scripts (TBD)
+    // if true, then the web server will be able to run CGI scripts
     bool cgi;
     // if true, then the web server will display directory listing
     bool dirL;
+    // if true, then the web server will answer /metrics with its stats
+    bool metrics;
+    // every how many requests one is traced, 0 if none
+    http_size_t trace;
     
     // IPv6 or IPv4
     bool ipv6;
@@ -33,10 +38,17 @@ typedef struct {
     char* address;
     http_port_t port;
     
+    // worker threads count, 0 means one per CPU core
+    http_size_t workers;
+    // event loop backend
+    http_backend_t backend;
+    
     // root static directory
     char* root;
     // the HTTP server itself
     http_server_ref server;
+    // static file engine serving the root
+    sv_static_ref files;
 } sv_options;
 
 char* sv_getwd() {
@@ -48,12 +60,13 @@ char* sv_getwd() {
 
 void sv_show_help() {
     fprintf(stderr, "Usage: http [-6] [-lIPADDR] [-pPORT] [-N] [-C] [-rROOT]\n");
-    fprintf(stderr, "       [-D] [-help]\n");
+    fprintf(stderr, "       [-D] [-M] [-tINTERVAL] [-wWORKERS] [-bselect|epoll|uring] [-help]\n");
+    fprintf(stderr, "       -t traces every INTERVAL-th request, SIGUSR1 dumps them to $TMPDIR\n");
 }
 
 sv_options sv_make_options(const size_t argc, const char** argv) {
-    sv_options opts = { true, false, true, false, strdup(HTTP_ADDRESS_PUBLIC), 5454,
-        sv_getwd(), NULL };
+    sv_options opts = { true, false, true, false, false, 0, strdup(HTTP_ADDRESS_PUBLIC), 5454,
+        1, HTTP_BACKEND_AUTO, sv_getwd(), NULL, NULL };
     
     for (size_t index = 1; index < argc; index++) {
         const char* param = argv[index];
@@ -91,6 +104,24 @@ sv_options sv_make_options(const size_t argc, const char** argv) {
                 opts.port = (http_port_t)atoi(param);
                 break;
             }
+            case 'w': {
+                // worker threads
+                opts.workers = (http_size_t)atoi(param);
+                break;
+            }
+            case 'b': {
+                // event backend
+                if (strcmp(param, "select") == 0)
+                    opts.backend = HTTP_BACKEND_SELECT;
+                else if (strcmp(param, "epoll") == 0)
+                    opts.backend = HTTP_BACKEND_EPOLL;
+                else if (strcmp(param, "uring") == 0)
+                    opts.backend = HTTP_BACKEND_IO_URING;
+                else
+                    fprintf(stderr, "warning! unknown backend - \"%s\"\n", param);
+                
+                break;
+            }
             case 'N': {
                 // ranges disabled
                 opts.ranges = false;
@@ -111,6 +142,16 @@ sv_options sv_make_options(const size_t argc, const char** argv) {
                 opts.dirL = false;
                 break;
             }
+            case 't': {
+                // trace sampling interval
+                opts.trace = (http_size_t)atoi(param);
+                break;
+            }
+            case 'M': {
+                // metrics enabled
+                opts.metrics = true;
+                break;
+            }
             case 'h':
             case 'H':
             case '?': {
@@ -130,29 +171,92 @@ sv_options sv_make_options(const size_t argc, const char** argv) {
 
 http_headers_ref sv_http_callback(const http_headers_ref request,
                                   void* additionalData) {
-    char* coolDateTime = hi_make_current_datetime();
+    // read out options as we'll need them, requests are logged by the server
+    sv_options* optsPtr = (sv_options*)additionalData;
     
-    // read out options as we'll need them
+    return sv_static_respond(optsPtr->files, request);
+}
+
+void* sv_trace_thread(void* additionalData) {
     sv_options* optsPtr = (sv_options*)additionalData;
-    printf(" %s %s - %s %s \n", coolDateTime, http_headers_get_client_info(request),
-                                http_headers_get_request_type(request),
-                                http_headers_get_request_url(request));
     
-    free(coolDateTime);
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGUSR1);
     
-    return NULL;
+    // the signal is blocked everywhere, so it's only ever taken here
+    for (unsigned dump = 1; ; dump++) {
+        int received = 0;
+        
+        if (sigwait(&signals, &received) != 0)
+            return NULL;
+        
+        const char* directory = getenv("TMPDIR");
+        char path[MAXPATHLEN];
+        
+        snprintf(path, sizeof(path), "%s/http-trace.%d.%u.json",
+                 directory ? directory : P_tmpdir, (int)getpid(), dump);
+        
+        int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+        
+        if (fd >= 0 && http_server_dump_trace(optsPtr->server, fd))
+            fprintf(stderr, "trace written to %s\n", path);
+        else
+            fprintf(stderr, "warning! couldn't write the trace to %s\n", path);
+        
+        if (fd >= 0)
+            close(fd);
+    }
 }
 
 int main(const int argc, const char** argv) {
     sv_options opts = sv_make_options((size_t)argc, argv);
     
-    // init web server
+    // the server only blocks it in its workers, but the CGI runner's socket and a piped
+    // access log are written from other threads as well
+    signal(SIGPIPE, SIG_IGN);
+    
+    if (opts.trace > 0) {
+        // before any other thread starts, so that they all inherit the mask and the
+        // trace thread is the only one to take it
+        sigset_t signals;
+        sigemptyset(&signals);
+        sigaddset(&signals, SIGUSR1);
+        pthread_sigmask(SIG_BLOCK, &signals, NULL);
+    }
+    
+    // nothing to serve without the root
+    opts.files = sv_static_init(opts.root, opts.ranges, opts.dirL, opts.cgi);
+    
+    if (!opts.files)
+        return 1;
+
+// init web server
     if (opts.ipv6)
         opts.server = http_server_init_ipv6(opts.address, opts.port);
     else
         opts.server = http_server_init_ipv4(opts.address, opts.port);
     
     http_server_set_callback(opts.server, sv_http_callback, &opts);
+    http_server_set_access_log(opts.server, STDOUT_FILENO);
+    
+    if (opts.metrics)
+        http_server_set_metrics_path(opts.server, "/metrics");
+    
+    if (opts.trace > 0) {
+        http_server_set_tracing(opts.server, opts.trace);
+        
+        pthread_t traceThread;
+        
+        if (pthread_create(&traceThread, NULL, sv_trace_thread, &opts) == 0)
+            pthread_detach(traceThread);
+        else
+            fprintf(stderr, "warning! couldn't start the trace thread\n");
+    }
+    
+    if (opts.backend != HTTP_BACKEND_AUTO &&
+        !http_server_set_backend(opts.server, opts.backend))
+        fprintf(stderr, "warning! requested backend unavailable, using a fallback\n");
     
     // show success message
     printf("=============================================\n");
@@ -160,10 +264,16 @@ int main(const int argc, const char** argv) {
     printf(" Press Ctrl+C to stop \n\n");
     printf(" Directory listings: %s \n", SV_YES_NO(opts.dirL));
     printf(" CGI scripts: %s \n", SV_YES_NO(opts.cgi));
+    printf(" Metrics at /metrics: %s \n", SV_YES_NO(opts.metrics));
+    printf(" Tracing every request out of: %u \n", opts.trace);
     printf(" Enhanced downloads: %s \n\n", SV_YES_NO(opts.ranges));
     printf(" Served directory: %s \n", opts.root);
+    printf(" Worker threads: %u \n", opts.workers);
     printf("=============================================\n");
     
-    http_server_listen(opts.server);
+    // the access log writes to stdout directly, the banner must be out before it
+    fflush(stdout);
+    
+    http_server_listen_workers(opts.server, opts.workers);
     return 0;
 }
@@ -0,0 +1,682 @@
+//
+//  static.c
+//  http
+//
+//  Created by Tim K. on 26.02.23.
+//  Copyright © 2023 Tim K. All rights reserved.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/param.h>
+#include "static.h"
+#include "cache.h"
+#include "compress.h"
+#include "listing.h"
+#include "cgi.h"
+
+struct sv_static_s {
+    // served directory, every file is opened relative to it
+    int rootFD;
+    char* root;
+    
+    // open files and their metadata
+    sv_cache_ref cache;
+    // compressed variants of them
+    sv_compress_cache_ref compressed;
+    
+    // listings of directories without an index page, NULL if they're disabled
+    sv_listing_cache_ref listings;
+    
+    // runners of CGI scripts, NULL if they're disabled
+    sv_cgi_ref cgi;
+    
+    // true if Range requests get partial responses
+    bool ranges;
+};
+
+/// inclusive byte range of a file
+typedef struct {
+    off_t first;
+    off_t last;
+} sv_range_t;
+
+/// room for an entity tag of three hex numbers in quotes
+#define SV_STATIC_ETAG_MAX 64
+
+typedef struct {
+    const char* extension;
+    const char* contentType;
+} sv_content_type_t;
+
+static const sv_content_type_t sv_content_types[] = {
+    { "html", "text/html; charset=utf-8" },
+    { "htm", "text/html; charset=utf-8" },
+    { "css", "text/css; charset=utf-8" },
+    { "js", "text/javascript; charset=utf-8" },
+    { "mjs", "text/javascript; charset=utf-8" },
+    { "json", "application/json" },
+    { "map", "application/json" },
+    { "txt", "text/plain; charset=utf-8" },
+    { "md", "text/markdown; charset=utf-8" },
+    { "csv", "text/csv; charset=utf-8" },
+    { "xml", "application/xml" },
+    { "svg", "image/svg+xml" },
+    { "png", "image/png" },
+    { "jpg", "image/jpeg" },
+    { "jpeg", "image/jpeg" },
+    { "gif", "image/gif" },
+    { "webp", "image/webp" },
+    { "avif", "image/avif" },
+    { "ico", "image/x-icon" },
+    { "woff", "font/woff" },
+    { "woff2", "font/woff2" },
+    { "ttf", "font/ttf" },
+    { "otf", "font/otf" },
+    { "wasm", "application/wasm" },
+    { "pdf", "application/pdf" },
+    { "zip", "application/zip" },
+    { "gz", "application/gzip" },
+    { "tar", "application/x-tar" },
+    { "mp3", "audio/mpeg" },
+    { "ogg", "audio/ogg" },
+    { "wav", "audio/wav" },
+    { "mp4", "video/mp4" },
+    { "webm", "video/webm" },
+    { NULL, NULL }
+};
+
+//
+// private
+//
+
+int sv_static_hex(const char digit) {
+    if (digit >= '0' && digit <= '9')
+        return digit - '0';
+    else if (digit >= 'a' && digit <= 'f')
+        return digit - 'a' + 10;
+    else if (digit >= 'A' && digit <= 'F')
+        return digit - 'A' + 10;
+    
+    return -1;
+}
+
+bool sv_static_decode(const char* url, char* decoded, const size_t size) {
+    size_t length = 0;
+    
+    // only the path, without the query and the fragment
+    for (const char* position = url; *position && *position != '?' && *position != '#';
+         position++) {
+        char current = *position;
+        
+        if (current == '%') {
+            int high = sv_static_hex(position[1]);
+            int low = (high < 0) ? -1 : sv_static_hex(position[2]);
+            
+            if (low < 0)
+                return false;
+            
+            current = (char)(high * 16 + low);
+            position += 2;
+            
+            // no way to open a file with that in its name
+            if (current == '\0')
+                return false;
+        }
+        
+        if (length + 1 >= size)
+            return false;
+        
+        decoded[length++] = current;
+    }
+    
+    decoded[length] = '\0';
+    return true;
+}
+
+size_t sv_static_normalize(const char* decoded, char* path) {
+    // the segments without empty, "." and ".." ones, relative to the root
+    size_t length = 0;
+    const char* segment = decoded;
+    
+    while (*segment) {
+        const char* end = strchrnul(segment, '/');
+        size_t segmentLength = (size_t)(end - segment);
+        
+        if (segmentLength == 2 && memcmp(segment, "..", 2) == 0) {
+            // one level up, but never above the root
+            while (length > 0 && path[length - 1] != '/')
+                length--;
+            
+            if (length > 0)
+                length--;
+        } else if (segmentLength > 0 && !(segmentLength == 1 && segment[0] == '.')) {
+            if (length > 0)
+                path[length++] = '/';
+            
+            memcpy(path + length, segment, segmentLength);
+            length += segmentLength;
+        }
+        
+        segment = *end ? end + 1 : end;
+    }
+    
+    path[length] = '\0';
+    return length;
+}
+
+void sv_static_close_entry(const int fd, void* closerData) {
+    (void)fd;
+    sv_cache_entry_release((sv_cache_entry_ref)closerData);
+}
+
+void sv_static_close_variant(const int fd, void* closerData) {
+    (void)fd;
+    sv_variant_release((sv_variant_ref)closerData);
+}
+
+http_headers_ref sv_static_respond_compressed(sv_static_ref files, const http_headers_ref request,
+                                              sv_cache_entry_ref entry) {
+    sv_encoding_t encodings[SV_ENCODING_COUNT];
+    http_size_t encodingsCount = sv_compress_negotiate(http_headers_get(request, "Accept-Encoding"),
+                                                       encodings);
+    
+    if (encodingsCount < 1 || entry->size < SV_COMPRESS_SIZE_MIN)
+        return NULL;
+    
+    // precompressed siblings (foo.js.br, foo.js.gz) first, whichever the client likes
+    char path[MAXPATHLEN + 4];
+    
+    for (http_size_t sz = 0; sz < encodingsCount; sz++) {
+        snprintf(path, sizeof(path), "%s%s", entry->path, sv_compress_get_extension(encodings[sz]));
+        sv_cache_entry_ref sibling = sv_cache_open(files->cache, path);
+        
+        if (!sibling)
+            continue;
+        else if (!S_ISREG(sibling->mode)) {
+            sv_cache_entry_release(sibling);
+            continue;
+        }
+        
+        http_headers_ref response = http_headers_init_with_file(HTTP_OK, entry->contentType,
+                                                                sibling->fd, 0, sibling->size,
+                                                                sv_static_close_entry, sibling);
+        http_headers_set(response, "Content-Encoding", sv_compress_get_name(encodings[sz]));
+        
+        return response;
+    }
+    
+    // otherwise the best one that can be made here, compressed once and kept
+    for (http_size_t sz = 0; sz < encodingsCount; sz++) {
+        if (!sv_compress_is_available(encodings[sz]))
+            continue;
+        
+        sv_variant_ref variant = sv_compress_cache_get(files->compressed, entry, encodings[sz]);
+        
+        if (!variant)
+            return NULL;
+        
+        http_headers_ref response = http_headers_init_with_file(HTTP_OK, entry->contentType,
+                                                                variant->fd, 0, variant->size,
+                                                                sv_static_close_variant, variant);
+        http_headers_set(response, "Content-Encoding", sv_compress_get_name(encodings[sz]));
+        
+        return response;
+    }
+    
+    return NULL;
+}
+
+http_headers_ref sv_static_respond_listing(sv_static_ref files, const http_headers_ref request,
+                                           sv_cache_entry_ref directory) {
+    // HTML unless asked for JSON with ?format=json
+    const char* query = strchr(http_headers_get_request_url(request), '?');
+    sv_listing_format_t format = (query && strstr(query, "format=json")) ? SV_LISTING_JSON :
+                                                                            SV_LISTING_HTML;
+    
+    sv_listing_ref listing = sv_listing_cache_get(files->listings, directory, format);
+    
+    if (!listing)
+        return NULL;
+    
+    // the cached text itself is the body, it's only given back once it's sent
+    http_headers_ref response = http_headers_init_with_response(HTTP_OK,
+                                                                sv_listing_get_content_type(format),
+                                                                listing->text,
+                                                                (http_size_t)listing->size,
+                                                                sv_listing_release_text);
+    
+    char lastModified[HTTP_DATE_MAX];
+    http_date_format(lastModified, directory->modified.tv_sec);
+    http_headers_set(response, "Last-Modified", lastModified);
+    
+    return response;
+}
+
+http_headers_ref sv_static_make_error(const http_status_t status) {
+    // the reason phrases are static, nothing to deallocate
+    const char* reason = http_status_get_reason(status);
+    
+    return http_headers_init_with_response(status, "text/plain; charset=utf-8",
+                                           (void*)reason, (http_size_t)strlen(reason), NULL);
+}
+
+http_headers_ref sv_static_make_not_allowed(void) {
+    http_headers_ref response = sv_static_make_error(HTTP_METHOD_NOT_ALLOWED);
+    http_headers_set(response, "Allow", "GET, HEAD");
+    
+    return response;
+}
+
+http_headers_ref sv_static_make_redirect(const http_headers_ref request) {
+    // directories are only served with a trailing slash, so relative links work
+    const char* url = http_headers_get_request_url(request);
+    size_t pathLength = strcspn(url, "?#");
+    size_t urlLength = strlen(url);
+    
+    char* location = http_headers_alloc(request, (http_size_t)urlLength + 2);
+    memcpy(location, url, pathLength);
+    location[pathLength] = '/';
+    memcpy(location + pathLength + 1, url + pathLength, urlLength - pathLength + 1);
+    
+    http_headers_ref response = sv_static_make_error(HTTP_MOVED_PERMANENTLY);
+    http_headers_set(response, "Location", location);
+    
+    return response;
+}
+
+http_status_t sv_static_get_errno_status(const int error) {
+    switch (error) {
+        case ENOENT:
+        case ENOTDIR:
+        case ENAMETOOLONG:
+            return HTTP_NOT_FOUND;
+        case EACCES:
+        case EPERM:
+        case ELOOP:
+            return HTTP_FORBIDDEN;
+        default:
+            return HTTP_INTERNAL_SERVER_ERROR;
+    }
+}
+
+void sv_static_make_etag(const sv_cache_entry_ref entry, char etag[SV_STATIC_ETAG_MAX]) {
+    // any change to the file changes at least one of these
+    unsigned long long modified = (unsigned long long)entry->modified.tv_sec * 1000000000ull +
+                                  (unsigned long long)entry->modified.tv_nsec;
+    
+    snprintf(etag, SV_STATIC_ETAG_MAX, "\"%llx-%llx-%llx\"", (unsigned long long)entry->inode,
+             (unsigned long long)entry->size, modified);
+}
+
+const char* sv_static_parse_offset(const char* position, int64_t* valuePtr) {
+    // -1 if there are no digits, huge values saturate instead of overflowing
+    int64_t value = -1;
+    
+    for (; isdigit((unsigned char)*position); position++) {
+        if (value < 0)
+            value = 0;
+        
+        if (value > (INT64_MAX - 9) / 10)
+            value = INT64_MAX;
+        else
+            value = value * 10 + (*position - '0');
+    }
+    
+    (*valuePtr) = value;
+    return position;
+}
+
+int sv_static_compare_ranges(const void* left, const void* right) {
+    const sv_range_t* leftRange = left;
+    const sv_range_t* rightRange = right;
+    
+    return (leftRange->first > rightRange->first) - (leftRange->first < rightRange->first);
+}
+
+///
+/// parses the Range header of a request for a file of the specified size into the
+/// satisfiable ranges, sorted and with overlapping ones merged. Returns their amount,
+/// 0 if none of them can be satisfied or -1 if the header is to be ignored (invalid,
+/// in some other unit or asking for too many ranges)
+///
+int sv_static_parse_ranges(const char* header, const off_t size,
+                           sv_range_t ranges[SV_STATIC_RANGES_MAX]) {
+    if (strncasecmp(header, "bytes=", 6) != 0)
+        return -1;
+    
+    const char* position = header + 6;
+    bool anyRange = false;
+    int count = 0;
+    
+    while (*position) {
+        // list elements might be empty and surrounded by whitespace
+        if (*position == ' ' || *position == '\t' || *position == ',') {
+            position++;
+            continue;
+        }
+        
+        int64_t first = -1;
+        int64_t last = -1;
+        
+        position = sv_static_parse_offset(position, &first);
+        
+        if (*position != '-')
+            return -1;
+        
+        position = sv_static_parse_offset(position + 1, &last);
+        
+        while (*position == ' ' || *position == '\t')
+            position++;
+        
+        if ((*position && *position != ',') || (first < 0 && last < 0) ||
+            (first >= 0 && last >= 0 && last < first))
+            return -1;
+        
+        anyRange = true;
+        
+        if (first < 0) {
+            // the last bytes of the file
+            if (last == 0 || size < 1)
+                continue;
+            
+            first = (last < size) ? size - last : 0;
+            last = size - 1;
+        } else if (first >= size)
+            continue;
+        else if (last < 0 || last >= size)
+            last = size - 1;
+        
+        if (count >= SV_STATIC_RANGES_MAX)
+            return -1;
+        
+        ranges[count].first = (off_t)first;
+        ranges[count].last = (off_t)last;
+        count++;
+    }
+    
+    if (!anyRange)
+        return -1;
+    else if (count < 2)
+        return count;
+    
+    // overlapping and adjacent ranges are sent as one
+    qsort(ranges, (size_t)count, sizeof(sv_range_t), sv_static_compare_ranges);
+    int merged = 0;
+    
+    for (int index = 1; index < count; index++) {
+        if (ranges[index].first <= ranges[merged].last + 1) {
+            ranges[merged].last = MAX(ranges[merged].last, ranges[index].last);
+            continue;
+        }
+        
+        ranges[++merged] = ranges[index];
+    }
+    
+    return merged + 1;
+}
+
+http_headers_ref sv_static_respond_ranges(const http_headers_ref request, sv_cache_entry_ref entry,
+                                          const char* etag, const char* lastModified) {
+    const char* rangeHeader = http_headers_get(request, "Range");
+    const char* ifRange = http_headers_get(request, "If-Range");
+    
+    if (!rangeHeader)
+        return NULL;
+    
+    // a changed file is sent whole, either validator (compared strongly) must match
+    if (ifRange && strcmp(ifRange, (ifRange[0] == '"') ? etag : lastModified) != 0)
+        return NULL;
+    
+    sv_range_t ranges[SV_STATIC_RANGES_MAX];
+    int rangesCount = sv_static_parse_ranges(rangeHeader, entry->size, ranges);
+    char contentRange[80];
+    
+    if (rangesCount < 0)
+        return NULL;
+    else if (rangesCount == 0) {
+        http_headers_ref response = sv_static_make_error(HTTP_RANGE_NOT_SATISFIABLE);
+        
+        snprintf(contentRange, sizeof(contentRange), "bytes */%lld", (long long)entry->size);
+        http_headers_set(response, "Content-Range", contentRange);
+        
+        sv_cache_entry_release(entry);
+        return response;
+    } else if (rangesCount == 1) {
+        http_headers_ref response = http_headers_init_with_file(HTTP_PARTIAL_CONTENT,
+                                                                entry->contentType, entry->fd,
+                                                                ranges[0].first,
+                                                                ranges[0].last - ranges[0].first + 1,
+                                                                sv_static_close_entry, entry);
+        
+        snprintf(contentRange, sizeof(contentRange), "bytes %lld-%lld/%lld",
+                 (long long)ranges[0].first, (long long)ranges[0].last, (long long)entry->size);
+        http_headers_set(response, "Content-Range", contentRange);
+        
+        return response;
+    }
+    
+    // several ranges go as a multipart/byteranges body, its parts straight from the file
+    char boundary[24];
+    char contentType[64];
+    unsigned long long boundaryValue = ((unsigned long long)entry->inode * 0x9E3779B97F4A7C15ull) ^
+                                       (unsigned long long)entry->modified.tv_nsec ^
+                                       (unsigned long long)entry->size;
+    
+    snprintf(boundary, sizeof(boundary), "%016llx", boundaryValue);
+    snprintf(contentType, sizeof(contentType), "multipart/byteranges; boundary=%s", boundary);
+    
+    http_headers_ref response = http_headers_init_with_file(HTTP_PARTIAL_CONTENT, contentType,
+                                                            entry->fd, 0, 0,
+                                                            sv_static_close_entry, entry);
+    http_size_t prefixMax = (http_size_t)strlen(entry->contentType) + 160;
+    
+    for (int index = 0; index <= rangesCount; index++) {
+        char* prefix = http_headers_alloc(response, prefixMax);
+        int prefixLength = 0;
+        
+        if (index < rangesCount) {
+            // the CRLF in front of a delimiter belongs to it, but the first one needs none
+            prefixLength = snprintf(prefix, prefixMax, "%s--%s\r\nContent-Type: %s\r\n"
+                                    "Content-Range: bytes %lld-%lld/%lld\r\n\r\n",
+                                    index > 0 ? "\r\n" : "", boundary, entry->contentType,
+                                    (long long)ranges[index].first, (long long)ranges[index].last,
+                                    (long long)entry->size);
+            
+            http_headers_add_file_part(response, prefix, (http_size_t)prefixLength, ranges[index].first,
+                                       ranges[index].last - ranges[index].first + 1);
+        } else {
+            prefixLength = snprintf(prefix, prefixMax, "\r\n--%s--\r\n", boundary);
+            http_headers_add_file_part(response, prefix, (http_size_t)prefixLength, 0, 0);
+        }
+    }
+    
+    return response;
+}
+
+//
+// public
+//
+
+sv_static_ref sv_static_init(const char* root, const bool ranges, const bool listings,
+                             const bool cgi) {
+    int rootFD = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    
+    if (rootFD < 0) {
+        fprintf(stderr, "warning! cannot open the served directory - \"%s\": %s\n", root,
+                strerror(errno));
+        return NULL;
+    }
+    
+    sv_static_ref files = calloc(1, sizeof(struct sv_static_s));
+    files->rootFD = rootFD;
+    files->root = strdup(root);
+    // the runners are forked before the cache starts its thread
+    files->cgi = cgi ? sv_cgi_init(root, SV_CGI_RUNNERS) : NULL;
+    files->cache = sv_cache_init(rootFD, root);
+    files->compressed = sv_compress_cache_init(SV_COMPRESS_CACHE_SIZE);
+    files->listings = listings ? sv_listing_cache_init(rootFD, SV_LISTING_CACHE_SIZE) : NULL;
+    files->ranges = ranges;
+    
+    return files;
+}
+
+const char* sv_static_get_content_type(const char* path) {
+    const char* extension = strrchr(path, '.');
+    
+    if (extension && !strchr(extension, '/')) {
+        extension++;
+        
+        for (const sv_content_type_t* type = sv_content_types; type->extension; type++) {
+            if (strcasecmp(type->extension, extension) == 0)
+                return type->contentType;
+        }
+    }
+    
+    return "application/octet-stream";
+}
+
+http_headers_ref sv_static_respond(sv_static_ref files, const http_headers_ref request) {
+    const char* type = http_headers_get_request_type(request);
+    bool readOnly = (strcmp(type, "GET") == 0 || strcmp(type, "HEAD") == 0);
+    
+    // scripts take any method, files don't
+    if (!readOnly && !files->cgi)
+        return sv_static_make_not_allowed();
+    
+    // map the URL onto a path below the root
+    char decoded[MAXPATHLEN];
+    char path[MAXPATHLEN + sizeof("/index.html")];
+    
+    if (!sv_static_decode(http_headers_get_request_url(request), decoded, MAXPATHLEN))
+        return sv_static_make_error(HTTP_BAD_REQUEST);
+    
+    size_t pathLength = sv_static_normalize(decoded, path);
+    
+    if (pathLength < 1)
+        strcpy(path, ".");
+    
+    sv_cache_entry_ref entry = sv_cache_open(files->cache, path);
+    
+    if (!entry)
+        return sv_static_make_error(sv_static_get_errno_status(errno));
+    
+    if (S_ISDIR(entry->mode)) {
+        sv_cache_entry_ref directory = entry;
+        
+        if (!readOnly) {
+            sv_cache_entry_release(directory);
+            return sv_static_make_not_allowed();
+        }
+        
+        size_t decodedLength = strlen(decoded);
+        
+        if (decodedLength < 1 || decoded[decodedLength - 1] != '/') {
+            sv_cache_entry_release(directory);
+            return sv_static_make_redirect(request);
+        }
+        
+        // a directory is represented by its index page, or its listing if there's none
+        if (pathLength > 0)
+            strcpy(path + pathLength, "/index.html");
+        else
+            strcpy(path, "index.html");
+        
+        entry = sv_cache_open(files->cache, path);
+        int error = errno;
+        
+        if (!entry && error == ENOENT && files->listings) {
+            http_headers_ref response = sv_static_respond_listing(files, request, directory);
+            error = errno;
+            
+            sv_cache_entry_release(directory);
+            return response ? response : sv_static_make_error(sv_static_get_errno_status(error));
+        }
+        
+        sv_cache_entry_release(directory);
+        
+        if (!entry)
+            return sv_static_make_error(error == ENOENT ? HTTP_FORBIDDEN :
+                                        sv_static_get_errno_status(error));
+    }
+    
+    if (!S_ISREG(entry->mode)) {
+        // devices, sockets and the like aren't for the web
+        sv_cache_entry_release(entry);
+        return sv_static_make_error(HTTP_FORBIDDEN);
+    }
+    
+    if (files->cgi && sv_cgi_is_script(path, entry->mode)) {
+        sv_cache_entry_release(entry);
+        return sv_cgi_respond(files->cgi, request, path);
+    } else if (!readOnly) {
+        sv_cache_entry_release(entry);
+        return sv_static_make_not_allowed();
+    }
+    
+    // validators of the file, for caches and for resuming downloads
+    char etag[SV_STATIC_ETAG_MAX];
+    char lastModified[HTTP_DATE_MAX];
+    
+    sv_static_make_etag(entry, etag);
+    http_date_format(lastModified, entry->modified.tv_sec);
+    
+    http_headers_ref response = NULL;
+    bool compressible = sv_compress_is_compressible(entry->contentType);
+    bool identity = true;
+    
+    // ranges are always ranges of the file itself, never of a compressed variant
+    if (files->ranges && strcmp(type, "GET") == 0)
+        response = sv_static_respond_ranges(request, entry, etag, lastModified);
+    
+    // otherwise the representation depends on Accept-Encoding for anything compressible
+    if (!response && compressible) {
+        response = sv_static_respond_compressed(files, request, entry);
+        identity = (response == NULL);
+        
+        if (response)
+            sv_cache_entry_release(entry);
+    }
+    
+    if (!response) {
+        // the entry (and its descriptor) stays around until the file is sent
+        response = http_headers_init_with_file(HTTP_OK, entry->contentType, entry->fd, 0,
+                                               entry->size, sv_static_close_entry, entry);
+    }
+    
+    if (compressible)
+        http_headers_set(response, "Vary", "Accept-Encoding");
+    
+    http_headers_set(response, "Last-Modified", lastModified);
+    
+    if (identity) {
+        // compressed variants aren't byte-for-byte the same, so they get no strong tag
+        http_headers_set(response, "ETag", etag);
+        
+        if (files->ranges)
+            http_headers_set(response, "Accept-Ranges", "bytes");
+    }
+    
+    return response;
+}
+
+void sv_static_release(sv_static_ref files) {
+    if (!files)
+        return;
+    
+    sv_cgi_release(files->cgi);
+    sv_listing_cache_release(files->listings);
+    sv_compress_cache_release(files->compressed);
+    sv_cache_release(files->cache);
+    
+    close(files->rootFD);
+    free(files->root);
+    free(files);
+}
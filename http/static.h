@@ -0,0 +1,37 @@
+//
+//  static.h
+//  http
+//
+//  Created by Tim K. on 26.02.23.
+//  Copyright © 2023 Tim K. All rights reserved.
+//
+
+#pragma once
+
+#include "http_server.h"
+
+//
+// static file engine of the CLI: maps request URLs onto files below the served
+// directory and answers with file responses, so the server core sends their
+// contents right from the page cache
+//
+
+/// most ranges one request may ask for, the whole file is sent for more
+#define SV_STATIC_RANGES_MAX 16
+
+typedef struct sv_static_s* sv_static_ref;
+
+/// creates the engine serving files below root, NULL if root is not a directory. If
+/// ranges is true, Range requests are answered with just the parts asked for, if
+/// listings is true, directories without an index page are listed, and if cgi is true,
+/// scripts (see sv_cgi_is_script) are run instead of being sent
+sv_static_ref sv_static_init(const char* root, const bool ranges, const bool listings,
+                             const bool cgi);
+
+/// answers the request with a file or an error, never returns NULL
+http_headers_ref sv_static_respond(sv_static_ref files, const http_headers_ref request);
+
+/// gets the MIME type of a file based on its extension
+const char* sv_static_get_content_type(const char* path);
+
+void sv_static_release(sv_static_ref files);
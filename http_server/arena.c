@@ -0,0 +1,145 @@
+//
+//  arena.c
+//  http_server
+//
+//  Created by Tim K. on 26.02.23.
+//  Copyright © 2023 Tim K. All rights reserved.
+//
+
+#include <string.h>
+#include "arena.h"
+
+//
+// private
+//
+
+/// every allocation is aligned to this
+#define HTTP_ARENA_ALIGNMENT 16
+
+typedef struct http_arena_chunk_s* http_arena_chunk_ref;
+
+struct http_arena_chunk_s {
+    http_arena_chunk_ref next;
+    size_t size;
+    
+    // the memory itself follows at HTTP_ARENA_CHUNK_HEADER
+};
+
+#define HTTP_ARENA_ALIGN(sz) (((sz) + HTTP_ARENA_ALIGNMENT - 1) & \
+                              ~((size_t)HTTP_ARENA_ALIGNMENT - 1))
+#define HTTP_ARENA_CHUNK_HEADER HTTP_ARENA_ALIGN(sizeof(struct http_arena_chunk_s))
+
+struct http_arena_s {
+    // chunk allocations are bumped in, older chunks follow it
+    http_arena_chunk_ref current;
+    size_t used;
+    
+    http_size_t chunkSize;
+};
+
+static __thread http_arena_ref http_arena_current = NULL;
+
+http_arena_chunk_ref http_arena_chunk_init(const size_t size) {
+    http_arena_chunk_ref chunk = malloc(HTTP_ARENA_CHUNK_HEADER + size);
+    if (!chunk)
+        return NULL;
+    
+    chunk->next = NULL;
+    chunk->size = size;
+    
+    return chunk;
+}
+
+//
+// public
+//
+
+http_arena_ref http_arena_init(const http_size_t chunkSize) {
+    http_arena_ref arena = hizalloc_struct(http_arena_s);
+    arena->chunkSize = HI_IF_NULL(chunkSize, HTTP_ARENA_CHUNK_SIZE);
+    
+    return arena;
+}
+
+void* http_arena_alloc(http_arena_ref arena, const size_t size) {
+    size_t aligned = HTTP_ARENA_ALIGN(size);
+    
+    if (!arena->current || arena->used + aligned > arena->current->size) {
+        // doesn't fit, so start a new chunk (a dedicated one for large allocations)
+        http_arena_chunk_ref chunk = http_arena_chunk_init((aligned > arena->chunkSize) ?
+                                                           aligned : arena->chunkSize);
+        if (!chunk) {
+            HI_DEBUG("out of memory in arena <%p>", arena);
+            return NULL;
+        }
+        
+        chunk->next = arena->current;
+        arena->current = chunk;
+        arena->used = 0;
+    }
+    
+    void* result = (char*)arena->current + HTTP_ARENA_CHUNK_HEADER + arena->used;
+    arena->used += aligned;
+    
+    return result;
+}
+
+void* http_arena_zalloc(http_arena_ref arena, const size_t size) {
+    void* result = http_arena_alloc(arena, size);
+    
+    if (result)
+        bzero(result, size);
+    
+    return result;
+}
+
+char* http_arena_strdup(http_arena_ref arena, const char* str) {
+    size_t size = strlen(str) + 1;
+    char* result = http_arena_alloc(arena, size);
+    
+    if (result)
+        memcpy(result, str, size);
+    
+    return result;
+}
+
+void http_arena_reset(http_arena_ref arena) {
+    if (!arena || !arena->current)
+        return;
+    
+    // keep the oldest (regular-sized) chunk only
+    http_arena_chunk_ref chunk = arena->current;
+    
+    while (chunk->next) {
+        http_arena_chunk_ref next = chunk->next;
+        
+        free(chunk);
+        chunk = next;
+    }
+    
+    if (chunk->size != arena->chunkSize) {
+        free(chunk);
+        chunk = NULL;
+    }
+    
+    arena->current = chunk;
+    arena->used = 0;
+}
+
+void http_arena_release(http_arena_ref arena) {
+    if (!arena)
+        return;
+    
+    http_arena_reset(arena);
+    
+    free(arena->current);
+    free(arena);
+}
+
+http_arena_ref http_arena_get_current() {
+    return http_arena_current;
+}
+
+void http_arena_set_current(http_arena_ref arena) {
+    http_arena_current = arena;
+}
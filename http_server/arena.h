@@ -0,0 +1,43 @@
+//
+//  arena.h
+//  http_server
+//
+//  Created by Tim K. on 26.02.23.
+//  Copyright © 2023 Tim K. All rights reserved.
+//
+
+#pragma once
+
+#include "wrappers.h"
+
+//
+// bump allocator backing everything a request/response pair needs. Allocations are
+// never freed one by one, the whole arena is reset at once after the responses are
+// sent, keeping its first chunk around for the next ones
+//
+
+/// default size of an arena chunk
+#define HTTP_ARENA_CHUNK_SIZE 8192
+
+typedef struct http_arena_s* http_arena_ref;
+
+http_arena_ref http_arena_init(const http_size_t chunkSize);
+
+/// allocates uninitialized memory, aligned for any type
+void* http_arena_alloc(http_arena_ref arena, const size_t size);
+/// allocates zeroed memory
+void* http_arena_zalloc(http_arena_ref arena, const size_t size);
+char* http_arena_strdup(http_arena_ref arena, const char* str);
+
+#define http_arena_zalloc_struct(arena, stt) http_arena_zalloc(arena, sizeof(struct stt))
+
+/// forgets about all of the allocations at once
+void http_arena_reset(http_arena_ref arena);
+void http_arena_release(http_arena_ref arena);
+
+///
+/// arena of the request being handled on this thread (NULL outside of the request
+/// callback), responses created during the callback are allocated from it
+///
+http_arena_ref http_arena_get_current(void);
+void http_arena_set_current(http_arena_ref arena);
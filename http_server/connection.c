@@ -0,0 +1,618 @@
+//
+//  connection.c
+//  http_server
+//
+//  Created by Tim K. on 26.02.23.
+//  Copyright © 2023 Tim K. All rights reserved.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/param.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+#include "connection.h"
+
+//
+// private
+//
+
+void http_pending_release(http_pending_ref pending) {
+    // the pending object and the heading are in the arena
+    if (pending)
+        http_headers_release(pending->response);
+}
+
+size_t http_pending_get_memory_size(http_pending_ref pending) {
+    return pending->parts[0].iov_len + pending->parts[1].iov_len;
+}
+
+size_t http_pending_get_size(http_pending_ref pending) {
+    return http_pending_get_memory_size(pending) + pending->fileSize;
+}
+
+bool http_pending_is_done(http_pending_ref pending) {
+    // streamed bodies are done once their producer is, not when a part is out
+    return (pending->sent >= http_pending_get_size(pending) &&
+            (!pending->stream || pending->stream->finished));
+}
+
+bool http_pending_produce(http_connection_ref connection, http_pending_ref pending) {
+    http_stream_ref stream = pending->stream;
+    
+    // the previous part is out, the next one takes its place
+    pending->sent -= pending->parts[1].iov_len;
+    
+    bool produced = http_stream_produce(stream);
+    
+    pending->parts[1].iov_base = stream->buffer;
+    pending->parts[1].iov_len = stream->size;
+    connection->queuedSize += stream->size;
+    
+    return produced;
+}
+
+int http_connection_open_temporary(const char* directory) {
+    int fd = -1;
+
+#ifdef O_TMPFILE
+    // never has a name, so nothing is left behind whatever happens
+    fd = open(directory, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+    
+    if (fd >= 0 || (errno != EOPNOTSUPP && errno != EISDIR))
+        return fd;
+#endif
+    
+    // has one for a moment otherwise
+    char path[MAXPATHLEN];
+    snprintf(path, sizeof(path), "%s/http_server.XXXXXX", directory);
+    
+    fd = mkstemp(path);
+    
+    if (fd >= 0) {
+        unlink(path);
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+    }
+    
+    return fd;
+}
+
+void http_connection_drop_pending(http_connection_ref connection) {
+    while (connection->firstPending) {
+        http_pending_ref next = connection->firstPending->next;
+        
+        http_pending_release(connection->firstPending);
+        connection->firstPending = next;
+    }
+    
+    connection->lastPending = NULL;
+    
+    connection->queuedSize = 0;
+    
+    // nothing refers to the arena anymore
+    http_arena_reset(connection->arena);
+}
+
+void http_connection_getpeeraddress(http_connection_ref connection,
+                                    const struct sockaddr* address) {
+    connection->ipAddress[0] = '\0';
+    connection->port = 0;
+    
+    if (!address)
+        return;
+    else if (address->sa_family == AF_INET) {
+        const struct sockaddr_in* ipv4 = (const struct sockaddr_in*)address;
+        
+        inet_ntop(AF_INET, &ipv4->sin_addr, connection->ipAddress, INET6_ADDRSTRLEN);
+        connection->port = ntohs(ipv4->sin_port);
+    } else if (address->sa_family == AF_INET6) {
+        const struct sockaddr_in6* ipv6 = (const struct sockaddr_in6*)address;
+        
+        inet_ntop(AF_INET6, &ipv6->sin6_addr, connection->ipAddress, INET6_ADDRSTRLEN);
+        connection->port = ntohs(ipv6->sin6_port);
+    } else
+        HI_DEBUG("unknown address family %u", address->sa_family);
+}
+
+void http_connection_fill(http_connection_ref connection, http_pending_ref pending,
+                          http_headers_ref response, const bool withBody) {
+    pending->response = response;
+    pending->queued = http_stats_clock();
+    
+    http_size_t headingSize = 0;
+    pending->heading = http_headers_get_response_in(response, connection->arena,
+                                                    &headingSize);
+    
+    http_size_t bodySize = 0;
+    void* body = http_headers_get_body(response, &bodySize);
+    
+    pending->parts[0].iov_base = pending->heading;
+    pending->parts[0].iov_len = headingSize;
+    pending->parts[1].iov_base = body;
+    pending->parts[1].iov_len = (body && withBody) ? bodySize : 0;
+    
+    // file bodies don't go through memory at all
+    off_t fileSize = 0;
+    pending->fileFD = http_headers_get_file(response, &pending->fileOffset, &fileSize);
+    
+    if (pending->fileFD >= 0 && withBody && fileSize > 0)
+        pending->fileSize = (size_t)fileSize;
+    
+    connection->queuedSize += http_pending_get_size(pending);
+    
+    // the first part of a streamed body is there right away, a failure shows once
+    // it's asked for the next one
+    pending->stream = withBody ? http_headers_get_stream(response) : NULL;
+    
+    if (pending->stream)
+        http_pending_produce(connection, pending);
+    
+    // further parts of the file each go out as a pending of their own right behind
+    // it, the last one of them keeps the response alive until everything is sent
+    http_file_part_ref part = withBody ? http_headers_get_file_parts(response) : NULL;
+    http_pending_ref previous = pending;
+    
+    for (; part; part = part->next) {
+        http_pending_ref partPending = http_arena_zalloc_struct(connection->arena, http_pending_s);
+        partPending->parts[0].iov_base = (void*)part->prefix;
+        partPending->parts[0].iov_len = part->prefixSize;
+        partPending->fileFD = pending->fileFD;
+        partPending->fileOffset = part->offset;
+        partPending->fileSize = (size_t)part->size;
+        partPending->queued = pending->queued;
+        partPending->trace = pending->trace;
+        connection->queuedSize += http_pending_get_size(partPending);
+        
+        partPending->response = response;
+        previous->response = NULL;
+        
+        partPending->next = previous->next;
+        previous->next = partPending;
+        
+        if (connection->lastPending == previous)
+            connection->lastPending = partPending;
+        
+        previous = partPending;
+    }
+}
+
+void http_connection_take_trace(http_connection_ref connection, http_pending_ref pending) {
+    if (!connection->tracing)
+        return;
+    
+    // the connection's copy is for the next request already
+    pending->trace = http_arena_alloc(connection->arena, sizeof(http_trace_record_t));
+    *pending->trace = connection->trace;
+    
+    connection->tracing = false;
+}
+
+void http_connection_append(http_connection_ref connection, http_pending_ref pending) {
+    // queue it behind whatever is still waiting
+    if (connection->lastPending)
+        connection->lastPending->next = pending;
+    else
+        connection->firstPending = pending;
+    
+    connection->lastPending = pending;
+}
+
+//
+// public
+//
+
+void http_connection_init(http_connection_ref connection, int sk,
+                          const struct sockaddr* address) {
+    // keep the input buffer of the previous client around, it's reusable
+    char* input = connection->input;
+    http_size_t inputCapacity = connection->inputCapacity;
+    http_arena_ref arena = connection->arena;
+    uint32_t generation = connection->generation;
+    
+    bzero(connection, sizeof(struct http_connection_s));
+    
+    connection->sk = sk;
+    connection->input = input;
+    connection->inputCapacity = inputCapacity;
+    connection->arena = arena ? arena : http_arena_init(HTTP_ARENA_CHUNK_SIZE);
+    connection->generation = generation + 1;
+    http_parser_reset(&connection->parser);
+    
+    // remember who it is once instead of asking on every request
+    http_connection_getpeeraddress(connection, address);
+}
+
+bool http_connection_reserve_input(http_connection_ref connection, const http_size_t size,
+                                   const http_size_t maxSize) {
+    http_size_t required = connection->inputSize + size;
+    
+    if (required <= connection->inputCapacity)
+        return true;
+    else if (required > maxSize)
+        return false;
+    
+    // grow geometrically, but never beyond the limit
+    http_size_t capacity = HI_IF_NULL(connection->inputCapacity, HTTP_REQUEST_FIELD_SIZE);
+    while (capacity < required)
+        capacity *= 2;
+    
+    if (capacity > maxSize)
+        capacity = maxSize;
+    
+    char* input = realloc(connection->input, capacity);
+    if (!input)
+        return false;
+    
+    connection->input = input;
+    connection->inputCapacity = capacity;
+    
+    return true;
+}
+
+bool http_connection_append_input(http_connection_ref connection, const char* data,
+                                  const http_size_t size, const http_size_t maxSize) {
+    if (!http_connection_reserve_input(connection, size, maxSize))
+        return false;
+    
+    memcpy(connection->input + connection->inputSize, data, size);
+    connection->inputSize += size;
+    
+    return true;
+}
+
+void http_connection_consume_input(http_connection_ref connection, const http_size_t size) {
+    if (size >= connection->inputSize) {
+        connection->inputSize = 0;
+        return;
+    }
+    
+    // keep the (partial) rest at the beginning
+    memmove(connection->input, connection->input + size, connection->inputSize - size);
+    connection->inputSize -= size;
+}
+
+bool http_connection_begin_spill(http_connection_ref connection, const char* message,
+                                 const http_size_t headingSize, const http_size_t bodySize) {
+    const char* directory = getenv("TMPDIR");
+    
+    if (!directory || !directory[0])
+        directory = P_tmpdir;
+    
+    int fd = http_connection_open_temporary(directory);
+    
+    if (fd < 0) {
+        HI_ERRNO_DEBUG("couldn't create a file for the request body");
+        return false;
+    }
+    
+    // the input buffer is going to be reused for the body
+    connection->spillHeading = malloc(headingSize);
+    
+    if (!connection->spillHeading) {
+        close(fd);
+        return false;
+    }
+    
+    memcpy(connection->spillHeading, message, headingSize);
+    connection->spillFD = fd;
+    connection->spillLeft = bodySize;
+    
+    return true;
+}
+
+bool http_connection_is_spilling(http_connection_ref connection) {
+    return (connection->spillHeading != NULL);
+}
+
+bool http_connection_spill(http_connection_ref connection, const char* data,
+                           const http_size_t size, http_size_t* consumedPtr) {
+    http_size_t amount = (size < connection->spillLeft) ? size : connection->spillLeft;
+    http_size_t written = 0;
+    
+    while (written < amount) {
+        ssize_t result = write(connection->spillFD, data + written, amount - written);
+        
+        if (result < 0 && errno == EINTR)
+            continue;
+        else if (result < 1) {
+            HI_ERRNO_DEBUG("couldn't write the request body");
+            return false;
+        }
+        
+        written += (http_size_t)result;
+    }
+    
+    connection->spillLeft -= amount;
+    (*consumedPtr) = amount;
+    
+    // the callback reads it from the start
+    if (connection->spillLeft < 1 && lseek(connection->spillFD, 0, SEEK_SET) < 0) {
+        HI_ERRNO_DEBUG("couldn't rewind the request body");
+        return false;
+    }
+    
+    return true;
+}
+
+void http_connection_end_spill(http_connection_ref connection) {
+    if (!connection->spillHeading)
+        return;
+    
+    close(connection->spillFD);
+    free(connection->spillHeading);
+    
+    connection->spillHeading = NULL;
+    connection->spillFD = -1;
+    connection->spillLeft = 0;
+}
+
+void http_connection_queue(http_connection_ref connection, http_headers_ref response,
+                           const bool withBody) {
+    http_pending_ref pending = http_arena_zalloc_struct(connection->arena, http_pending_s);
+    
+    http_connection_take_trace(connection, pending);
+    http_connection_append(connection, pending);
+    http_connection_fill(connection, pending, response, withBody);
+}
+
+http_pending_ref http_connection_queue_deferred(http_connection_ref connection,
+                                               http_headers_ref placeholder,
+                                               http_deferred_ref deferred) {
+    http_pending_ref pending = http_arena_zalloc_struct(connection->arena, http_pending_s);
+    pending->response = placeholder;
+    pending->deferred = deferred;
+    pending->fileFD = -1;
+    
+    http_connection_take_trace(connection, pending);
+    http_connection_append(connection, pending);
+    connection->deferredCount++;
+    
+    return pending;
+}
+
+void http_connection_resolve(http_connection_ref connection, http_pending_ref pending,
+                             http_headers_ref response, const bool withBody) {
+    http_headers_release(pending->response);
+    
+    pending->deferred = NULL;
+    connection->deferredCount--;
+    
+    http_connection_fill(connection, pending, response, withBody);
+}
+
+bool http_connection_has_pending(http_connection_ref connection) {
+    return (connection->firstPending != NULL);
+}
+
+size_t http_connection_build_message(http_connection_ref connection) {
+    size_t total = 0;
+    http_size_t count = 0;
+    
+    http_pending_ref pending = connection->firstPending;
+    
+    // every pending response contributes whatever is left of its two parts
+    while (pending && !pending->deferred && count + 2 <= HTTP_CONNECTION_IOV_MAX) {
+        size_t skip = pending->sent;
+        
+        for (http_size_t sz = 0; sz < 2; sz++) {
+            struct iovec* part = &pending->parts[sz];
+            
+            if (skip >= part->iov_len) {
+                skip -= part->iov_len;
+                continue;
+            }
+            
+            connection->iov[count].iov_base = (char*)part->iov_base + skip;
+            connection->iov[count].iov_len = part->iov_len - skip;
+            
+            total += connection->iov[count].iov_len;
+            count++;
+            skip = 0;
+        }
+        
+        // nothing after a file body or a streamed one can be sent before it
+        if (pending->fileSize > 0 || (pending->stream && !pending->stream->finished))
+            break;
+        
+        pending = pending->next;
+    }
+    
+    bzero(&connection->message, sizeof(struct msghdr));
+    connection->message.msg_iov = connection->iov;
+    connection->message.msg_iovlen = count;
+    
+    return total;
+}
+
+void http_connection_sent(http_connection_ref connection, size_t sent) {
+    HTTP_STATS_ADD(connection->stats->bytesOut, sent);
+    
+    while (http_connection_can_send(connection) && sent > 0) {
+        http_pending_ref pending = connection->firstPending;
+        size_t left = http_pending_get_size(pending) - pending->sent;
+        
+        if (pending->trace && pending->trace->firstWritten < 1)
+            pending->trace->firstWritten = http_stats_clock();
+        
+        if (sent < left) {
+            // partially out
+            pending->sent += sent;
+            connection->queuedSize -= sent;
+            return;
+        }
+        
+        sent -= left;
+        connection->queuedSize -= left;
+        pending->sent += left;
+        
+        // the streamed body goes on with its next part
+        if (!http_pending_is_done(pending))
+            return;
+        
+        // done with this one, file parts count once the last of them is out
+        if (pending->response) {
+            uint64_t now = http_stats_clock();
+            http_stats_record(&connection->stats->sendTime, now - pending->queued);
+            
+            if (pending->trace) {
+                pending->trace->lastWritten = now;
+                http_trace_push(connection->traceRing, pending->trace);
+            }
+        }
+        
+        connection->firstPending = pending->next;
+        http_pending_release(pending);
+    }
+    
+    // responses without any bytes left (shouldn't really happen) go too
+    while (http_connection_can_send(connection) && http_pending_is_done(connection->firstPending)) {
+        http_pending_ref pending = connection->firstPending;
+        
+        connection->firstPending = pending->next;
+        http_pending_release(pending);
+    }
+    
+    // all sent, time to drop everything the requests and responses allocated
+    if (!connection->firstPending)
+        http_connection_drop_pending(connection);
+}
+
+bool http_connection_can_send(http_connection_ref connection) {
+    return (connection->firstPending && !connection->firstPending->deferred);
+}
+
+bool http_connection_wants_produce(http_connection_ref connection) {
+    http_pending_ref pending = connection->firstPending;
+    
+    return (pending && pending->stream && !pending->stream->finished &&
+            pending->sent >= http_pending_get_size(pending));
+}
+
+bool http_connection_produce(http_connection_ref connection) {
+    return http_pending_produce(connection, connection->firstPending);
+}
+
+bool http_connection_wants_sendfile(http_connection_ref connection) {
+    http_pending_ref pending = connection->firstPending;
+    
+    // the heading and such must be out already
+    return (pending && pending->fileSize > 0 &&
+            pending->sent >= http_pending_get_memory_size(pending));
+}
+
+ssize_t http_connection_sendfile(http_connection_ref connection) {
+    http_pending_ref pending = connection->firstPending;
+    
+    size_t done = pending->sent - http_pending_get_memory_size(pending);
+    size_t left = MIN(pending->fileSize - done, HTTP_CONNECTION_SENDFILE_MAX);
+    off_t offset = pending->fileOffset + (off_t)done;
+
+#ifdef __linux__
+    // straight from the page cache to the socket
+    ssize_t sent = sendfile(connection->sk, pending->fileFD, &offset, left);
+#else
+    // no Linux-like sendfile here, go through a buffer instead
+    char buffer[HTTP_REQUEST_FIELD_SIZE * 4];
+    ssize_t sent = pread(pending->fileFD, buffer, MIN(left, sizeof(buffer)), offset);
+    
+    if (sent > 0)
+        sent = send(connection->sk, buffer, (size_t)sent, 0);
+#endif
+    
+    if (sent == 0) {
+        // the file got shorter than promised, the response can't be completed
+        errno = EIO;
+        return -1;
+    } else if (sent > 0)
+        http_connection_sent(connection, (size_t)sent);
+    else if (errno == EAGAIN || errno == EWOULDBLOCK)
+        connection->writeBlocked = true;
+    
+    return sent;
+}
+
+bool http_connection_flush(http_connection_ref connection) {
+    while (http_connection_can_send(connection)) {
+        if (http_connection_wants_produce(connection)) {
+            if (http_connection_produce(connection))
+                continue;
+            
+            HI_DEBUG("streamed body of client %d failed", connection->sk);
+            return false;
+        } else if (http_connection_wants_sendfile(connection)) {
+            if (http_connection_sendfile(connection) >= 0 || errno == EINTR)
+                continue;
+            else if (connection->writeBlocked)
+                return true;
+            
+            HI_ERRNO_DEBUG("sendfile failed");
+            return false;
+        } else if (http_connection_build_message(connection) < 1) {
+            http_connection_sent(connection, 0);
+            continue;
+        }
+        
+        // everything queued goes out in one syscall
+        ssize_t sent = sendmsg(connection->sk, &connection->message, MSG_NOSIGNAL);
+        
+        if (sent < 0) {
+            if (errno == EINTR)
+                continue;
+            else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                // the rest goes once the client has taken some of it
+                connection->writeBlocked = true;
+                return true;
+            }
+            
+            HI_ERRNO_DEBUG("sendmsg failed");
+            return false;
+        }
+        
+        http_connection_sent(connection, (size_t)sent);
+    }
+    
+    return true;
+}
+
+void http_connection_reset(http_connection_ref connection) {
+    http_connection_drop_pending(connection);
+    http_connection_end_spill(connection);
+    
+    // the input buffer stays for the next client of this slot, unless some
+    // request made it grow way beyond the usual size
+    char* input = connection->input;
+    http_size_t inputCapacity = connection->inputCapacity;
+    
+    if (inputCapacity > HTTP_REQUEST_FIELD_SIZE * 4) {
+        free(input);
+        
+        input = NULL;
+        inputCapacity = 0;
+    }
+    
+    http_arena_ref arena = connection->arena;
+    uint32_t generation = connection->generation;
+    
+    bzero(connection, sizeof(struct http_connection_s));
+    
+    connection->sk = -1;
+    connection->input = input;
+    connection->inputCapacity = inputCapacity;
+    connection->arena = arena;
+    connection->generation = generation;
+}
+
+void http_connection_release(http_connection_ref connection) {
+    http_connection_reset(connection);
+    
+    free(connection->input);
+    http_arena_release(connection->arena);
+    
+    connection->input = NULL;
+    connection->inputCapacity = 0;
+    connection->arena = NULL;
+}
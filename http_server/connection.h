@@ -0,0 +1,225 @@
+//
+//  connection.h
+//  http_server
+//
+//  Created by Tim K. on 26.02.23.
+//  Copyright © 2023 Tim K. All rights reserved.
+//
+
+#pragma once
+
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <time.h>
+#include "headers.h"
+#include "fds.h"
+#include "stats.h"
+#include "trace.h"
+
+/// per-client state kept by a worker
+typedef struct http_connection_s* http_connection_ref;
+
+/// response queued for transmission on a connection
+typedef struct http_pending_s* http_pending_ref;
+
+/// max iovecs handed to the kernel at once (two per response)
+#define HTTP_CONNECTION_IOV_MAX 64
+/// max bytes of a file body handed to one sendfile call
+#define HTTP_CONNECTION_SENDFILE_MAX (4 * 1024 * 1024)
+/// bytes read at once while a request body goes to a temporary file
+#define HTTP_CONNECTION_SPILL_READ_SIZE (64 * 1024)
+
+struct http_pending_s {
+    // response object and its serialized heading (in the connection's arena). Bodies
+    // of several file parts are queued as several pendings, only the last of which
+    // holds the response
+    http_headers_ref response;
+    char* heading;
+    
+    // heading and body, in this order
+    struct iovec parts[2];
+    // file body going out after them with sendfile, fileSize is 0 if there's none
+    int fileFD;
+    off_t fileOffset;
+    size_t fileSize;
+    // streamed body, parts[1] holds its current part until the producer is done
+    http_stream_ref stream;
+    // amount of bytes of all the parts (the file included) already sent
+    size_t sent;
+    // when it was queued (see http_stats_clock), for the send time of the response
+    uint64_t queued;
+    // timestamps of the request, in the arena, if it's traced (shared by all the
+    // pendings of the response)
+    http_trace_record_t* trace;
+    
+    // set while the response is yet to come (see http_headers_init_deferred), nothing
+    // queued after it can be sent before it
+    http_deferred_ref deferred;
+    
+    http_pending_ref next;
+};
+
+struct http_connection_s {
+    // client socket, -1 if the slot is free
+    int sk;
+    
+    // client address, captured once on accept
+    char ipAddress[INET6_ADDRSTRLEN];
+    http_port_t port;
+    
+    // received bytes not yet consumed by a complete request
+    char* input;
+    http_size_t inputSize;
+    http_size_t inputCapacity;
+    // state of the request at the beginning of the input
+    struct http_parser_s parser;
+    // nanoseconds spent parsing it so far, it may come in several parts
+    uint64_t parseTime;
+    // timestamps of it if it's traced, they move to the pending of its response as
+    // soon as that's queued
+    http_trace_record_t trace;
+    bool tracing;
+    // while the body of a large request is written to the (unnamed) spillFD instead,
+    // its headers are kept in spillHeading and the input starts with the body. NULL
+    // if there's no such request
+    char* spillHeading;
+    int spillFD;
+    http_size_t spillLeft;
+    
+    // responses waiting to be sent, the first ones might be in flight already
+    http_pending_ref firstPending;
+    http_pending_ref lastPending;
+    // bytes of them not sent yet
+    size_t queuedSize;
+    // memory of the requests and responses until they are all sent, kept for
+    // every next client of the slot
+    http_arena_ref arena;
+    
+    // all of the pending responses as one message, rebuilt before every send
+    struct iovec iov[HTTP_CONNECTION_IOV_MAX];
+    struct msghdr message;
+    
+    // true while the backend is sending asynchronously
+    bool sending;
+    // true if the socket's send buffer is full, nothing is sent until the backend
+    // reports it writable again
+    bool writeBlocked;
+    // true while reading is paused because too much output is queued
+    bool readPaused;
+    // events currently watched for by the backend
+    http_fd_event_t events;
+    // true if the connection must be closed once the send in flight completes
+    bool closing;
+    // true if the client asked for (or the server decided on) closing the
+    // connection after the queued responses are out
+    bool closeAfterFlush;
+    
+    // requests served over this connection so far
+    http_size_t requestsCount;
+    // responses queued, but still waiting for http_deferred_respond
+    http_size_t deferredCount;
+    // bumped for every new client of the slot, so that late deferred responses
+    // can tell whether their client is still there
+    uint32_t generation;
+    
+    // the worker's stats, which bytes and send times are counted into
+    http_stats_t* stats;
+    // the worker's trace ring, which traced requests go to, and when the client
+    // connected (only taken while tracing is on)
+    http_trace_ring_ref traceRing;
+    uint64_t acceptedAt;
+    
+    // monotonic time (in seconds) of the last activity
+    time_t lastActive;
+    // neighbours in the worker's idle list, least recently active first
+    http_size_t idlePrev;
+    http_size_t idleNext;
+};
+
+void http_pending_release(http_pending_ref pending);
+
+/// prepares a free slot for a new client
+void http_connection_init(http_connection_ref connection, int sk,
+                          const struct sockaddr* address);
+
+/// appends received data to the input buffer, false if it would grow beyond maxSize
+bool http_connection_append_input(http_connection_ref connection, const char* data,
+                                  const http_size_t size, const http_size_t maxSize);
+/// makes sure at least the specified amount of bytes can be appended to the input
+bool http_connection_reserve_input(http_connection_ref connection, const http_size_t size,
+                                   const http_size_t maxSize);
+/// drops the specified amount of bytes from the beginning of the input buffer
+void http_connection_consume_input(http_connection_ref connection, const http_size_t size);
+
+///
+/// starts writing the body of the request at the beginning of message to a temporary
+/// file, keeping a copy of its headingSize bytes of headers. The caller then drops
+/// the headers from the input, false on failure
+///
+bool http_connection_begin_spill(http_connection_ref connection, const char* message,
+                                 const http_size_t headingSize, const http_size_t bodySize);
+/// true while a request body is written to a temporary file
+bool http_connection_is_spilling(http_connection_ref connection);
+///
+/// writes as much of data as belongs to the body to its file, the amount is put into
+/// consumedPtr. Once all of it is there (spillLeft is 0), the file is rewound for
+/// the callback. False on failure
+///
+bool http_connection_spill(http_connection_ref connection, const char* data,
+                           const http_size_t size, http_size_t* consumedPtr);
+/// closes the body's file and frees the headers, if a request was being spilled
+void http_connection_end_spill(http_connection_ref connection);
+
+/// serializes the response and queues it for sending, takes ownership of it. Only
+/// the heading is sent if withBody is false (answers to HEAD requests). The response
+/// belongs to the request traced right now, if any
+void http_connection_queue(http_connection_ref connection, http_headers_ref response,
+                           const bool withBody);
+
+/// queues a placeholder for a deferred response, which must be handed over to
+/// http_connection_resolve before anything queued after it goes out
+http_pending_ref http_connection_queue_deferred(http_connection_ref connection,
+                                               http_headers_ref placeholder,
+                                               http_deferred_ref deferred);
+/// puts the response in place of the placeholder, takes ownership of it
+void http_connection_resolve(http_connection_ref connection, http_pending_ref pending,
+                             http_headers_ref response, const bool withBody);
+
+/// true if there is anything left to send
+bool http_connection_has_pending(http_connection_ref connection);
+/// true if there is anything that can be sent right now, i.e. the first response
+/// in the queue isn't a deferred one still waiting
+bool http_connection_can_send(http_connection_ref connection);
+
+///
+/// fills connection->message with everything queued up to the first file body (the
+/// heading of its response included), returns the amount of bytes
+///
+size_t http_connection_build_message(http_connection_ref connection);
+/// true if the next thing to send is a file body, which needs http_connection_sendfile
+bool http_connection_wants_sendfile(http_connection_ref connection);
+/// sends the next part of the current file body, returns the amount of bytes sent or
+/// -1 on failure (with errno set) and if the socket can't take more right now (with
+/// connection->writeBlocked set)
+ssize_t http_connection_sendfile(http_connection_ref connection);
+/// true if the next thing to send is the next part of a streamed body, which needs
+/// http_connection_produce
+bool http_connection_wants_produce(http_connection_ref connection);
+/// has the producer of the current streamed body write its next part, false on failure
+bool http_connection_produce(http_connection_ref connection);
+/// marks the specified amount of queued bytes as sent, releasing finished responses
+void http_connection_sent(http_connection_ref connection, size_t sent);
+
+///
+/// sends everything queued up to the first deferred response still waiting, as far as
+/// the (non-blocking) socket takes it. Sets connection->writeBlocked if something is
+/// left for when it's writable again, false on failure
+///
+bool http_connection_flush(http_connection_ref connection);
+
+/// releases everything the connection holds and marks the slot as free, the socket
+/// itself is not closed
+void http_connection_reset(http_connection_ref connection);
+/// same as http_connection_reset, but also frees the buffers kept for reuse
+void http_connection_release(http_connection_ref connection);
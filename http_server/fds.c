@@ -10,7 +10,18 @@
 #include <errno.h>
 #include <sys/select.h>
 #include <unistd.h>
+#include <poll.h>
 #include "fds.h"
+#include "uring.h"
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#define HTTP_FD_SET_HAS_EPOLL 1
+#endif
+
+#ifdef HTTP_URING_AVAILABLE
+#define HTTP_FD_SET_HAS_URING 1
+#endif
 
 #ifdef __APPLE__
 // to fix the warnings
@@ -23,150 +34,916 @@ int select(int, fd_set* restrict, fd_set* restrict, fd_set* restrict,
 // private
 //
 
+/// a single ready socket reported by the backend
+typedef struct {
+    int sk;
+    http_size_t index;
+    http_fd_event_t events;
+    
+    // completion-based backends only: result and received data
+    http_ssize_t result;
+    char* data;
+} http_fd_ready_t;
+
+/// event backend implementation, one per http_backend_t
+typedef struct {
+    bool (*init)(http_fd_set_ref set);
+    bool (*add)(http_fd_set_ref set, int sk, const http_size_t index,
+                const http_fd_event_t events);
+    bool (*modify)(http_fd_set_ref set, int sk, const http_size_t index,
+                   const http_fd_event_t events);
+    bool (*remove)(http_fd_set_ref set, int sk, const http_size_t index);
+    http_ssize_t (*wait)(http_fd_set_ref set, const int timeoutMs);
+    void (*release)(http_fd_set_ref set);
+} http_fd_backend_ops_t;
+
 struct http_fd_set_s {
-    // the fd_set being wrapped itself
-    fd_set managedFDs;
+    // backend in use and its implementation
+    http_backend_t backend;
+    const http_fd_backend_ops_t* ops;
     
-    // client connection sockets array
+    // client connection sockets array (-1 means free slot)
     int* clientFDs;
+    // events requested for each of the client sockets
+    http_fd_event_t* clientEvents;
     // array size
     http_size_t clientMax;
+    // amount of occupied slots
+    http_size_t clientCount;
+    
+    // stack of free slot indices, so that adding a client is O(1)
+    http_size_t* freeSlots;
+    http_size_t freeSlotsCount;
     
-    // server socket
+    // server socket, not watched while there's no free slot, so that new clients wait
+    // in its backlog rather than being accepted only to be dropped
     int mainSocket;
+    bool mainPaused;
+    
+    // sockets reported as ready by the last wait
+    http_fd_ready_t* ready;
+    http_size_t readyCount;
+    http_size_t readyMax;
     
-    // newest-most socket value, needed for select()
+    // select() backend: newest-most socket value and the sets themselves
     int maxFD;
+    fd_set readFDs;
+    fd_set writeFDs;
+
+#ifdef HTTP_FD_SET_HAS_EPOLL
+    // epoll backend: epoll instance and the events buffer
+    int epollFD;
+    struct epoll_event* epollEvents;
+#endif
+
+#ifdef HTTP_FD_SET_HAS_URING
+    // io_uring backend: the ring, per-slot generation counters (so that completions of
+    // a previous client in the same slot are recognized), armed operations and the
+    // buffers to hand back to the kernel on the next wait
+    http_uring_ref uring;
+    uint32_t* uringGenerations;
+    uint8_t* uringArmed;
+    uint16_t* uringUsedBuffers;
+    http_size_t uringUsedBuffersCount;
+    // accepts in flight, never more than there are free slots
+    http_size_t uringAccepts;
+#endif
 };
 
-void http_fd_set_fill_gap_in_array(http_fd_set_ref set, int sk) {
-    if (!set)
-        return;
+//
+// select() backend
+//
+
+bool http_fd_set_select_init(http_fd_set_ref set) {
+    FD_ZERO(&set->readFDs);
+    FD_ZERO(&set->writeFDs);
+    
+    return true;
+}
+
+bool http_fd_set_select_add(http_fd_set_ref set, int sk, const http_size_t index,
+                            const http_fd_event_t events) {
+    HI_UNUSED(set);
+    HI_UNUSED(index);
+    HI_UNUSED(events);
+    
+    if (sk >= FD_SETSIZE) {
+        HI_DEBUG("socket %d does not fit into fd_set (FD_SETSIZE = %d)", sk, FD_SETSIZE);
+        return false;
+    }
+    
+    // nothing else to do, the sets are rebuilt on every wait
+    return true;
+}
+
+bool http_fd_set_select_remove(http_fd_set_ref set, int sk, const http_size_t index) {
+    HI_UNUSED(set);
+    HI_UNUSED(sk);
+    HI_UNUSED(index);
+    
+    return true;
+}
+
+http_ssize_t http_fd_set_select_wait(http_fd_set_ref set, const int timeoutMs) {
+    // zero and then sync fd_set client descriptors
+    FD_ZERO(&set->readFDs);
+    FD_ZERO(&set->writeFDs);
+    set->maxFD = -1;
+    
+    if (set->mainSocket >= 0 && !set->mainPaused) {
+        FD_SET(set->mainSocket, &set->readFDs);
+        set->maxFD = set->mainSocket;
+    }
     
     for (http_size_t sz = 0; sz < set->clientMax; sz++) {
-        if (set->clientFDs[sz] == 0) {
-            // add it to the empty spot
-            set->clientFDs[sz] = sk;
+        int clientSocket = set->clientFDs[sz];
+        
+        if (clientSocket < 0)
+            continue;
+        
+        if (set->clientEvents[sz] & HTTP_FD_EVENT_READ)
+            FD_SET(clientSocket, &set->readFDs);
+        if (set->clientEvents[sz] & HTTP_FD_EVENT_WRITE)
+            FD_SET(clientSocket, &set->writeFDs);
+        
+        // new max socket
+        if (clientSocket > set->maxFD)
+            set->maxFD = clientSocket;
+    }
+    
+    struct timeval timeout;
+    if (timeoutMs >= 0) {
+        timeout.tv_sec = timeoutMs / 1000;
+        timeout.tv_usec = (timeoutMs % 1000) * 1000;
+    }
+    
+    int result = select(set->maxFD + 1, &set->readFDs, &set->writeFDs, NULL,
+                        (timeoutMs >= 0) ? &timeout : NULL);
+    if (result < 0) {
+        if (errno == EINTR)
+            return 0;
+        
+        HI_ERRNO_DEBUG("select failed");
+        return -1;
+    }
+    
+    // collect the ready ones
+    if (result > 0 && set->mainSocket >= 0 && !set->mainPaused &&
+        FD_ISSET(set->mainSocket, &set->readFDs)) {
+        http_fd_ready_t* ready = &set->ready[set->readyCount++];
+        
+        ready->sk = set->mainSocket;
+        ready->index = HTTP_FD_SET_MAIN_INDEX;
+        ready->events = HTTP_FD_EVENT_READ;
+    }
+    
+    for (http_size_t sz = 0; result > 0 && sz < set->clientMax; sz++) {
+        int clientSocket = set->clientFDs[sz];
+        if (clientSocket < 0)
+            continue;
+        
+        http_fd_event_t events = HTTP_FD_EVENT_NONE;
+        
+        if (FD_ISSET(clientSocket, &set->readFDs))
+            events |= HTTP_FD_EVENT_READ;
+        if (FD_ISSET(clientSocket, &set->writeFDs))
+            events |= HTTP_FD_EVENT_WRITE;
+        
+        if (events != HTTP_FD_EVENT_NONE) {
+            http_fd_ready_t* ready = &set->ready[set->readyCount++];
+            
+            ready->sk = clientSocket;
+            ready->index = sz;
+            ready->events = events;
+        }
+    }
+    
+    return (http_ssize_t)set->readyCount;
+}
+
+void http_fd_set_select_release(http_fd_set_ref set) {
+    // zero-out all managed file descriptors
+    FD_ZERO(&set->readFDs);
+    FD_ZERO(&set->writeFDs);
+}
+
+static const http_fd_backend_ops_t http_fd_set_select_ops = {
+    http_fd_set_select_init,
+    http_fd_set_select_add,
+    http_fd_set_select_add,
+    http_fd_set_select_remove,
+    http_fd_set_select_wait,
+    http_fd_set_select_release
+};
+
+//
+// epoll backend (level-triggered)
+//
+
+#ifdef HTTP_FD_SET_HAS_EPOLL
+uint32_t http_fd_set_epoll_flags(const http_fd_event_t events) {
+    uint32_t result = 0;
+    
+    if (events & HTTP_FD_EVENT_READ)
+        result |= EPOLLIN | EPOLLRDHUP;
+    if (events & HTTP_FD_EVENT_WRITE)
+        result |= EPOLLOUT;
+    
+    return result;
+}
+
+bool http_fd_set_epoll_ctl(http_fd_set_ref set, int op, int sk, const http_size_t index,
+                           const http_fd_event_t events) {
+    struct epoll_event event;
+    bzero(&event, sizeof(struct epoll_event));
+    
+    // keep both the socket and its slot, so that no lookups are needed later
+    event.events = http_fd_set_epoll_flags(events);
+    event.data.u64 = ((uint64_t)index << 32) | (uint32_t)sk;
+    
+    if (epoll_ctl(set->epollFD, op, sk, &event) != 0) {
+        HI_ERRNO_DEBUG("epoll_ctl failed");
+        return false;
+    }
+    
+    return true;
+}
+
+bool http_fd_set_epoll_init(http_fd_set_ref set) {
+    set->epollFD = epoll_create1(EPOLL_CLOEXEC);
+    if (set->epollFD < 0) {
+        HI_ERRNO_DEBUG("epoll_create1 failed");
+        return false;
+    }
+    
+    // one extra for the main socket
+    set->epollEvents = calloc(set->clientMax + 1, sizeof(struct epoll_event));
+    return true;
+}
+
+bool http_fd_set_epoll_add(http_fd_set_ref set, int sk, const http_size_t index,
+                           const http_fd_event_t events) {
+    return http_fd_set_epoll_ctl(set, EPOLL_CTL_ADD, sk, index, events);
+}
+
+bool http_fd_set_epoll_modify(http_fd_set_ref set, int sk, const http_size_t index,
+                              const http_fd_event_t events) {
+    return http_fd_set_epoll_ctl(set, EPOLL_CTL_MOD, sk, index, events);
+}
+
+bool http_fd_set_epoll_remove(http_fd_set_ref set, int sk, const http_size_t index) {
+    HI_UNUSED(index);
+    
+    // pre-2.6.9 kernels want a non-NULL event even though it's ignored
+    struct epoll_event event;
+    bzero(&event, sizeof(struct epoll_event));
+    
+    return (epoll_ctl(set->epollFD, EPOLL_CTL_DEL, sk, &event) == 0);
+}
+
+http_ssize_t http_fd_set_epoll_wait(http_fd_set_ref set, const int timeoutMs) {
+    int result = epoll_wait(set->epollFD, set->epollEvents, (int)set->clientMax + 1,
+                            timeoutMs);
+    if (result < 0) {
+        if (errno == EINTR)
+            return 0;
+        
+        HI_ERRNO_DEBUG("epoll_wait failed");
+        return -1;
+    }
+    
+    // only the reported sockets are looked at, O(ready) rather than O(clientMax)
+    for (int sz = 0; sz < result; sz++) {
+        struct epoll_event* event = &set->epollEvents[sz];
+        http_fd_ready_t* ready = &set->ready[set->readyCount++];
+        
+        ready->sk = (int)(uint32_t)(event->data.u64 & UINT32_MAX);
+        ready->index = (http_size_t)(event->data.u64 >> 32);
+        ready->events = HTTP_FD_EVENT_NONE;
+        
+        if (event->events & EPOLLIN)
+            ready->events |= HTTP_FD_EVENT_READ;
+        if (event->events & EPOLLOUT)
+            ready->events |= HTTP_FD_EVENT_WRITE;
+        if (event->events & (EPOLLHUP | EPOLLRDHUP | EPOLLERR))
+            ready->events |= HTTP_FD_EVENT_HANGUP | HTTP_FD_EVENT_READ;
+    }
+    
+    return (http_ssize_t)set->readyCount;
+}
+
+void http_fd_set_epoll_release(http_fd_set_ref set) {
+    if (set->epollFD >= 0)
+        close(set->epollFD);
+    
+    free(set->epollEvents);
+}
+
+static const http_fd_backend_ops_t http_fd_set_epoll_ops = {
+    http_fd_set_epoll_init,
+    http_fd_set_epoll_add,
+    http_fd_set_epoll_modify,
+    http_fd_set_epoll_remove,
+    http_fd_set_epoll_wait,
+    http_fd_set_epoll_release
+};
+#endif
+
+//
+// io_uring backend (completion-based accept, receive and send)
+//
+
+#ifdef HTTP_FD_SET_HAS_URING
+/// provided receive buffers per set, must be a power of two
+#define HTTP_FD_SET_URING_BUFFERS 256
+/// max accepts in flight at a time
+#define HTTP_FD_SET_URING_ACCEPTS 16
+
+/// operation kinds encoded into the completion user data
+typedef enum {
+    HTTP_FD_URING_OP_ACCEPT = 1,
+    HTTP_FD_URING_OP_RECV,
+    HTTP_FD_URING_OP_POLL,
+    HTTP_FD_URING_OP_SEND,
+    HTTP_FD_URING_OP_CANCEL
+} http_fd_uring_op_t;
+
+/// operations currently armed on a slot
+typedef enum {
+    HTTP_FD_URING_ARMED_RECV = 1 << 0,
+    HTTP_FD_URING_ARMED_POLL = 1 << 1
+} http_fd_uring_armed_t;
+
+uint64_t http_fd_set_uring_user_data(http_fd_set_ref set, const http_fd_uring_op_t op,
+                                     const http_size_t index) {
+    // op (8 bits) | generation (24 bits) | slot (32 bits)
+    uint32_t generation = (index == HTTP_FD_SET_MAIN_INDEX) ? 0 :
+                                                              set->uringGenerations[index];
+    
+    return ((uint64_t)op << 56) | ((uint64_t)(generation & 0xFFFFFF) << 32) | index;
+}
+
+bool http_fd_set_uring_arm(http_fd_set_ref set, const http_fd_uring_op_t op, int sk,
+                           const http_size_t index) {
+    struct io_uring_sqe* sqe = http_uring_get_sqe(set->uring);
+    if (!sqe)
+        return false;
+    
+    sqe->fd = sk;
+    sqe->user_data = http_fd_set_uring_user_data(set, op, index);
+    
+    switch (op) {
+        case HTTP_FD_URING_OP_ACCEPT: {
+            // one client per submission, a multishot accept would take in clients
+            // there's no room for
+            sqe->opcode = IORING_OP_ACCEPT;
+            sqe->accept_flags = SOCK_CLOEXEC;
+            
+            set->uringAccepts++;
+            break;
+        }
+        case HTTP_FD_URING_OP_RECV: {
+            // one submission keeps receiving into provided buffers until cancelled
+            sqe->opcode = IORING_OP_RECV;
+            sqe->ioprio = IORING_RECV_MULTISHOT;
+            sqe->flags = IOSQE_BUFFER_SELECT;
+            sqe->buf_group = HTTP_URING_BUFFER_GROUP;
+            
+            set->uringArmed[index] |= HTTP_FD_URING_ARMED_RECV;
+            break;
+        }
+        case HTTP_FD_URING_OP_POLL: {
+            sqe->opcode = IORING_OP_POLL_ADD;
+            sqe->poll32_events = POLLOUT;
+            
+            set->uringArmed[index] |= HTTP_FD_URING_ARMED_POLL;
+            break;
+        }
+        default:
+            return false;
+    }
+    
+    return true;
+}
+
+void http_fd_set_uring_cancel(http_fd_set_ref set, const http_fd_uring_op_t op,
+                              const http_size_t index) {
+    struct io_uring_sqe* sqe = http_uring_get_sqe(set->uring);
+    if (!sqe)
+        return;
+    
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = http_fd_set_uring_user_data(set, op, index);
+    sqe->user_data = http_fd_set_uring_user_data(set, HTTP_FD_URING_OP_CANCEL, index);
+}
+
+bool http_fd_set_uring_init(http_fd_set_ref set) {
+    if (!http_uring_is_supported())
+        return false;
+    
+    set->uring = http_uring_init(set->clientMax * 2 + 2, HTTP_FD_SET_URING_BUFFERS,
+                                 HTTP_REQUEST_FIELD_SIZE);
+    if (!set->uring)
+        return false;
+    
+    set->uringGenerations = calloc(set->clientMax, sizeof(uint32_t));
+    set->uringArmed = calloc(set->clientMax, sizeof(uint8_t));
+    set->uringUsedBuffers = calloc(set->readyMax, sizeof(uint16_t));
+    
+    return true;
+}
+
+bool http_fd_set_uring_add(http_fd_set_ref set, int sk, const http_size_t index,
+                           const http_fd_event_t events) {
+    // accepts are armed by every wait, as many as there are free slots for
+    if (index == HTTP_FD_SET_MAIN_INDEX)
+        return true;
+    
+    // new client in this slot, forget about the previous one's completions
+    set->uringGenerations[index]++;
+    set->uringArmed[index] = 0;
+    
+    if ((events & HTTP_FD_EVENT_READ) &&
+        !http_fd_set_uring_arm(set, HTTP_FD_URING_OP_RECV, sk, index))
+        return false;
+    if ((events & HTTP_FD_EVENT_WRITE) &&
+        !http_fd_set_uring_arm(set, HTTP_FD_URING_OP_POLL, sk, index))
+        return false;
+    
+    return true;
+}
+
+bool http_fd_set_uring_modify(http_fd_set_ref set, int sk, const http_size_t index,
+                              const http_fd_event_t events) {
+    uint8_t armed = set->uringArmed[index];
+    
+    if ((events & HTTP_FD_EVENT_READ) && !(armed & HTTP_FD_URING_ARMED_RECV))
+        http_fd_set_uring_arm(set, HTTP_FD_URING_OP_RECV, sk, index);
+    else if (!(events & HTTP_FD_EVENT_READ) && (armed & HTTP_FD_URING_ARMED_RECV)) {
+        http_fd_set_uring_cancel(set, HTTP_FD_URING_OP_RECV, index);
+        set->uringArmed[index] &= ~HTTP_FD_URING_ARMED_RECV;
+    }
+    
+    if ((events & HTTP_FD_EVENT_WRITE) && !(armed & HTTP_FD_URING_ARMED_POLL))
+        http_fd_set_uring_arm(set, HTTP_FD_URING_OP_POLL, sk, index);
+    else if (!(events & HTTP_FD_EVENT_WRITE) && (armed & HTTP_FD_URING_ARMED_POLL)) {
+        http_fd_set_uring_cancel(set, HTTP_FD_URING_OP_POLL, index);
+        set->uringArmed[index] &= ~HTTP_FD_URING_ARMED_POLL;
+    }
+    
+    return true;
+}
+
+bool http_fd_set_uring_remove(http_fd_set_ref set, int sk, const http_size_t index) {
+    // nothing's pending on the main socket without accepts in flight (they're only
+    // counted off once their cancellation completes)
+    if (index == HTTP_FD_SET_MAIN_INDEX && set->uringAccepts < 1)
+        return true;
+    
+    struct io_uring_sqe* sqe = http_uring_get_sqe(set->uring);
+    if (!sqe)
+        return false;
+    
+    // cancel everything still pending on the socket
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = sk;
+    sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+    sqe->user_data = http_fd_set_uring_user_data(set, HTTP_FD_URING_OP_CANCEL, index);
+    
+    // whatever still completes for it belongs to a stale generation from now on
+    if (index != HTTP_FD_SET_MAIN_INDEX) {
+        set->uringGenerations[index]++;
+        set->uringArmed[index] = 0;
+    }
+    
+    // the caller is about to close the socket, the cancellation has to find it
+    // still open (pending receives keep the connection alive otherwise)
+    return http_uring_submit(set->uring);
+}
+
+void http_fd_set_uring_complete(http_fd_set_ref set, struct io_uring_cqe* cqe) {
+    http_fd_uring_op_t op = (http_fd_uring_op_t)(cqe->user_data >> 56);
+    uint32_t generation = (uint32_t)(cqe->user_data >> 32) & 0xFFFFFF;
+    http_size_t index = (http_size_t)(cqe->user_data & UINT32_MAX);
+    
+    bool hasBuffer = (cqe->flags & IORING_CQE_F_BUFFER);
+    uint16_t bid = (uint16_t)(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+    bool rearm = !(cqe->flags & IORING_CQE_F_MORE);
+    
+    // buffers are handed back on the next wait, once the data has been consumed
+    if (hasBuffer)
+        set->uringUsedBuffers[set->uringUsedBuffersCount++] = bid;
+    
+    if (op == HTTP_FD_URING_OP_CANCEL)
+        return;
+    
+    if (op == HTTP_FD_URING_OP_ACCEPT) {
+        if (set->uringAccepts > 0)
+            set->uringAccepts--;
+        
+        if (cqe->res >= 0) {
+            http_fd_ready_t* ready = &set->ready[set->readyCount++];
+            
+            ready->sk = cqe->res;
+            ready->index = HTTP_FD_SET_MAIN_INDEX;
+            ready->events = HTTP_FD_EVENT_ACCEPTED;
+        } else if (cqe->res != -ECANCELED)
+            HI_DEBUG("accept failed: %s", strerror(-cqe->res));
+        
+        return;
+    }
+    
+    // the client in this slot is gone
+    if (index >= set->clientMax || set->clientFDs[index] < 0 ||
+        generation != (set->uringGenerations[index] & 0xFFFFFF))
+        return;
+    
+    int sk = set->clientFDs[index];
+    http_fd_ready_t* ready = &set->ready[set->readyCount];
+    
+    ready->sk = sk;
+    ready->index = index;
+    ready->events = HTTP_FD_EVENT_NONE;
+    ready->result = cqe->res;
+    ready->data = NULL;
+    
+    switch (op) {
+        case HTTP_FD_URING_OP_RECV: {
+            if (rearm)
+                set->uringArmed[index] &= ~HTTP_FD_URING_ARMED_RECV;
+            
+            if (cqe->res > 0 && hasBuffer) {
+                ready->events = HTTP_FD_EVENT_DATA;
+                ready->data = http_uring_get_buffer(set->uring, bid);
+            } else if (cqe->res == 0 || (cqe->res < 0 && cqe->res != -ENOBUFS &&
+                                          cqe->res != -ECANCELED)) {
+                // end of stream or an error
+                ready->events = HTTP_FD_EVENT_HANGUP;
+                rearm = false;
+            }
+            
+            // out of buffers or a one-off completion, keep receiving
+            if (rearm && cqe->res != -ECANCELED &&
+                (set->clientEvents[index] & HTTP_FD_EVENT_READ))
+                http_fd_set_uring_arm(set, HTTP_FD_URING_OP_RECV, sk, index);
+            
             break;
         }
+        case HTTP_FD_URING_OP_POLL: {
+            set->uringArmed[index] &= ~HTTP_FD_URING_ARMED_POLL;
+            
+            if (cqe->res >= 0) {
+                ready->events = HTTP_FD_EVENT_WRITE;
+                
+                // level-triggered like the others, keep reporting while asked to
+                if (set->clientEvents[index] & HTTP_FD_EVENT_WRITE)
+                    http_fd_set_uring_arm(set, HTTP_FD_URING_OP_POLL, sk, index);
+            }
+            
+            break;
+        }
+        case HTTP_FD_URING_OP_SEND: {
+            ready->events = HTTP_FD_EVENT_SENT;
+            break;
+        }
+        default:
+            break;
+    }
+    
+    if (ready->events != HTTP_FD_EVENT_NONE)
+        set->readyCount++;
+}
+
+http_ssize_t http_fd_set_uring_wait(http_fd_set_ref set, const int timeoutMs) {
+    // the data of the previous batch has been consumed by now
+    for (http_size_t sz = 0; sz < set->uringUsedBuffersCount; sz++)
+        http_uring_recycle_buffer(set->uring, set->uringUsedBuffers[sz]);
+    
+    set->uringUsedBuffersCount = 0;
+    
+    // the clients of the previous batch have their slots by now, every client accepted
+    // from here on gets one of the free ones
+    http_size_t accepts = (set->freeSlotsCount < HTTP_FD_SET_URING_ACCEPTS) ?
+                          set->freeSlotsCount : HTTP_FD_SET_URING_ACCEPTS;
+    
+    while (set->mainSocket >= 0 && set->uringAccepts < accepts &&
+           http_fd_set_uring_arm(set, HTTP_FD_URING_OP_ACCEPT, set->mainSocket,
+                                 HTTP_FD_SET_MAIN_INDEX));
+    
+    // the one and only syscall: submit everything queued and wait
+    if (!http_uring_submit_and_wait(set->uring, timeoutMs))
+        return -1;
+    
+    struct io_uring_cqe* cqe = NULL;
+    
+    while (set->readyCount < set->readyMax && set->uringUsedBuffersCount < set->readyMax &&
+           (cqe = http_uring_peek_cqe(set->uring))) {
+        http_fd_set_uring_complete(set, cqe);
+        http_uring_cqe_seen(set->uring);
     }
+    
+    return (http_ssize_t)set->readyCount;
+}
+
+bool http_fd_set_uring_send(http_fd_set_ref set, const http_size_t index,
+                            const struct msghdr* message) {
+    struct io_uring_sqe* sqe = http_uring_get_sqe(set->uring);
+    if (!sqe)
+        return false;
+    
+    // one submission for the whole iovec, the kernel retries short sends itself
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = set->clientFDs[index];
+    sqe->addr = (uint64_t)(uintptr_t)message;
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+    sqe->user_data = http_fd_set_uring_user_data(set, HTTP_FD_URING_OP_SEND, index);
+    
+    return true;
+}
+
+void http_fd_set_uring_release(http_fd_set_ref set) {
+    http_uring_release(set->uring);
+    set->uring = NULL;
+    
+    free(set->uringGenerations);
+    free(set->uringArmed);
+    free(set->uringUsedBuffers);
+}
+
+static const http_fd_backend_ops_t http_fd_set_uring_ops = {
+    http_fd_set_uring_init,
+    http_fd_set_uring_add,
+    http_fd_set_uring_modify,
+    http_fd_set_uring_remove,
+    http_fd_set_uring_wait,
+    http_fd_set_uring_release
+};
+#endif
+
+/// gets the backends to try for the requested one, best first, NULL-terminated
+void http_fd_set_get_candidates(const http_backend_t backend,
+                                const http_fd_backend_ops_t** candidates) {
+    http_size_t count = 0;
+
+#ifdef HTTP_FD_SET_HAS_URING
+    if (backend == HTTP_BACKEND_IO_URING)
+        candidates[count++] = &http_fd_set_uring_ops;
+#endif
+
+#ifdef HTTP_FD_SET_HAS_EPOLL
+    if (backend != HTTP_BACKEND_SELECT)
+        candidates[count++] = &http_fd_set_epoll_ops;
+#endif
+    
+    // always there as the last resort
+    candidates[count++] = &http_fd_set_select_ops;
+    candidates[count] = NULL;
+}
+
+http_backend_t http_fd_set_get_ops_backend(const http_fd_backend_ops_t* ops) {
+#ifdef HTTP_FD_SET_HAS_URING
+    if (ops == &http_fd_set_uring_ops)
+        return HTTP_BACKEND_IO_URING;
+#endif
+#ifdef HTTP_FD_SET_HAS_EPOLL
+    if (ops == &http_fd_set_epoll_ops)
+        return HTTP_BACKEND_EPOLL;
+#endif
+    
+    return HTTP_BACKEND_SELECT;
+}
+
+void http_fd_set_update_main(http_fd_set_ref set) {
+    bool full = (set->freeSlotsCount < 1);
+    
+    if (set->mainSocket < 0 || full == set->mainPaused)
+        return;
+    
+    if (full) {
+        set->ops->remove(set, set->mainSocket, HTTP_FD_SET_MAIN_INDEX);
+        
+        // readiness of the current batch would only make the caller accept clients
+        // there's no room for (clients the backend accepted already are reported
+        // anyway, they're open sockets)
+        for (http_size_t sz = 0; sz < set->readyCount; sz++) {
+            if (set->ready[sz].index == HTTP_FD_SET_MAIN_INDEX)
+                set->ready[sz].events &= ~HTTP_FD_EVENT_READ;
+        }
+    } else
+        set->ops->add(set, set->mainSocket, HTTP_FD_SET_MAIN_INDEX, HTTP_FD_EVENT_READ);
+    
+    set->mainPaused = full;
 }
 
 //
 // public
 //
 
-http_fd_set_ref http_fd_set_init(const http_size_t maxClients) {
+http_fd_set_ref http_fd_set_init(const http_size_t maxClients,
+                                 const http_backend_t backend) {
     if (maxClients < 1)
-        return http_fd_set_init(1);
+        return http_fd_set_init(1, backend);
     
     http_fd_set_ref result = hizalloc_struct(http_fd_set_s);
     
-    // initialize array first
+    // initialize arrays first
     result->clientMax = maxClients;
     result->clientFDs = calloc(result->clientMax, sizeof(int));
+    result->clientEvents = calloc(result->clientMax, sizeof(http_fd_event_t));
+    result->freeSlots = calloc(result->clientMax, sizeof(http_size_t));
+    // completion backends may report several events per client
+    result->readyMax = result->clientMax * 2 + 2;
+    result->ready = calloc(result->readyMax, sizeof(http_fd_ready_t));
+    result->mainSocket = -1;
     
-    // clean the fd_set and initialize it too
-    FD_ZERO(&result->managedFDs);
+    for (http_size_t sz = 0; sz < result->clientMax; sz++) {
+        result->clientFDs[sz] = -1;
+        
+        // lowest slots get handed out first
+        result->freeSlots[sz] = result->clientMax - sz - 1;
+    }
+    
+    result->freeSlotsCount = result->clientMax;
+
+#ifdef HTTP_FD_SET_HAS_EPOLL
+    result->epollFD = -1;
+#endif
+    
+    // pick the backend, falling back to the next best one if it is unusable
+    const http_fd_backend_ops_t* candidates[4];
+    http_fd_set_get_candidates(backend, candidates);
+    
+    for (http_size_t sz = 0; candidates[sz]; sz++) {
+        if (candidates[sz]->init(result)) {
+            result->ops = candidates[sz];
+            break;
+        }
+        
+        HI_DEBUG("backend %u unavailable, trying the next one",
+                 http_fd_set_get_ops_backend(candidates[sz]));
+        candidates[sz]->release(result);
+    }
     
+    result->backend = http_fd_set_get_ops_backend(result->ops);
+    
+    HI_DEBUG("fd set <%p> uses backend %u", result, result->backend);
     return result;
 }
 
+http_backend_t http_fd_set_get_backend(http_fd_set_ref set) {
+    return (set ? set->backend : HTTP_BACKEND_AUTO);
+}
+
 void http_fd_set_set_main_socket(http_fd_set_ref set, int sk) {
-    if (!set || sk < 1) {
+    if (!set || sk < 0) {
         HI_DEBUG("invalid set pointer <%p> or socket value <%d>, refusing to set anything",
                  set, sk);
         return;
     }
     
+    // unregister the old one first
+    if (set->mainSocket >= 0 && !set->mainPaused)
+        set->ops->remove(set, set->mainSocket, HTTP_FD_SET_MAIN_INDEX);
+    
     set->mainSocket = sk;
+    set->mainPaused = false;
+    set->ops->add(set, sk, HTTP_FD_SET_MAIN_INDEX, HTTP_FD_EVENT_READ);
+    
+    http_fd_set_update_main(set);
 }
 
-bool http_fd_set_add(http_fd_set_ref set, int sk, bool doFdSet) {
+http_size_t http_fd_set_add(http_fd_set_ref set, int sk, const http_fd_event_t events) {
     if (!set)
-        return false;
-    else if (sk == 0) {
-        HI_DEBUG("NULL socket is an invalid socket, cannot add it to the fd_set <%p>", set);
-        return false;
+        return HTTP_FD_SET_MAIN_INDEX;
+    else if (sk < 0) {
+        HI_DEBUG("invalid socket %d, cannot add it to the fd set <%p>", sk, set);
+        return HTTP_FD_SET_MAIN_INDEX;
+    } else if (set->freeSlotsCount < 1) {
+        HI_DEBUG("fd set <%p> is full (%u clients)", set, set->clientMax);
+        return HTTP_FD_SET_MAIN_INDEX;
     }
     
-    // register it with the set if necessary
-    if (doFdSet)
-        FD_SET(sk, &set->managedFDs);
+    http_size_t index = set->freeSlots[--set->freeSlotsCount];
     
-    // add it to the array too
-    http_fd_set_fill_gap_in_array(set, sk);
-    
-    return true;
-}
-
-int http_fd_set_get_socket(http_fd_set_ref set, const http_size_t index) {
-    if (!set) {
-        HI_DEBUG("NULL set specified, cannot continue");
-        return -1;
-    } else if (index >= set->clientMax) {
-        HI_DEBUG("index out of bounds, cannot continue, index = %u", index);
-        return -1;
+    // register it with the backend
+    if (!set->ops->add(set, sk, index, events)) {
+        set->freeSlotsCount++;
+        return HTTP_FD_SET_MAIN_INDEX;
     }
     
-    return set->clientFDs[index];
+    // add it to the array too
+    set->clientFDs[index] = sk;
+    set->clientEvents[index] = events;
+    set->clientCount++;
+    
+    http_fd_set_update_main(set);
+    return index;
 }
 
-bool http_fd_set_nullify_socket(http_fd_set_ref set, const http_size_t index) {
-    if (http_fd_set_get_socket(set, index) >= 0) {
-        set->clientFDs[index] = 0;
+bool http_fd_set_modify(http_fd_set_ref set, const http_size_t index,
+                        const http_fd_event_t events) {
+    int sk = http_fd_set_get_socket(set, index);
+    if (sk < 0)
+        return false;
+    else if (set->clientEvents[index] == events)
         return true;
-    }
     
-    return false;
+    if (!set->ops->modify(set, sk, index, events))
+        return false;
+    
+    set->clientEvents[index] = events;
+    return true;
 }
 
-bool http_fd_set_sync_descriptors(http_fd_set_ref set) {
-    if (!set)
+bool http_fd_set_remove(http_fd_set_ref set, const http_size_t index) {
+    int sk = http_fd_set_get_socket(set, index);
+    if (sk < 0)
         return false;
     
-    // clean the fd_set
-    FD_ZERO(&set->managedFDs);
+    set->ops->remove(set, sk, index);
     
-    // read main socket to the fd_set
-    FD_SET(set->mainSocket, &set->managedFDs);
-    set->maxFD = set->mainSocket;
+    // free the slot
+    set->clientFDs[index] = -1;
+    set->clientEvents[index] = HTTP_FD_EVENT_NONE;
+    set->freeSlots[set->freeSlotsCount++] = index;
+    set->clientCount--;
     
-    for (http_size_t sz = 0; sz < set->clientMax; sz++) {
-        int clientSocket = set->clientFDs[sz];
-        
-        if (clientSocket > 0) {
-            FD_SET(clientSocket, &set->managedFDs);
-            
-            // new max socket
-            if (clientSocket > set->maxFD)
-                set->maxFD = clientSocket;
-        }
+    http_fd_set_update_main(set);
+    
+    // make sure a stale ready entry from the current batch is not acted upon
+    for (http_size_t sz = 0; sz < set->readyCount; sz++) {
+        if (set->ready[sz].index == index)
+            set->ready[sz].events = HTTP_FD_EVENT_NONE;
     }
     
     return true;
 }
 
-bool http_fd_set_select(http_fd_set_ref set) {
+http_ssize_t http_fd_set_wait(http_fd_set_ref set, const int timeoutMs) {
     if (!set) {
-        HI_DEBUG("NULL set provided as a parameter to select()");
-        return false;
+        HI_DEBUG("NULL set provided as a parameter to wait");
+        return -1;
     }
     
-    int result = select(set->maxFD + 1, &set->managedFDs, NULL, NULL, NULL);
-    if (result < 0 && errno != EINTR) {
-        HI_ERRNO_DEBUG("select failed");
-        return false;
-    }
+    set->readyCount = 0;
+    return set->ops->wait(set, timeoutMs);
+}
+
+http_fd_event_t http_fd_set_get_ready(http_fd_set_ref set, const http_size_t number,
+                                      int* skPtr, http_size_t* indexPtr) {
+    if (!set || number >= set->readyCount)
+        return HTTP_FD_EVENT_NONE;
     
-    return true;
+    http_fd_ready_t* ready = &set->ready[number];
+    
+    if (skPtr)
+        (*skPtr) = ready->sk;
+    if (indexPtr)
+        (*indexPtr) = ready->index;
+    
+    return ready->events;
 }
 
-bool http_fd_set_is_set(http_fd_set_ref set, int sk) {
-    if (!set)
-        return false;
+http_ssize_t http_fd_set_get_data(http_fd_set_ref set, const http_size_t number,
+                                  char** dataPtr) {
+    if (!set || number >= set->readyCount)
+        return -EINVAL;
+    
+    if (dataPtr)
+        (*dataPtr) = set->ready[number].data;
+    
+    return set->ready[number].result;
+}
+
+bool http_fd_set_send(http_fd_set_ref set, const http_size_t index,
+                      const struct msghdr* message) {
+#ifdef HTTP_FD_SET_HAS_URING
+    if (set && set->ops == &http_fd_set_uring_ops && http_fd_set_get_socket(set, index) >= 0)
+        return http_fd_set_uring_send(set, index, message);
+#else
+    HI_UNUSED(set);
+    HI_UNUSED(index);
+    HI_UNUSED(message);
+#endif
+    
+    return false;
+}
+
+int http_fd_set_get_socket(http_fd_set_ref set, const http_size_t index) {
+    if (!set) {
+        HI_DEBUG("NULL set specified, cannot continue");
+        return -1;
+    } else if (index >= set->clientMax) {
+        HI_DEBUG("index out of bounds, cannot continue, index = %u", index);
+        return -1;
+    }
     
-    return FD_ISSET(sk, &set->managedFDs);
+    return set->clientFDs[index];
+}
+
+http_size_t http_fd_set_get_count(http_fd_set_ref set) {
+    return (set ? set->clientCount : 0);
 }
 
 void http_fd_set_release(http_fd_set_ref set) {
@@ -176,17 +953,19 @@ void http_fd_set_release(http_fd_set_ref set) {
     // first go through the list and terminate all potentially unclosed
     // connections
     for (http_size_t sz = 0; sz < set->clientMax; sz++) {
-        if (set->clientFDs[sz] != 0) {
+        if (set->clientFDs[sz] >= 0) {
             close(set->clientFDs[sz]);
-            set->clientFDs[sz] = 0;
+            set->clientFDs[sz] = -1;
         }
     }
     
-    // destroy now clean array
-    free(set->clientFDs);
+    set->ops->release(set);
     
-    // zero-out all managed file descriptors
-    FD_ZERO(&set->managedFDs);
+    // destroy now clean arrays
+    free(set->clientFDs);
+    free(set->clientEvents);
+    free(set->freeSlots);
+    free(set->ready);
     
     free(set);
 }
@@ -8,6 +8,7 @@
 
 #pragma once
 
+#include <sys/socket.h>
 #include "wrappers.h"
 
 //
@@ -17,19 +18,79 @@
 // this is because http_fd_set_ref is not supposed to be used publicly at all
 //
 
-http_fd_set_ref http_fd_set_init(const http_size_t maxClients);
+/// readiness flags reported by (and requested from) the event backend
+typedef enum {
+    HTTP_FD_EVENT_NONE = 0,
+    
+    // socket can be read from (or accepted on, for the main socket)
+    HTTP_FD_EVENT_READ = 1 << 0,
+    // socket can be written to
+    HTTP_FD_EVENT_WRITE = 1 << 1,
+    // peer hung up or the socket is in an error state
+    HTTP_FD_EVENT_HANGUP = 1 << 2,
+    
+    //
+    // completion-based backends (io_uring) do the I/O themselves and report results
+    //
+    
+    // a client was accepted on the main socket, the ready socket is the new client
+    HTTP_FD_EVENT_ACCEPTED = 1 << 3,
+    // data was received into a backend-owned buffer, see http_fd_set_get_data
+    HTTP_FD_EVENT_DATA = 1 << 4,
+    // an http_fd_set_send submission completed, see http_fd_set_get_data
+    HTTP_FD_EVENT_SENT = 1 << 5
+} http_fd_event_t;
+
+/// slot index reported for the main server socket by http_fd_set_get_ready
+#define HTTP_FD_SET_MAIN_INDEX UINT32_MAX
+
+http_fd_set_ref http_fd_set_init(const http_size_t maxClients,
+                                 const http_backend_t backend);
+
+/// returns the backend actually used by the set (never HTTP_BACKEND_AUTO)
+http_backend_t http_fd_set_get_backend(http_fd_set_ref set);
 
 /// set main server socket serving the clients
 void http_fd_set_set_main_socket(http_fd_set_ref set, int sk);
-/// adds the specified socket to the fd_set and the array
-bool http_fd_set_add(http_fd_set_ref set, int sk, bool doFdSet);
-/// sync client connections with the fd_set
-bool http_fd_set_sync_descriptors(http_fd_set_ref set);
 
-bool http_fd_set_select(http_fd_set_ref set);
-bool http_fd_set_is_set(http_fd_set_ref set, int sk);
+/// registers the socket with the backend, returns its slot index or
+/// HTTP_FD_SET_MAIN_INDEX if there is no free slot left. The main socket isn't
+/// watched while there's none
+http_size_t http_fd_set_add(http_fd_set_ref set, int sk, const http_fd_event_t events);
+/// changes the events the backend watches for on the specified slot
+bool http_fd_set_modify(http_fd_set_ref set, const http_size_t index,
+                        const http_fd_event_t events);
+/// unregisters the socket in the specified slot (does not close it)
+bool http_fd_set_remove(http_fd_set_ref set, const http_size_t index);
+
+///
+/// blocks until at least one socket is ready or the timeout (in milliseconds, -1 for
+/// none) expires. Returns the number of ready sockets, which can then be enumerated
+/// via http_fd_set_get_ready, or -1 on failure
+///
+http_ssize_t http_fd_set_wait(http_fd_set_ref set, const int timeoutMs);
+
+/// gets the ready socket number index from the last http_fd_set_wait call
+http_fd_event_t http_fd_set_get_ready(http_fd_set_ref set, const http_size_t number,
+                                      int* skPtr, http_size_t* indexPtr);
+
+///
+/// gets the result of a completion event: amount of bytes received (with dataPtr set
+/// to the data, which stays valid and may be modified until the next
+/// http_fd_set_wait) or sent. Negative values are -errno
+///
+http_ssize_t http_fd_set_get_data(http_fd_set_ref set, const http_size_t number,
+                                  char** dataPtr);
+
+///
+/// asynchronously sends the message on the specified slot if the backend supports it,
+/// reporting HTTP_FD_EVENT_SENT when done. The message and its buffers must stay alive
+/// until then. Returns false if the caller should send by itself
+///
+bool http_fd_set_send(http_fd_set_ref set, const http_size_t index,
+                      const struct msghdr* message);
 
 int http_fd_set_get_socket(http_fd_set_ref set, const http_size_t index);
-bool http_fd_set_nullify_socket(http_fd_set_ref set, const http_size_t index);
+http_size_t http_fd_set_get_count(http_fd_set_ref set);
 
 void http_fd_set_release(http_fd_set_ref set);
@@ -9,6 +9,8 @@
 #include <stdlib.h>
 #include <ctype.h>
 #include <string.h>
+#include <strings.h>
+#include <sys/param.h>
 #include <sys/socket.h>
 #include "headers.h"
 
@@ -16,195 +18,102 @@
 // private
 //
 
-struct http_pair_s {
-    char* key;
-    char* value;
-    
-    http_pair_ref next;
-};
+/// every status code the server knows of, with its reason phrase
+#define HTTP_STATUS_LIST(X) \
+    X(200, "OK") \
+    X(204, "No Content") \
+    X(205, "Reset Content") \
+    X(206, "Partial Content") \
+    X(301, "Moved Permanently") \
+    X(302, "Found") \
+    X(307, "Temporary Redirect") \
+    X(308, "Permanent Redirect") \
+    X(400, "Bad Request") \
+    X(401, "Unauthorized") \
+    X(403, "Forbidden") \
+    X(404, "Not Found") \
+    X(405, "Method Not Allowed") \
+    X(406, "Not Acceptable") \
+    X(408, "Request Timeout") \
+    X(409, "Conflict") \
+    X(410, "Gone") \
+    X(413, "Payload Too Large") \
+    X(414, "URI Too Long") \
+    X(416, "Range Not Satisfiable") \
+    X(418, "I'm a teapot") \
+    X(420, "Enhance Your Calm") \
+    X(431, "Request Header Fields Too Large") \
+    X(500, "Internal Server Error") \
+    X(501, "Not Implemented") \
+    X(502, "Bad Gateway") \
+    X(503, "Service Unavailable") \
+    X(504, "Gateway Timeout") \
+    X(505, "HTTP Version Not Supported")
 
-http_pair_ref http_pair_find_by_key(http_pair_ref first, const char* key,
-                                    http_size_t* countPtr) {
-    http_pair_ref current = first;
-    http_size_t count = 1;
-    
-    while (current) {
-        if (key) {
-            if (strcmp(current->key, key) == 0)
-                return current;
-        }
-        
-        current = current->next;
-        count++;
+const char* http_headers_get_status_line(const http_status_t status,
+                                         http_size_t* lengthPtr) {
+    // the whole HTTP/1.1 status line of every known code is a literal
+    switch ((int)status) {
+#define HTTP_STATUS_LINE(code, reason) \
+        case code: \
+            (*lengthPtr) = sizeof("HTTP/1.1 " #code " " reason "\r\n") - 1; \
+            return "HTTP/1.1 " #code " " reason "\r\n";
+        HTTP_STATUS_LIST(HTTP_STATUS_LINE)
+#undef HTTP_STATUS_LINE
+        default:
+            return NULL;
     }
-    
-    if (countPtr)
-        (*countPtr) = count;
-    
-    return NULL;
 }
 
-http_pair_ref http_pair_init(const char* key, const char* value) {
-    http_pair_ref pair = hizalloc_struct(http_pair_s);
-    
-    pair->key = strdup(key);
-    pair->value = strdup(value);
-    
-    return pair;
+char* http_headers_terminate(char* message, const http_parser_span_t span) {
+    // the byte right after any span is a delimiter nobody needs anymore
+    message[span.offset + span.length] = '\0';
+    return message + span.offset;
 }
 
-void http_pair_chain_release(http_pair_ref pair) {
-    http_pair_ref current = pair;
+bool http_headers_wants_keep_alive(const http_headers_ref request) {
+    if (!request || !request->requestVersion)
+        return false;
     
-    while (current) {
-        http_pair_ref next = current->next;
-        http_pair_release(current);
-        
-        current = next;
+    const char* connection = http_headers_get(request, "Connection");
+    
+    if (connection) {
+        if (strcasestr(connection, "close"))
+            return false;
+        else if (strcasestr(connection, "keep-alive"))
+            return true;
     }
+    
+    // persistent by default since HTTP/1.1 only
+    return (strcmp(request->requestVersion, "HTTP/1.0") != 0);
 }
 
-void http_pair_release(http_pair_ref pair) {
-    if (!pair)
-        return;
-    
-    free(pair->key);
-    free(pair->value);
-    free(pair);
+void http_headers_set_file_length(http_headers_ref headers) {
+    // files might be larger than what set_int takes
+    char lengthStr[24];
+    snprintf(lengthStr, sizeof(lengthStr), "%lld", (long long)headers->bodyFileLength);
+    http_headers_set(headers, "Content-Length", lengthStr);
 }
 
-bool http_headers_parse_request(http_headers_ref headers,
-                                const char* raw,
-                                const http_size_t rawSize) {
-    if (!raw || rawSize < 1) {
-        HI_DEBUG("raw request headers empty, cannot continue");
-        return false;
-    }
+bool http_stream_append(http_stream_ref stream, const void* data, const http_size_t size) {
+    http_size_t required = stream->size + size;
     
-    // state machine
-    http_request_parse_state_t state = HTTP_PARSE_STATE_METHOD;
-    
-    // token for the first few parts
-    char* token = calloc(HTTP_REQUEST_URL_LENGTH, sizeof(char));
-    http_size_t tokenC = 0;
-    
-    for (http_size_t sz = 0; sz < rawSize; sz++) {
-        char current = raw[sz];
-        HI_DEBUG("current = '%c'", current);
+    if (required > stream->capacity) {
+        http_size_t capacity = HI_IF_NULL(stream->capacity, HTTP_REQUEST_FIELD_SIZE);
+        while (capacity < required)
+            capacity *= 2;
         
-        // skip it, it's required by standard but is basically used to support
-        // \r\n platformd
-        if (current == '\r')
-            continue;
+        char* buffer = realloc(stream->buffer, capacity);
+        if (!buffer)
+            return false;
         
-        if (state < HTTP_PARSE_STATE_PAIR) {
-            if (isspace(current) == 0 && tokenC < HTTP_REQUEST_URL_LENGTH)
-                token[tokenC++] = current;
-            else {
-                switch (state) {
-                    case HTTP_PARSE_STATE_METHOD: {
-                        headers->requestType = strdup(token);
-                        break;
-                    }
-                    case HTTP_PARSE_STATE_URI: {
-                        headers->requestURL = strdup(token);
-                        break;
-                    }
-                    case HTTP_PARSE_STATE_VERSION: {
-                        headers->requestVersion = strdup(token);
-                        break;
-                    }
-                    default:
-                        break;
-                }
-                
-                HI_DEBUG("token = \"%s\", state = %u", token, state);
-                
-                // clear token and move on
-                bzero(token, HTTP_REQUEST_URL_LENGTH);
-                tokenC = 0;
-                state++;
-                
-                if (state > HTTP_PARSE_STATE_VERSION)
-                    free(token); // not needed anymore
-                
-            }
-        } else {
-            // header key-value pair
-            char* key = calloc(HTTP_HEADER_LENGTH_MAX, sizeof(char));
-            http_size_t keySize = 0;
-            
-            bool endOfHeaders = false;
-            
-            while (keySize < HTTP_HEADER_LENGTH_MAX) {
-                if (current == '\n') {
-                    // end of headers found
-                    endOfHeaders = true;
-                    break;
-                } else if (current == '\r')
-                    continue;
-                
-                current = raw[sz++];
-                
-                if (current != ':')
-                    key[keySize++] = current;
-                else
-                    break;
-            }
-            
-            if (endOfHeaders) {
-                free(key);
-               
-                // if GET, then nothing left to do
-                // TODO: HEAD, DELETE, OPTIONS also needs nothing in body
-                if (strcmp(headers->requestType, "GET") != 0) {
-                    sz++;
-                    
-                    // read the body
-                    http_size_t leftToRead = rawSize - sz;
-                    const char* rawCL = http_headers_get(headers, "Content-Length");
-                    
-                    // if specified, use Content-Length
-                    if (rawCL)
-                        leftToRead = (http_size_t)atoi(rawCL);
-                    
-                    char* body = calloc(leftToRead, sizeof(char));
-                    memcpy(body, raw + sz, leftToRead);
-                    
-                    // save read body into headers
-                    headers->body = body;
-                    headers->bodyDLC = (http_deallocator_t)free;
-                }
-                
-                break;
-            }
-            
-            // read in value now
-            char* value = calloc(HTTP_REQUEST_URL_LENGTH, sizeof(char));
-            http_size_t valueSize = 0;
-            
-            while (valueSize < HTTP_REQUEST_URL_LENGTH) {
-                current = raw[sz++];
-                
-                if (isspace(current) != 0 && valueSize < 1)
-                    continue;
-                else if (current != '\r' && current != '\n')
-                    value[valueSize++] = current;
-                else
-                    break;
-            }
-            
-            HI_DEBUG("read header \"%s\" (%u) with value (%u): |%s|", key, keySize,
-                     valueSize, value);
-            
-            http_headers_set(headers, key, value);
-            
-            // remove unnecessary items
-            free(key);
-            free(value);
-        }
+        stream->buffer = buffer;
+        stream->capacity = capacity;
     }
     
+    memcpy(stream->buffer + stream->size, data, size);
+    stream->size = required;
+    
     return true;
 }
 
@@ -212,13 +121,76 @@ bool http_headers_parse_request(http_headers_ref headers,
 // public
 //
 
+void http_headers_init_view(http_headers_ref headers, const http_parser_ref parser,
+                            char* message, http_arena_ref arena,
+                            const char* ipAddress, const http_port_t ipPort) {
+    bzero(headers, sizeof(struct http_headers_s));
+    
+    headers->arena = arena;
+    headers->message = message;
+    
+    http_table_init(&headers->fields, arena);
+    
+    // request line
+    headers->requestType = http_headers_terminate(message, parser->method);
+    headers->requestURL = http_headers_terminate(message, parser->url);
+    
+    if (parser->version.length > 0)
+        headers->requestVersion = http_headers_terminate(message, parser->version);
+    
+    // headers, only the table entries themselves are stored
+    for (http_size_t sz = 0; sz < parser->fieldsCount; sz++)
+        http_table_add(&headers->fields, http_headers_terminate(message, parser->fields[sz].key),
+                       http_headers_terminate(message, parser->fields[sz].value), true);
+    
+    // the body stays where it is too
+    if (parser->body.length > 0) {
+        headers->body = message + parser->body.offset;
+        headers->bodySize = parser->body.length;
+    }
+    
+    // the connection keeps the address around for longer than this
+    headers->ipAddress = (char*)ipAddress;
+    headers->port = ipPort;
+}
+
+void http_headers_set_body_file(http_headers_ref headers, int fd, const off_t size) {
+    headers->body = NULL;
+    headers->bodySize = 0;
+    
+    headers->bodyIsFile = true;
+    headers->bodyFD = fd;
+    headers->bodyFileOffset = 0;
+    headers->bodyFileSize = size;
+    headers->bodyFileLength = size;
+}
+
 http_headers_ref http_headers_init_with_request(const char* raw,
                                                 const http_size_t rawSize) {
-    http_headers_ref headers = hizalloc_struct(http_headers_s);
+    struct http_parser_s parser;
+    http_parser_reset(&parser);
+    
+    // it's all in memory already
+    parser.bodyMax = rawSize;
     
     // parse request headers
-    if (!http_headers_parse_request(headers, raw, rawSize))
-        HI_DEBUG("failed to parse headers properly, will move on as is");
+    http_parser_result_t result = http_parser_feed(&parser, raw, rawSize);
+    if (result == HTTP_PARSER_HEADERS_COMPLETE)
+        result = http_parser_feed(&parser, raw, rawSize);
+    
+    if (result != HTTP_PARSER_MESSAGE_COMPLETE) {
+        HI_DEBUG("failed to parse the request, will return NULL");
+        return NULL;
+    }
+    
+    // the view needs its own copy of the message
+    char* message = malloc(parser.position + 1);
+    memcpy(message, raw, parser.position);
+    
+    http_headers_ref headers = hizalloc_struct(http_headers_s);
+    http_headers_init_view(headers, &parser, message, NULL, NULL, 0);
+    
+    headers->ownsMessage = true;
     
     return headers;
 }
@@ -228,7 +200,12 @@ http_headers_ref http_headers_init_with_response(const http_status_t status,
                                                  void* body,
                                                  const http_size_t bodySize,
                                                  const http_deallocator_t bodyDLC) {
-    http_headers_ref headers = hizalloc_struct(http_headers_s);
+    // responses made while handling a request go away together with it
+    http_arena_ref arena = http_arena_get_current();
+    http_headers_ref headers = arena ? http_arena_zalloc_struct(arena, http_headers_s) :
+                                       hizalloc_struct(http_headers_s);
+    headers->arena = arena;
+    http_table_init(&headers->fields, arena);
     
     // set the appropriate headers
     http_headers_set(headers, "Content-Type", HI_IF_NULL(contentType, "application/octet-stream"));
@@ -236,19 +213,154 @@ http_headers_ref http_headers_init_with_response(const http_status_t status,
     
     // set body and status
     headers->body = body;
+    headers->bodySize = body ? bodySize : 0;
     headers->bodyDLC = bodyDLC;
     
     headers->statusCode = status;
     return headers;
 }
 
+http_headers_ref http_headers_init_with_file(const http_status_t status,
+                                             const char* contentType,
+                                             const int fd,
+                                             const off_t offset,
+                                             const off_t size,
+                                             const http_file_closer_t closer,
+                                             void* closerData) {
+    http_headers_ref headers = http_headers_init_with_response(status, contentType, NULL, 0, NULL);
+    
+    headers->bodyIsFile = true;
+    headers->bodyFD = fd;
+    headers->bodyFileOffset = offset;
+    headers->bodyFileSize = size;
+    headers->bodyFileLength = size;
+    headers->bodyFileCloser = closer;
+    headers->bodyFileCloserData = closerData;
+    
+    http_headers_set_file_length(headers);
+    return headers;
+}
+
+bool http_headers_add_file_part(http_headers_ref headers,
+                                const char* prefix,
+                                const http_size_t prefixSize,
+                                const off_t offset,
+                                const off_t size) {
+    if (!headers || !headers->bodyIsFile || size < 0 || (prefixSize > 0 && !prefix))
+        return false;
+    
+    http_file_part_ref part = http_headers_alloc(headers, sizeof(struct http_file_part_s));
+    part->prefix = prefix;
+    part->prefixSize = prefixSize;
+    part->offset = offset;
+    part->size = size;
+    part->next = NULL;
+    
+    if (headers->bodyFileLastPart)
+        headers->bodyFileLastPart->next = part;
+    else
+        headers->bodyFileParts = part;
+    
+    headers->bodyFileLastPart = part;
+    headers->bodyFileLength += (off_t)prefixSize + size;
+    
+    http_headers_set_file_length(headers);
+    return true;
+}
+
+http_headers_ref http_headers_init_with_stream(const http_status_t status,
+                                               const char* contentType,
+                                               const http_stream_producer_t producer,
+                                               void* data,
+                                               const http_deallocator_t dataDLC) {
+    if (!producer) {
+        HI_DEBUG("streamed responses need a producer, will return NULL");
+        return NULL;
+    }
+    
+    http_headers_ref headers = http_headers_init_with_response(status, contentType, NULL, 0, NULL);
+    
+    // the length isn't known up front
+    http_headers_remove(headers, "Content-Length");
+    http_headers_set(headers, "Transfer-Encoding", "chunked");
+    
+    headers->bodyIsStream = true;
+    headers->bodyStream.producer = producer;
+    headers->bodyStream.data = data;
+    headers->bodyStream.dataDLC = dataDLC;
+    headers->bodyStream.chunked = true;
+    
+    return headers;
+}
+
+bool http_stream_write(http_stream_ref stream,
+                       const void* data,
+                       const http_size_t size) {
+    if (!stream || (size > 0 && !data) || stream->finished)
+        return false;
+    else if (size < 1)
+        return true; // an empty chunk would end the body
+    else if (!stream->chunked)
+        return http_stream_append(stream, data, size);
+    
+    // hex size line, the data and its line break
+    char sizeLine[16];
+    int sizeLineLength = snprintf(sizeLine, sizeof(sizeLine), "%x\r\n", size);
+    
+    return (http_stream_append(stream, sizeLine, (http_size_t)sizeLineLength) &&
+            http_stream_append(stream, data, size) &&
+            http_stream_append(stream, "\r\n", 2));
+}
+
+bool http_stream_produce(http_stream_ref stream) {
+    stream->size = 0;
+    
+    if (!stream->producer(stream, stream->data)) {
+        // the last chunk is an empty one
+        if (stream->chunked && !http_stream_append(stream, "0\r\n\r\n", 5))
+            return false;
+        
+        stream->finished = true;
+        return true;
+    }
+    
+    // would be called over and over again otherwise
+    return (stream->size > 0);
+}
+
+int64_t http_headers_get_body_length(const http_headers_ref headers) {
+    if (headers->bodyIsStream)
+        return -1;
+    else if (headers->bodyIsFile)
+        return (int64_t)headers->bodyFileLength;
+    
+    return (int64_t)headers->bodySize;
+}
+
+http_stream_ref http_headers_get_stream(const http_headers_ref headers) {
+    return (headers && headers->bodyIsStream) ? &headers->bodyStream : NULL;
+}
+
+void http_stream_set_unframed(http_headers_ref headers) {
+    http_headers_remove(headers, "Transfer-Encoding");
+    headers->bodyStream.chunked = false;
+}
+
 const char* http_headers_get(const http_headers_ref headers,
                              const char* key) {
     if (!headers || !key)
         return NULL;
     
-    http_pair_ref result = http_pair_find_by_key(headers->first, key, NULL);
-    return (result ? result->value : NULL);
+    return http_table_get(&headers->fields, key, 0);
+}
+
+const char* http_headers_get_nth(const http_headers_ref headers,
+                                 const char* key,
+                                 const http_size_t number) {
+    if (!headers || !key)
+        return NULL;
+    
+    return http_table_get(&headers->fields, key, number);
 }
 
 void http_headers_debug_dump(http_headers_ref headers) {
@@ -259,55 +371,91 @@ void http_headers_debug_dump(http_headers_ref headers) {
             HI_DEBUG("%s %s %s", headers->requestType, headers->requestURL,
                      HI_IF_NULL(headers->requestVersion, "HTTP/1.0"));
         
-        http_pair_ref current = headers->first;
+        const http_table_entry_t* entries = http_table_get_entries(&headers->fields);
         
-        while (current) {
-            HI_DEBUG("%s: %s", current->key, current->value);
-            current = current->next;
+        for (http_size_t sz = 0; sz < headers->fields.count; sz++) {
+            if (entries[sz].value)
+                HI_DEBUG("%s: %s", entries[sz].key, entries[sz].value);
         }
         
         if (headers->ipAddress)
             HI_DEBUG("requested from %s with port %u", headers->ipAddress,
                      headers->port);
         
-        if (headers->body)
+        if (headers->body && !headers->message)
             HI_DEBUG("body:\n%s", (char*)headers->body);
     }
 }
 
+bool http_headers_get_field(const http_headers_ref headers,
+                            const http_size_t number,
+                            const char** keyPtr,
+                            const char** valuePtr) {
+    if (!headers)
+        return false;
+    
+    const http_table_entry_t* entries = http_table_get_entries(&headers->fields);
+    http_size_t found = 0;
+    
+    // removed entries don't count
+    for (http_size_t sz = 0; sz < headers->fields.count; sz++) {
+        if (!entries[sz].value || found++ < number)
+            continue;
+        
+        if (keyPtr)
+            (*keyPtr) = entries[sz].key;
+        if (valuePtr)
+            (*valuePtr) = entries[sz].value;
+        
+        return true;
+    }
+    
+    return false;
+}
+
 bool http_headers_set(http_headers_ref headers,
                       const char* key,
                       const char* value) {
     if (!headers || !key || strlen(key) < 1 || !value) {
-        HI_DEBUG("self <%p>, key <%p> or value <%p> invalid, not doing anything");
+        HI_DEBUG("self <%p>, key <%p> or value <%p> invalid, not doing anything", headers, key,
+                 value);
         return false;
     }
     
-    http_pair_ref last = http_pair_find_by_key(headers->first, key, NULL);
-    if (last) {
-        // replace value
-        free(last->value);
-        last->value = strdup(value);
-    } else if (!headers->first)
-        headers->first = http_pair_init(key, value);
-    else {
-        // insert self as second
-        http_pair_ref newNext = headers->first->next;
-        headers->first->next = http_pair_init(key, value);
-        headers->first->next->next = newNext;
+    return http_table_set(&headers->fields, key, value);
+}
+
+bool http_headers_add(http_headers_ref headers,
+                      const char* key,
+                      const char* value) {
+    if (!headers || !key || strlen(key) < 1 || !value) {
+        HI_DEBUG("self <%p>, key <%p> or value <%p> invalid, not doing anything", headers, key,
+                 value);
+        return false;
     }
     
-    return true;
+    // another value of a possibly repeated header, like Set-Cookie
+    return http_table_add(&headers->fields, key, value, false);
+}
+
+bool http_headers_remove(http_headers_ref headers,
+                         const char* key) {
+    if (!headers || !key) {
+        HI_DEBUG("self <%p> or key <%p> invalid, not doing anything", headers, key);
+        return false;
+    }
+    
+    return http_table_remove(&headers->fields, key);
 }
 
 bool http_headers_set_int(http_headers_ref headers,
                           const char* key,
                           const http_ssize_t value) {
     // convert to int and set the value
-    char* valueStr = hiitoa(value);
-    bool result = http_headers_set(headers, key, valueStr);
+    char valueStr[HI_ITOA_MAX];
+    hiitoa_in(valueStr, value);
     
-    return result;
+    return http_headers_set(headers, key, valueStr);
 }
 
 void http_headers_set_client_info(http_headers_ref headers,
@@ -316,8 +464,11 @@ void http_headers_set_client_info(http_headers_ref headers,
     if (!headers)
         return;
     
-    // clean up in advance
-    free(headers->ipAddress);
+    // clean up in advance, views borrow the address from the connection
+    if (!headers->message || headers->ownsMessage)
+        free(headers->ipAddress);
+    
+    headers->ipAddress = NULL;
     headers->port = 0;
     
     // set IP if necessary
@@ -336,81 +487,210 @@ const char* http_headers_get_request_url(const http_headers_ref headers) {
 }
 
 const char* http_headers_get_request_version(const http_headers_ref headers) {
-    return (headers ? headers->requestVersion : "HTTP/1.1");
+    if (!headers)
+        return "HTTP/1.1";
+    
+    // request lines without a version are as old as it gets, at most HTTP/1.0
+    return HI_IF_NULL(headers->requestVersion, "HTTP/1.0");
 }
 
 const char* http_headers_get_client_info(const http_headers_ref headers) {
     return (headers ? headers->ipAddress : NULL);
 }
 
-char* http_headers_get_response(const http_headers_ref headers,
-                                http_size_t* sizePtr) {
+char* http_headers_get_response_in(const http_headers_ref headers, http_arena_ref arena,
+                                   http_size_t* sizePtr) {
     if (!headers) {
         HI_DEBUG("NULL headers, cannot generate reponse");
         return NULL;
     }
     
-    char* heading = calloc(HTTP_HEADER_LENGTH_MAX, sizeof(char));
+    // first the main entry, ready-made for the usual version and known codes
+    const char* version = HI_IF_NULL(headers->requestVersion, "HTTP/1.1");
+    http_size_t statusLineLength = 0;
+    const char* statusLine = NULL;
+    char customStatusLine[HTTP_HEADER_LENGTH_MAX];
+    
+    if (strcmp(version, "HTTP/1.1") == 0)
+        statusLine = http_headers_get_status_line(headers->statusCode, &statusLineLength);
+    
+    if (!statusLine) {
+        int customLength = snprintf(customStatusLine, sizeof(customStatusLine),
+                                    "%s %u %s\r\n", version, headers->statusCode,
+                                    http_status_get_reason(headers->statusCode));
+        
+        statusLine = customStatusLine;
+        statusLineLength = (http_size_t)MIN(customLength, (int)sizeof(customStatusLine) - 1);
+    }
+    
+    // the current date, unless the callback set one already
+    http_size_t dateLength = 0;
+    const char* date = NULL;
+    
+    if (!http_table_get(&headers->fields, "Date", 0))
+        date = hi_get_http_date(&dateLength);
+    
+    // measure first, so that it's allocated just once
+    const http_table_entry_t* entries = http_table_get_entries(&headers->fields);
+    size_t length = statusLineLength + 2;
+    
+    if (date)
+        length += 6 + dateLength + 2;
+    
+    for (http_size_t sz = 0; sz < headers->fields.count; sz++) {
+        if (entries[sz].value)
+            length += entries[sz].keyLength + 4 + entries[sz].valueLength;
+    }
     
-    // first the main entry (TODO: proper status code strings)
-    sprintf(heading, "%s %u OK\r\n", HI_IF_NULL(headers->requestVersion, "HTTP/1.1"),
-            headers->statusCode);
+    char* heading = arena ? http_arena_alloc(arena, length + 1) : malloc(length + 1);
+    char* position = heading;
     
-    http_size_t length = (http_size_t)strlen(heading);
+    memcpy(position, statusLine, statusLineLength);
+    position += statusLineLength;
     
-    // add each header to the heading
-    http_pair_ref current = headers->first;
+    if (date) {
+        memcpy(position, "Date: ", 6);
+        memcpy(position + 6, date, dateLength);
+        memcpy(position + 6 + dateLength, "\r\n", 2);
+        
+        position += 6 + dateLength + 2;
+    }
     
-    while (current) {
-        strcat(heading, current->key);
-        strcat(heading, ": ");
-        strcat(heading, current->value);
-        strcat(heading, "\r\n");
+    // add each header to the heading, in the order they were set
+    for (http_size_t sz = 0; sz < headers->fields.count; sz++) {
+        const http_table_entry_t* entry = &entries[sz];
+        
+        if (!entry->value)
+            continue;
+        
+        size_t valueLength = entry->valueLength;
+        
+        memcpy(position, entry->key, entry->keyLength);
+        memcpy(position + entry->keyLength, ": ", 2);
+        memcpy(position + entry->keyLength + 2, entry->value, valueLength);
+        memcpy(position + entry->keyLength + 2 + valueLength, "\r\n", 2);
         
-        length += strlen(current->key) + 4 + strlen(current->value);
-        current = current->next;
+        position += entry->keyLength + 4 + valueLength;
     }
     
-    strcat(heading, "\r\n");
-    length += 2;
-   
+    memcpy(position, "\r\n\0", 3);
+    
     // save size
     if (sizePtr)
-        (*sizePtr) = length;
+        (*sizePtr) = (http_size_t)length;
     
     return heading;
 }
 
+char* http_headers_get_response(const http_headers_ref headers,
+                                http_size_t* sizePtr) {
+    return http_headers_get_response_in(headers, NULL, sizePtr);
+}
+
+const char* http_status_get_reason(const http_status_t status) {
+    switch ((int)status) {
+#define HTTP_STATUS_REASON(code, reason) \
+        case code: \
+            return reason;
+        HTTP_STATUS_LIST(HTTP_STATUS_REASON)
+#undef HTTP_STATUS_REASON
+        default:
+            return "Unknown";
+    }
+}
+
 void* http_headers_get_body(const http_headers_ref headers,
                             http_size_t* sizePtr) {
-    // TODO: optimize
     if (!headers || !headers->body)
         return NULL;
     
     // set size
     if (sizePtr)
-        (*sizePtr) = atoi(HI_IF_NULL(http_headers_get(headers, "Content-Length"), "0"));
+        (*sizePtr) = headers->bodySize;
     
     return headers->body;
 }
 
-void http_headers_release(http_headers_ref headers) {
+int http_headers_get_file(const http_headers_ref headers,
+                          off_t* offsetPtr,
+                          off_t* sizePtr) {
+    if (!headers || !headers->bodyIsFile)
+        return -1;
+    
+    if (offsetPtr)
+        (*offsetPtr) = headers->bodyFileOffset;
+    if (sizePtr)
+        (*sizePtr) = headers->bodyFileSize;
+    
+    return headers->bodyFD;
+}
+
+http_file_part_ref http_headers_get_file_parts(const http_headers_ref headers) {
+    return (headers && headers->bodyIsFile) ? headers->bodyFileParts : NULL;
+}
+
+void* http_headers_alloc(http_headers_ref headers, const http_size_t size) {
+    if (!headers)
+        return NULL;
+    else if (headers->arena)
+        return http_arena_alloc(headers->arena, size);
+    
+    // standalone objects get an arena of their own on demand
+    if (!headers->userArena)
+        headers->userArena = http_arena_init(HTTP_ARENA_CHUNK_SIZE);
+    
+    return http_arena_alloc(headers->userArena, size);
+}
+
+void http_headers_deinit(http_headers_ref headers) {
     if (!headers)
         return;
     
     // delete all keys first
-    http_pair_chain_release(headers->first);
-    headers->first = NULL;
+    http_table_deinit(&headers->fields);
+    
+    if (!headers->message) {
+        // free all strings
+        free(headers->requestType);
+        free(headers->requestURL);
+        free(headers->requestVersion);
+    } else if (headers->ownsMessage)
+        free(headers->message);
     
-    // free all strings
-    free(headers->ipAddress);
-    free(headers->requestType);
-    free(headers->requestURL);
-    free(headers->requestVersion);
+    if (!headers->message || headers->ownsMessage)
+        free(headers->ipAddress);
     
     // deallocate raw body if necessary
     if (headers->bodyDLC)
         headers->bodyDLC(headers->body);
     
-    free(headers);
+    // and streams
+    if (headers->bodyIsStream) {
+        free(headers->bodyStream.buffer);
+        
+        if (headers->bodyStream.dataDLC)
+            headers->bodyStream.dataDLC(headers->bodyStream.data);
+    }
+    
+    headers->bodyIsStream = false;
+    
+    // same for files
+    if (headers->bodyIsFile && headers->bodyFileCloser)
+        headers->bodyFileCloser(headers->bodyFD, headers->bodyFileCloserData);
+    
+    headers->bodyIsFile = false;
+    
+    http_arena_release(headers->userArena);
+    headers->userArena = NULL;
+}
+
+void http_headers_release(http_headers_ref headers) {
+    if (!headers)
+        return;
+    
+    http_headers_deinit(headers);
+    
+    // the arena owns the object itself too
+    if (!headers->arena)
+        free(headers);
 }
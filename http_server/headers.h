@@ -9,13 +9,44 @@
 #pragma once
 
 #include "wrappers.h"
+#include "parser.h"
+#include "arena.h"
+#include "table.h"
 
-/// internally-used key-value storing object
-typedef struct http_pair_s* http_pair_ref;
+/// further part of a file body, see http_headers_add_file_part
+typedef struct http_file_part_s* http_file_part_ref;
+
+struct http_file_part_s {
+    // memory going out right before the slice of the file
+    const char* prefix;
+    http_size_t prefixSize;
+    
+    off_t offset;
+    off_t size;
+    
+    http_file_part_ref next;
+};
+
+/// state of a streamed body, see http_headers_init_with_stream
+struct http_stream_s {
+    http_stream_producer_t producer;
+    void* data;
+    http_deallocator_t dataDLC;
+    
+    // what the current producer call wrote (framed as chunks), reused for every call
+    char* buffer;
+    http_size_t size;
+    http_size_t capacity;
+    
+    // false if the body goes out unframed (HTTP/1.0 clients)
+    bool chunked;
+    // true once the producer is done and the end of the body has been written
+    bool finished;
+};
 
 struct http_headers_s {
-    // first header reference
-    http_pair_ref first;
+    // header fields
+    struct http_table_s fields;
     
     // HTTP status code
     http_status_t statusCode;
@@ -29,39 +60,95 @@ struct http_headers_s {
     
     // raw body contents
     void* body;
+    // size of the body in bytes, kept apart from Content-Length so that binary
+    // bodies are never measured with strlen or atoi
+    http_size_t bodySize;
     // raw body deallocator
     http_deallocator_t bodyDLC;
     
+    // true if the body is a part of a file instead
+    bool bodyIsFile;
+    int bodyFD;
+    off_t bodyFileOffset;
+    off_t bodyFileSize;
+    // parts sent after the first one (allocated with the headers) and the length of
+    // the whole body
+    http_file_part_ref bodyFileParts;
+    http_file_part_ref bodyFileLastPart;
+    off_t bodyFileLength;
+    // releases bodyFD once the response is done with
+    http_file_closer_t bodyFileCloser;
+    void* bodyFileCloserData;
+    
+    // true if the body is produced while it's sent instead
+    bool bodyIsStream;
+    struct http_stream_s bodyStream;
+    
+    // set on placeholders returned by http_headers_init_deferred
+    http_deferred_ref deferred;
+    
     // client IP address
     char* ipAddress;
     // client port
     http_port_t port;
+    
+    // arena the object and everything it holds were allocated from, freed all at
+    // once with the arena (NULL for standalone objects)
+    http_arena_ref arena;
+    // arena created for http_headers_alloc calls on standalone objects, owned
+    http_arena_ref userArena;
+    
+    //
+    // requests are views: the strings above and the headers below point right into
+    // the message they were parsed from, nothing is copied
+    //
+    
+    // received message, NULL for responses
+    char* message;
+    // true if message belongs to this object, otherwise it is owned by the
+    // connection and only valid during the callback
+    bool ownsMessage;
 };
 
-typedef enum {
-    // GET, POST, misc
-    HTTP_PARSE_STATE_METHOD = 0,
-    // URI
-    HTTP_PARSE_STATE_URI,
-    // HTTP version
-    HTTP_PARSE_STATE_VERSION,
-    
-    // header key-pair
-    HTTP_PARSE_STATE_PAIR
-} http_request_parse_state_t;
+///
+/// turns the (uninitialized) headers into a view of a request the parser is done
+/// with, without allocating anything. The message is NUL-terminated in place, so
+/// it must be writable, and both it and the parser must outlive the view
+///
+void http_headers_init_view(http_headers_ref headers, const http_parser_ref parser,
+                            char* message, http_arena_ref arena,
+                            const char* ipAddress, const http_port_t ipPort);
 
-bool http_headers_parse_request(http_headers_ref headers,
-                                const char* raw,
-                                const http_size_t rawSize);
+/// makes the view's body the first size bytes of the file instead of the message,
+/// the fd is not closed with it
+void http_headers_set_body_file(http_headers_ref headers, int fd, const off_t size);
 
-//
-// pair-related
-//
+/// serializes the status line and the headers into memory from the arena (or malloc,
+/// if the arena is NULL)
+char* http_headers_get_response_in(const http_headers_ref headers, http_arena_ref arena,
+                                   http_size_t* sizePtr);
+
+/// gets the parts of a file response's body that follow the first one
+http_file_part_ref http_headers_get_file_parts(const http_headers_ref headers);
+
+/// gets the amount of body bytes of a response, -1 if that's not known (streams)
+int64_t http_headers_get_body_length(const http_headers_ref headers);
+
+/// gets the state of a streamed body, NULL for other responses
+http_stream_ref http_headers_get_stream(const http_headers_ref headers);
+
+///
+/// empties the stream's buffer and calls the producer for the next part of the body,
+/// ending the body once it's done. False if it wrote nothing without being done, or
+/// if it failed to write
+///
+bool http_stream_produce(http_stream_ref stream);
 
-http_pair_ref http_pair_init(const char* key, const char* value);
+/// sends the body unframed, for clients not knowing chunked transfer coding
+void http_stream_set_unframed(http_headers_ref headers);
 
-http_pair_ref http_pair_find_by_key(http_pair_ref first, const char* key,
-                                    http_size_t* countPtr);
+/// releases everything the headers own except for the object itself
+void http_headers_deinit(http_headers_ref headers);
 
-void http_pair_chain_release(http_pair_ref pair);
-void http_pair_release(http_pair_ref pair);
+/// true if the connection should stay open after answering the request
+bool http_headers_wants_keep_alive(const http_headers_ref request);
@@ -10,6 +10,7 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <sys/types.h>
 
 //
 // constant values
@@ -18,14 +19,36 @@
 /// default max clients value for the HTTP server
 #define HTTP_CLIENTS_MAX 30
 /// default pending connections limit for the HTTP server
-#define HTTP_PENDING_CONNECTIONS_MAX 1
+#define HTTP_PENDING_CONNECTIONS_MAX 128
 /// default request field size limit for the HTTP server
 #define HTTP_REQUEST_FIELD_SIZE 4096
 /// default acceptable URL length size
 #define HTTP_REQUEST_URL_LENGTH 2048
+/// max size of the request line and headers together
+#define HTTP_REQUEST_HEADERS_MAX 16384
+/// max size of a whole request (headers and body) the server will buffer
+#define HTTP_REQUEST_SIZE_MAX (1024 * 1024)
+/// default max size of a request body, larger ones are rejected before they're read
+#define HTTP_REQUEST_BODY_MAX (1024 * 1024)
+/// default size above which request bodies are written to a temporary file instead
+/// of being buffered
+#define HTTP_REQUEST_BODY_SPILL_SIZE (64 * 1024)
+/// unsent response bytes (file bodies included) at which a connection stops reading
+/// further requests, until the client takes its answers
+#define HTTP_OUTPUT_HIGH_WATERMARK (1024 * 1024)
+/// unsent response bytes at which a paused connection reads requests again
+#define HTTP_OUTPUT_LOW_WATERMARK (256 * 1024)
+
+/// default idle time (in seconds) after which keep-alive connections are closed
+#define HTTP_KEEP_ALIVE_TIMEOUT 5
+/// default max amount of requests served over one keep-alive connection
+#define HTTP_KEEP_ALIVE_REQUESTS_MAX 1000
 
 #define HTTP_HEADER_LENGTH_MAX 128
 
+/// room for an IMF-fixdate ("Sun, 06 Nov 1994 08:49:37 GMT") and its terminator
+#define HTTP_DATE_MAX 30
+
 //
 // default constant IP address values (IPv4)
 //
@@ -47,9 +70,25 @@ typedef int32_t http_ssize_t;
 /// memory management
 typedef void (*http_deallocator_t)(void*);
 
+/// callback releasing the file of a file response (e.g. closing it) once it's sent
+typedef void (*http_file_closer_t)(const int fd, void* closerData);
+
 /// HTTP server port value
 typedef uint16_t http_port_t;
 
+/// event notification backend used by the server's event loop
+typedef enum {
+    // best backend available on this platform
+    HTTP_BACKEND_AUTO = 0,
+    // portable select(), limited to FD_SETSIZE descriptors
+    HTTP_BACKEND_SELECT,
+    // Linux epoll, only available on Linux
+    HTTP_BACKEND_EPOLL,
+    // Linux io_uring with multishot receive, falls back to epoll on older
+    // kernels (< 6.0)
+    HTTP_BACKEND_IO_URING
+} http_backend_t;
+
 /// HTTP server status codes
 typedef enum {
     HTTP_OK = 200,
@@ -79,6 +118,8 @@ typedef enum {
     // 410s - processing issues
     HTTP_PAYLOAD_TOO_LARGE = 413,
     HTTP_URL_TOO_LONG = 414,
+    HTTP_RANGE_NOT_SATISFIABLE = 416,
+    HTTP_HEADERS_TOO_LARGE = 431,
     
     // 500s - server errors
     HTTP_INTERNAL_SERVER_ERROR = 500,
@@ -93,6 +134,43 @@ typedef enum {
     HTTP_RESERVED = 420
 } http_status_t;
 
+/// buckets of a latency histogram: 8 per power of two, so any value is off by at
+/// most 12.5%
+#define HTTP_HISTOGRAM_BUCKETS 496
+
+/// HDR-style latency histogram, all values are in nanoseconds
+typedef struct {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+    uint64_t buckets[HTTP_HISTOGRAM_BUCKETS];
+} http_histogram_t;
+
+/// status classes of http_stats_t's requests, 1xx to 5xx
+#define HTTP_STATUS_CLASSES 5
+
+/// what the server has been doing since it started listening, see http_server_get_stats
+typedef struct {
+    uint64_t connectionsAccepted;
+    uint64_t connectionsClosed;
+    uint64_t connectionsActive;
+    
+    // answered requests by status class, [0] for 1xx up to [4] for 5xx
+    uint64_t requests[HTTP_STATUS_CLASSES];
+    // requests rejected as malformed or too large (also counted in requests)
+    uint64_t parseErrors;
+    
+    uint64_t bytesIn;
+    uint64_t bytesOut;
+    
+    // parsing a request, from its response's callback call until it's there (for
+    // deferred ones, until it's handed over) and from then on until the last byte of
+    // it is given to the kernel
+    http_histogram_t parseTime;
+    http_histogram_t callbackTime;
+    http_histogram_t sendTime;
+} http_stats_t;
+
 //
 // complex types
 //
@@ -106,6 +184,19 @@ typedef struct http_headers_s* http_headers_ref;
 /// HTTP server control object
 typedef struct http_server_s* http_server_ref;
 
+/// request whose response is handed to the server later, see http_headers_init_deferred
+typedef struct http_deferred_s* http_deferred_ref;
+
+/// body of a response generated while it's sent, see http_headers_init_with_stream
+typedef struct http_stream_s* http_stream_ref;
+
+///
+/// producer of a streamed body, called whenever the client has taken everything
+/// written so far. Writes the next part with http_stream_write and returns true, or
+/// returns false once the body is complete (possibly after writing its last part)
+///
+typedef bool (*http_stream_producer_t)(http_stream_ref stream, void* data);
+
 /// HTTP server central route callback
 typedef http_headers_ref (*http_callback_t)(const http_headers_ref,
                                             void*);
@@ -130,15 +221,97 @@ http_headers_ref http_headers_init_with_response(const http_status_t status,
                                                  void* body,
                                                  const http_size_t bodySize,
                                                  const http_deallocator_t bodyDLC);
+///
+/// initializes a HTTP/1.1 response whose body is size bytes of the open file starting
+/// at offset. The server sends them right from the file with sendfile(), so nothing
+/// is read into memory. Once the server is done with the file, the closer (if not
+/// NULL) is called with the descriptor and closerData
+///
+http_headers_ref http_headers_init_with_file(const http_status_t status,
+                                             const char* contentType,
+                                             const int fd,
+                                             const off_t offset,
+                                             const off_t size,
+                                             const http_file_closer_t closer,
+                                             void* closerData);
+
+///
+/// appends another part of the same file to the body of a file response: prefixSize
+/// bytes of prefix followed by size bytes of the file at offset (size may be 0 to
+/// only send the prefix). That's how multipart/byteranges bodies are put together.
+/// The prefix is not copied, so allocate it with http_headers_alloc
+///
+bool http_headers_add_file_part(http_headers_ref headers,
+                                const char* prefix,
+                                const http_size_t prefixSize,
+                                const off_t offset,
+                                const off_t size);
 
-/// retreives the value of the specified header or NULL if it doesn't exist
+///
+/// initializes a HTTP/1.1 response whose body is produced piece by piece while it is
+/// sent, with Transfer-Encoding: chunked instead of a Content-Length (HTTP/1.0 clients
+/// get the body unframed and the connection is closed after it). The producer is
+/// called once as the response is queued and then again whenever its output is out,
+/// so only one part of the body is in memory at a time. Once the response is done
+/// with, dataDLC (if not NULL) is called with data
+///
+http_headers_ref http_headers_init_with_stream(const http_status_t status,
+                                               const char* contentType,
+                                               const http_stream_producer_t producer,
+                                               void* data,
+                                               const http_deallocator_t dataDLC);
+
+/// appends size bytes to a streamed body (as one chunk), only valid within its producer
+bool http_stream_write(http_stream_ref stream,
+                       const void* data,
+                       const http_size_t size);
+
+///
+/// lets the callback answer a request later instead of right away, e.g. once some
+/// other process is done with it: the callback returns what this returns and gives
+/// the real response to http_deferred_respond whenever it's ready. Anything the
+/// request points to is only valid during the callback, so copy whatever's needed.
+/// Responses to requests pipelined behind it wait for it, in order
+///
+http_headers_ref http_headers_init_deferred(const http_headers_ref request,
+                                            http_deferred_ref* deferredPtr);
+
+///
+/// answers a deferred request, taking ownership of the response. Can be called from
+/// any thread, exactly once per deferred request. If the client is gone by then,
+/// the response is just released
+///
+void http_deferred_respond(http_deferred_ref deferred,
+                           http_headers_ref response);
+
+/// retreives the value of the specified header or NULL if it doesn't exist, header
+/// names are case-insensitive
 const char* http_headers_get(const http_headers_ref headers,
                              const char* key);
 
+/// retreives the number-th value of a header that appears several times
+const char* http_headers_get_nth(const http_headers_ref headers,
+                                 const char* key,
+                                 const http_size_t number);
+
+/// gets the number-th header field in the order they were received or set, false if
+/// there are not that many
+bool http_headers_get_field(const http_headers_ref headers,
+                            const http_size_t number,
+                            const char** keyPtr,
+                            const char** valuePtr);
+
 /// sets the value of the specified header. The value cannot be NULL
 bool http_headers_set(http_headers_ref headers,
                       const char* key,
                       const char* value);
+/// adds one more value for the key, even if it's already set (Set-Cookie, etc)
+bool http_headers_add(http_headers_ref headers,
+                      const char* key,
+                      const char* value);
+/// removes every value of the specified header, false if there was none
+bool http_headers_remove(http_headers_ref headers,
+                         const char* key);
 /// convenience wrapper in case if you need to set a numeric value for the specified
 /// header
 bool http_headers_set_int(http_headers_ref headers,
@@ -154,10 +327,35 @@ void http_headers_set_client_info(http_headers_ref headers,
 char* http_headers_get_response(const http_headers_ref headers,
                                 http_size_t* sizePtr);
 
+/// gets the reason phrase of the status code, e.g. "Not Found" for 404
+const char* http_status_get_reason(const http_status_t status);
+
+/// formats the time as an HTTP date (IMF-fixdate) into a buffer of at least
+/// HTTP_DATE_MAX bytes, returns the length
+http_size_t http_date_format(char* buffer, const time_t time);
+
+///
+/// allocates memory that lives as long as the headers do. For requests and responses
+/// inside of the callback, that's until the response is sent, after which all of it
+/// is dropped at once, so bodies built with it need no deallocator
+///
+void* http_headers_alloc(http_headers_ref headers, const http_size_t size);
+
 /// gets request or response body
 void* http_headers_get_body(const http_headers_ref headers,
                             http_size_t* sizePtr);
 
+///
+/// gets the file descriptor of a file response and its part to send, -1 for others.
+/// Requests with a body larger than the spill size have it in an unnamed temporary
+/// file instead of memory (http_headers_get_body gives NULL then), which is what
+/// this gives for them. That file is closed once the callback returns, dup it if you
+/// need it for longer
+///
+int http_headers_get_file(const http_headers_ref headers,
+                          off_t* offsetPtr,
+                          off_t* sizePtr);
+
 /// gets request type (GET, POST, etc)
 const char* http_headers_get_request_type(const http_headers_ref headers);
 
@@ -167,7 +365,7 @@ const char* http_headers_get_request_url(const http_headers_ref headers);
 /// gets client's IP address (request-only)
 const char* http_headers_get_client_info(const http_headers_ref headers);
 
-/// gets client's requested HTTP version
+/// gets client's requested HTTP version, "HTTP/1.0" if its request line had none
 const char* http_headers_get_request_version(const http_headers_ref headers);
 
 void http_headers_debug_dump(http_headers_ref headers);
@@ -198,9 +396,114 @@ void http_server_set_callback(http_server_ref server,
                               const http_callback_t cb,
                               void* additionalData);
 
+///
+/// configures HTTP/1.1 persistent connections: idle connections are closed after the
+/// specified amount of seconds and every connection is closed after serving
+/// requestsMax requests. Setting idleTimeout to 0 disables keep-alive completely
+///
+void http_server_set_keep_alive(http_server_ref server,
+                                const http_size_t idleTimeout,
+                                const http_size_t requestsMax);
+
+///
+/// limits the size of request bodies: ones larger than sizeMax (according to their
+/// Content-Length) are answered with 413 Payload Too Large right away, without
+/// reading them. Bodies larger than spillSize (clamped so that they fit
+/// HTTP_REQUEST_SIZE_MAX along with the headers) are written to a temporary file in
+/// $TMPDIR while they arrive, see http_headers_get_file. Bodies must come with a
+/// Content-Length: chunked ones are not decoded and get 501 Not Implemented, several
+/// Content-Length fields or one next to a Transfer-Encoding get 400 Bad Request
+///
+void http_server_set_body_limits(http_server_ref server,
+                                 const http_size_t sizeMax,
+                                 const http_size_t spillSize);
+
+///
+/// writes a line (common log format, plus the seconds the callback took) for every
+/// request to fd, e.g. STDOUT_FILENO, or nothing if fd is -1 (the default). Workers
+/// only copy a record into a lock-free ring of their own, a background thread formats
+/// and writes them in batches, so a slow log never holds up requests. Records that
+/// don't fit a full ring are dropped (and counted in the log). Must be called before
+/// http_server_listen
+///
+void http_server_set_access_log(http_server_ref server,
+                                const int fd);
+
+///
+/// answers GET and HEAD requests for path (e.g. "/metrics", NULL turns it off, the
+/// default) with http_server_get_stats in the Prometheus text format, instead of
+/// calling the callback. The path is not copied
+///
+void http_server_set_metrics_path(http_server_ref server,
+                                  const char* path);
+
+///
+/// sums up the counters of all workers into stats. Every worker only counts on its
+/// own, so this can be called from any thread at any time without slowing them down
+/// (though the numbers of a worker busy meanwhile may be off by a request). False if
+/// the server has never listened
+///
+bool http_server_get_stats(const http_server_ref server,
+                           http_stats_t* stats);
+
+/// gets the value (in nanoseconds) that percentile (0-100) of the histogram's values
+/// are at or below
+uint64_t http_histogram_get_percentile(const http_histogram_t* histogram,
+                                       const double percentile);
+
+///
+/// traces every sampleInterval-th request (0, the default, turns it off) of each worker:
+/// when it was read, parsed, handled by the callback and written out. The most recent
+/// of them are kept (in memory, per worker) for http_server_dump_trace. Has to be set
+/// before listening
+///
+void http_server_set_tracing(http_server_ref server,
+                             const http_size_t sampleInterval);
+
+///
+/// writes the traced requests to fd as Chrome trace-event JSON, which can be opened
+/// with chrome://tracing or Perfetto. Can be called from any thread at any time, the
+/// workers keep going meanwhile. False if nothing was traced or writing failed
+///
+bool http_server_dump_trace(const http_server_ref server,
+                            const int fd);
+
+///
+/// sets the max amount of clients each worker serves at a time (HTTP_CLIENTS_MAX by
+/// default). While a worker is full, it stops accepting: further clients wait in the
+/// listen backlog (HTTP_PENDING_CONNECTIONS_MAX) until one of its clients leaves, and
+/// idle keep-alive ones only leave after the idle timeout. Must be called before
+/// http_server_listen, false if it can't be changed anymore
+///
+bool http_server_set_clients_max(http_server_ref server,
+                                 const http_size_t clientsMax);
+
+///
+/// switches the event loop to the specified backend. Must be called before
+/// http_server_listen. If the backend is not available on this system, the server falls
+/// back to the next best one (io_uring to epoll, epoll to select()) and false is
+/// returned, check http_server_get_backend to see which one it ended up with
+///
+bool http_server_set_backend(http_server_ref server,
+                             const http_backend_t backend);
+
+/// gets the event backend currently used by the server
+http_backend_t http_server_get_backend(const http_server_ref server);
+
 /// starts listening for connection (event loop)
 bool http_server_listen(http_server_ref server);
 
+///
+/// starts listening for connections on the specified amount of worker threads (0 means
+/// one per CPU core). Every worker has its own SO_REUSEPORT socket, client set and event
+/// loop, so nothing is shared between them on the hot path. Please note that the
+/// callback will be called from multiple threads at once in this mode. SIGPIPE is
+/// blocked on the calling thread (and so in the workers) while it runs, the process's
+/// handler is left alone
+///
+bool http_server_listen_workers(http_server_ref server,
+                                const http_size_t workersCount);
+
 void http_server_release(http_server_ref server);
 
 
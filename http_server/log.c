@@ -0,0 +1,289 @@
+//
+//  log.c
+//  http_server
+//
+//  Created by Tim K. on 26.02.23.
+//  Copyright © 2023 Tim K. All rights reserved.
+//
+
+#include <string.h>
+#include <unistd.h>
+#include "log.h"
+
+//
+// private
+//
+
+struct http_log_ring_s {
+    http_log_record_t records[HTTP_LOG_RING_SIZE];
+    
+    // only ever increasing, the worker owns head and the log thread tail
+    uint32_t head;
+    uint32_t tail;
+    // records that didn't fit since the log thread last looked
+    uint32_t dropped;
+    
+    http_log_ref log;
+    http_log_ring_ref next;
+};
+
+struct http_log_s {
+    int fd;
+    
+    // rings are only ever prepended, so the log thread walks the list without a lock
+    http_log_ring_ref rings;
+    
+    bool stopping;
+    pthread_t thread;
+    
+    // set by the log thread (holding the lock) right before it waits for records,
+    // workers pushing one only take the lock to wake it up while it's set
+    pthread_mutex_t wakeLock;
+    pthread_cond_t wake;
+    bool sleeping;
+    
+    // formatted lines waiting to be written, only touched by the log thread
+    char batch[HTTP_LOG_BATCH_SIZE];
+    size_t batchSize;
+    
+    // the time of the last record, formatted, as most records share it
+    time_t second;
+    char timeText[HI_DATETIME_MAX];
+};
+
+void http_log_copy(char* destination, const char* source, const size_t size) {
+    size_t length = source ? strnlen(source, size - 1) : 0;
+    
+    memcpy(destination, HI_IF_NULL(source, ""), length);
+    destination[length] = '\0';
+}
+
+void http_log_flush(http_log_ref log) {
+    size_t written = 0;
+    
+    while (written < log->batchSize) {
+        ssize_t result = write(log->fd, log->batch + written, log->batchSize - written);
+        
+        if (result < 0 && errno == EINTR)
+            continue;
+        else if (result < 1)
+            break; // nowhere to complain to, the lines are lost
+        
+        written += (size_t)result;
+    }
+    
+    log->batchSize = 0;
+}
+
+void http_log_format(http_log_ref log, const http_log_record_t* record) {
+    if (record->time != log->second) {
+        struct tm tmTime;
+        localtime_r(&record->time, &tmTime);
+        
+        log->second = record->time;
+        strftime(log->timeText, sizeof(log->timeText), "%d/%b/%Y:%H:%M:%S %z", &tmTime);
+    }
+    
+    char bytes[24] = "-";
+    
+    if (record->bytes >= 0)
+        snprintf(bytes, sizeof(bytes), "%lld", (long long)record->bytes);
+    
+    // common log format, plus the time the callback took
+    int length = snprintf(log->batch + log->batchSize, HTTP_LOG_BATCH_SIZE - log->batchSize,
+                          "%s - - [%s] \"%s %s%s%s\" %u %s %u.%06u\n",
+                          record->address, log->timeText, record->method, record->url,
+                          record->version[0] ? " " : "", record->version, record->status,
+                          bytes, record->duration / 1000000, record->duration % 1000000);
+    
+    if (length > 0 && (size_t)length < HTTP_LOG_BATCH_SIZE - log->batchSize)
+        log->batchSize += (size_t)length;
+}
+
+size_t http_log_drain(http_log_ref log) {
+    size_t count = 0;
+    
+    http_log_ring_ref rings = __atomic_load_n(&log->rings, __ATOMIC_ACQUIRE);
+    
+    for (http_log_ring_ref ring = rings; ring; ring = ring->next) {
+        uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        uint32_t tail = ring->tail;
+        
+        for (; tail != head; tail++, count++) {
+            // the longest line there can be has to fit
+            if (HTTP_LOG_BATCH_SIZE - log->batchSize < sizeof(http_log_record_t) + 128)
+                http_log_flush(log);
+            
+            http_log_format(log, &ring->records[tail & (HTTP_LOG_RING_SIZE - 1)]);
+        }
+        
+        // the worker may reuse the slots now
+        __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+        
+        uint32_t dropped = __atomic_exchange_n(&ring->dropped, 0, __ATOMIC_RELAXED);
+        
+        if (dropped > 0) {
+            int length = snprintf(log->batch + log->batchSize,
+                                  HTTP_LOG_BATCH_SIZE - log->batchSize,
+                                  "[%s] %u access log records dropped\n",
+                                  hi_get_current_datetime(), dropped);
+            
+            if (length > 0 && (size_t)length < HTTP_LOG_BATCH_SIZE - log->batchSize)
+                log->batchSize += (size_t)length;
+        }
+    }
+    
+    if (log->batchSize > 0)
+        http_log_flush(log);
+    
+    return count;
+}
+
+bool http_log_has_records(http_log_ref log) {
+    http_log_ring_ref rings = __atomic_load_n(&log->rings, __ATOMIC_ACQUIRE);
+    
+    for (http_log_ring_ref ring = rings; ring; ring = ring->next) {
+        if (__atomic_load_n(&ring->head, __ATOMIC_SEQ_CST) != ring->tail)
+            return true;
+    }
+    
+    return false;
+}
+
+void http_log_sleep(http_log_ref log) {
+    pthread_mutex_lock(&log->wakeLock);
+    
+    // announced before the last look at the rings, so a worker pushing a record
+    // either finds it set (and wakes the thread up) or its record is seen right here
+    __atomic_store_n(&log->sleeping, true, __ATOMIC_SEQ_CST);
+    
+    while (__atomic_load_n(&log->sleeping, __ATOMIC_SEQ_CST) &&
+           !__atomic_load_n(&log->stopping, __ATOMIC_ACQUIRE) && !http_log_has_records(log))
+        pthread_cond_wait(&log->wake, &log->wakeLock);
+    
+    __atomic_store_n(&log->sleeping, false, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&log->wakeLock);
+}
+
+void http_log_wake(http_log_ref log) {
+    pthread_mutex_lock(&log->wakeLock);
+    
+    __atomic_store_n(&log->sleeping, false, __ATOMIC_SEQ_CST);
+    pthread_cond_signal(&log->wake);
+    
+    pthread_mutex_unlock(&log->wakeLock);
+}
+
+void* http_log_thread(void* data) {
+    http_log_ref log = (http_log_ref)data;
+    
+    // drains until there's nothing left, then waits for the workers to wake it up
+    while (!__atomic_load_n(&log->stopping, __ATOMIC_ACQUIRE)) {
+        if (http_log_drain(log) < 1)
+            http_log_sleep(log);
+    }
+    
+    http_log_drain(log);
+    return NULL;
+}
+
+//
+// public
+//
+
+http_log_ref http_log_init(const int fd) {
+    if (fd < 0) {
+        HI_DEBUG("invalid fd %d, will return NULL", fd);
+        return NULL;
+    }
+    
+    http_log_ref log = hizalloc_struct(http_log_s);
+    log->fd = fd;
+    log->second = -1;
+    
+    pthread_mutex_init(&log->wakeLock, NULL);
+    pthread_cond_init(&log->wake, NULL);
+    
+    if (pthread_create(&log->thread, NULL, http_log_thread, log) != 0) {
+        HI_ERRNO_DEBUG("couldn't start the log thread");
+        
+        pthread_cond_destroy(&log->wake);
+        pthread_mutex_destroy(&log->wakeLock);
+        free(log);
+        
+        return NULL;
+    }
+    
+    return log;
+}
+
+http_log_ring_ref http_log_add_ring(http_log_ref log) {
+    if (!log)
+        return NULL;
+    
+    http_log_ring_ref ring = hizalloc_struct(http_log_ring_s);
+    
+    if (!ring)
+        return NULL;
+    
+    ring->log = log;
+    ring->next = __atomic_load_n(&log->rings, __ATOMIC_RELAXED);
+    
+    // published only once it's all set up
+    while (!__atomic_compare_exchange_n(&log->rings, &ring->next, ring, true,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    
+    return ring;
+}
+
+void http_log_record_request(http_log_record_t* record, const http_headers_ref request) {
+    http_log_copy(record->address, http_headers_get_client_info(request),
+                  sizeof(record->address));
+    http_log_copy(record->method, http_headers_get_request_type(request),
+                  sizeof(record->method));
+    http_log_copy(record->version, http_headers_get_request_version(request),
+                  sizeof(record->version));
+    http_log_copy(record->url, http_headers_get_request_url(request), sizeof(record->url));
+    
+    record->time = time(NULL);
+}
+
+bool http_log_push(http_log_ring_ref ring, const http_log_record_t* record) {
+    uint32_t head = ring->head;
+    
+    if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) >= HTTP_LOG_RING_SIZE) {
+        __atomic_fetch_add(&ring->dropped, 1, __ATOMIC_RELAXED);
+        return false;
+    }
+    
+    ring->records[head & (HTTP_LOG_RING_SIZE - 1)] = *record;
+    
+    // visible to the log thread only once it's all there
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_SEQ_CST);
+    
+    if (__atomic_load_n(&ring->log->sleeping, __ATOMIC_SEQ_CST))
+        http_log_wake(ring->log);
+    
+    return true;
+}
+
+void http_log_release(http_log_ref log) {
+    if (!log)
+        return;
+    
+    __atomic_store_n(&log->stopping, true, __ATOMIC_RELEASE);
+    
+    http_log_wake(log);
+    pthread_join(log->thread, NULL);
+    
+    while (log->rings) {
+        http_log_ring_ref next = log->rings->next;
+        
+        free(log->rings);
+        log->rings = next;
+    }
+    
+    pthread_cond_destroy(&log->wake);
+    pthread_mutex_destroy(&log->wakeLock);
+    free(log);
+}
@@ -0,0 +1,64 @@
+//
+//  log.h
+//  http_server
+//
+//  Created by Tim K. on 26.02.23.
+//  Copyright © 2023 Tim K. All rights reserved.
+//
+
+#pragma once
+
+#include <time.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include "wrappers.h"
+
+//
+// access log. Every worker copies a fixed-size binary record per request into a
+// ring of its own (one producer, one consumer, no locks), a background thread drains
+// all of the rings, formats the records and writes them out in batches. A full ring
+// drops records (and counts them) instead of ever making a worker wait. Once all of
+// the rings are empty, the log thread sleeps on a condition variable until a record
+// arrives, which is the only time a worker takes a lock (to wake it up)
+//
+
+/// records per worker ring, must be a power of two
+#define HTTP_LOG_RING_SIZE 1024
+/// max bytes of the URL kept in a record, longer ones are cut off
+#define HTTP_LOG_URL_MAX 160
+/// formatted lines collected before they are written out
+#define HTTP_LOG_BATCH_SIZE (64 * 1024)
+
+typedef struct http_log_s* http_log_ref;
+typedef struct http_log_ring_s* http_log_ring_ref;
+
+/// everything the log line of one request is made of
+typedef struct {
+    // wall clock time the request was handled at
+    time_t time;
+    // microseconds the callback took
+    uint32_t duration;
+    http_status_t status;
+    // body bytes of the response, -1 if not known up front (streamed bodies)
+    int64_t bytes;
+    
+    char address[INET6_ADDRSTRLEN];
+    char method[16];
+    char version[9];
+    char url[HTTP_LOG_URL_MAX];
+} http_log_record_t;
+
+/// starts the log thread writing to fd, NULL on failure
+http_log_ref http_log_init(const int fd);
+
+/// makes a ring for one producer thread, it lives as long as the log does
+http_log_ring_ref http_log_add_ring(http_log_ref log);
+
+/// fills in the parts of the record that come from the request
+void http_log_record_request(http_log_record_t* record, const http_headers_ref request);
+
+/// copies the record into the ring, false if it's full (the record is dropped then)
+bool http_log_push(http_log_ring_ref ring, const http_log_record_t* record);
+
+/// writes out whatever is left, stops the log thread and frees the rings
+void http_log_release(http_log_ref log);
@@ -0,0 +1,312 @@
+//
+//  parser.c
+//  http_server
+//
+//  Created by Tim K. on 26.02.23.
+//  Copyright © 2023 Tim K. All rights reserved.
+//
+
+#include <string.h>
+#include <strings.h>
+#include "parser.h"
+#include "scan.h"
+
+//
+// private
+//
+
+http_parser_result_t http_parser_fail(http_parser_ref parser, const http_status_t error) {
+    HI_DEBUG("malformed request at byte %u, answering with %u", parser->position, error);
+    
+    parser->error = error;
+    return HTTP_PARSER_ERROR;
+}
+
+http_parser_span_t http_parser_make_span(const char* message, const http_size_t start,
+                                         const http_size_t end) {
+    http_parser_span_t result = { start, end - start };
+    
+    // line endings and trailing whitespace are not a part of anything
+    while (result.length > 0 && (message[start + result.length - 1] == '\r' ||
+                                 message[start + result.length - 1] == ' ' ||
+                                 message[start + result.length - 1] == '\t'))
+        result.length--;
+    
+    return result;
+}
+
+bool http_parser_span_equals(const char* message, const http_parser_span_t span,
+                             const char* str) {
+    size_t length = strlen(str);
+    return (span.length == length && strncasecmp(message + span.offset, str, length) == 0);
+}
+
+http_scan_class_t http_parser_get_class(const http_parser_state_t state) {
+    switch (state) {
+        case HTTP_PARSER_STATE_URL:
+            return HTTP_SCAN_CLASS_URL;
+        case HTTP_PARSER_STATE_VERSION:
+        case HTTP_PARSER_STATE_VALUE:
+            return HTTP_SCAN_CLASS_VALUE;
+        case HTTP_PARSER_STATE_KEY:
+            return HTTP_SCAN_CLASS_TOKEN;
+        default:
+            return HTTP_SCAN_CLASS_COUNT; // short ones, not worth it
+    }
+}
+
+http_parser_result_t http_parser_end_headers(http_parser_ref parser,
+                                             const char* message) {
+    unsigned long long contentLength = 0;
+    
+    if (parser->position > HTTP_REQUEST_HEADERS_MAX)
+        return http_parser_fail(parser, HTTP_HEADERS_TOO_LARGE);
+    
+    const http_parser_field_t* length = NULL;
+    bool hasEncoding = false;
+    bool isIdentity = true;
+    
+    for (http_size_t sz = 0; sz < parser->fieldsCount; sz++) {
+        const http_parser_field_t* field = &parser->fields[sz];
+        
+        if (http_parser_span_equals(message, field->key, "Transfer-Encoding")) {
+            hasEncoding = true;
+            isIdentity = (isIdentity && http_parser_span_equals(message, field->value,
+                                                                "identity"));
+        } else if (http_parser_span_equals(message, field->key, "Content-Length")) {
+            // a proxy in front might go by another one than we do (request smuggling),
+            // so there can't be several of them, not even agreeing ones
+            if (length)
+                return http_parser_fail(parser, HTTP_BAD_REQUEST);
+            
+            length = field;
+        }
+    }
+    
+    // the same goes for a length next to a transfer coding
+    if (hasEncoding && length)
+        return http_parser_fail(parser, HTTP_BAD_REQUEST);
+    else if (!isIdentity)
+        return http_parser_fail(parser, HTTP_NOT_IMPLEMENTED); // chunked bodies aren't decoded
+    
+    if (length) {
+        if (length->value.length < 1)
+            return http_parser_fail(parser, HTTP_BAD_REQUEST);
+        
+        for (http_size_t sz = 0; sz < length->value.length; sz++) {
+            char current = message[length->value.offset + sz];
+            
+            if (current < '0' || current > '9')
+                return http_parser_fail(parser, HTTP_BAD_REQUEST);
+            
+            // anything beyond the limit is too large anyway, just don't overflow
+            if (contentLength <= parser->bodyMax)
+                contentLength = contentLength * 10 + (unsigned long long)(current - '0');
+        }
+    }
+    
+    // rejected before a single byte of it is read
+    if (contentLength > parser->bodyMax)
+        return http_parser_fail(parser, HTTP_PAYLOAD_TOO_LARGE);
+    
+    parser->body.offset = parser->position;
+    parser->body.length = (http_size_t)contentLength;
+    parser->state = HTTP_PARSER_STATE_BODY;
+    
+    return HTTP_PARSER_HEADERS_COMPLETE;
+}
+
+//
+// public
+//
+
+void http_parser_reset(http_parser_ref parser) {
+    // the fields table is only valid up to fieldsCount, no need to clear it
+    parser->state = HTTP_PARSER_STATE_METHOD;
+    parser->position = 0;
+    parser->tokenStart = 0;
+    
+    bzero(&parser->method, sizeof(http_parser_span_t));
+    bzero(&parser->url, sizeof(http_parser_span_t));
+    bzero(&parser->version, sizeof(http_parser_span_t));
+    bzero(&parser->body, sizeof(http_parser_span_t));
+    
+    parser->fieldsCount = 0;
+    parser->error = HTTP_OK;
+}
+
+http_parser_result_t http_parser_feed(http_parser_ref parser, const char* message,
+                                      const http_size_t size) {
+    if (parser->state == HTTP_PARSER_STATE_DONE)
+        return HTTP_PARSER_MESSAGE_COMPLETE;
+    
+    while (parser->state < HTTP_PARSER_STATE_BODY && parser->position < size) {
+        http_scan_class_t byteClass = http_parser_get_class(parser->state);
+        
+        // skip the bulk of the token at once, the byte-by-byte part below only
+        // deals with whatever ends it
+        if (byteClass != HTTP_SCAN_CLASS_COUNT) {
+            parser->position += http_scan(message + parser->position, size - parser->position,
+                                          byteClass);
+            
+            if (parser->position >= size)
+                break;
+        }
+        
+        http_size_t sz = parser->position++;
+        char current = message[sz];
+        
+        switch (parser->state) {
+            case HTTP_PARSER_STATE_METHOD: {
+                if (sz == parser->tokenStart && (current == '\r' || current == '\n')) {
+                    // stray line endings between pipelined requests are fine
+                    parser->tokenStart++;
+                    break;
+                } else if (current != ' ') {
+                    if ((current < 'A' || current > 'Z') && current != '-' && current != '_')
+                        return http_parser_fail(parser, HTTP_BAD_REQUEST);
+                    
+                    break;
+                } else if (sz == parser->tokenStart)
+                    return http_parser_fail(parser, HTTP_BAD_REQUEST);
+                
+                parser->method = http_parser_make_span(message, parser->tokenStart, sz);
+                parser->tokenStart = sz + 1;
+                parser->state = HTTP_PARSER_STATE_URL;
+                break;
+            }
+            case HTTP_PARSER_STATE_URL: {
+                if (sz - parser->tokenStart >= HTTP_REQUEST_URL_LENGTH)
+                    return http_parser_fail(parser, HTTP_URL_TOO_LONG);
+                else if (current == '\r' || (uint8_t)current >= 0x80)
+                    break; // tolerated, CRs are trimmed later on
+                else if (current != ' ' && current != '\n')
+                    return http_parser_fail(parser, HTTP_BAD_REQUEST);
+                else if (sz == parser->tokenStart)
+                    return http_parser_fail(parser, HTTP_BAD_REQUEST);
+                
+                parser->url = http_parser_make_span(message, parser->tokenStart, sz);
+                parser->tokenStart = sz + 1;
+                
+                // HTTP/0.9 style request lines have no version
+                parser->state = (current == ' ') ? HTTP_PARSER_STATE_VERSION :
+                                                   HTTP_PARSER_STATE_FIELD_START;
+                break;
+            }
+            case HTTP_PARSER_STATE_VERSION: {
+                if (current != '\n')
+                    break;
+                
+                parser->version = http_parser_make_span(message, parser->tokenStart, sz);
+                
+                if (parser->version.length != 8 ||
+                    strncmp(message + parser->version.offset, "HTTP/1.", 7) != 0)
+                    return http_parser_fail(parser, HTTP_UNSUPPORTED_VERSION);
+                
+                parser->tokenStart = sz + 1;
+                parser->state = HTTP_PARSER_STATE_FIELD_START;
+                break;
+            }
+            case HTTP_PARSER_STATE_FIELD_START: {
+                if (current == '\r')
+                    break;
+                else if (current == '\n') {
+                    // empty line, that's all of them
+                    http_parser_result_t result = http_parser_end_headers(parser, message);
+                    
+                    if (result != HTTP_PARSER_HEADERS_COMPLETE || parser->body.length > 0)
+                        return result;
+                    
+                    // no body, so the message is over as well
+                    parser->state = HTTP_PARSER_STATE_DONE;
+                    return HTTP_PARSER_HEADERS_COMPLETE;
+                } else if (current == ' ' || current == '\t' || current == ':')
+                    return http_parser_fail(parser, HTTP_BAD_REQUEST); // obsolete folding
+                else if (parser->fieldsCount >= HTTP_PARSER_FIELDS_MAX)
+                    return http_parser_fail(parser, HTTP_HEADERS_TOO_LARGE);
+                
+                parser->tokenStart = sz;
+                parser->state = HTTP_PARSER_STATE_KEY;
+                break;
+            }
+            case HTTP_PARSER_STATE_KEY: {
+                if (sz - parser->tokenStart >= HTTP_HEADER_LENGTH_MAX)
+                    return http_parser_fail(parser, HTTP_HEADERS_TOO_LARGE);
+                else if (current != ':')
+                    return http_parser_fail(parser, HTTP_BAD_REQUEST);
+                
+                parser->fields[parser->fieldsCount].key.offset = parser->tokenStart;
+                parser->fields[parser->fieldsCount].key.length = sz - parser->tokenStart;
+                
+                parser->state = HTTP_PARSER_STATE_VALUE_START;
+                break;
+            }
+            case HTTP_PARSER_STATE_VALUE_START: {
+                if (current == ' ' || current == '\t')
+                    break;
+                
+                // the value starts here (even if empty), have another look at it
+                parser->tokenStart = sz;
+                parser->position = sz;
+                parser->state = HTTP_PARSER_STATE_VALUE;
+                break;
+            }
+            case HTTP_PARSER_STATE_VALUE: {
+                if ((uint8_t)current >= 0x80)
+                    break; // obsolete, but allowed
+                else if (current == '\r') {
+                    parser->state = HTTP_PARSER_STATE_VALUE_END;
+                    break;
+                } else if (current != '\n')
+                    return http_parser_fail(parser, HTTP_BAD_REQUEST);
+                
+                parser->fields[parser->fieldsCount++].value =
+                    http_parser_make_span(message, parser->tokenStart, sz);
+                
+                parser->state = HTTP_PARSER_STATE_FIELD_START;
+                break;
+            }
+            case HTTP_PARSER_STATE_VALUE_END: {
+                // a CR anywhere but right before the LF is a bare one
+                if (current != '\n')
+                    return http_parser_fail(parser, HTTP_BAD_REQUEST);
+                
+                parser->fields[parser->fieldsCount++].value =
+                    http_parser_make_span(message, parser->tokenStart, sz);
+                
+                parser->state = HTTP_PARSER_STATE_FIELD_START;
+                break;
+            }
+            default:
+                break;
+        }
+    }
+    
+    if (parser->state < HTTP_PARSER_STATE_BODY) {
+        // don't wait forever for the headers to end
+        if (parser->position > HTTP_REQUEST_HEADERS_MAX)
+            return http_parser_fail(parser, HTTP_HEADERS_TOO_LARGE);
+        
+        return HTTP_PARSER_NEED_MORE;
+    }
+    
+    // the body is only waited for, never scanned
+    http_size_t end = parser->body.offset + parser->body.length;
+    parser->position = (size < end) ? size : end;
+    
+    if (parser->position < end)
+        return HTTP_PARSER_NEED_MORE;
+    
+    parser->state = HTTP_PARSER_STATE_DONE;
+    return HTTP_PARSER_MESSAGE_COMPLETE;
+}
+
+const http_parser_field_t* http_parser_find(const http_parser_ref parser,
+                                            const char* message, const char* key) {
+    for (http_size_t sz = 0; sz < parser->fieldsCount; sz++) {
+        if (http_parser_span_equals(message, parser->fields[sz].key, key))
+            return &parser->fields[sz];
+    }
+    
+    return NULL;
+}
@@ -0,0 +1,104 @@
+//
+//  parser.h
+//  http_server
+//
+//  Created by Tim K. on 26.02.23.
+//  Copyright © 2023 Tim K. All rights reserved.
+//
+
+#pragma once
+
+#include "wrappers.h"
+
+//
+// resumable HTTP/1.x request parser. It is fed the bytes of the current message
+// (from its very first byte on) as they arrive and only looks at the ones it hasn't
+// seen yet, remembering everything it found as offsets into the message
+//
+
+/// max amount of headers in a single request
+#define HTTP_PARSER_FIELDS_MAX 64
+
+typedef struct http_parser_s* http_parser_ref;
+
+typedef enum {
+    // need more data
+    HTTP_PARSER_NEED_MORE = 0,
+    // the request line and the headers are there, the body might not be yet
+    HTTP_PARSER_HEADERS_COMPLETE,
+    // the whole message is there, parser->position is its size
+    HTTP_PARSER_MESSAGE_COMPLETE,
+    // the message is malformed or too large, see parser->error
+    HTTP_PARSER_ERROR
+} http_parser_result_t;
+
+typedef enum {
+    HTTP_PARSER_STATE_METHOD = 0,
+    HTTP_PARSER_STATE_URL,
+    HTTP_PARSER_STATE_VERSION,
+    
+    // beginning of a header line (or of the empty line ending them)
+    HTTP_PARSER_STATE_FIELD_START,
+    HTTP_PARSER_STATE_KEY,
+    HTTP_PARSER_STATE_VALUE_START,
+    HTTP_PARSER_STATE_VALUE,
+    // the CR ending a value, only a LF may follow
+    HTTP_PARSER_STATE_VALUE_END,
+    
+    HTTP_PARSER_STATE_BODY,
+    HTTP_PARSER_STATE_DONE
+} http_parser_state_t;
+
+/// part of the message, relative to its first byte
+typedef struct {
+    http_size_t offset;
+    http_size_t length;
+} http_parser_span_t;
+
+typedef struct {
+    http_parser_span_t key;
+    http_parser_span_t value;
+} http_parser_field_t;
+
+struct http_parser_s {
+    http_parser_state_t state;
+    // amount of bytes of the message already looked at
+    http_size_t position;
+    // beginning of the token being read
+    http_size_t tokenStart;
+    
+    // request line
+    http_parser_span_t method;
+    http_parser_span_t url;
+    http_parser_span_t version;
+    
+    // headers in the order they came in
+    http_parser_field_t fields[HTTP_PARSER_FIELDS_MAX];
+    http_size_t fieldsCount;
+    
+    // body, set once the headers are complete
+    http_parser_span_t body;
+    
+    // status code to answer with on HTTP_PARSER_ERROR
+    http_status_t error;
+    
+    // bodies announcing more than this are rejected, set by the owner (kept by
+    // http_parser_reset)
+    http_size_t bodyMax;
+};
+
+/// prepares the parser for the next message
+void http_parser_reset(http_parser_ref parser);
+
+///
+/// continues parsing the message, which must start at message and contain everything
+/// received so far (size bytes, previously passed bytes included). Returns
+/// HTTP_PARSER_HEADERS_COMPLETE once, right as the headers end, subsequent calls go on
+/// with the body
+///
+http_parser_result_t http_parser_feed(http_parser_ref parser, const char* message,
+                                      const http_size_t size);
+
+/// finds the header with the specified (case-insensitive) key, NULL if none
+const http_parser_field_t* http_parser_find(const http_parser_ref parser,
+                                            const char* message, const char* key);
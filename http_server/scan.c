@@ -0,0 +1,178 @@
+//
+//  scan.c
+//  http_server
+//
+//  Created by Tim K. on 26.02.23.
+//  Copyright © 2023 Tim K. All rights reserved.
+//
+
+#include <string.h>
+#include <pthread.h>
+#include "scan.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HTTP_SCAN_X86 1
+#endif
+
+//
+// private
+//
+
+typedef http_size_t (*http_scan_fn)(const char* data, const http_size_t size,
+                                    const uint8_t* table);
+
+///
+/// every class is a nibble lookup table: entry n has bit h set if the byte (h << 4) | n
+/// belongs to the class. Only h < 8 is used, so non-ASCII bytes never belong to any
+///
+static uint8_t http_scan_tables[HTTP_SCAN_CLASS_COUNT][16];
+
+static http_scan_fn http_scan_impl = NULL;
+static const char* http_scan_impl_name = "scalar";
+
+bool http_scan_byte_is(const uint8_t byte, const http_scan_class_t byteClass) {
+    switch (byteClass) {
+        case HTTP_SCAN_CLASS_TOKEN:
+            return ((byte >= '0' && byte <= '9') || (byte >= 'A' && byte <= 'Z') ||
+                    (byte >= 'a' && byte <= 'z') ||
+                    (byte != 0 && strchr("!#$%&'*+-.^_`|~", byte) != NULL));
+        case HTTP_SCAN_CLASS_URL:
+            return (byte > 0x20 && byte < 0x7f);
+        case HTTP_SCAN_CLASS_VALUE:
+            return ((byte >= 0x20 && byte < 0x7f) || byte == '\t');
+        default:
+            return false;
+    }
+}
+
+http_size_t http_scan_scalar(const char* data, const http_size_t size,
+                             const uint8_t* table) {
+    for (http_size_t sz = 0; sz < size; sz++) {
+        uint8_t byte = (uint8_t)data[sz];
+        
+        if (byte >= 0x80 || !(table[byte & 0x0f] & (1 << (byte >> 4))))
+            return sz;
+    }
+    
+    return size;
+}
+
+#ifdef HTTP_SCAN_X86
+__attribute__((target("sse4.2")))
+http_size_t http_scan_sse42(const char* data, const http_size_t size,
+                            const uint8_t* table) {
+    const __m128i lut = _mm_loadu_si128((const __m128i*)table);
+    // 1 << h for the high nibble h, nothing for non-ASCII bytes
+    const __m128i bits = _mm_setr_epi8(1, 2, 4, 8, 16, 32, 64, (char)128,
+                                       0, 0, 0, 0, 0, 0, 0, 0);
+    const __m128i lowMask = _mm_set1_epi8(0x0f);
+    
+    http_size_t sz = 0;
+    
+    for (; sz + 16 <= size; sz += 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i*)(data + sz));
+        
+        __m128i rows = _mm_shuffle_epi8(lut, _mm_and_si128(chunk, lowMask));
+        __m128i columns = _mm_shuffle_epi8(bits, _mm_and_si128(_mm_srli_epi16(chunk, 4),
+                                                               lowMask));
+        
+        // bytes outside of the class have no bits in common
+        __m128i outside = _mm_cmpeq_epi8(_mm_and_si128(rows, columns),
+                                         _mm_setzero_si128());
+        int mask = _mm_movemask_epi8(outside);
+        
+        if (mask != 0)
+            return sz + (http_size_t)__builtin_ctz((unsigned)mask);
+    }
+    
+    return sz + http_scan_scalar(data + sz, size - sz, table);
+}
+
+__attribute__((target("avx2")))
+http_size_t http_scan_avx2(const char* data, const http_size_t size,
+                           const uint8_t* table) {
+    const __m256i lut = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)table));
+    const __m256i bits = _mm256_setr_epi8(1, 2, 4, 8, 16, 32, 64, (char)128,
+                                          0, 0, 0, 0, 0, 0, 0, 0,
+                                          1, 2, 4, 8, 16, 32, 64, (char)128,
+                                          0, 0, 0, 0, 0, 0, 0, 0);
+    const __m256i lowMask = _mm256_set1_epi8(0x0f);
+    
+    http_size_t sz = 0;
+    
+    for (; sz + 32 <= size; sz += 32) {
+        __m256i chunk = _mm256_loadu_si256((const __m256i*)(data + sz));
+        
+        __m256i rows = _mm256_shuffle_epi8(lut, _mm256_and_si256(chunk, lowMask));
+        __m256i columns = _mm256_shuffle_epi8(bits,
+                                              _mm256_and_si256(_mm256_srli_epi16(chunk, 4),
+                                                               lowMask));
+        
+        __m256i outside = _mm256_cmpeq_epi8(_mm256_and_si256(rows, columns),
+                                            _mm256_setzero_si256());
+        unsigned mask = (unsigned)_mm256_movemask_epi8(outside);
+        
+        if (mask != 0)
+            return sz + (http_size_t)__builtin_ctz(mask);
+    }
+    
+    // the rest is still worth a 16 bytes step
+    return sz + http_scan_sse42(data + sz, size - sz, table);
+}
+#endif
+
+void http_scan_init() {
+    for (http_size_t byteClass = 0; byteClass < HTTP_SCAN_CLASS_COUNT; byteClass++) {
+        for (http_size_t byte = 0; byte < 0x80; byte++) {
+            if (http_scan_byte_is((uint8_t)byte, (http_scan_class_t)byteClass))
+                http_scan_tables[byteClass][byte & 0x0f] |= (uint8_t)(1 << (byte >> 4));
+        }
+    }
+    
+    http_scan_fn impl = http_scan_scalar;
+
+#ifdef HTTP_SCAN_X86
+    // CPUID tells what's there
+    __builtin_cpu_init();
+    
+    if (__builtin_cpu_supports("avx2")) {
+        impl = http_scan_avx2;
+        http_scan_impl_name = "avx2";
+    } else if (__builtin_cpu_supports("sse4.2")) {
+        impl = http_scan_sse42;
+        http_scan_impl_name = "sse4.2";
+    }
+#endif
+    
+    HI_DEBUG("scanning with the %s implementation", http_scan_impl_name);
+    __atomic_store_n(&http_scan_impl, impl, __ATOMIC_RELEASE);
+}
+
+//
+// public
+//
+
+http_size_t http_scan(const char* data, const http_size_t size,
+                      const http_scan_class_t byteClass) {
+    http_scan_fn impl = __atomic_load_n(&http_scan_impl, __ATOMIC_ACQUIRE);
+    
+    // set up by whichever worker gets here first
+    if (!impl) {
+        static pthread_once_t once = PTHREAD_ONCE_INIT;
+        
+        pthread_once(&once, http_scan_init);
+        impl = http_scan_impl;
+    }
+    
+    return impl(data, size, http_scan_tables[byteClass]);
+}
+
+bool http_scan_is(const char byte, const http_scan_class_t byteClass) {
+    return http_scan_byte_is((uint8_t)byte, byteClass);
+}
+
+const char* http_scan_get_implementation() {
+    http_scan(NULL, 0, HTTP_SCAN_CLASS_TOKEN);
+    return http_scan_impl_name;
+}
@@ -0,0 +1,39 @@
+//
+//  scan.h
+//  http_server
+//
+//  Created by Tim K. on 26.02.23.
+//  Copyright © 2023 Tim K. All rights reserved.
+//
+
+#pragma once
+
+#include "wrappers.h"
+
+//
+// bulk byte classification for the request parser. Tokens are skipped 32 (AVX2) or
+// 16 (SSE4.2) bytes at a time, the implementation is picked at runtime via CPUID,
+// with a scalar one for everything else
+//
+
+/// classes of bytes a token can consist of (all of them ASCII only)
+typedef enum {
+    // header names: RFC 9110 tchar
+    HTTP_SCAN_CLASS_TOKEN = 0,
+    // request target: visible characters
+    HTTP_SCAN_CLASS_URL,
+    // header values: visible characters, space and tab
+    HTTP_SCAN_CLASS_VALUE,
+    
+    HTTP_SCAN_CLASS_COUNT
+} http_scan_class_t;
+
+/// returns the amount of bytes at the beginning of data belonging to the class
+http_size_t http_scan(const char* data, const http_size_t size,
+                      const http_scan_class_t byteClass);
+
+/// true if the byte belongs to the class
+bool http_scan_is(const char byte, const http_scan_class_t byteClass);
+
+/// name of the implementation in use ("avx2", "sse4.2" or "scalar")
+const char* http_scan_get_implementation(void);
@@ -7,9 +7,17 @@
 //
 
 #include <string.h>
+#include <strings.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <netinet/tcp.h>
 #include "server.h"
 
+// worker and slot of the request the callback on this thread is answering
+static __thread http_worker_ref http_worker_current = NULL;
+static __thread http_size_t http_worker_current_index = 0;
+
 //
 // private
 //
@@ -18,6 +26,8 @@ struct sockaddr_in http_make_ipv4(const char* ipAddress,
     struct sockaddr_in result;
     bzero(&result, sizeof(struct sockaddr_in));
     
+    result.sin_family = AF_INET;
+    
     // parse the IP address first
     if (!inet_pton(AF_INET, HI_IF_NULL(ipAddress, HTTP_ADDRESS_PUBLIC), &result.sin_addr)) {
         HI_ERRNO_DEBUG("inet_pton failed, filling ipv4 struct with predefined values");
@@ -38,6 +48,8 @@ struct sockaddr_in6 http_make_ipv6(const char* ipAddress,
     struct sockaddr_in6 result;
     bzero(&result, sizeof(struct sockaddr_in6));
     
+    result.sin6_family = AF_INET6;
+    
     // parse the IP address first
     // TODO: handle errors correctly
     if (!inet_pton(AF_INET6, HI_IF_NULL(ipAddress, HTTP_ADDRESS_PUBLIC_IPV6), &result.sin6_addr)) {
@@ -52,74 +64,43 @@ struct sockaddr_in6 http_make_ipv6(const char* ipAddress,
 }
 
 
-void http_getpeerinfo(int sk, char** ipAddressPtr, http_port_t* portPtr) {
-    struct sockaddr_in ipv4;
-    bzero(&ipv4, sizeof(struct sockaddr_in));
+int http_server_init_socket(const http_server_ref server) {
+    // init main socket
+    int sk = socket(server->useIPv6 ? AF_INET6 : AF_INET, SOCK_STREAM, 0);
     
-    socklen_t length = sizeof(ipv4);
+    if (sk < 0)
+        return -1;
     
-    if (getpeername(sk, (struct sockaddr*)&ipv4, &length) == 0) {
-        // success
-        
-        // convert to IPv4
-        char* ipAddress = calloc(INET_ADDRSTRLEN, sizeof(char));
-        inet_ntop(AF_INET, &ipv4, ipAddress, length);
-        
-        // obtain port
-        http_port_t port = ntohs(ipv4.sin_port);
-        
-        // save values
-        if (ipAddressPtr)
-            (*ipAddressPtr) = ipAddress;
-        
-        if (portPtr)
-            (*portPtr) = port;
-    } else
-        HI_ERRNO_DEBUG("getpeername failed (ipv4)");
-}
+    // make socket rebindable in case of a crash
+    int tempTrueV = true;
+    if (setsockopt(sk, SOL_SOCKET, SO_REUSEADDR, &tempTrueV, sizeof(tempTrueV)) != 0) {
+        close(sk);
+        return -1;
+    }
 
-void http_getpeerinfo6(int sk, char** ipAddressPtr, http_port_t* portPtr) {
-    struct sockaddr_in6 ipv6;
-    bzero(&ipv6, sizeof(struct sockaddr_in6));
-    
-    socklen_t length = sizeof(ipv6);
+#ifdef SO_REUSEPORT
+    // let every worker bind its own socket to the same address, the kernel will
+    // then balance incoming connections between them
+    if (setsockopt(sk, SOL_SOCKET, SO_REUSEPORT, &tempTrueV, sizeof(tempTrueV)) != 0)
+        HI_ERRNO_DEBUG("SO_REUSEPORT unavailable, workers will share one socket");
+#endif
     
-    if (getpeername(sk, (struct sockaddr*)&ipv6, &length) == 0) {
-        // success
-        
-        // convert to IPv4
-        char* ipAddress = calloc(INET6_ADDRSTRLEN, sizeof(char));
-        inet_ntop(AF_INET6, &ipv6, ipAddress, length);
-        
-        // obtain port
-        http_port_t port = ntohs(ipv6.sin6_port);
-        
-        // save values
-        if (ipAddressPtr)
-            (*ipAddressPtr) = ipAddress;
-        
-        if (portPtr)
-            (*portPtr) = port;
-    } else
-        HI_ERRNO_DEBUG("getpeername failed (ipv6)");
-}
-
-bool http_server_init_socket(http_server_ref result, bool isIPv6) {
-    // init main socket
-    result->mainSocket = socket(isIPv6 ? AF_INET6 : AF_INET, SOCK_STREAM, 0);
+    // several workers may poll the same socket, so accept() must never block
+    fcntl(sk, F_SETFL, fcntl(sk, F_GETFL, 0) | O_NONBLOCK);
     
-    if (result->mainSocket == 0)
-        return false;
+    // bind when possible
+    const struct sockaddr* address = server->useIPv6 ? (struct sockaddr*)&server->ipv6 :
+                                                       (struct sockaddr*)&server->ipv4;
+    socklen_t addressSize = server->useIPv6 ? sizeof(server->ipv6) : sizeof(server->ipv4);
     
-    // make socket rebindable in case of a crash
-    http_size_t tempTrueV = true;
-    if (setsockopt(result->mainSocket, SOL_SOCKET, SO_REUSEADDR, &tempTrueV,
-                   sizeof(tempTrueV)) != 0) {
-        close(result->mainSocket);
-        return false;
+    if (bind(sk, address, addressSize) != 0) {
+        HI_ERRNO_DEBUG("bind failed");
+        
+        close(sk);
+        return -1;
     }
     
-    return true;
+    return sk;
 }
 
 http_server_ref http_server_init(const char* ipAddress,
@@ -127,17 +108,14 @@ http_server_ref http_server_init(const char* ipAddress,
                                  const bool useIPv6) {
     http_server_ref result = hizalloc_struct(http_server_s);
     result->clientsMax = HTTP_CLIENTS_MAX;
+    result->backend = HTTP_BACKEND_AUTO;
+    result->idleTimeout = HTTP_KEEP_ALIVE_TIMEOUT;
+    result->requestsMax = HTTP_KEEP_ALIVE_REQUESTS_MAX;
+    result->bodyMax = HTTP_REQUEST_BODY_MAX;
+    result->bodySpillSize = HTTP_REQUEST_BODY_SPILL_SIZE;
+    result->accessLogFD = -1;
     
-    // init IPv4 socket
-    if (!http_server_init_socket(result, false)) {
-        HI_ERRNO_DEBUG("init ipv4 socket failed, will return NULL");
-        
-        // destroy itself on failure
-        free(result);
-        return NULL;
-    }
-    
-    // import IPv4 listen address
+    // import listen address
     result->useIPv6 = useIPv6;
     
     if (useIPv6)
@@ -145,22 +123,143 @@ http_server_ref http_server_init(const char* ipAddress,
     else
         result->ipv4 = http_make_ipv4(ipAddress, ipPort);
     
-    // bind when possible
-    if (bind(result->mainSocket, (struct sockaddr*)&result->ipv4, sizeof(result->ipv4)) != 0) {
-        HI_ERRNO_DEBUG("bind failed, will destroy itself and return NULL");
+    // init and bind the main socket
+    result->mainSocket = http_server_init_socket(result);
+    
+    if (result->mainSocket < 0) {
+        HI_ERRNO_DEBUG("init socket failed, will return NULL");
         
-        http_server_release(result);
+        // destroy itself on failure
+        free(result);
         return NULL;
     }
     
     // init used in the future multiconnection management via fd_set
-    result->clientsFDs = http_fd_set_init(result->clientsMax);
+    result->clientsFDs = http_fd_set_init(HTTP_WORKER_SLOTS(result), result->backend);
     http_fd_set_set_main_socket(result->clientsFDs, result->mainSocket);
     
     HI_DEBUG("hello world, ipv%u HTTP server initialized, <%p>", useIPv6 ? 6 : 4, result);
     return result;
 }
 
+bool http_worker_init_wake(http_worker_ref worker) {
+    // a socket pair rather than a pipe, so that every backend can receive from it
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, worker->wakeSockets) != 0) {
+        HI_ERRNO_DEBUG("socketpair failed, deferred responses won't work");
+        
+        worker->wakeSockets[0] = worker->wakeSockets[1] = -1;
+        return false;
+    }
+    
+    for (http_size_t sz = 0; sz < 2; sz++) {
+        fcntl(worker->wakeSockets[sz], F_SETFL, fcntl(worker->wakeSockets[sz], F_GETFL, 0) | O_NONBLOCK);
+        fcntl(worker->wakeSockets[sz], F_SETFD, FD_CLOEXEC);
+    }
+    
+    worker->wakeIndex = http_fd_set_add(worker->clientsFDs, worker->wakeSockets[0],
+                                        HTTP_FD_EVENT_READ);
+    
+    return (worker->wakeIndex != HTTP_FD_SET_MAIN_INDEX);
+}
+
+bool http_worker_init(http_worker_ref worker, http_server_ref server,
+                      const http_size_t number) {
+    bzero(worker, sizeof(struct http_worker_s));
+    
+    worker->server = server;
+    worker->number = number;
+    worker->logRing = http_log_add_ring(server->accessLog);
+    worker->stats = &server->stats[number];
+    worker->traceRing = (server->traceInterval > 0) ? &server->traces[number] : NULL;
+    
+    // per-slot client state, slots are handed out by the fd set
+    worker->connections = calloc(HTTP_WORKER_SLOTS(server), sizeof(struct http_connection_s));
+    
+    for (http_size_t sz = 0; sz < HTTP_WORKER_SLOTS(server); sz++)
+        worker->connections[sz].sk = -1;
+    
+    worker->idleHead = worker->idleTail = HTTP_FD_SET_MAIN_INDEX;
+    worker->wakeIndex = HTTP_FD_SET_MAIN_INDEX;
+    worker->wakeSockets[0] = worker->wakeSockets[1] = -1;
+    
+    pthread_mutex_init(&worker->mailboxLock, NULL);
+    
+    if (number == 0) {
+        // the first worker reuses the server's own socket and set
+        worker->mainSocket = server->mainSocket;
+        worker->clientsFDs = server->clientsFDs;
+        worker->asyncSend = (http_fd_set_get_backend(worker->clientsFDs) ==
+                             HTTP_BACKEND_IO_URING);
+        
+        return http_worker_init_wake(worker);
+    }
+    
+    // every other worker gets a socket of its own, sharing nothing with the rest
+    worker->mainSocket = http_server_init_socket(server);
+    
+    if (worker->mainSocket < 0) {
+        HI_DEBUG("worker %u will share the main socket", number);
+        worker->mainSocket = server->mainSocket;
+    } else if (listen(worker->mainSocket, HTTP_PENDING_CONNECTIONS_MAX) != 0) {
+        HI_ERRNO_DEBUG("listen failed for the worker, will share the main socket");
+        
+        close(worker->mainSocket);
+        worker->mainSocket = server->mainSocket;
+    }
+    
+    worker->clientsFDs = http_fd_set_init(HTTP_WORKER_SLOTS(server), server->backend);
+    http_fd_set_set_main_socket(worker->clientsFDs, worker->mainSocket);
+    worker->asyncSend = (http_fd_set_get_backend(worker->clientsFDs) == HTTP_BACKEND_IO_URING);
+    
+    return http_worker_init_wake(worker);
+}
+
+void http_worker_release(http_worker_ref worker) {
+    if (!worker)
+        return;
+    
+    for (http_size_t sz = 0; sz < HTTP_WORKER_SLOTS(worker->server); sz++) {
+        http_connection_ref connection = &worker->connections[sz];
+        
+        http_connection_release(connection);
+    }
+    
+    free(worker->connections);
+    
+    // responses nobody is going to send anymore
+    while (worker->mailbox) {
+        http_deferred_ref deferred = worker->mailbox;
+        worker->mailbox = deferred->next;
+        
+        http_headers_release(deferred->response);
+        free(deferred);
+    }
+    
+    if (worker->wakeIndex != HTTP_FD_SET_MAIN_INDEX)
+        http_fd_set_remove(worker->clientsFDs, worker->wakeIndex);
+    
+    if (worker->wakeSockets[0] >= 0) {
+        close(worker->wakeSockets[0]);
+        close(worker->wakeSockets[1]);
+    }
+    
+    pthread_mutex_destroy(&worker->mailboxLock);
+    
+    // the first worker's socket and set belong to the server itself
+    if (worker->number == 0)
+        return;
+    
+    http_fd_set_release(worker->clientsFDs);
+    
+    if (worker->mainSocket != worker->server->mainSocket)
+        close(worker->mainSocket);
+}
+
+void* http_worker_thread(void* worker) {
+    http_worker_run((http_worker_ref)worker);
+    return NULL;
+}
+
 //
 // public
 //
@@ -188,119 +287,1109 @@ void http_server_set_callback(http_server_ref server,
     server->requestCB = cb;
 }
 
-bool http_server_listen(http_server_ref server) {
+bool http_server_set_backend(http_server_ref server,
+                             const http_backend_t backend) {
+    if (!server) {
+        HI_DEBUG("NULL server instance, no reason to continue");
+        return false;
+    } else if (http_fd_set_get_count(server->clientsFDs) > 0) {
+        HI_DEBUG("server <%p> already has clients, cannot switch backends", server);
+        return false;
+    }
+    
+    // recreate the set with the new backend, workers will follow
+    server->backend = backend;
+    
+    http_fd_set_release(server->clientsFDs);
+    server->clientsFDs = http_fd_set_init(HTTP_WORKER_SLOTS(server), backend);
+    http_fd_set_set_main_socket(server->clientsFDs, server->mainSocket);
+    
+    return (backend == HTTP_BACKEND_AUTO ||
+            http_fd_set_get_backend(server->clientsFDs) == backend);
+}
+
+bool http_server_set_clients_max(http_server_ref server,
+                                 const http_size_t clientsMax) {
+    if (!server) {
+        HI_DEBUG("NULL server instance, no reason to continue");
+        return false;
+    } else if (http_fd_set_get_count(server->clientsFDs) > 0 || clientsMax < 1) {
+        HI_DEBUG("can't have server <%p> serve %u clients", server, clientsMax);
+        return false;
+    }
+    
+    // the set has a slot for every one of them
+    server->clientsMax = clientsMax;
+    
+    http_fd_set_release(server->clientsFDs);
+    server->clientsFDs = http_fd_set_init(HTTP_WORKER_SLOTS(server), server->backend);
+    http_fd_set_set_main_socket(server->clientsFDs, server->mainSocket);
+    
+    return true;
+}
+
+http_backend_t http_server_get_backend(const http_server_ref server) {
+    return (server ? http_fd_set_get_backend(server->clientsFDs) : HTTP_BACKEND_AUTO);
+}
+
+void http_server_set_keep_alive(http_server_ref server,
+                                const http_size_t idleTimeout,
+                                const http_size_t requestsMax) {
+    if (!server) {
+        HI_DEBUG("NULL server instance, no reason to continue");
+        return;
+    }
+    
+    server->idleTimeout = idleTimeout;
+    server->requestsMax = HI_IF_NULL(requestsMax, 1);
+}
+
+void http_server_set_body_limits(http_server_ref server,
+                                 const http_size_t sizeMax,
+                                 const http_size_t spillSize) {
+    if (!server) {
+        HI_DEBUG("NULL server instance, no reason to continue");
+        return;
+    }
+    
+    // whatever isn't spilled has to fit the input buffer together with the headers
+    http_size_t spillSizeMax = HTTP_REQUEST_SIZE_MAX - HTTP_REQUEST_HEADERS_MAX;
+    
+    server->bodyMax = sizeMax;
+    server->bodySpillSize = (spillSize < spillSizeMax) ? spillSize : spillSizeMax;
+}
+
+void http_server_set_access_log(http_server_ref server,
+                                const int fd) {
+    if (!server) {
+        HI_DEBUG("NULL server instance, no reason to continue");
+        return;
+    }
+    
+    server->accessLogFD = fd;
+}
+
+void http_server_set_metrics_path(http_server_ref server,
+                                  const char* path) {
+    if (!server) {
+        HI_DEBUG("NULL server instance, no reason to continue");
+        return;
+    }
+    
+    server->metricsPath = path;
+}
+
+bool http_server_get_stats(const http_server_ref server,
+                           http_stats_t* stats) {
+    if (!server || !stats) {
+        HI_DEBUG("NULL server or stats parameter specified");
+        return false;
+    }
+    
+    bzero(stats, sizeof(http_stats_t));
+    
+    // published once all of them are there
+    http_size_t count = __atomic_load_n(&server->statsCount, __ATOMIC_ACQUIRE);
+    
+    for (http_size_t sz = 0; sz < count; sz++)
+        http_stats_sum(stats, &server->stats[sz]);
+    
+    return (count > 0);
+}
+
+void http_server_set_tracing(http_server_ref server,
+                             const http_size_t sampleInterval) {
+    if (!server) {
+        HI_DEBUG("NULL server instance, no reason to continue");
+        return;
+    }
+    
+    server->traceInterval = sampleInterval;
+}
+
+bool http_server_dump_trace(const http_server_ref server,
+                            const int fd) {
     if (!server) {
         HI_DEBUG("NULL server parameter specified");
         return false;
-    } else if (listen(server->mainSocket, HTTP_PENDING_CONNECTIONS_MAX) != 0) {
-        HI_ERRNO_DEBUG("listen failed, returning false");
+    }
+    
+    // published once all of them are there
+    http_size_t count = __atomic_load_n(&server->tracesCount, __ATOMIC_ACQUIRE);
+    
+    return (count > 0 && http_trace_dump(server->traces, count, fd));
+}
+
+uint64_t http_worker_answered(http_worker_ref worker, http_log_record_t* record,
+                              const uint64_t started, const http_headers_ref response,
+                              const bool withBody) {
+    uint64_t now = http_stats_clock();
+    
+    http_stats_record(&worker->stats->callbackTime, now - started);
+    http_stats_count_status(worker->stats, response->statusCode);
+    
+    if (!worker->logRing)
+        return now;
+    
+    record->duration = (uint32_t)((now - started) / 1000);
+    record->status = response->statusCode;
+    record->bytes = withBody ? http_headers_get_body_length(response) : 0;
+    
+    http_log_push(worker->logRing, record);
+    return now;
+}
+
+void http_worker_trace_begin(http_worker_ref worker, const http_size_t index) {
+    http_connection_ref connection = &worker->connections[index];
+    
+    if (!worker->traceRing || ++worker->traceCounter < worker->server->traceInterval)
+        return;
+    
+    worker->traceCounter = 0;
+    
+    bzero(&connection->trace, sizeof(http_trace_record_t));
+    connection->tracing = true;
+    
+    // connecting only is a phase of the first request
+    connection->trace.accepted = (connection->requestsCount < 1) ? connection->acceptedAt : 0;
+    // not when the bytes were read, pipelined requests behind it came with them
+    connection->trace.firstRead = http_stats_clock();
+    connection->trace.worker = worker->number;
+    connection->trace.slot = index;
+}
+
+bool http_worker_is_metrics(http_worker_ref worker, const http_headers_ref request) {
+    const char* path = worker->server->metricsPath;
+    
+    if (!path)
         return false;
+    
+    const char* method = http_headers_get_request_type(request);
+    const char* url = http_headers_get_request_url(request);
+    size_t length = strlen(path);
+    
+    // the query, if any, doesn't matter
+    return ((strcmp(method, "GET") == 0 || strcmp(method, "HEAD") == 0) &&
+            strncmp(url, path, length) == 0 && (url[length] == '\0' || url[length] == '?'));
+}
+
+http_headers_ref http_worker_make_metrics(http_worker_ref worker) {
+    http_stats_t* stats = malloc(sizeof(http_stats_t));
+    http_size_t size = 0;
+    char* text = NULL;
+    
+    if (stats && http_server_get_stats(worker->server, stats))
+        text = http_stats_format(stats, &size);
+    
+    free(stats);
+    
+    if (!text)
+        return http_headers_init_with_response(HTTP_INTERNAL_SERVER_ERROR, "text/plain",
+                                               strdup("error"), 5, free);
+    
+    return http_headers_init_with_response(HTTP_OK, HTTP_STATS_CONTENT_TYPE, text, size,
+                                           free);
+}
+
+time_t http_worker_clock() {
+    struct timespec ts;
+
+#ifdef CLOCK_MONOTONIC_COARSE
+    // second precision is plenty for idle timeouts
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+#else
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+    
+    return ts.tv_sec;
+}
+
+void http_worker_idle_unlink(http_worker_ref worker, const http_size_t index) {
+    http_connection_ref connection = &worker->connections[index];
+    
+    if (connection->idlePrev != HTTP_FD_SET_MAIN_INDEX)
+        worker->connections[connection->idlePrev].idleNext = connection->idleNext;
+    else if (worker->idleHead == index)
+        worker->idleHead = connection->idleNext;
+    else
+        return; // not in the list
+    
+    if (connection->idleNext != HTTP_FD_SET_MAIN_INDEX)
+        worker->connections[connection->idleNext].idlePrev = connection->idlePrev;
+    else
+        worker->idleTail = connection->idlePrev;
+    
+    connection->idlePrev = connection->idleNext = HTTP_FD_SET_MAIN_INDEX;
+}
+
+void http_worker_touch(http_worker_ref worker, const http_size_t index) {
+    http_connection_ref connection = &worker->connections[index];
+    connection->lastActive = worker->now;
+    
+    if (worker->idleTail == index)
+        return;
+    
+    // most recently active ones go to the back
+    http_worker_idle_unlink(worker, index);
+    
+    connection->idlePrev = worker->idleTail;
+    connection->idleNext = HTTP_FD_SET_MAIN_INDEX;
+    
+    if (worker->idleTail != HTTP_FD_SET_MAIN_INDEX)
+        worker->connections[worker->idleTail].idleNext = index;
+    else
+        worker->idleHead = index;
+    
+    worker->idleTail = index;
+}
+
+void http_worker_add_client(http_worker_ref worker, int newClient,
+                            const struct sockaddr* address) {
+    // add the new client to the set, it will be reported as soon as it sends anything
+    http_size_t index = http_fd_set_add(worker->clientsFDs, newClient, HTTP_FD_EVENT_READ);
+    
+    if (index == HTTP_FD_SET_MAIN_INDEX) {
+        HI_DEBUG("no room for client %d, dropping it", newClient);
+        close(newClient);
+        return;
     }
     
-    // now that we're listening, roll the event loop
-    while (true) {
-        // zero and then sync fd_set client descriptors
-        http_fd_set_sync_descriptors(server->clientsFDs);
-        HI_DEBUG("descriptors synced");
+    HTTP_STATS_ADD(worker->stats->connectionsAccepted, 1);
+    
+    // a client not reading its answers must never block the whole worker
+    fcntl(newClient, F_SETFL, fcntl(newClient, F_GETFL, 0) | O_NONBLOCK);
+    
+    // responses leave in one sendmsg each, there's nothing for Nagle to coalesce
+    // and waiting for the ACK of the previous one only delays pipelined answers
+    int tempTrueV = 1;
+    if (setsockopt(newClient, IPPROTO_TCP, TCP_NODELAY, &tempTrueV, sizeof(tempTrueV)) != 0)
+        HI_ERRNO_DEBUG("failed to disable Nagle's algorithm for the client");
+    
+    http_connection_ref connection = &worker->connections[index];
+    http_connection_init(connection, newClient, address);
+    
+    connection->parser.bodyMax = worker->server->bodyMax;
+    connection->stats = worker->stats;
+    connection->traceRing = worker->traceRing;
+    
+    if (worker->traceRing)
+        connection->acceptedAt = http_stats_clock();
+    
+    connection->events = HTTP_FD_EVENT_READ;
+    connection->idlePrev = connection->idleNext = HTTP_FD_SET_MAIN_INDEX;
+    http_worker_touch(worker, index);
+}
+
+void http_worker_accept(http_worker_ref worker) {
+    struct sockaddr_storage address;
+    socklen_t addressSize = sizeof(address);
+    
+    int newClient = accept(worker->mainSocket, (struct sockaddr*)&address, &addressSize);
+    HI_DEBUG("new connection %d on worker %u", newClient, worker->number);
+    
+    if (newClient < 0) {
+        // another worker sharing the socket was faster
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return;
+        
+        // uh oh, error, warn the user
+        HI_ERRNO_DEBUG("accept from client failed, here is the reason, will continue as usual");
+        return;
+    }
+    
+    http_worker_add_client(worker, newClient, (struct sockaddr*)&address);
+}
+
+void http_worker_accepted(http_worker_ref worker, int newClient) {
+    // completion backends accept by themselves, so just ask for the address
+    struct sockaddr_storage address;
+    socklen_t addressSize = sizeof(address);
+    
+    bzero(&address, sizeof(address));
+    
+    if (getpeername(newClient, (struct sockaddr*)&address, &addressSize) != 0)
+        HI_ERRNO_DEBUG("getpeername failed");
+    
+    http_worker_add_client(worker, newClient, (struct sockaddr*)&address);
+}
+
+void http_worker_close(http_worker_ref worker, const http_size_t index) {
+    http_connection_ref connection = &worker->connections[index];
+    
+    if (connection->sk < 0)
+        return;
+    
+    http_worker_idle_unlink(worker, index);
+    
+    if (connection->sending) {
+        // the kernel still uses the response buffers, abort the send and finish
+        // once it reports back
+        connection->closing = true;
+        
+        shutdown(connection->sk, SHUT_RDWR);
+        http_fd_set_modify(worker->clientsFDs, index, HTTP_FD_EVENT_NONE);
+        return;
+    }
+    
+    HI_DEBUG("client %d saying his goodbyes to us", connection->sk);
+    
+    // drop it from the set and close it
+    http_fd_set_remove(worker->clientsFDs, index);
+    close(connection->sk);
+    
+    http_connection_reset(connection);
+    HTTP_STATS_ADD(worker->stats->connectionsClosed, 1);
+}
+
+bool http_worker_is_done(http_connection_ref connection) {
+    // closing is only up to us once every answer (deferred ones included) is out
+    return (connection->closeAfterFlush && !http_connection_has_pending(connection));
+}
+
+void http_worker_update_events(http_worker_ref worker, const http_size_t index) {
+    http_connection_ref connection = &worker->connections[index];
+    
+    // no more requests from a client not taking its answers, until it catches up
+    if (!connection->readPaused && connection->queuedSize >= HTTP_OUTPUT_HIGH_WATERMARK)
+        connection->readPaused = true;
+    else if (connection->readPaused && connection->queuedSize <= HTTP_OUTPUT_LOW_WATERMARK)
+        connection->readPaused = false;
+    
+    http_fd_event_t events = HTTP_FD_EVENT_NONE;
+    
+    if (!connection->closeAfterFlush && !connection->readPaused)
+        events |= HTTP_FD_EVENT_READ;
+    if (connection->writeBlocked)
+        events |= HTTP_FD_EVENT_WRITE;
+    
+    if (events != connection->events) {
+        connection->events = events;
+        http_fd_set_modify(worker->clientsFDs, index, events);
+    }
+}
+
+bool http_worker_send(http_worker_ref worker, const http_size_t index) {
+    http_connection_ref connection = &worker->connections[index];
+    
+    // the backend can't send asynchronously, do it right here
+    if (!worker->asyncSend)
+        return http_connection_flush(connection);
+    
+    // there's no asynchronous sendfile, so file bodies go out right here
+    while (http_connection_wants_sendfile(connection)) {
+        if (http_connection_sendfile(connection) >= 0 || errno == EINTR)
+            continue;
+        else if (connection->writeBlocked)
+            return true;
+        
+        HI_ERRNO_DEBUG("sendfile failed");
+        return false;
+    }
+    
+    if (!http_connection_can_send(connection))
+        return true;
+    else if (http_connection_wants_produce(connection) && !http_connection_produce(connection)) {
+        HI_DEBUG("streamed body of client %d failed", connection->sk);
+        return false;
+    }
+    
+    // everything answered so far goes out as one submission
+    http_connection_build_message(connection);
+    
+    if (http_fd_set_send(worker->clientsFDs, index, &connection->message)) {
+        connection->sending = true;
+        return true;
+    }
+    
+    HI_DEBUG("async send failed for client %d", connection->sk);
+    return false;
+}
+
+bool http_worker_flush(http_worker_ref worker, const http_size_t index) {
+    http_connection_ref connection = &worker->connections[index];
+    
+    // a send in flight is continued by http_worker_sent, a full socket once it's
+    // writable again
+    if (!connection->sending && !connection->writeBlocked &&
+        http_connection_can_send(connection) && !http_worker_send(worker, index))
+        return false;
+    
+    http_worker_update_events(worker, index);
+    return !http_worker_is_done(connection);
+}
+
+void http_worker_sent(http_worker_ref worker, const http_size_t index,
+                      const http_ssize_t result) {
+    http_connection_ref connection = &worker->connections[index];
+    connection->sending = false;
+    
+    // the socket is non-blocking, the kernel may give up on a full send buffer
+    bool blocked = (result == -EAGAIN || result == -EWOULDBLOCK);
+    
+    if ((result < 0 && !blocked) || connection->closing) {
+        HI_DEBUG("send to client %d failed: %s", connection->sk, strerror(-result));
+        
+        connection->closing = false;
+        http_worker_close(worker, index);
+        return;
+    }
+    
+    // release whatever made it out and push the rest (or newer responses)
+    if (blocked)
+        connection->writeBlocked = true;
+    else
+        http_connection_sent(connection, (size_t)result);
+    
+    if (!http_worker_flush(worker, index))
+        http_worker_close(worker, index);
+}
+
+http_headers_ref http_worker_make_error(const http_status_t status) {
+    // the reason phrases are static, nothing to allocate or deallocate
+    const char* reason = http_status_get_reason(status);
+    http_headers_ref response = http_headers_init_with_response(status, "text/plain",
+                                                                (void*)reason,
+                                                                (http_size_t)strlen(reason),
+                                                                NULL);
+    http_headers_set(response, "Connection", "close");
+    
+    return response;
+}
+
+void http_worker_handle_request(http_worker_ref worker, const http_size_t index,
+                                char* message) {
+    http_server_ref server = worker->server;
+    http_connection_ref connection = &worker->connections[index];
+    http_parser_ref parser = &connection->parser;
+    
+    HI_DEBUG("got %u bytes long request from %d", parser->position, connection->sk);
+    
+    // create request object, a view of the received message living on the stack
+    struct http_headers_s requestView;
+    http_headers_ref request = &requestView;
+    
+    http_headers_init_view(request, parser, message, connection->arena,
+                           connection->ipAddress, connection->port);
+    
+    // large bodies are in their file by now
+    if (http_connection_is_spilling(connection))
+        http_headers_set_body_file(request, connection->spillFD, parser->body.length);
+
+#ifdef DEBUG
+    HI_DEBUG("headers:");
+    http_headers_debug_dump(request);
+#endif
+    
+    // the log record is taken while the request is still there
+    http_log_record_t logRecord;
+    
+    if (worker->logRing)
+        http_log_record_request(&logRecord, request);
+    
+    uint64_t started = http_stats_clock();
+    
+    if (connection->tracing) {
+        http_trace_record_request(&connection->trace, request);
+        connection->trace.callbackEntered = started;
+    }
+    
+    // prepare for response, which (like whatever else the callback allocates via
+    // http_headers_alloc) lives in the connection's arena until it's sent
+    http_headers_ref response = NULL;
+    http_arena_set_current(connection->arena);
+    
+    http_worker_current = worker;
+    http_worker_current_index = index;
+    
+    if (http_worker_is_metrics(worker, request))
+        response = http_worker_make_metrics(worker);
+    else if (server->requestCB) {
+        response = server->requestCB(request, server->cbData);
+        
+        if (!response) {
+            perror("Callback returned NULL, HTTP server will send 500 Internal Server Error!");
+            perror("If you're the developer of this application, please keep in mind that the HTTP server callback must NEVER return NULL.");
+            
+            // dummy response
+            response = http_headers_init_with_response(500, "text/plain", strdup("error"), 5, free);
+        }
+    } else {
+        const char* staticText = "<h1>Congrats, the server is up!</h1><br> Don't forget to add a callback to handle your own requests.";
         
-        // to handle the new client immediately
-        int newClient = 0;
+        response = http_headers_init_with_response(200, "text/html", strdup(staticText), (http_size_t)strlen(staticText), free);
+    }
+    
+    http_worker_current = NULL;
+    
+    // decide whether the connection outlives this request. Request lines without a
+    // version get neither keep-alive nor chunked bodies
+    connection->requestsCount++;
+    
+    const char* version = request->requestVersion;
+    bool isHTTP10 = (!version || strcmp(version, "HTTP/1.0") == 0);
+    
+    bool keepAlive = (server->idleTimeout > 0 && http_headers_wants_keep_alive(request) &&
+                      connection->requestsCount < server->requestsMax);
+    const char* connectionHeader = NULL;
+    
+    if (!keepAlive) {
+        connectionHeader = "close";
+        connection->closeAfterFlush = true;
+    } else if (isHTTP10)
+        connectionHeader = "keep-alive";
+    
+    // answers to HEAD are just like answers to GET, minus the body
+    bool withBody = (strcmp(http_headers_get_request_type(request), "HEAD") != 0);
+    // HTTP/1.0 has no chunked transfer coding, streamed bodies end with the connection
+    bool canChunk = !isHTTP10;
+    
+    // goodbye, request
+    http_headers_deinit(request);
+    http_arena_set_current(NULL);
+    
+    if (response->deferred) {
+        // holds its place in the queue until http_deferred_respond fills it in
+        http_deferred_ref deferred = response->deferred;
+        deferred->connectionHeader = connectionHeader;
+        deferred->withBody = withBody;
+        deferred->canChunk = canChunk;
+        deferred->pending = http_connection_queue_deferred(connection, response, deferred);
+        
+        deferred->started = started;
+        
+        if (worker->logRing)
+            deferred->logRecord = logRecord;
+        
+        return;
+    }
+    
+    if (!canChunk && http_headers_get_stream(response)) {
+        http_stream_set_unframed(response);
         
-        if (http_fd_set_is_set(server->clientsFDs, server->mainSocket)) {
-            // new connection
-            newClient = accept(server->mainSocket, NULL, NULL);
-            HI_DEBUG("new connection %d", newClient);
+        connectionHeader = "close";
+        connection->closeAfterFlush = true;
+    }
+    
+    if (connectionHeader)
+        http_headers_set(response, "Connection", connectionHeader);
+    
+    uint64_t answered = http_worker_answered(worker, &logRecord, started, response, withBody);
+    
+    if (connection->tracing) {
+        connection->trace.callbackLeft = answered;
+        connection->trace.status = response->statusCode;
+    }
+    
+    // the response goes out together with the rest of the batch
+    http_connection_queue(connection, response, withBody);
+}
+
+void http_worker_reject(http_worker_ref worker, const http_size_t index,
+                        const http_status_t status) {
+    http_connection_ref connection = &worker->connections[index];
+    
+    http_stats_count_status(worker->stats, status);
+    connection->trace.status = status;
+    
+    // nothing the client sends after this is looked at
+    http_connection_queue(connection, http_worker_make_error(status), true);
+    connection->closeAfterFlush = true;
+}
+
+void http_worker_continue(http_worker_ref worker, const http_size_t index,
+                          const char* message, const http_size_t size) {
+    http_connection_ref connection = &worker->connections[index];
+    http_parser_ref parser = &connection->parser;
+    
+    const http_parser_field_t* expect = http_parser_find(parser, message, "Expect");
+    bool isHTTP10 = (parser->version.length < 1 ||
+                     strncmp(message + parser->version.offset, "HTTP/1.0", 8) == 0);
+    
+    // only for HTTP/1.1 clients waiting for it before sending their body, and only if
+    // it doesn't have to wait for other answers (the client sends it anyway after a
+    // while then)
+    if (!expect || isHTTP10 || expect->value.length != 12 ||
+        strncasecmp(message + expect->value.offset, "100-continue", 12) != 0 ||
+        parser->body.length < 1 || size > parser->body.offset ||
+        http_connection_has_pending(connection))
+        return;
+    
+    const char* interim = "HTTP/1.1 100 Continue\r\n\r\n";
+    
+    if (send(connection->sk, interim, strlen(interim), MSG_NOSIGNAL | MSG_DONTWAIT) < 0)
+        HI_ERRNO_DEBUG("couldn't send 100 Continue");
+}
+
+http_size_t http_worker_process(http_worker_ref worker, const http_size_t index,
+                                char* data, const http_size_t size) {
+    http_server_ref server = worker->server;
+    http_connection_ref connection = &worker->connections[index];
+    http_parser_ref parser = &connection->parser;
+    http_size_t consumed = 0;
+    
+    // answer every complete request, clients may pipeline several of them
+    while (!connection->closeAfterFlush && consumed < size) {
+        if (http_connection_is_spilling(connection)) {
+            // the body of a large request goes straight to its file
+            http_size_t spilled = 0;
             
-            // add the new client to the array
-            if (newClient >= 0)
-                http_fd_set_add(server->clientsFDs, newClient, false);
-            else {
-                // uh oh, error, warn the user
-                HI_ERRNO_DEBUG("accept from client failed, here is the reason, will continue as usual");
+            if (!http_connection_spill(connection, data + consumed, size - consumed, &spilled)) {
+                http_connection_end_spill(connection);
+                http_worker_reject(worker, index, HTTP_INTERNAL_SERVER_ERROR);
+                
+                return size;
             }
+            
+            consumed += spilled;
+            
+            if (connection->spillLeft > 0)
+                break;
+            
+            http_worker_handle_request(worker, index, connection->spillHeading);
+            
+            http_connection_end_spill(connection);
+            http_parser_reset(parser);
+            continue;
         }
         
-        for (http_size_t sz = 0; sz < server->clientsMax; sz++) {
-            int checkedSocket = http_fd_set_get_socket(server->clientsFDs, sz);
+        // a new request, which might be one to trace
+        if (parser->position < 1)
+            http_worker_trace_begin(worker, index);
+        
+        // picks up right where the last call stopped
+        uint64_t parseStarted = http_stats_clock();
+        http_parser_result_t result = http_parser_feed(parser, data + consumed,
+                                                       size - consumed);
+        
+        connection->parseTime += http_stats_clock() - parseStarted;
+        
+        if (result == HTTP_PARSER_HEADERS_COMPLETE) {
+            if (connection->tracing)
+                connection->trace.parsed = http_stats_clock();
+            
+            http_worker_continue(worker, index, data + consumed, size - consumed);
             
-            // check if there is anything new on the connection front
-            if (newClient == checkedSocket || http_fd_set_is_set(server->clientsFDs, checkedSocket)) {
-                HI_DEBUG("react to %d", checkedSocket);
+            if (parser->body.length <= server->bodySpillSize)
+                continue; // now wait for the body
+            
+            // the rest of it isn't parsed, just written out
+            http_stats_record(&worker->stats->parseTime, connection->parseTime);
+            connection->parseTime = 0;
+            
+            if (!http_connection_begin_spill(connection, data + consumed,
+                                                  parser->body.offset, parser->body.length)) {
+                http_worker_reject(worker, index, HTTP_INTERNAL_SERVER_ERROR);
+                return size;
+            }
+            
+            // from here on, the input is all body
+            consumed += parser->body.offset;
+            continue;
+        } else if (result == HTTP_PARSER_NEED_MORE)
+            break;
+        else if (result == HTTP_PARSER_ERROR) {
+            HI_DEBUG("bad request from %d, rejecting it", connection->sk);
+            
+            HTTP_STATS_ADD(worker->stats->parseErrors, 1);
+            http_worker_reject(worker, index, parser->error);
+            return size;
+        }
+        
+        http_stats_record(&worker->stats->parseTime, connection->parseTime);
+        connection->parseTime = 0;
+        
+        http_worker_handle_request(worker, index, data + consumed);
+        
+        consumed += parser->position;
+        http_parser_reset(parser);
+    }
+    
+    // whatever follows a request closing the connection is dropped
+    return connection->closeAfterFlush ? size : consumed;
+}
+
+bool http_worker_handle_data(http_worker_ref worker, const http_size_t index,
+                             char* raw, const http_size_t rawSize) {
+    http_connection_ref connection = &worker->connections[index];
+    HTTP_STATS_ADD(worker->stats->bytesIn, rawSize);
+    
+    if (connection->inputSize < 1) {
+        // usual case, whole requests in one chunk, no need to copy anything
+        http_size_t consumed = http_worker_process(worker, index, raw, rawSize);
+        
+        if (consumed < rawSize &&
+            !http_connection_append_input(connection, raw + consumed, rawSize - consumed,
+                                          HTTP_REQUEST_SIZE_MAX))
+            return false;
+    } else {
+        // continues what was received before
+        if (!http_connection_append_input(connection, raw, rawSize, HTTP_REQUEST_SIZE_MAX))
+            return false;
+        
+        http_connection_consume_input(connection,
+                                      http_worker_process(worker, index, connection->input,
+                                                          connection->inputSize));
+    }
+    
+    return http_worker_flush(worker, index);
+}
+
+bool http_worker_handle_client(http_worker_ref worker, const http_size_t index) {
+    http_connection_ref connection = &worker->connections[index];
+    HI_DEBUG("react to %d", connection->sk);
+    
+    // read right behind whatever is left from before, bodies on their way to a file
+    // in larger portions
+    http_size_t readSize = http_connection_is_spilling(connection) ?
+                           HTTP_CONNECTION_SPILL_READ_SIZE : HTTP_REQUEST_FIELD_SIZE;
+    
+    if (!http_connection_reserve_input(connection, readSize, HTTP_REQUEST_SIZE_MAX))
+        return false;
+    
+    ssize_t rawRead = read(connection->sk, connection->input + connection->inputSize,
+                           connection->inputCapacity - connection->inputSize);
+    
+    if (rawRead < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+        return true; // nothing there after all
+    else if (rawRead == 0 && http_connection_has_pending(connection)) {
+        // the client is done talking, but some answers are still to come
+        connection->closeAfterFlush = true;
+        http_worker_update_events(worker, index);
+        
+        return true;
+    } else if (rawRead < 1)
+        return false; // connection terminated
+    
+    connection->inputSize += (http_size_t)rawRead;
+    HTTP_STATS_ADD(worker->stats->bytesIn, (uint64_t)rawRead);
+    
+    http_connection_consume_input(connection,
+                                  http_worker_process(worker, index, connection->input,
+                                                      connection->inputSize));
+    
+    return http_worker_flush(worker, index);
+}
+
+void http_worker_wake(http_worker_ref worker, const http_fd_event_t events) {
+    if (events & HTTP_FD_EVENT_READ) {
+        // the wake-ups themselves carry nothing (completion backends drop them)
+        char drained[64];
+        while (read(worker->wakeSockets[0], drained, sizeof(drained)) > 0);
+    }
+    
+    pthread_mutex_lock(&worker->mailboxLock);
+    http_deferred_ref deferred = worker->mailbox;
+    worker->mailbox = NULL;
+    pthread_mutex_unlock(&worker->mailboxLock);
+    
+    while (deferred) {
+        http_deferred_ref next = deferred->next;
+        http_connection_ref connection = &worker->connections[deferred->index];
+        
+        if (connection->sk >= 0 && !connection->closing &&
+            connection->generation == deferred->generation) {
+            if (!deferred->canChunk && http_headers_get_stream(deferred->response)) {
+                http_stream_set_unframed(deferred->response);
                 
-                char* raw = calloc(HTTP_REQUEST_FIELD_SIZE, sizeof(char));
-                ssize_t rawRead = read(checkedSocket, raw, HTTP_REQUEST_FIELD_SIZE);
+                deferred->connectionHeader = "close";
+                connection->closeAfterFlush = true;
+            }
+            
+            if (deferred->connectionHeader)
+                http_headers_set(deferred->response, "Connection", deferred->connectionHeader);
+            
+            uint64_t answered = http_worker_answered(worker, &deferred->logRecord,
+                                                     deferred->started, deferred->response,
+                                                     deferred->withBody);
+            
+            if (deferred->pending->trace) {
+                deferred->pending->trace->callbackLeft = answered;
+                deferred->pending->trace->status = deferred->response->statusCode;
+            }
+            
+            http_connection_resolve(connection, deferred->pending, deferred->response,
+                                    deferred->withBody);
+            http_worker_touch(worker, deferred->index);
+            
+            if (!http_worker_flush(worker, deferred->index))
+                http_worker_close(worker, deferred->index);
+        } else {
+            // the client didn't wait for it
+            http_headers_release(deferred->response);
+        }
+        
+        free(deferred);
+        deferred = next;
+    }
+}
+
+int http_worker_sweep(http_worker_ref worker) {
+    http_size_t idleTimeout = worker->server->idleTimeout;
+    
+    if (idleTimeout < 1)
+        idleTimeout = HTTP_KEEP_ALIVE_TIMEOUT;
+    
+    // the least recently active connections come first
+    while (worker->idleHead != HTTP_FD_SET_MAIN_INDEX) {
+        http_size_t index = worker->idleHead;
+        http_connection_ref connection = &worker->connections[index];
+        
+        time_t expires = connection->lastActive + (time_t)idleTimeout;
+        
+        if (expires > worker->now)
+            return (int)(expires - worker->now) * 1000;
+        else if (connection->sending || connection->deferredCount > 0) {
+            // still busy answering, that's not idling
+            http_worker_touch(worker, index);
+            continue;
+        }
+        
+        HI_DEBUG("client %d idle for too long", connection->sk);
+        http_worker_close(worker, index);
+    }
+    
+    // nothing to wait for
+    return -1;
+}
+
+void http_worker_run(http_worker_ref worker) {
+    http_fd_set_ref clientsFDs = worker->clientsFDs;
+    
+    // now that we're listening, roll the event loop
+    while (true) {
+        worker->now = http_worker_clock();
+        
+        // sleep until something actually happens or an idle client has to go
+        http_ssize_t readyCount = http_fd_set_wait(clientsFDs, http_worker_sweep(worker));
+        if (readyCount < 0)
+            return;
+        
+        HI_DEBUG("%d sockets ready", readyCount);
+        worker->now = http_worker_clock();
+        
+        for (http_size_t sz = 0; sz < (http_size_t)readyCount; sz++) {
+            int checkedSocket = -1;
+            http_size_t index = 0;
+            
+            http_fd_event_t events = http_fd_set_get_ready(clientsFDs, sz,
+                                                           &checkedSocket, &index);
+            if (events == HTTP_FD_EVENT_NONE)
+                continue;
+            
+            if (index == HTTP_FD_SET_MAIN_INDEX) {
+                // new connection
+                if (events & HTTP_FD_EVENT_ACCEPTED)
+                    http_worker_accepted(worker, checkedSocket);
+                else
+                    http_worker_accept(worker);
+                
+                continue;
+            } else if (index == worker->wakeIndex) {
+                // deferred responses are there
+                http_worker_wake(worker, events);
+                continue;
+            }
+            
+            http_connection_ref connection = &worker->connections[index];
+            
+            // nothing but the completion of the last send matters for it anymore
+            if (connection->sk < 0 || (connection->closing && !(events & HTTP_FD_EVENT_SENT)))
+                continue;
+            
+            bool keep = true;
+            http_worker_touch(worker, index);
+            
+            if (events & HTTP_FD_EVENT_SENT) {
+                http_worker_sent(worker, index, http_fd_set_get_data(clientsFDs, sz, NULL));
+                continue;
+            } else if (events & HTTP_FD_EVENT_WRITE) {
+                // room in the socket's send buffer again
+                connection->writeBlocked = false;
                 
-                if (rawRead < 1) {
-                    // connection terminated
-                    free(raw);
-                    
-                    HI_DEBUG("client %d saying his goodbyes to us", checkedSocket);
-                    http_fd_set_nullify_socket(server->clientsFDs, sz);
-                } else {
-                    HI_DEBUG("read %d bytes", rawRead);
-                    
-                    // create request object
-                    http_headers_ref request = http_headers_init_with_request(raw, (http_size_t)rawRead);
-                    
-                    // populate it with IP info
-                    char* ipAddress = NULL;
-                    http_port_t ipPort = 8080;
-                    
-                    if (server->useIPv6)
-                        http_getpeerinfo6(checkedSocket, &ipAddress, &ipPort);
-                    else
-                        http_getpeerinfo(checkedSocket, &ipAddress, &ipPort);
-                    
-                    // save IP info
-                    http_headers_set_client_info(request, ipAddress, ipPort);
-                    free(ipAddress);
-                    
-                    HI_DEBUG("headers:");
-                    http_headers_debug_dump(request);
-                    
-                    // prepare for response
-                    
-                    http_headers_ref response = NULL;
-                    char* headersSent = NULL;
-                    http_size_t headersSentSize = 0;
-                    
-                    if (server->requestCB) {
-                        response = server->requestCB(request, server->cbData);
-                        
-                        if (!response) {
-                            perror("Callback returned NULL, HTTP server will send 500 Internal Server Error!");
-                            perror("If you're the developer of this application, please keep in mind that the HTTP server callback must NEVER return NULL.");
-                            
-                            // dummy response
-                            response = http_headers_init_with_response(500, "text/plain", strdup("error"), 5, free);
-                        }
-                    } else {
-                        const char* staticText = "<h1>Congrats, the server is up!</h1><br> Don't forget to add a callback to handle your own requests.";
-                        
-                        response = http_headers_init_with_response(200, "text/html", strdup(staticText), (http_size_t)strlen(staticText), free);
-                    }
-                    
-                    headersSent = http_headers_get_response(response, &headersSentSize);
-                    
-                    // send headers
-                    send(checkedSocket, headersSent, headersSentSize, 0);
-                    
-                    // send body
-                    http_size_t respSize = 0;
-                    void* resp = http_headers_get_body(response, &respSize);
-                    
-                    send(checkedSocket, resp, strlen(resp), 0);
-                    
-                    // goodbye, response and request
-                    http_headers_release(response);
-                    http_headers_release(request);
-                    
-                    // TODO: support other responses
-                    // TODO: handle properly
+                if (!http_worker_flush(worker, index)) {
+                    http_worker_close(worker, index);
+                    continue;
                 }
             }
+            
+            if ((events & HTTP_FD_EVENT_HANGUP) && http_connection_has_pending(connection)) {
+                // the client might just be done talking while still waiting for the
+                // answers on their way, they close it once they are out
+                connection->closeAfterFlush = true;
+                http_worker_update_events(worker, index);
+                continue;
+            } else if (connection->closeAfterFlush) {
+                // not interested in anything the client has to say anymore
+                keep = !(events & HTTP_FD_EVENT_HANGUP);
+            } else if (events & HTTP_FD_EVENT_DATA) {
+                // the backend already did the reading for us
+                char* raw = NULL;
+                http_ssize_t rawRead = http_fd_set_get_data(clientsFDs, sz, &raw);
+                
+                keep = (rawRead > 0 &&
+                        http_worker_handle_data(worker, index, raw, (http_size_t)rawRead));
+            } else if (events & HTTP_FD_EVENT_READ)
+                keep = http_worker_handle_client(worker, index);
+            else if (events & HTTP_FD_EVENT_HANGUP)
+                keep = false;
+            
+            if (!keep)
+                http_worker_close(worker, index);
+        }
+    }
+}
+
+http_headers_ref http_headers_init_deferred(const http_headers_ref request,
+                                            http_deferred_ref* deferredPtr) {
+    http_worker_ref worker = http_worker_current;
+    
+    if (!request || !deferredPtr || !worker || worker->wakeIndex == HTTP_FD_SET_MAIN_INDEX) {
+        HI_DEBUG("requests can only be deferred from within the callback");
+        return NULL;
+    }
+    
+    http_deferred_ref deferred = hizalloc_struct(http_deferred_s);
+    deferred->worker = worker;
+    deferred->index = http_worker_current_index;
+    deferred->generation = worker->connections[deferred->index].generation;
+    
+    // stands in for the response in the connection's queue until it's there
+    http_headers_ref placeholder = http_headers_init_with_response(HTTP_OK, "text/plain",
+                                                                   NULL, 0, NULL);
+    placeholder->deferred = deferred;
+    
+    (*deferredPtr) = deferred;
+    return placeholder;
+}
+
+void http_deferred_respond(http_deferred_ref deferred,
+                           http_headers_ref response) {
+    if (!deferred) {
+        http_headers_release(response);
+        return;
+    } else if (!response) {
+        HI_DEBUG("deferred request answered with NULL, sending 500 Internal Server Error");
+        response = http_headers_init_with_response(500, "text/plain", strdup("error"), 5, free);
+    }
+    
+    deferred->response = response;
+    http_worker_ref worker = deferred->worker;
+    
+    pthread_mutex_lock(&worker->mailboxLock);
+    bool wasEmpty = (worker->mailbox == NULL);
+    
+    deferred->next = worker->mailbox;
+    worker->mailbox = deferred;
+    pthread_mutex_unlock(&worker->mailboxLock);
+    
+    // one wake-up per batch, the worker takes the whole mailbox at once
+    char wakeUp = 1;
+    
+    if (wasEmpty && send(worker->wakeSockets[1], &wakeUp, 1, MSG_NOSIGNAL) < 0 &&
+        errno != EAGAIN && errno != EWOULDBLOCK)
+        HI_ERRNO_DEBUG("failed to wake the worker up");
+}
+
+bool http_server_listen(http_server_ref server) {
+    return http_server_listen_workers(server, 1);
+}
+
+bool http_server_listen_workers(http_server_ref server,
+                                const http_size_t workersCount) {
+    if (!server) {
+        HI_DEBUG("NULL server parameter specified");
+        return false;
+    } else if (listen(server->mainSocket, HTTP_PENDING_CONNECTIONS_MAX) != 0) {
+        HI_ERRNO_DEBUG("listen failed, returning false");
+        return false;
+    }
+    
+    // sendfile() has no MSG_NOSIGNAL, a client leaving mid-file must not kill us. The
+    // signal is blocked rather than ignored, the handler belongs to the host, and the
+    // workers inherit the mask
+    sigset_t pipeSignal;
+    sigset_t previousSignals;
+    sigemptyset(&pipeSignal);
+    sigaddset(&pipeSignal, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &pipeSignal, &previousSignals);
+    
+    http_size_t count = workersCount;
+    
+    // one worker per core by default
+    if (count < 1) {
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        count = (cores > 0) ? (http_size_t)cores : 1;
+    }
+    
+    // the workers' rings are added to it as they're set up
+    if (server->accessLogFD >= 0 && !server->accessLog)
+        server->accessLog = http_log_init(server->accessLogFD);
+    
+    // counted from here on, summed up by http_server_get_stats
+    if (server->statsCount < count) {
+        __atomic_store_n(&server->statsCount, 0, __ATOMIC_RELEASE);
+        
+        free(server->stats);
+        server->stats = calloc(count, sizeof(http_stats_t));
+    }
+    
+    __atomic_store_n(&server->statsCount, count, __ATOMIC_RELEASE);
+    
+    if (server->traceInterval > 0 && server->tracesCount < count) {
+        http_size_t tracesCount = server->tracesCount;
+        __atomic_store_n(&server->tracesCount, 0, __ATOMIC_RELEASE);
+        
+        http_trace_release_rings(server->traces, tracesCount);
+        server->traces = http_trace_init_rings(count);
+        
+        // no tracing without them
+        if (!server->traces)
+            server->traceInterval = 0;
+        else
+            __atomic_store_n(&server->tracesCount, count, __ATOMIC_RELEASE);
+    }
+    
+    http_worker_ref workers = calloc(count, sizeof(struct http_worker_s));
+    
+    for (http_size_t sz = 0; sz < count; sz++)
+        http_worker_init(&workers[sz], server, sz);
+    
+    // worker 0 runs right here, the rest get threads of their own
+    http_size_t started = 1;
+    
+    for (; started < count; started++) {
+        if (pthread_create(&workers[started].thread, NULL, http_worker_thread,
+                           &workers[started]) != 0) {
+            HI_ERRNO_DEBUG("pthread_create failed, continuing with fewer workers");
+            break;
         }
     }
+    
+    HI_DEBUG("server <%p> running %u workers", server, started);
+    http_worker_run(&workers[0]);
+    
+    for (http_size_t sz = 1; sz < started; sz++)
+        pthread_join(workers[sz].thread, NULL);
+    
+    for (http_size_t sz = 0; sz < count; sz++)
+        http_worker_release(&workers[sz]);
+    
+    free(workers);
+    
+    // whatever the workers logged last is written out before the log goes
+    http_log_release(server->accessLog);
+    server->accessLog = NULL;
+    
+    // whatever the workers raised is dropped instead of being delivered on unblocking
+    if (!sigismember(&previousSignals, SIGPIPE)) {
+        struct timespec noWait = { 0, 0 };
+        
+        while (sigtimedwait(&pipeSignal, NULL, &noWait) == SIGPIPE)
+            continue;
+    }
+    
+    pthread_sigmask(SIG_SETMASK, &previousSignals, NULL);
+    return false;
 }
 
 void http_server_release(http_server_ref server) {
@@ -309,6 +1398,8 @@ void http_server_release(http_server_ref server) {
     
     // destroy fd_set
     http_fd_set_release(server->clientsFDs);
+    free(server->stats);
+    http_trace_release_rings(server->traces, server->tracesCount);
     // destroy main socket first
     close(server->mainSocket);
     free(server);
@@ -10,7 +10,17 @@
 
 #include <arpa/inet.h>
 #include <sys/socket.h>
+#include <pthread.h>
 #include "fds.h"
+#include "connection.h"
+#include "log.h"
+#include "stats.h"
+
+/// single event loop thread of the HTTP server
+typedef struct http_worker_s* http_worker_ref;
+
+/// slots of a worker's fd set: one per client plus one for its wake-up socket
+#define HTTP_WORKER_SLOTS(server) ((server)->clientsMax + 1)
 
 struct http_server_s {
     // IP address to listen on
@@ -21,12 +31,38 @@ struct http_server_s {
     // if true, use server->ipv6 field for valid address
     bool useIPv6;
     
-    // maximum accepted connections at a time
+    // maximum accepted connections at a time (per worker)
     http_size_t clientsMax;
+    // event backend requested for the workers
+    http_backend_t backend;
+    
+    // seconds an idle keep-alive connection is kept open, 0 disables keep-alive
+    http_size_t idleTimeout;
+    // requests served over one connection before it gets closed
+    http_size_t requestsMax;
+    
+    // larger request bodies are rejected, see http_server_set_body_limits
+    http_size_t bodyMax;
+    // larger request bodies go to a temporary file
+    http_size_t bodySpillSize;
+    
+    // access log destination (-1 if none) and its writer while listening
+    int accessLogFD;
+    http_log_ref accessLog;
+    // path answered with the metrics instead of calling the callback, NULL if none
+    const char* metricsPath;
+    // one per worker, allocated when listening and kept until the server is released
+    http_stats_t* stats;
+    http_size_t statsCount;
+    // every traceInterval-th request of a worker is traced (0 if none), into a ring
+    // per worker, allocated and kept just like the stats
+    http_size_t traceInterval;
+    http_trace_ring_ref traces;
+    http_size_t tracesCount;
     // client connections managed by a fd_set wrapper
     http_fd_set_ref clientsFDs;
     
-    // main listening socket
+    // main listening socket (used by the first worker)
     int mainSocket;
     
     // callback called on every request
@@ -35,6 +71,69 @@ struct http_server_s {
     void* cbData;
 };
 
+struct http_worker_s {
+    // server this worker belongs to
+    http_server_ref server;
+    // worker number, 0 runs on the thread that called http_server_listen
+    http_size_t number;
+    
+    // listening socket, SO_REUSEPORT sibling of the server's one for number > 0
+    int mainSocket;
+    // this worker's client connections, never touched by other workers
+    http_fd_set_ref clientsFDs;
+    // state of every client, indexed by the fd set slot
+    http_connection_ref connections;
+    // true if the backend sends by itself (io_uring)
+    bool asyncSend;
+    // access log records of this worker, NULL if there's no access log
+    http_log_ring_ref logRing;
+    // counted by this worker only, one of server->stats
+    http_stats_t* stats;
+    // traced requests of this worker, NULL if tracing is off, and the requests
+    // since the last traced one
+    http_trace_ring_ref traceRing;
+    http_size_t traceCounter;
+    
+    // connections ordered by last activity, the least recent one first
+    // (HTTP_FD_SET_MAIN_INDEX if none)
+    http_size_t idleHead;
+    http_size_t idleTail;
+    // monotonic time (in seconds) of the current event loop iteration
+    time_t now;
+    
+    // deferred responses handed over by other threads, newest first
+    pthread_mutex_t mailboxLock;
+    http_deferred_ref mailbox;
+    // writing to the second socket wakes the event loop up, the first one is
+    // watched in the wakeIndex slot
+    int wakeSockets[2];
+    http_size_t wakeIndex;
+    
+    pthread_t thread;
+};
+
+struct http_deferred_s {
+    // the client waiting for the response, which might be gone by the time it's
+    // there if the slot's generation changed
+    http_worker_ref worker;
+    http_size_t index;
+    uint32_t generation;
+    http_pending_ref pending;
+    
+    // decided on when the request came in
+    const char* connectionHeader;
+    bool withBody;
+    bool canChunk;
+    
+    // logged once the response is there, started is when the callback was called
+    http_log_record_t logRecord;
+    uint64_t started;
+    
+    // the response and the next one in the worker's mailbox
+    http_headers_ref response;
+    http_deferred_ref next;
+};
+
 struct sockaddr_in http_make_ipv4(const char* ipAddress,
                                   const http_port_t ipPort);
 struct sockaddr_in6 http_make_ipv6(const char* ipAddress,
@@ -44,7 +143,10 @@ http_server_ref http_server_init(const char* ipAddress,
                                  const http_port_t ipPort,
                                  const bool useIPv6);
 
-void http_getpeerinfo(int sk, char** ipAddressPtr, http_port_t* portPtr);
-void http_getpeerinfo6(int sk, char** ipAddressPtr, http_port_t* portPtr);
+/// creates, configures and binds a listening socket, returns -1 on failure
+int http_server_init_socket(const http_server_ref server);
 
-bool http_server_init_socket(http_server_ref result, bool isIPv6);
+bool http_worker_init(http_worker_ref worker, http_server_ref server,
+                      const http_size_t number);
+void http_worker_run(http_worker_ref worker);
+void http_worker_release(http_worker_ref worker);
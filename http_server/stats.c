@@ -0,0 +1,226 @@
+//
+//  stats.c
+//  http_server
+//
+//  Created by Tim K. on 26.02.23.
+//  Copyright © 2023 Tim K. All rights reserved.
+//
+
+#include <string.h>
+#include <sys/param.h>
+#include "stats.h"
+
+//
+// private
+//
+
+/// sub-buckets per power of two are 2^HTTP_STATS_SUB_BITS
+#define HTTP_STATS_SUB_BITS 3
+#define HTTP_STATS_SUB_COUNT (1 << HTTP_STATS_SUB_BITS)
+
+/// powers of two (in nanoseconds) the metrics endpoint has histogram buckets for,
+/// about 1 us to 34 s
+#define HTTP_STATS_TEXT_EXPONENT_MIN 10
+#define HTTP_STATS_TEXT_EXPONENT_MAX 35
+
+typedef struct {
+    char* text;
+    http_size_t size;
+} http_stats_text_t;
+
+http_size_t http_stats_get_index(const uint64_t value) {
+    // the smallest values have a bucket each, larger ones share a power of two
+    // between HTTP_STATS_SUB_COUNT buckets
+    if (value < HTTP_STATS_SUB_COUNT)
+        return (http_size_t)value;
+    
+    unsigned exponent = 63 - (unsigned)__builtin_clzll(value);
+    unsigned shift = exponent - HTTP_STATS_SUB_BITS;
+    
+    return (http_size_t)(HTTP_STATS_SUB_COUNT + shift * HTTP_STATS_SUB_COUNT +
+                         ((value >> shift) & (HTTP_STATS_SUB_COUNT - 1)));
+}
+
+uint64_t http_stats_get_upper_bound(const http_size_t index) {
+    if (index < HTTP_STATS_SUB_COUNT)
+        return index;
+    
+    unsigned shift = (index - HTTP_STATS_SUB_COUNT) / HTTP_STATS_SUB_COUNT;
+    uint64_t sub = (index - HTTP_STATS_SUB_COUNT) % HTTP_STATS_SUB_COUNT;
+    
+    // the largest value that still falls into it
+    return ((HTTP_STATS_SUB_COUNT + sub + 1) << shift) - 1;
+}
+
+uint64_t http_stats_load(const uint64_t* field) {
+    return __atomic_load_n(field, __ATOMIC_RELAXED);
+}
+
+void http_stats_sum_histogram(http_histogram_t* total, const http_histogram_t* histogram) {
+    total->count += http_stats_load(&histogram->count);
+    total->sum += http_stats_load(&histogram->sum);
+    
+    uint64_t max = http_stats_load(&histogram->max);
+    
+    if (max > total->max)
+        total->max = max;
+    
+    for (http_size_t sz = 0; sz < HTTP_HISTOGRAM_BUCKETS; sz++)
+        total->buckets[sz] += http_stats_load(&histogram->buckets[sz]);
+}
+
+void http_stats_append(http_stats_text_t* text, const char* format, ...) {
+    if (text->size >= HTTP_STATS_TEXT_MAX)
+        return;
+    
+    va_list args;
+    va_start(args, format);
+    
+    int length = vsnprintf(text->text + text->size, HTTP_STATS_TEXT_MAX - text->size,
+                           format, args);
+    
+    va_end(args);
+    
+    if (length > 0)
+        text->size = MIN(text->size + (http_size_t)length, HTTP_STATS_TEXT_MAX);
+}
+
+void http_stats_append_counter(http_stats_text_t* text, const char* name,
+                               const char* type, const char* help, const uint64_t value) {
+    http_stats_append(text, "# HELP %s %s\n# TYPE %s %s\n%s %llu\n", name, help, name, type,
+                      name, (unsigned long long)value);
+}
+
+void http_stats_append_histogram(http_stats_text_t* text, const char* phase,
+                                 const http_histogram_t* histogram) {
+    const char* name = "http_server_phase_duration_seconds";
+    uint64_t below = 0;
+    http_size_t index = 0;
+    
+    // Prometheus buckets are cumulative, everything below 2^exponent ns goes into
+    // the one of that exponent
+    for (unsigned exponent = HTTP_STATS_TEXT_EXPONENT_MIN;
+         exponent <= HTTP_STATS_TEXT_EXPONENT_MAX; exponent++) {
+        http_size_t end = http_stats_get_index(1ULL << exponent);
+        
+        for (; index < end; index++)
+            below += histogram->buckets[index];
+        
+        http_stats_append(text, "%s_bucket{phase=\"%s\",le=\"%.9g\"} %llu\n", name, phase,
+                          (double)(1ULL << exponent) / 1e9, (unsigned long long)below);
+    }
+    
+    http_stats_append(text, "%s_bucket{phase=\"%s\",le=\"+Inf\"} %llu\n", name, phase,
+                      (unsigned long long)histogram->count);
+    http_stats_append(text, "%s_sum{phase=\"%s\"} %.9f\n", name, phase,
+                      (double)histogram->sum / 1e9);
+    http_stats_append(text, "%s_count{phase=\"%s\"} %llu\n", name, phase,
+                      (unsigned long long)histogram->count);
+}
+
+//
+// public
+//
+
+uint64_t http_stats_clock() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+void http_stats_record(http_histogram_t* histogram, const uint64_t value) {
+    http_size_t index = http_stats_get_index(value);
+    
+    HTTP_STATS_ADD(histogram->buckets[index], 1);
+    HTTP_STATS_ADD(histogram->count, 1);
+    HTTP_STATS_ADD(histogram->sum, value);
+    
+    if (value > histogram->max)
+        __atomic_store_n(&histogram->max, value, __ATOMIC_RELAXED);
+}
+
+void http_stats_count_status(http_stats_t* stats, const http_status_t status) {
+    if (status >= 100 && status < 100 * (HTTP_STATUS_CLASSES + 1))
+        HTTP_STATS_ADD(stats->requests[status / 100 - 1], 1);
+}
+
+void http_stats_sum(http_stats_t* total, const http_stats_t* stats) {
+    total->connectionsAccepted += http_stats_load(&stats->connectionsAccepted);
+    total->connectionsClosed += http_stats_load(&stats->connectionsClosed);
+    
+    for (http_size_t sz = 0; sz < HTTP_STATUS_CLASSES; sz++)
+        total->requests[sz] += http_stats_load(&stats->requests[sz]);
+    
+    total->parseErrors += http_stats_load(&stats->parseErrors);
+    total->bytesIn += http_stats_load(&stats->bytesIn);
+    total->bytesOut += http_stats_load(&stats->bytesOut);
+    
+    http_stats_sum_histogram(&total->parseTime, &stats->parseTime);
+    http_stats_sum_histogram(&total->callbackTime, &stats->callbackTime);
+    http_stats_sum_histogram(&total->sendTime, &stats->sendTime);
+    
+    // connections closed after the accepted ones were loaded would make it wrap
+    total->connectionsActive = (total->connectionsAccepted > total->connectionsClosed) ?
+                               total->connectionsAccepted - total->connectionsClosed : 0;
+}
+
+char* http_stats_format(const http_stats_t* stats, http_size_t* sizePtr) {
+    http_stats_text_t text = { .text = malloc(HTTP_STATS_TEXT_MAX), .size = 0 };
+    
+    if (!text.text)
+        return NULL;
+    
+    http_stats_append_counter(&text, "http_server_connections_accepted_total", "counter",
+                              "Client connections accepted.", stats->connectionsAccepted);
+    http_stats_append_counter(&text, "http_server_connections_closed_total", "counter",
+                              "Client connections closed.", stats->connectionsClosed);
+    http_stats_append_counter(&text, "http_server_connections_active", "gauge",
+                              "Client connections open right now.", stats->connectionsActive);
+    
+    http_stats_append(&text, "# HELP http_server_requests_total Requests answered, by status class.\n"
+                             "# TYPE http_server_requests_total counter\n");
+    
+    for (http_size_t sz = 0; sz < HTTP_STATUS_CLASSES; sz++)
+        http_stats_append(&text, "http_server_requests_total{class=\"%uxx\"} %llu\n", sz + 1,
+                          (unsigned long long)stats->requests[sz]);
+    
+    http_stats_append_counter(&text, "http_server_parse_errors_total", "counter",
+                              "Requests rejected as malformed or too large.", stats->parseErrors);
+    http_stats_append_counter(&text, "http_server_received_bytes_total", "counter",
+                              "Bytes received from clients.", stats->bytesIn);
+    http_stats_append_counter(&text, "http_server_sent_bytes_total", "counter",
+                              "Bytes sent to clients.", stats->bytesOut);
+    
+    http_stats_append(&text, "# HELP http_server_phase_duration_seconds Time spent parsing "
+                             "requests, in the callback and sending responses.\n"
+                             "# TYPE http_server_phase_duration_seconds histogram\n");
+    http_stats_append_histogram(&text, "parse", &stats->parseTime);
+    http_stats_append_histogram(&text, "callback", &stats->callbackTime);
+    http_stats_append_histogram(&text, "send", &stats->sendTime);
+    
+    (*sizePtr) = text.size;
+    return text.text;
+}
+
+uint64_t http_histogram_get_percentile(const http_histogram_t* histogram,
+                                       const double percentile) {
+    if (!histogram || histogram->count < 1)
+        return 0;
+    
+    // the value ranked at the percentile, at least the first one
+    uint64_t rank = (uint64_t)((double)histogram->count * MIN(percentile, 100.0) / 100.0 + 0.5);
+    uint64_t seen = 0;
+    
+    if (rank < 1)
+        rank = 1;
+    
+    for (http_size_t sz = 0; sz < HTTP_HISTOGRAM_BUCKETS; sz++) {
+        seen += histogram->buckets[sz];
+        
+        if (seen >= rank)
+            return MIN(http_stats_get_upper_bound(sz), histogram->max);
+    }
+    
+    return histogram->max;
+}
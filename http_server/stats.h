@@ -0,0 +1,41 @@
+//
+//  stats.h
+//  http_server
+//
+//  Created by Tim K. on 26.02.23.
+//  Copyright © 2023 Tim K. All rights reserved.
+//
+
+#pragma once
+
+#include <time.h>
+#include "wrappers.h"
+
+//
+// metrics. Every worker counts into a http_stats_t of its own, which only it ever
+// writes to, so there are no locks and no atomic read-modify-write anywhere. The
+// fields are still stored and loaded atomically (relaxed), so that
+// http_server_get_stats can sum them up from any thread
+//
+
+/// adds n to a field of the calling worker's own stats
+#define HTTP_STATS_ADD(field, n) __atomic_store_n(&(field), (field) + (n), __ATOMIC_RELAXED)
+
+/// bytes the Prometheus text of the metrics endpoint may take
+#define HTTP_STATS_TEXT_MAX (32 * 1024)
+/// Content-Type of the metrics endpoint's answers
+#define HTTP_STATS_CONTENT_TYPE "text/plain; version=0.0.4"
+
+/// monotonic time in nanoseconds, what the histograms are fed with
+uint64_t http_stats_clock();
+
+/// counts value (in nanoseconds) into the calling worker's own histogram
+void http_stats_record(http_histogram_t* histogram, const uint64_t value);
+/// counts an answer with the specified status
+void http_stats_count_status(http_stats_t* stats, const http_status_t status);
+
+/// adds the stats of a worker (while it keeps on counting) to total
+void http_stats_sum(http_stats_t* total, const http_stats_t* stats);
+
+/// the stats in the Prometheus text exposition format, malloc'ed, NULL on failure
+char* http_stats_format(const http_stats_t* stats, http_size_t* sizePtr);
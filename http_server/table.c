@@ -0,0 +1,263 @@
+//
+//  table.c
+//  http_server
+//
+//  Created by Tim K. on 26.02.23.
+//  Copyright © 2023 Tim K. All rights reserved.
+//
+
+#include <string.h>
+#include <strings.h>
+#include "table.h"
+
+//
+// private
+//
+
+uint32_t http_table_hash(const char* key, http_size_t* lengthPtr) {
+    // FNV-1a over the lowercase key
+    uint32_t hash = 2166136261u;
+    http_size_t length = 0;
+    
+    for (; key[length]; length++) {
+        char current = key[length];
+        
+        if (current >= 'A' && current <= 'Z')
+            current += 'a' - 'A';
+        
+        hash = (hash ^ (uint8_t)current) * 16777619u;
+    }
+    
+    (*lengthPtr) = length;
+    return hash;
+}
+
+void* http_table_alloc(http_table_ref table, const size_t size) {
+    return table->arena ? http_arena_alloc(table->arena, size) : malloc(size);
+}
+
+void http_table_free(http_table_ref table, void* memory) {
+    if (!table->arena)
+        free(memory);
+}
+
+char* http_table_strdup(http_table_ref table, const char* str) {
+    return table->arena ? http_arena_strdup(table->arena, str) : strdup(str);
+}
+
+bool http_table_matches(const http_table_entry_t* entry, const char* key,
+                        const uint32_t hash, const http_size_t keyLength) {
+    return (entry->value && entry->hash == hash && entry->keyLength == keyLength &&
+            strncasecmp(entry->key, key, keyLength) == 0);
+}
+
+void http_table_index(http_table_ref table, const http_size_t number) {
+    http_size_t slot = table->entries[number].hash & table->slotsMask;
+    
+    // linear probing, so entries with the same key are found in insertion order
+    while (table->slots[slot] != 0)
+        slot = (slot + 1) & table->slotsMask;
+    
+    table->slots[slot] = number + 1;
+}
+
+bool http_table_grow(http_table_ref table) {
+    http_size_t capacity = table->capacity ? table->capacity * 2 : HTTP_TABLE_INLINE_MAX * 2;
+    http_table_entry_t* entries = http_table_alloc(table, capacity * sizeof(http_table_entry_t));
+    
+    if (!entries)
+        return false;
+    
+    memcpy(entries, http_table_get_entries(table), table->count * sizeof(http_table_entry_t));
+    
+    if (table->entries)
+        http_table_free(table, table->entries);
+    
+    table->entries = entries;
+    table->capacity = capacity;
+    
+    // keep the index at most half full
+    http_size_t slotsCount = capacity * 2;
+    
+    if (table->slots)
+        http_table_free(table, table->slots);
+    
+    table->slots = http_table_alloc(table, slotsCount * sizeof(http_size_t));
+    table->slotsMask = slotsCount - 1;
+    
+    if (!table->slots)
+        return false;
+    
+    bzero(table->slots, slotsCount * sizeof(http_size_t));
+    
+    for (http_size_t sz = 0; sz < table->count; sz++)
+        http_table_index(table, sz);
+    
+    return true;
+}
+
+//
+// public
+//
+
+void http_table_init(http_table_ref table, http_arena_ref arena) {
+    table->arena = arena;
+}
+
+http_table_entry_t* http_table_get_entries(http_table_ref table) {
+    return table->entries ? table->entries : table->inlineEntries;
+}
+
+bool http_table_add(http_table_ref table, const char* key, const char* value,
+                    const bool borrow) {
+    if (table->count >= HTTP_TABLE_INLINE_MAX && table->count >= table->capacity &&
+        !http_table_grow(table)) {
+        HI_DEBUG("table <%p> cannot grow any further", table);
+        return false;
+    }
+    
+    http_table_entry_t* entry = &http_table_get_entries(table)[table->count];
+    entry->hash = http_table_hash(key, &entry->keyLength);
+    entry->valueLength = (http_size_t)strlen(value);
+    
+    if (borrow) {
+        entry->key = key;
+        entry->value = value;
+        entry->owned = false;
+    } else {
+        entry->key = http_table_strdup(table, key);
+        entry->value = http_table_strdup(table, value);
+        entry->owned = (table->arena == NULL);
+    }
+    
+    if (table->entries)
+        http_table_index(table, table->count);
+    
+    table->count++;
+    return true;
+}
+
+bool http_table_set(http_table_ref table, const char* key, const char* value) {
+    http_size_t keyLength = 0;
+    uint32_t hash = http_table_hash(key, &keyLength);
+    
+    http_table_entry_t* entries = http_table_get_entries(table);
+    bool found = false;
+    
+    for (http_size_t sz = 0; sz < table->count; sz++) {
+        http_table_entry_t* entry = &entries[sz];
+        
+        if (!http_table_matches(entry, key, hash, keyLength))
+            continue;
+        
+        if (entry->owned)
+            free((void*)entry->value);
+        
+        if (found) {
+            // only the first one stays
+            if (entry->owned)
+                free((void*)entry->key);
+            
+            entry->value = NULL;
+            entry->owned = false;
+            continue;
+        }
+        
+        // the key stays as is, only the value changes
+        char* newValue = http_table_strdup(table, value);
+        entry->valueLength = (http_size_t)strlen(value);
+        
+        if (entry->owned || table->arena)
+            entry->value = newValue;
+        else {
+            // borrowed entry, its key has to be copied as well now
+            entry->key = strdup(entry->key);
+            entry->value = newValue;
+            entry->owned = true;
+        }
+        
+        found = true;
+    }
+    
+    return found ? true : http_table_add(table, key, value, false);
+}
+
+bool http_table_remove(http_table_ref table, const char* key) {
+    http_size_t keyLength = 0;
+    uint32_t hash = http_table_hash(key, &keyLength);
+    
+    http_table_entry_t* entries = http_table_get_entries(table);
+    bool found = false;
+    
+    // the entries stay in place (and indexed), they just don't match anymore
+    for (http_size_t sz = 0; sz < table->count; sz++) {
+        http_table_entry_t* entry = &entries[sz];
+        
+        if (!http_table_matches(entry, key, hash, keyLength))
+            continue;
+        
+        if (entry->owned) {
+            free((void*)entry->key);
+            free((void*)entry->value);
+        }
+        
+        entry->value = NULL;
+        entry->owned = false;
+        found = true;
+    }
+    
+    return found;
+}
+
+const char* http_table_get(http_table_ref table, const char* key,
+                           const http_size_t number) {
+    http_size_t keyLength = 0;
+    uint32_t hash = http_table_hash(key, &keyLength);
+    http_size_t left = number;
+    
+    if (!table->entries) {
+        // few enough to just go through them
+        for (http_size_t sz = 0; sz < table->count; sz++) {
+            const http_table_entry_t* entry = &table->inlineEntries[sz];
+            
+            if (http_table_matches(entry, key, hash, keyLength) && left-- == 0)
+                return entry->value;
+        }
+        
+        return NULL;
+    }
+    
+    http_size_t slot = hash & table->slotsMask;
+    
+    while (table->slots[slot] != 0) {
+        const http_table_entry_t* entry = &table->entries[table->slots[slot] - 1];
+        
+        if (http_table_matches(entry, key, hash, keyLength) && left-- == 0)
+            return entry->value;
+        
+        slot = (slot + 1) & table->slotsMask;
+    }
+    
+    return NULL;
+}
+
+void http_table_deinit(http_table_ref table) {
+    http_table_entry_t* entries = http_table_get_entries(table);
+    
+    for (http_size_t sz = 0; sz < table->count; sz++) {
+        if (!entries[sz].owned)
+            continue;
+        
+        free((void*)entries[sz].key);
+        free((void*)entries[sz].value);
+    }
+    
+    if (table->entries) {
+        http_table_free(table, table->entries);
+        http_table_free(table, table->slots);
+    }
+    
+    table->entries = NULL;
+    table->slots = NULL;
+    table->count = table->capacity = 0;
+}
@@ -0,0 +1,75 @@
+//
+//  table.h
+//  http_server
+//
+//  Created by Tim K. on 26.02.23.
+//  Copyright © 2023 Tim K. All rights reserved.
+//
+
+#pragma once
+
+#include "wrappers.h"
+#include "arena.h"
+
+//
+// header fields of an http_headers_ref. Entries stay in insertion order (which is
+// how they are serialized) with their case-insensitive key hashes precomputed. The
+// first few live right in the table and are scanned linearly, more than that spill
+// into an array indexed by an open addressing hash table
+//
+
+/// amount of entries stored without any allocations
+#define HTTP_TABLE_INLINE_MAX 8
+
+typedef struct http_table_s* http_table_ref;
+
+typedef struct {
+    const char* key;
+    // NULL if the entry was removed
+    const char* value;
+    
+    uint32_t hash;
+    http_size_t keyLength;
+    http_size_t valueLength;
+    
+    // true if key and value were malloc'd for this entry
+    bool owned;
+} http_table_entry_t;
+
+struct http_table_s {
+    // spilled entries, NULL while they fit into inlineEntries
+    http_table_entry_t* entries;
+    http_size_t count;
+    http_size_t capacity;
+    
+    // entry number + 1 for every used slot, 0 for empty ones (spilled tables only)
+    http_size_t* slots;
+    http_size_t slotsMask;
+    
+    // where spilled arrays and copied strings go, malloc is used if NULL
+    http_arena_ref arena;
+    
+    http_table_entry_t inlineEntries[HTTP_TABLE_INLINE_MAX];
+};
+
+/// a zeroed table is a valid empty one, this only sets the arena
+void http_table_init(http_table_ref table, http_arena_ref arena);
+
+/// gets the entries in insertion order (count of them, removed ones included)
+http_table_entry_t* http_table_get_entries(http_table_ref table);
+
+/// appends an entry, copying the strings unless borrow is true (then they must
+/// outlive the table)
+bool http_table_add(http_table_ref table, const char* key, const char* value,
+                    const bool borrow);
+/// replaces the value of the first entry with the key, removing all the others
+bool http_table_set(http_table_ref table, const char* key, const char* value);
+
+/// removes every entry with the key, false if there was none
+bool http_table_remove(http_table_ref table, const char* key);
+
+/// gets the value of the number-th entry with the key (case-insensitive)
+const char* http_table_get(http_table_ref table, const char* key,
+                           const http_size_t number);
+
+void http_table_deinit(http_table_ref table);
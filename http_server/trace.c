@@ -0,0 +1,224 @@
+//
+//  trace.c
+//  http_server
+//
+//  Created by Tim K. on 26.02.23.
+//  Copyright © 2023 Tim K. All rights reserved.
+//
+
+#include <string.h>
+#include <unistd.h>
+#include "trace.h"
+
+//
+// private
+//
+
+typedef struct {
+    int fd;
+    bool failed;
+    // whether an event was written already, all but the first one need a comma
+    bool separate;
+    
+    char batch[HTTP_TRACE_BATCH_SIZE];
+    size_t batchSize;
+} http_trace_writer_t;
+
+void http_trace_copy(char* destination, const char* source, const size_t size) {
+    size_t length = source ? strnlen(source, size - 1) : 0;
+    
+    memcpy(destination, HI_IF_NULL(source, ""), length);
+    destination[length] = '\0';
+}
+
+void http_trace_flush(http_trace_writer_t* writer) {
+    size_t written = 0;
+    
+    while (!writer->failed && written < writer->batchSize) {
+        ssize_t result = write(writer->fd, writer->batch + written,
+                               writer->batchSize - written);
+        
+        if (result < 0 && errno == EINTR)
+            continue;
+        else if (result < 1)
+            writer->failed = true;
+        else
+            written += (size_t)result;
+    }
+    
+    writer->batchSize = 0;
+}
+
+void http_trace_append(http_trace_writer_t* writer, const char* format, ...) {
+    // an event (with the longest URL there can be, escaped) always fits
+    if (HTTP_TRACE_BATCH_SIZE - writer->batchSize < HTTP_TRACE_URL_MAX * 6 + 512)
+        http_trace_flush(writer);
+    
+    va_list args;
+    va_start(args, format);
+    
+    int length = vsnprintf(writer->batch + writer->batchSize,
+                           HTTP_TRACE_BATCH_SIZE - writer->batchSize, format, args);
+    
+    va_end(args);
+    
+    if (length > 0 && (size_t)length < HTTP_TRACE_BATCH_SIZE - writer->batchSize)
+        writer->batchSize += (size_t)length;
+}
+
+void http_trace_escape(char* destination, const char* source) {
+    // JSON strings can't hold quotes, backslashes and control characters as they are,
+    // and whatever isn't ASCII isn't necessarily UTF-8 either
+    for (; *source; source++) {
+        unsigned char current = (unsigned char)*source;
+        
+        if (current == '"' || current == '\\') {
+            *destination++ = '\\';
+            *destination++ = (char)current;
+        } else if (current < 0x20 || current >= 0x80)
+            destination += sprintf(destination, "\\u%04x", current);
+        else
+            *destination++ = (char)current;
+    }
+    
+    *destination = '\0';
+}
+
+void http_trace_append_event(http_trace_writer_t* writer, const http_trace_record_t* record,
+                             const char* name, const uint64_t begin, const uint64_t end,
+                             const char* args) {
+    // phases that didn't happen (connections closed mid-way) are left out
+    if (begin < 1 || end < begin)
+        return;
+    
+    // microseconds, with the nanoseconds after the point
+    http_trace_append(writer, "%s\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%u,\"tid\":%u,"
+                              "\"ts\":%llu.%03llu,\"dur\":%llu.%03llu%s}",
+                      writer->separate ? "," : "", name, record->worker, record->slot,
+                      (unsigned long long)(begin / 1000), (unsigned long long)(begin % 1000),
+                      (unsigned long long)((end - begin) / 1000),
+                      (unsigned long long)((end - begin) % 1000), args);
+    
+    writer->separate = true;
+}
+
+void http_trace_append_record(http_trace_writer_t* writer, const http_trace_record_t* record) {
+    char method[sizeof(record->method) * 6];
+    char url[HTTP_TRACE_URL_MAX * 6];
+    char args[sizeof(method) + sizeof(url) + 64];
+    
+    http_trace_escape(method, record->method);
+    http_trace_escape(url, record->url);
+    
+    snprintf(args, sizeof(args), ",\"args\":{\"method\":\"%s\",\"url\":\"%s\",\"status\":%u}",
+             method, url, record->status);
+    
+    // the request spans all of its phases, which show up nested right below it
+    http_trace_append_event(writer, record, "connect", record->accepted, record->firstRead, "");
+    http_trace_append_event(writer, record, "request", record->firstRead, record->lastWritten,
+                            args);
+    http_trace_append_event(writer, record, "parse", record->firstRead, record->parsed, "");
+    http_trace_append_event(writer, record, "body", record->parsed, record->callbackEntered, "");
+    http_trace_append_event(writer, record, "callback", record->callbackEntered,
+                            record->callbackLeft, "");
+    http_trace_append_event(writer, record, "queued", record->callbackLeft,
+                            record->firstWritten, "");
+    http_trace_append_event(writer, record, "send", record->firstWritten, record->lastWritten, "");
+}
+
+//
+// public
+//
+
+http_trace_ring_ref http_trace_init_rings(const http_size_t count) {
+    http_trace_ring_ref rings = calloc(count, sizeof(struct http_trace_ring_s));
+    
+    if (!rings) {
+        HI_ERRNO_DEBUG("couldn't allocate the trace rings");
+        return NULL;
+    }
+    
+    for (http_size_t sz = 0; sz < count; sz++)
+        pthread_mutex_init(&rings[sz].lock, NULL);
+    
+    return rings;
+}
+
+void http_trace_release_rings(http_trace_ring_ref rings, const http_size_t count) {
+    if (!rings)
+        return;
+    
+    for (http_size_t sz = 0; sz < count; sz++)
+        pthread_mutex_destroy(&rings[sz].lock);
+    
+    free(rings);
+}
+
+void http_trace_record_request(http_trace_record_t* record, const http_headers_ref request) {
+    http_trace_copy(record->method, http_headers_get_request_type(request),
+                    sizeof(record->method));
+    http_trace_copy(record->url, http_headers_get_request_url(request), sizeof(record->url));
+}
+
+bool http_trace_push(http_trace_ring_ref ring, const http_trace_record_t* record) {
+    // a dump is copying the ring, this one isn't worth waiting for
+    if (pthread_mutex_trylock(&ring->lock) != 0)
+        return false;
+    
+    ring->records[ring->head % HTTP_TRACE_RING_SIZE] = *record;
+    ring->head++;
+    
+    pthread_mutex_unlock(&ring->lock);
+    return true;
+}
+
+bool http_trace_dump(http_trace_ring_ref rings, const http_size_t count, const int fd) {
+    http_trace_writer_t* writer = calloc(1, sizeof(http_trace_writer_t));
+    http_trace_record_t* records = calloc(HTTP_TRACE_RING_SIZE, sizeof(http_trace_record_t));
+    
+    if (!writer || !records) {
+        HI_ERRNO_DEBUG("couldn't allocate the trace buffers");
+        
+        free(writer);
+        free(records);
+        
+        return false;
+    }
+    
+    writer->fd = fd;
+    http_trace_append(writer, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+    
+    for (http_size_t sz = 0; sz < count && rings; sz++) {
+        http_trace_ring_ref ring = &rings[sz];
+        
+        // copied out first, so that the worker's pushes fail for as short as possible
+        pthread_mutex_lock(&ring->lock);
+        
+        uint64_t head = ring->head;
+        size_t recordsCount = (head < HTTP_TRACE_RING_SIZE) ? (size_t)head : HTTP_TRACE_RING_SIZE;
+        memcpy(records, ring->records, recordsCount * sizeof(http_trace_record_t));
+        
+        pthread_mutex_unlock(&ring->lock);
+        
+        http_trace_append(writer, "%s\n{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%u,"
+                                  "\"args\":{\"name\":\"worker %u\"}}",
+                          writer->separate ? "," : "", sz, sz);
+        writer->separate = true;
+        
+        // oldest first
+        for (size_t record = 0; record < recordsCount; record++) {
+            size_t position = (size_t)((head - recordsCount + record) % HTTP_TRACE_RING_SIZE);
+            http_trace_append_record(writer, &records[position]);
+        }
+    }
+    
+    http_trace_append(writer, "\n]}\n");
+    http_trace_flush(writer);
+    
+    bool result = !writer->failed;
+    
+    free(records);
+    free(writer);
+    
+    return result;
+}
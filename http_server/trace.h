@@ -0,0 +1,80 @@
+//
+//  trace.h
+//  http_server
+//
+//  Created by Tim K. on 26.02.23.
+//  Copyright © 2023 Tim K. All rights reserved.
+//
+
+#pragma once
+
+#include <pthread.h>
+#include "wrappers.h"
+
+//
+// request tracing. Every worker takes the timestamps of each sampled request through
+// all of its phases and, once the last byte of the answer is out, copies them into a
+// ring of its own that always holds the most recent ones. The rings are only read
+// when they are dumped (as Chrome trace-event JSON), which the workers never wait for:
+// they drop the record instead if a dump holds their ring right then
+//
+
+/// records kept per worker ring
+#define HTTP_TRACE_RING_SIZE 4096
+/// max bytes of the URL kept in a record, longer ones are cut off
+#define HTTP_TRACE_URL_MAX 96
+/// bytes of JSON collected before they are written out
+#define HTTP_TRACE_BATCH_SIZE (64 * 1024)
+
+typedef struct http_trace_ring_s* http_trace_ring_ref;
+
+/// timestamps (see http_stats_clock) of a request, 0 for anything that didn't happen
+typedef struct {
+    // the client connected, only set for the first request of a connection
+    uint64_t accepted;
+    // the parser started on the request and its headers were all there
+    uint64_t firstRead;
+    uint64_t parsed;
+    // the callback was called and the response was there (returned, or handed over
+    // later for deferred ones)
+    uint64_t callbackEntered;
+    uint64_t callbackLeft;
+    // the first and the last bytes of the response were given to the kernel
+    uint64_t firstWritten;
+    uint64_t lastWritten;
+    
+    // where it was handled: the worker and its connection slot
+    http_size_t worker;
+    http_size_t slot;
+    
+    http_status_t status;
+    char method[16];
+    char url[HTTP_TRACE_URL_MAX];
+} http_trace_record_t;
+
+struct http_trace_ring_s {
+    // taken by the worker for every record and by dumps, never waited for by the
+    // worker
+    pthread_mutex_t lock;
+    // records pushed so far, the last HTTP_TRACE_RING_SIZE of them are kept
+    uint64_t head;
+    
+    http_trace_record_t records[HTTP_TRACE_RING_SIZE];
+};
+
+/// makes count rings, one per worker, NULL on failure
+http_trace_ring_ref http_trace_init_rings(const http_size_t count);
+/// frees the rings made by http_trace_init_rings
+void http_trace_release_rings(http_trace_ring_ref rings, const http_size_t count);
+
+/// fills in the parts of the record that come from the request
+void http_trace_record_request(http_trace_record_t* record, const http_headers_ref request);
+
+/// copies the finished record into the ring, false if it's dropped (being dumped)
+bool http_trace_push(http_trace_ring_ref ring, const http_trace_record_t* record);
+
+///
+/// writes the records of all the rings to fd as Chrome trace-event JSON, every worker
+/// is a process and every connection slot a thread in it. False on failure
+///
+bool http_trace_dump(http_trace_ring_ref rings, const http_size_t count, const int fd);
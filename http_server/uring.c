@@ -0,0 +1,346 @@
+//
+//  uring.c
+//  http_server
+//
+//  Created by Tim K. on 26.02.23.
+//  Copyright © 2023 Tim K. All rights reserved.
+//
+
+#include "uring.h"
+
+#ifdef HTTP_URING_AVAILABLE
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/utsname.h>
+
+//
+// private
+//
+
+struct http_uring_s {
+    // ring file descriptor
+    int fd;
+    
+    // submission queue
+    void* sqMemory;
+    size_t sqMemorySize;
+    uint32_t* sqHead;
+    uint32_t* sqTail;
+    uint32_t sqMask;
+    uint32_t* sqArray;
+    struct io_uring_sqe* sqes;
+    size_t sqesSize;
+    // entries queued since the last submit
+    uint32_t sqPending;
+    
+    // completion queue, mapped together with the submission queue
+    uint32_t* cqHead;
+    uint32_t* cqTail;
+    uint32_t cqMask;
+    struct io_uring_cqe* cqes;
+    
+    // provided buffer ring
+    struct io_uring_buf_ring* bufferRing;
+    size_t bufferRingSize;
+    char* buffers;
+    http_size_t bufferCount;
+    http_size_t bufferSize;
+};
+
+int http_uring_setup(const http_size_t entries, struct io_uring_params* params) {
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+int http_uring_enter(int fd, const uint32_t toSubmit, const uint32_t minComplete,
+                     const uint32_t flags, void* arg, const size_t argSize) {
+    return (int)syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags, arg,
+                        argSize);
+}
+
+int http_uring_register(int fd, const uint32_t opcode, void* arg,
+                        const uint32_t argCount) {
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, argCount);
+}
+
+bool http_uring_init_buffers(http_uring_ref ring, const http_size_t bufferCount,
+                             const http_size_t bufferSize) {
+    ring->bufferCount = bufferCount;
+    ring->bufferSize = bufferSize;
+    
+    // the ring itself must be page-aligned, hence mmap
+    ring->bufferRingSize = bufferCount * sizeof(struct io_uring_buf);
+    ring->bufferRing = mmap(NULL, ring->bufferRingSize, PROT_READ | PROT_WRITE,
+                            MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    
+    if (ring->bufferRing == MAP_FAILED) {
+        ring->bufferRing = NULL;
+        return false;
+    }
+    
+    struct io_uring_buf_reg reg;
+    bzero(&reg, sizeof(struct io_uring_buf_reg));
+    
+    reg.ring_addr = (uint64_t)(uintptr_t)ring->bufferRing;
+    reg.ring_entries = bufferCount;
+    reg.bgid = HTTP_URING_BUFFER_GROUP;
+    
+    if (http_uring_register(ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) != 0) {
+        HI_ERRNO_DEBUG("IORING_REGISTER_PBUF_RING failed");
+        return false;
+    }
+    
+    // hand every buffer to the kernel
+    ring->buffers = malloc((size_t)bufferCount * bufferSize);
+    
+    for (http_size_t sz = 0; sz < bufferCount; sz++) {
+        struct io_uring_buf* buf = &ring->bufferRing->bufs[sz];
+        
+        buf->addr = (uint64_t)(uintptr_t)(ring->buffers + (size_t)sz * bufferSize);
+        buf->len = bufferSize;
+        buf->bid = (uint16_t)sz;
+    }
+    
+    __atomic_store_n(&ring->bufferRing->tail, (uint16_t)bufferCount, __ATOMIC_RELEASE);
+    return true;
+}
+
+//
+// public
+//
+
+bool http_uring_is_supported() {
+    // multishot receives need 6.0, which is also where provided buffer rings and
+    // multishot accepts are guaranteed to be around
+    struct utsname name;
+    if (uname(&name) != 0)
+        return false;
+    
+    int major = 0;
+    int minor = 0;
+    
+    if (sscanf(name.release, "%d.%d", &major, &minor) != 2 || major < 6)
+        return false;
+    
+    // the kernel might still have io_uring disabled
+    struct io_uring_params params;
+    bzero(&params, sizeof(struct io_uring_params));
+    
+    int fd = http_uring_setup(2, &params);
+    if (fd < 0) {
+        HI_ERRNO_DEBUG("io_uring_setup failed");
+        return false;
+    }
+    
+    close(fd);
+    return ((params.features & (IORING_FEAT_SINGLE_MMAP | IORING_FEAT_EXT_ARG |
+                                IORING_FEAT_NODROP)) ==
+            (IORING_FEAT_SINGLE_MMAP | IORING_FEAT_EXT_ARG | IORING_FEAT_NODROP));
+}
+
+http_uring_ref http_uring_init(const http_size_t entries,
+                               const http_size_t bufferCount,
+                               const http_size_t bufferSize) {
+    struct io_uring_params params;
+    bzero(&params, sizeof(struct io_uring_params));
+    
+    // plenty of room for multishot completions
+    params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_CLAMP;
+    params.cq_entries = entries * 4;
+    
+    http_uring_ref ring = hizalloc_struct(http_uring_s);
+    ring->fd = http_uring_setup(entries, &params);
+    
+    if (ring->fd < 0) {
+        HI_ERRNO_DEBUG("io_uring_setup failed");
+        
+        free(ring);
+        return NULL;
+    } else if (!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+        HI_DEBUG("kernel too old for a single-mmap ring");
+        http_uring_release(ring);
+        return NULL;
+    }
+    
+    // map the rings, both live in one mapping
+    size_t cqMemorySize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqMemorySize = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+    
+    if (cqMemorySize > ring->sqMemorySize)
+        ring->sqMemorySize = cqMemorySize;
+    
+    ring->sqMemory = mmap(NULL, ring->sqMemorySize, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    
+    ring->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqesSize, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    
+    if (ring->sqMemory == MAP_FAILED || ring->sqes == MAP_FAILED) {
+        HI_ERRNO_DEBUG("mmap of the io_uring failed");
+        
+        if (ring->sqMemory == MAP_FAILED)
+            ring->sqMemory = NULL;
+        if (ring->sqes == MAP_FAILED)
+            ring->sqes = NULL;
+        
+        http_uring_release(ring);
+        return NULL;
+    }
+    
+    char* sq = (char*)ring->sqMemory;
+    
+    ring->sqHead = (uint32_t*)(sq + params.sq_off.head);
+    ring->sqTail = (uint32_t*)(sq + params.sq_off.tail);
+    ring->sqMask = *(uint32_t*)(sq + params.sq_off.ring_mask);
+    ring->sqArray = (uint32_t*)(sq + params.sq_off.array);
+    
+    ring->cqHead = (uint32_t*)(sq + params.cq_off.head);
+    ring->cqTail = (uint32_t*)(sq + params.cq_off.tail);
+    ring->cqMask = *(uint32_t*)(sq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)(sq + params.cq_off.cqes);
+    
+    if (!http_uring_init_buffers(ring, bufferCount, bufferSize)) {
+        http_uring_release(ring);
+        return NULL;
+    }
+    
+    HI_DEBUG("io_uring <%p> ready, %u sq entries, %u cq entries", ring,
+             params.sq_entries, params.cq_entries);
+    return ring;
+}
+
+struct io_uring_sqe* http_uring_get_sqe(http_uring_ref ring) {
+    uint32_t head = __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE);
+    uint32_t tail = *ring->sqTail;
+    
+    if (tail - head > ring->sqMask) {
+        // full, push everything queued so far to the kernel and retry
+        http_uring_enter(ring->fd, ring->sqPending, 0, 0, NULL, 0);
+        ring->sqPending = 0;
+        
+        head = __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE);
+        if (tail - head > ring->sqMask) {
+            HI_DEBUG("submission queue of <%p> still full", ring);
+            return NULL;
+        }
+    }
+    
+    uint32_t index = tail & ring->sqMask;
+    struct io_uring_sqe* sqe = &ring->sqes[index];
+    
+    bzero(sqe, sizeof(struct io_uring_sqe));
+    ring->sqArray[index] = index;
+    
+    __atomic_store_n(ring->sqTail, tail + 1, __ATOMIC_RELEASE);
+    ring->sqPending++;
+    
+    return sqe;
+}
+
+bool http_uring_submit_and_wait(http_uring_ref ring, const int timeoutMs) {
+    uint32_t flags = 0;
+    uint32_t minComplete = 0;
+    
+    // only block if there is nothing to reap already
+    if (__atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE) == *ring->cqHead) {
+        flags |= IORING_ENTER_GETEVENTS;
+        minComplete = 1;
+    } else if (ring->sqPending < 1)
+        return true;
+    
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec ts;
+    
+    bzero(&arg, sizeof(struct io_uring_getevents_arg));
+    
+    if (timeoutMs >= 0 && minComplete > 0) {
+        ts.tv_sec = timeoutMs / 1000;
+        ts.tv_nsec = (long long)(timeoutMs % 1000) * 1000000;
+        arg.ts = (uint64_t)(uintptr_t)&ts;
+    }
+    
+    flags |= IORING_ENTER_EXT_ARG;
+    
+    int result = http_uring_enter(ring->fd, ring->sqPending, minComplete, flags, &arg,
+                                  sizeof(arg));
+    if (result < 0 && errno != EINTR && errno != ETIME && errno != EBUSY) {
+        HI_ERRNO_DEBUG("io_uring_enter failed");
+        return false;
+    }
+    
+    if (result > 0)
+        ring->sqPending -= ((uint32_t)result > ring->sqPending) ? ring->sqPending :
+                                                                   (uint32_t)result;
+    
+    return true;
+}
+
+bool http_uring_submit(http_uring_ref ring) {
+    if (ring->sqPending < 1)
+        return true;
+    
+    int result = http_uring_enter(ring->fd, ring->sqPending, 0, 0, NULL, 0);
+    if (result < 0) {
+        HI_ERRNO_DEBUG("io_uring_enter failed");
+        return false;
+    }
+    
+    ring->sqPending -= ((uint32_t)result > ring->sqPending) ? ring->sqPending :
+                                                               (uint32_t)result;
+    return true;
+}
+
+struct io_uring_cqe* http_uring_peek_cqe(http_uring_ref ring) {
+    uint32_t head = *ring->cqHead;
+    
+    if (head == __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE))
+        return NULL;
+    
+    return &ring->cqes[head & ring->cqMask];
+}
+
+void http_uring_cqe_seen(http_uring_ref ring) {
+    __atomic_store_n(ring->cqHead, *ring->cqHead + 1, __ATOMIC_RELEASE);
+}
+
+void* http_uring_get_buffer(http_uring_ref ring, const uint16_t bid) {
+    return ring->buffers + (size_t)bid * ring->bufferSize;
+}
+
+void http_uring_recycle_buffer(http_uring_ref ring, const uint16_t bid) {
+    uint16_t tail = ring->bufferRing->tail;
+    struct io_uring_buf* buf = &ring->bufferRing->bufs[tail & (ring->bufferCount - 1)];
+    
+    buf->addr = (uint64_t)(uintptr_t)http_uring_get_buffer(ring, bid);
+    buf->len = ring->bufferSize;
+    buf->bid = bid;
+    
+    __atomic_store_n(&ring->bufferRing->tail, (uint16_t)(tail + 1), __ATOMIC_RELEASE);
+}
+
+void http_uring_release(http_uring_ref ring) {
+    if (!ring)
+        return;
+    
+    if (ring->bufferRing) {
+        struct io_uring_buf_reg reg;
+        bzero(&reg, sizeof(struct io_uring_buf_reg));
+        reg.bgid = HTTP_URING_BUFFER_GROUP;
+        
+        http_uring_register(ring->fd, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+        munmap(ring->bufferRing, ring->bufferRingSize);
+    }
+    
+    free(ring->buffers);
+    
+    if (ring->sqes)
+        munmap(ring->sqes, ring->sqesSize);
+    if (ring->sqMemory)
+        munmap(ring->sqMemory, ring->sqMemorySize);
+    
+    close(ring->fd);
+    free(ring);
+}
+#endif
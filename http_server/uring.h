@@ -0,0 +1,65 @@
+//
+//  uring.h
+//  http_server
+//
+//  Created by Tim K. on 26.02.23.
+//  Copyright © 2023 Tim K. All rights reserved.
+//
+
+#pragma once
+
+#include "wrappers.h"
+
+//
+// thin io_uring wrapper talking to the kernel via raw syscalls (no liburing), used by
+// the io_uring event backend in fds.c. Only available on Linux with a new enough
+// kernel, see http_uring_is_supported
+//
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define HTTP_URING_AVAILABLE 1
+#endif
+#endif
+
+#ifdef HTTP_URING_AVAILABLE
+#include <linux/io_uring.h>
+
+/// provided buffer group used for all receives
+#define HTTP_URING_BUFFER_GROUP 0
+
+typedef struct http_uring_s* http_uring_ref;
+
+/// returns true if the kernel supports everything the io_uring backend needs
+bool http_uring_is_supported(void);
+
+/// sets up a ring with the specified submission queue size and a provided buffer ring
+/// of bufferCount (power of two) buffers of bufferSize bytes each
+http_uring_ref http_uring_init(const http_size_t entries,
+                               const http_size_t bufferCount,
+                               const http_size_t bufferSize);
+
+/// gets a zeroed submission entry, flushing the queue to the kernel if it is full
+struct io_uring_sqe* http_uring_get_sqe(http_uring_ref ring);
+
+///
+/// submits all the queued entries and waits for at least one completion (unless some
+/// are already there) or for the timeout in milliseconds to expire (-1 for none). This
+/// is the only syscall the ring makes per event loop iteration
+///
+bool http_uring_submit_and_wait(http_uring_ref ring, const int timeoutMs);
+
+/// submits all the queued entries right away without waiting for anything
+bool http_uring_submit(http_uring_ref ring);
+
+/// gets the next completion or NULL, must be followed by http_uring_cqe_seen
+struct io_uring_cqe* http_uring_peek_cqe(http_uring_ref ring);
+void http_uring_cqe_seen(http_uring_ref ring);
+
+/// gets the data of the provided buffer with the specified id
+void* http_uring_get_buffer(http_uring_ref ring, const uint16_t bid);
+/// gives the provided buffer back to the kernel
+void http_uring_recycle_buffer(http_uring_ref ring, const uint16_t bid);
+
+void http_uring_release(http_uring_ref ring);
+#endif
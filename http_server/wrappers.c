@@ -9,6 +9,8 @@
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <unistd.h>
+#include <sys/param.h>
 #include "wrappers.h"
 
 void* hizalloc(const http_size_t size) {
@@ -21,25 +23,96 @@ void* hizalloc(const http_size_t size) {
     return data;
 }
 
+/// a formatted time string and the second it was formatted for
+typedef struct {
+    time_t second;
+    http_size_t length;
+    char text[HI_DATETIME_MAX];
+} hi_time_cache_t;
+
+// every worker thread has its own, so there's nothing to lock
+static __thread hi_time_cache_t hi_datetime_cache;
+static __thread hi_time_cache_t hi_http_date_cache;
+
+static const char* hi_weekdays[7] = { "Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat" };
+static const char* hi_months[12] = { "Jan", "Feb", "Mar", "Apr", "May", "Jun",
+                                     "Jul", "Aug", "Sep", "Oct", "Nov", "Dec" };
+
 char* hi_make_current_datetime() {
-    // get current C time first
+    return strdup(hi_get_current_datetime());
+}
+
+const char* hi_get_current_datetime() {
     time_t tmRaw = time(0);
-    struct tm* tmNow = localtime(&tmRaw);
     
-    // allocate buffer and fill it in
-    char* result = calloc(HI_DATETIME_MAX, sizeof(char));
-    strftime(result, HI_DATETIME_MAX, "%Y-%m-%d %H:%M:%S", tmNow);
+    if (tmRaw != hi_datetime_cache.second) {
+        struct tm tmNow;
+        localtime_r(&tmRaw, &tmNow);
+        
+        hi_datetime_cache.second = tmRaw;
+        hi_datetime_cache.length = (http_size_t)strftime(hi_datetime_cache.text, HI_DATETIME_MAX,
+                                                         "%Y-%m-%d %H:%M:%S", &tmNow);
+    }
     
-    return result;
+    return hi_datetime_cache.text;
+}
+
+const char* hi_get_http_date(http_size_t* lengthPtr) {
+    time_t tmRaw = time(0);
+    
+    if (tmRaw != hi_http_date_cache.second) {
+        hi_http_date_cache.second = tmRaw;
+        hi_http_date_cache.length = http_date_format(hi_http_date_cache.text, tmRaw);
+    }
+    
+    if (lengthPtr)
+        (*lengthPtr) = hi_http_date_cache.length;
+    
+    return hi_http_date_cache.text;
+}
+
+http_size_t http_date_format(char* buffer, const time_t time) {
+    struct tm tmTime;
+    gmtime_r(&time, &tmTime);
+    
+    // IMF-fixdate, spelled out by hand as strftime's names depend on the locale
+    int length = snprintf(buffer, HTTP_DATE_MAX, "%s, %02d %s %04d %02d:%02d:%02d GMT",
+                          hi_weekdays[tmTime.tm_wday], tmTime.tm_mday, hi_months[tmTime.tm_mon],
+                          tmTime.tm_year + 1900, tmTime.tm_hour, tmTime.tm_min, tmTime.tm_sec);
+    
+    return (http_size_t)MIN(length, HTTP_DATE_MAX - 1);
 }
 
 char* hiitoa(const http_ssize_t value) {
-    char* result = calloc(10, sizeof(char));
-    sprintf(result, "%d", value);
+    char* result = calloc(HI_ITOA_MAX, sizeof(char));
+    hiitoa_in(result, value);
     
     return result;
 }
 
+http_size_t hiitoa_in(char* buffer, const http_ssize_t value) {
+    // digits come out backwards, so they go to the end of a scratch buffer first
+    char digits[HI_ITOA_MAX];
+    char* position = digits + HI_ITOA_MAX;
+    
+    // negated as unsigned, so that the smallest value doesn't overflow
+    uint32_t magnitude = value < 0 ? 0u - (uint32_t)value : (uint32_t)value;
+    
+    do {
+        *(--position) = (char)('0' + magnitude % 10);
+        magnitude /= 10;
+    } while (magnitude > 0);
+    
+    if (value < 0)
+        *(--position) = '-';
+    
+    http_size_t length = (http_size_t)(digits + HI_ITOA_MAX - position);
+    memcpy(buffer, position, length);
+    buffer[length] = '\0';
+    
+    return length;
+}
+
 void hiprintf(const char* fn, const http_size_t fc,
               const char* msg, ...) {
 #ifndef DEBUG
@@ -50,16 +123,24 @@ void hiprintf(const char* fn, const http_size_t fc,
     va_list vl;
     va_start(vl, msg);
     
-    // make printable time and print header
-    char* timeStr = hi_make_current_datetime();
-    fprintf(stderr, "[%s:%s:%u] ", timeStr, fn, fc);
-    
-    free(timeStr);
+    // the whole line goes out at once, so lines of several threads don't mix and
+    // there's no stdio lock to wait for
+    char line[HI_DEBUG_LINE_MAX];
+    int length = snprintf(line, sizeof(line), "[%s:%s:%u] ", hi_get_current_datetime(),
+                          fn, fc);
     
-    // print msg and vl
-    vfprintf(stderr, msg, vl);
-    fprintf(stderr, "%c", '\n');
+    if (length >= 0 && (size_t)length < sizeof(line))
+        length += vsnprintf(line + length, sizeof(line) - (size_t)length, msg, vl);
     
     va_end(vl);
+    
+    // long ones are cut off
+    if (length < 0 || (size_t)length > sizeof(line) - 2)
+        length = (int)sizeof(line) - 2;
+    
+    line[length++] = '\n';
+    
+    if (write(STDERR_FILENO, line, (size_t)length) < 0)
+        return; // nowhere to complain to
 #endif
 }
@@ -22,18 +22,35 @@ void* hizalloc(const http_size_t size);
 /// Ruby-like if-null condition
 #define HI_IF_NULL(stv, sto) (stv ? stv : sto)
 
-/// debug printf string (-> stderr) - do not use directly!
+/// max length of a debug line, longer ones are cut off
+#define HI_DEBUG_LINE_MAX 1024
+
+/// debug printf string (-> stderr, one write per line) - do not use directly!
 void hiprintf(const char* fn, const http_size_t fc,
-              const char* msg, ...);
+              const char* msg, ...) __attribute__((format(printf, 3, 4)));
 
 /// int -> string
 char* hiitoa(const http_ssize_t value);
 
+/// enough room for any http_ssize_t with its sign and the NUL terminator
+#define HI_ITOA_MAX 12
+
+/// int -> string, into a buffer of at least HI_ITOA_MAX bytes, returns the length
+http_size_t hiitoa_in(char* buffer, const http_ssize_t value);
+
 #define HI_DATETIME_MAX 30
 
 /// make current date-time string
 char* hi_make_current_datetime(void);
 
+///
+/// current local date-time string for logs and current RFC 7231 date for the Date
+/// header. Both are formatted at most once per second per thread and stay valid
+/// (though they change every second) for as long as the calling thread lives
+///
+const char* hi_get_current_datetime(void);
+const char* hi_get_http_date(http_size_t* lengthPtr);
+
 /// short filename macro
 #ifdef __FILE_NAME__
 #define __HI_COMPILER_FILE_NAME__ __FILE_NAME__
@@ -41,10 +58,19 @@ char* hi_make_current_datetime(void);
 #define __HI_COMPILER_FILE_NAME__ __FILE__
 #endif
 
+#ifdef DEBUG
 #define HI_DEBUG(...) hiprintf(__HI_COMPILER_FILE_NAME__, __LINE__, \
                                __VA_ARGS__)
 #define HI_ERRNO_DEBUG(msg) hiprintf(__HI_COMPILER_FILE_NAME__, __LINE__, \
                                     "%s: %s", msg, \
                                     strerror(errno))
+#else
+// compiled out completely, arguments aren't evaluated (but still type-checked)
+#define HI_DEBUG(...) do { if (0) hiprintf(__HI_COMPILER_FILE_NAME__, __LINE__, \
+                                           __VA_ARGS__); } while (0)
+#define HI_ERRNO_DEBUG(msg) do { if (0) hiprintf(__HI_COMPILER_FILE_NAME__, __LINE__, \
+                                                 "%s: %s", msg, \
+                                                 strerror(errno)); } while (0)
+#endif
 
 #define HI_UNUSED(vl) (void)(vl)
@@ -0,0 +1,220 @@
+//
+//  main.c
+//  test
+//
+//  Created by Tim K. on 26.02.23.
+//  Copyright © 2023 Tim K. All rights reserved.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include "http_server.h"
+#include "wrappers.h"
+
+//
+// regression tests. A server is started in-process for every event backend, each
+// case sends its raw bytes on a connection of its own and checks the status line of
+// the first answer. Anything that crashes the server takes the tests down with it
+//
+
+/// seconds a case waits for its answer
+#define TEST_TIMEOUT 2
+/// milliseconds to wait for a server to accept connections before giving up
+#define TEST_CONNECT_TIMEOUT 2000
+/// body of every answer
+#define TEST_BODY "ok\n"
+
+typedef struct {
+    const char* name;
+    const char* request;
+    // what the answer has to start with
+    const char* expected;
+} test_case;
+
+static const test_case test_cases[] = {
+    { "request line with a version", "GET / HTTP/1.1\r\nHost: test\r\n\r\n",
+      "HTTP/1.1 200" },
+    { "request line without a version", "GET /index.html\r\n\r\n", "HTTP/1.1 200" },
+    { "HTTP/1.0 request line", "GET / HTTP/1.0\r\n\r\n", "HTTP/1.1 200" },
+    { "unsupported version", "GET / HTTP/2.0\r\n\r\n", "HTTP/1.1 505" },
+    { "body with a length", "POST / HTTP/1.1\r\nContent-Length: 2\r\n\r\nhi",
+      "HTTP/1.1 200" },
+    { "several lengths", "POST / HTTP/1.1\r\nContent-Length: 2\r\n"
+                         "Content-Length: 5\r\n\r\nhello", "HTTP/1.1 400" },
+    { "several agreeing lengths", "POST / HTTP/1.1\r\nContent-Length: 2\r\n"
+                                  "Content-Length: 2\r\n\r\nhi", "HTTP/1.1 400" },
+    { "length list", "POST / HTTP/1.1\r\nContent-Length: 2, 2\r\n\r\nhi", "HTTP/1.1 400" },
+    { "length next to a transfer coding", "POST / HTTP/1.1\r\nTransfer-Encoding: chunked\r\n"
+                                          "Content-Length: 2\r\n\r\nhi", "HTTP/1.1 400" },
+    { "bare CR in a value", "GET / HTTP/1.1\r\nX-Test: a\rb\r\n\r\n", "HTTP/1.1 400" },
+    { "chunked body", "POST / HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n"
+                      "2\r\nhi\r\n0\r\n\r\n", "HTTP/1.1 501" }
+};
+
+http_headers_ref test_callback(const http_headers_ref request, void* additionalData) {
+    HI_UNUSED(request);
+    HI_UNUSED(additionalData);
+    
+    return http_headers_init_with_response(HTTP_OK, "text/plain", TEST_BODY,
+                                           (http_size_t)strlen(TEST_BODY), NULL);
+}
+
+void* test_server_thread(void* server) {
+    http_server_listen((http_server_ref)server);
+    return NULL;
+}
+
+http_port_t test_find_port() {
+    // whatever port the system would pick right now
+    struct sockaddr_in address;
+    socklen_t addressSize = sizeof(address);
+    
+    bzero(&address, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    
+    int sk = socket(AF_INET, SOCK_STREAM, 0);
+    http_port_t port = 0;
+    
+    if (sk >= 0 && bind(sk, (struct sockaddr*)&address, sizeof(address)) == 0 &&
+        getsockname(sk, (struct sockaddr*)&address, &addressSize) == 0)
+        port = ntohs(address.sin_port);
+    
+    if (sk >= 0)
+        close(sk);
+    
+    return port;
+}
+
+int test_connect(const http_port_t port) {
+    struct sockaddr_in target;
+    bzero(&target, sizeof(target));
+    
+    target.sin_family = AF_INET;
+    target.sin_port = htons(port);
+    target.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    
+    // the server might still be starting up
+    for (int waited = 0; waited < TEST_CONNECT_TIMEOUT; waited += 10) {
+        int sk = socket(AF_INET, SOCK_STREAM, 0);
+        
+        if (sk < 0)
+            return -1;
+        else if (connect(sk, (struct sockaddr*)&target, sizeof(target)) == 0) {
+            struct timeval timeout = { .tv_sec = TEST_TIMEOUT, .tv_usec = 0 };
+            setsockopt(sk, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+            
+            return sk;
+        }
+        
+        close(sk);
+        usleep(10 * 1000);
+    }
+    
+    return -1;
+}
+
+http_port_t test_start_server(const http_backend_t backend) {
+    http_port_t port = test_find_port();
+    http_server_ref server = http_server_init_ipv4("127.0.0.1", port);
+    
+    if (!server)
+        return 0;
+    
+    http_server_set_callback(server, test_callback, NULL);
+    
+    if (!http_server_set_backend(server, backend)) {
+        // nothing new to test with the fallback
+        http_server_release(server);
+        return 0;
+    }
+    
+    // runs until the process ends
+    pthread_t thread;
+    
+    if (pthread_create(&thread, NULL, test_server_thread, server) != 0)
+        return 0;
+    
+    pthread_detach(thread);
+    return port;
+}
+
+bool test_run(const test_case* test, const http_port_t port) {
+    int sk = test_connect(port);
+    
+    if (sk < 0) {
+        fprintf(stderr, "couldn't connect to the server\n");
+        return false;
+    }
+    
+    size_t size = strlen(test->request);
+    bool result = (send(sk, test->request, size, MSG_NOSIGNAL) == (ssize_t)size);
+    
+    // just the status line matters
+    char answer[256];
+    size_t answerSize = 0;
+    size_t expectedSize = strlen(test->expected);
+    
+    while (result && answerSize < expectedSize) {
+        ssize_t received = recv(sk, answer + answerSize, sizeof(answer) - answerSize - 1, 0);
+        
+        if (received < 1)
+            break;
+        
+        answerSize += (size_t)received;
+    }
+    
+    answer[answerSize] = '\0';
+    close(sk);
+    
+    if (answerSize < expectedSize || strncmp(answer, test->expected, expectedSize) != 0) {
+        char* end = strpbrk(answer, "\r\n");
+        
+        if (end)
+            (*end) = '\0';
+        
+        fprintf(stderr, "expected \"%s\", got \"%s\"\n", test->expected, answer);
+        return false;
+    }
+    
+    return true;
+}
+
+int main(const int argc, const char** argv) {
+    HI_UNUSED(argc);
+    HI_UNUSED(argv);
+    
+    const http_backend_t backends[] = { HTTP_BACKEND_SELECT, HTTP_BACKEND_EPOLL,
+                                        HTTP_BACKEND_IO_URING };
+    const size_t casesCount = sizeof(test_cases) / sizeof(test_cases[0]);
+    size_t failed = 0;
+    
+    for (size_t backend = 0; backend < sizeof(backends) / sizeof(backends[0]); backend++) {
+        http_port_t port = test_start_server(backends[backend]);
+        
+        if (port == 0) {
+            printf("backend %d: unavailable, skipped\n", (int)backends[backend]);
+            continue;
+        }
+        
+        for (size_t sz = 0; sz < casesCount; sz++) {
+            bool passed = test_run(&test_cases[sz], port);
+            
+            printf("backend %d: %s: %s\n", (int)backends[backend], test_cases[sz].name,
+                   passed ? "ok" : "FAILED");
+            
+            if (!passed)
+                failed++;
+        }
+    }
+    
+    printf("%zu failed\n", failed);
+    return (failed > 0) ? 1 : 0;
+}